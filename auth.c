@@ -0,0 +1,374 @@
+/******************************************************************************
+
+PROGRAM:  auth.c
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: User accounts, password checks and session tokens, see auth.h.
+
+          The account table is filled once at startup and never changes
+          afterwards, so the auth threads and the workers read it without a
+          lock.  Only the queue of waiting logins and each worker's queue of
+          finished ones are shared, and each has a lock of its own.
+
+******************************************************************************/
+#define _GNU_SOURCE
+#include <crypt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include "auth.h"
+
+#define AUTH_BUCKETS 1024
+
+// The account used when there is no credential file
+#define BUILTIN_USER "GroupProject"
+#define BUILTIN_PASSWORD "hello"
+
+struct account
+{
+    char name[AUTH_NAME_MAX];
+    char *hash;
+    struct account *next;
+};
+
+static struct account *accounts[AUTH_BUCKETS];
+
+// Checked against when the username is unknown, so that a wrong username
+// takes as long to reject as a wrong password.  It costs as many rounds as
+// the dearest account, which is as slow as a login can be.
+static char *dummy_hash;
+static unsigned int dummy_rounds = AUTH_DEFAULT_ROUNDS;
+
+// Signs session tokens
+static unsigned char token_key[32];
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static struct auth_job *waiting_head, *waiting_tail;
+static size_t waiting, max_waiting;
+
+static unsigned int hash_name(const char *name)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*name != '\0')
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    return hash % AUTH_BUCKETS;
+}
+
+static struct account *find_account(const char *name)
+{
+    struct account *account = accounts[hash_name(name)];
+
+    while (account != NULL && strcmp(account->name, name) != 0)
+        account = account->next;
+    return account;
+}
+
+static bool valid_name(const char *name)
+{
+    size_t len = strlen(name);
+
+    return len > 0 && len < AUTH_NAME_MAX && strpbrk(name, ":\n") == NULL;
+}
+
+// The rounds of a SHA-512 crypt() hash, which are 5000 when it doesn't say,
+// or 0 for a hash of any other kind
+static unsigned int hash_rounds(const char *hash)
+{
+    unsigned int rounds;
+
+    if (strncmp(hash, "$6$", 3) != 0)
+        return 0;
+    if (sscanf(hash + 3, "rounds=%u$", &rounds) == 1)
+        return rounds;
+    return 5000;
+}
+
+static int add_account(const char *name, const char *hash)
+{
+    struct account *account;
+    unsigned int bucket;
+
+    if (!valid_name(name) || find_account(name) != NULL)
+        return -1;
+    if ((account = calloc(1, sizeof(*account))) == NULL || (account->hash = strdup(hash)) == NULL)
+    {
+        free(account);
+        return -1;
+    }
+    strcpy(account->name, name);
+    bucket = hash_name(name);
+    account->next = accounts[bucket];
+    accounts[bucket] = account;
+    if (hash_rounds(hash) > dummy_rounds)
+        dummy_rounds = hash_rounds(hash);
+    return 0;
+}
+
+// Hash a password with a new random salt, or return NULL
+static char *make_hash(const char *password, unsigned int rounds)
+{
+    static const char saltchars[] = "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+    unsigned char random[16];
+    char salt[sizeof(random) + 1];
+    char setting[64];
+    struct crypt_data data = {0};
+    const char *hash;
+
+    if (RAND_bytes(random, sizeof(random)) != 1)
+        return NULL;
+    for (size_t i = 0; i < sizeof(random); i++)
+        salt[i] = saltchars[random[i] % (sizeof(saltchars) - 1)];
+    salt[sizeof(random)] = '\0';
+
+    snprintf(setting, sizeof(setting), "$6$rounds=%u$%s", rounds, salt);
+    hash = crypt_r(password, setting, &data);
+    if (hash == NULL || hash[0] == '*')
+        return NULL;
+    return strdup(hash);
+}
+
+/******************************************************************************
+
+Read the credential file.  Blank lines and lines starting with '#' are
+skipped; every other line is "username:hash".
+
+******************************************************************************/
+int auth_load(const char *path)
+{
+    FILE *fp;
+    char *line = NULL;
+    size_t size = 0;
+    int lineno = 0;
+    int count = 0;
+
+    if (RAND_bytes(token_key, sizeof(token_key)) != 1)
+        return -1;
+
+    if ((fp = fopen(path, "r")) == NULL)
+    {
+        char *hash;
+
+        if (errno != ENOENT)
+            return -1;
+        if ((hash = make_hash(BUILTIN_PASSWORD, AUTH_DEFAULT_ROUNDS)) == NULL)
+            return -1;
+        add_account(BUILTIN_USER, hash);
+        free(hash);
+        fprintf(stdout, "Server: No credential file %s, using the built-in account\n", path);
+        return (dummy_hash = make_hash(BUILTIN_PASSWORD, dummy_rounds)) != NULL ? 0 : -1;
+    }
+
+    while (getline(&line, &size, fp) > 0)
+    {
+        char *hash;
+
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+        if ((hash = strchr(line, ':')) == NULL || (*hash++ = '\0', hash[0] != '$') || add_account(line, hash) < 0)
+        {
+            fprintf(stderr, "Server: %s:%d: Ignoring invalid or duplicate account\n", path, lineno);
+            continue;
+        }
+        count++;
+    }
+    free(line);
+    fclose(fp);
+    if ((dummy_hash = make_hash(BUILTIN_PASSWORD, dummy_rounds)) == NULL)
+        return -1;
+    fprintf(stdout, "Server: Loaded %d account(s) from %s\n", count, path);
+    return 0;
+}
+
+const char *auth_expected_hash(const char *username)
+{
+    struct account *account = find_account(username);
+
+    return account != NULL ? account->hash : dummy_hash;
+}
+
+// Hash the submitted password with the account's salt and compare.  An
+// unknown username is hashed and compared all the same, and only then
+// turned down.
+static bool check_password(const char *username, const char *password)
+{
+    static __thread struct crypt_data data;
+    const char *expected = auth_expected_hash(username);
+    const char *hash = crypt_r(password, expected, &data);
+    size_t len = strlen(expected);
+    bool match = hash != NULL && strlen(hash) == len && CRYPTO_memcmp(hash, expected, len) == 0;
+
+    return match && find_account(username) != NULL;
+}
+
+static void *run_auth_thread(void *arg)
+{
+    (void)arg;
+    while (true)
+    {
+        struct auth_job *job;
+        struct auth_queue *reply;
+
+        pthread_mutex_lock(&queue_lock);
+        while (waiting_head == NULL)
+            pthread_cond_wait(&queue_ready, &queue_lock);
+        job = waiting_head;
+        waiting_head = job->next;
+        if (waiting_head == NULL)
+            waiting_tail = NULL;
+        waiting--;
+        pthread_mutex_unlock(&queue_lock);
+
+        job->ok = check_password(job->username, job->password);
+        explicit_bzero(job->password, sizeof(job->password));
+
+        // The job belongs to the worker again as soon as it is posted
+        reply = job->reply;
+        pthread_mutex_lock(&reply->lock);
+        job->next = reply->done;
+        reply->done = job;
+        pthread_mutex_unlock(&reply->lock);
+        eventfd_write(reply->eventfd, 1);
+    }
+    return NULL;
+}
+
+int auth_start(int threads, size_t queue_size)
+{
+    max_waiting = queue_size;
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, run_auth_thread, NULL) != 0)
+            return -1;
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+bool auth_submit(struct auth_job *job)
+{
+    pthread_mutex_lock(&queue_lock);
+    if (waiting >= max_waiting)
+    {
+        pthread_mutex_unlock(&queue_lock);
+        return false;
+    }
+    job->next = NULL;
+    if (waiting_tail != NULL)
+        waiting_tail->next = job;
+    else
+        waiting_head = job;
+    waiting_tail = job;
+    waiting++;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+    return true;
+}
+
+int auth_queue_init(struct auth_queue *queue)
+{
+    pthread_mutex_init(&queue->lock, NULL);
+    queue->done = NULL;
+    queue->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return queue->eventfd < 0 ? -1 : 0;
+}
+
+struct auth_job *auth_queue_take(struct auth_queue *queue)
+{
+    struct auth_job *done;
+    eventfd_t count;
+
+    eventfd_read(queue->eventfd, &count);
+    pthread_mutex_lock(&queue->lock);
+    done = queue->done;
+    queue->done = NULL;
+    pthread_mutex_unlock(&queue->lock);
+    return done;
+}
+
+static void sign_token(const unsigned char *token, size_t len, unsigned char *mac)
+{
+    unsigned int maclen = TOKEN_MAC_SIZE;
+
+    HMAC(EVP_sha256(), token_key, sizeof(token_key), token, len, mac, &maclen);
+}
+
+size_t auth_make_token(const char *username, unsigned char *token)
+{
+    size_t namelen = strlen(username);
+
+    put_u64(token, time(NULL) + AUTH_TOKEN_LIFETIME);
+    token[8] = namelen;
+    memcpy(token + TOKEN_HEADER_SIZE, username, namelen);
+    sign_token(token, TOKEN_HEADER_SIZE + namelen, token + TOKEN_HEADER_SIZE + namelen);
+    return TOKEN_HEADER_SIZE + namelen + TOKEN_MAC_SIZE;
+}
+
+bool auth_check_token(const unsigned char *token, size_t len, char *username)
+{
+    unsigned char mac[TOKEN_MAC_SIZE];
+    size_t namelen;
+
+    if (len < TOKEN_HEADER_SIZE + TOKEN_MAC_SIZE)
+        return false;
+    namelen = token[8];
+    if (namelen >= AUTH_NAME_MAX || len != TOKEN_HEADER_SIZE + namelen + TOKEN_MAC_SIZE)
+        return false;
+    sign_token(token, TOKEN_HEADER_SIZE + namelen, mac);
+    if (CRYPTO_memcmp(mac, token + TOKEN_HEADER_SIZE + namelen, TOKEN_MAC_SIZE) != 0 ||
+        get_u64(token) < (uint64_t)time(NULL))
+        return false;
+
+    memcpy(username, token + TOKEN_HEADER_SIZE, namelen);
+    username[namelen] = '\0';
+
+    // The account may have been removed since
+    return find_account(username) != NULL;
+}
+
+int auth_add_user(const char *path, const char *username, const char *password, unsigned int rounds)
+{
+    char *hash;
+    FILE *fp;
+    int fd;
+
+    if (!valid_name(username))
+    {
+        fprintf(stderr, "Server: Invalid username '%s'\n", username);
+        return -1;
+    }
+    if ((hash = make_hash(password, rounds)) == NULL)
+    {
+        fprintf(stderr, "Server: Unable to hash the password\n");
+        return -1;
+    }
+
+    // Only the server needs to read the hashes
+    fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0 || (fp = fdopen(fd, "a")) == NULL)
+    {
+        fprintf(stderr, "Server: Unable to open %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        free(hash);
+        return -1;
+    }
+    fprintf(fp, "%s:%s\n", username, hash);
+    free(hash);
+    return fclose(fp) == 0 ? 0 : -1;
+}
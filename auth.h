@@ -0,0 +1,97 @@
+/******************************************************************************
+
+PROGRAM:  auth.h
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: User accounts, password checks and session tokens.
+
+          Accounts come from a credential file with one "username:hash" line
+          per user, where the hash is a salted SHA-512 crypt() hash
+          ("$6$rounds=N$salt$...") made once when the user is added.  The
+          file is loaded into a hash table when the server starts, so a
+          login costs exactly one hash of the submitted password.
+
+          Hashing is deliberately slow, so it never runs on the workers'
+          event loops.  A login is handed to a small pool of auth threads
+          through a bounded queue; when the check is done the job is posted
+          back to the worker that submitted it, which is woken through an
+          eventfd in its epoll set.  A login storm therefore only delays
+          other logins, and once the queue is full further logins are turned
+          away straight away instead of piling up.
+
+          A successful login is answered with a session token: the username
+          and an expiry time signed with a key only the server knows.
+          Presenting the token on a later connection logs the client in
+          without any password hashing at all.  The key is made when the
+          server starts, so a restart invalidates every token.
+
+******************************************************************************/
+#ifndef AUTH_H
+#define AUTH_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "protocol.h"
+
+#define AUTH_NAME_MAX 32
+#define AUTH_PASSWORD_MAX 256
+
+// Cost of the hashes --add-user makes, as SHA-512 crypt() rounds
+#define AUTH_DEFAULT_ROUNDS 5000
+
+// How long a session token is accepted, in seconds
+#define AUTH_TOKEN_LIFETIME (24 * 60 * 60)
+
+struct auth_queue;
+
+// One password check, from submission until its worker has dealt with it
+struct auth_job
+{
+    char username[AUTH_NAME_MAX];
+    char password[AUTH_PASSWORD_MAX];
+    bool ok;                  // Set by the auth thread
+    void *owner;              // The submitter's, e.g. its session; NULL once it has gone away
+    struct auth_queue *reply; // Where the finished job is posted
+    struct auth_job *next;
+};
+
+// Finished jobs waiting for the worker that submitted them
+struct auth_queue
+{
+    pthread_mutex_t lock;
+    struct auth_job *done;
+    int eventfd; // Readable while 'done' isn't empty
+};
+
+// Load the accounts from 'path'.  If the file doesn't exist the single
+// built-in account is used instead.  Returns -1 if the file can't be read.
+int auth_load(const char *path);
+
+// The hash a login as 'username' is checked against: the account's, or for
+// an unknown username one with the cost of the dearest account
+const char *auth_expected_hash(const char *username);
+
+// Start 'threads' auth threads with room for 'queue_size' waiting logins
+int auth_start(int threads, size_t queue_size);
+
+// Queue a password check.  Returns false if the queue is full.
+bool auth_submit(struct auth_job *job);
+
+int auth_queue_init(struct auth_queue *queue);
+
+// Take every finished job posted to the queue, in no particular order
+struct auth_job *auth_queue_take(struct auth_queue *queue);
+
+// Sign a token for 'username' into 'token', which has room for
+// TOKEN_MAX_SIZE bytes.  Returns its length.
+size_t auth_make_token(const char *username, unsigned char *token);
+
+// Check a token and return the username it was issued to, or false
+bool auth_check_token(const unsigned char *token, size_t len, char *username);
+
+// Append an account to the credential file, hashing 'password' with the
+// given number of rounds
+int auth_add_user(const char *path, const char *username, const char *password, unsigned int rounds);
+
+#endif
@@ -0,0 +1,250 @@
+/******************************************************************************
+
+PROGRAM:  bench-catalog.c
+SYNOPSIS: Startup time of the server's catalog on a synthetic library.
+
+          Generates a data directory with the given number of files (sparse,
+          with random sizes, so even a million of them take next to no disk
+          space) and then starts the catalog the way ssl-server does, in a
+          fresh child process each time:
+
+          cold    no snapshot file, every file is stat'ed
+          warm    the snapshot written by the cold start is mapped
+          changed the same after the mtime of some of the files was changed
+
+          For each it reports how long catalog_start() took, i.e. how long
+          the server would take before it could answer an ls, and how long
+          the background thread then took to write or check the snapshot.
+
+          bench-catalog [-n files] [-c changed-percent] [-d directory]
+
+          The library is generated in the directory given with -d (kept for
+          the next run, which then skips generating it) or in a scratch
+          directory that is removed afterwards.
+
+******************************************************************************/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "../catalog.h"
+
+struct result
+{
+    double start_ms;   // catalog_start()
+    double settle_ms;  // Until the snapshot file was written or found current
+    size_t entries;
+};
+
+double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Create 'count' files with random sizes up to 10 MB, without writing any data
+void generate_library(const char *data, int count)
+{
+    char path[PATH_MAX];
+    double start = now_ms();
+
+    if (mkdir(data, 0755) < 0)
+    {
+        fprintf(stderr, "bench-catalog: mkdir %s: %s\n", data, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    srand(1);
+    for (int i = 0; i < count; i++)
+    {
+        int fd;
+
+        snprintf(path, sizeof(path), "%s/track%07d.mp3", data, i);
+        if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 || ftruncate(fd, rand() % (10 << 20)) < 0)
+        {
+            fprintf(stderr, "bench-catalog: %s: %s\n", path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
+    printf("generated %d files in %.0f ms\n", count, now_ms() - start);
+}
+
+// Give 'percent' percent of the files a new mtime
+void touch_library(const char *data, int count, int percent)
+{
+    char path[PATH_MAX];
+    int step = percent > 0 ? 100 / percent : 0;
+
+    for (int i = 0; step > 0 && i < count; i += step)
+    {
+        snprintf(path, sizeof(path), "%s/track%07d.mp3", data, i);
+        utimensat(AT_FDCWD, path, NULL, 0);
+    }
+}
+
+// Whether the catalog thread has logged that the snapshot matched the directory
+bool logged_up_to_date(const char *log)
+{
+    char line[PATH_MAX + 128];
+    bool found = false;
+    FILE *fp = fopen(log, "r");
+
+    while (fp != NULL && !found && fgets(line, sizeof(line), fp) != NULL)
+        found = strstr(line, "is up to date") != NULL;
+    if (fp != NULL)
+        fclose(fp);
+    return found;
+}
+
+/******************************************************************************
+
+Start the catalog in a child process, so that every run starts from nothing
+just like a freshly started server, and wait there until the catalog thread
+has settled: the snapshot file has been replaced (cold or changed library),
+or it has logged that the snapshot is up to date.
+
+******************************************************************************/
+struct result run_catalog(const char *data, const char *snapshot, const char *log)
+{
+    struct result result = {0};
+    int fds[2];
+    pid_t pid;
+
+    // Or the child would print whatever is still buffered a second time
+    fflush(stdout);
+    if (pipe(fds) < 0 || (pid = fork()) < 0)
+    {
+        perror("bench-catalog");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pid == 0)
+    {
+        struct stat before, after;
+        bool existed = stat(snapshot, &before) == 0;
+        struct catalog *cat;
+        double start;
+
+        close(fds[0]);
+        if (freopen(log, "w", stdout) == NULL)
+            _exit(EXIT_FAILURE);
+        setvbuf(stdout, NULL, _IOLBF, 0);
+
+        start = now_ms();
+        if (catalog_start(data, snapshot, sysconf(_SC_NPROCESSORS_ONLN)) < 0)
+            _exit(EXIT_FAILURE);
+        result.start_ms = now_ms() - start;
+        cat = catalog_acquire();
+        result.entries = cat->count;
+        catalog_release(cat);
+
+        // A snapshot is replaced by renaming a new file over it
+        while (!(stat(snapshot, &after) == 0 && (!existed || after.st_ino != before.st_ino)) &&
+               !logged_up_to_date(log))
+            usleep(1000);
+        result.settle_ms = now_ms() - start;
+        write(fds[1], &result, sizeof(result));
+        _exit(EXIT_SUCCESS);
+    }
+
+    close(fds[1]);
+    if (read(fds[0], &result, sizeof(result)) != sizeof(result))
+    {
+        fprintf(stderr, "bench-catalog: catalog failed to start\n");
+        exit(EXIT_FAILURE);
+    }
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+    return result;
+}
+
+void report(const char *name, struct result r)
+{
+    printf("%-8s %10zu %14.2f %14.1f\n", name, r.entries, r.start_ms, r.settle_ms);
+}
+
+void usage(void)
+{
+    fprintf(stderr, "Usage: bench-catalog [-n files] [-c changed-percent] [-d directory]\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    char work[PATH_MAX], data[PATH_MAX], snapshot[PATH_MAX], log[PATH_MAX];
+    const char *dir = NULL;
+    int count = 100000;
+    int changed = 1;
+    struct stat fileInfo;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:c:d:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'c':
+            changed = atoi(optarg);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc || count < 0 || changed < 0 || changed > 100)
+        usage();
+
+    if (dir != NULL)
+    {
+        snprintf(work, sizeof(work), "%s", dir);
+        mkdir(work, 0755);
+    }
+    else
+    {
+        snprintf(work, sizeof(work), "/tmp/bench-catalog-XXXXXX");
+        if (mkdtemp(work) == NULL)
+        {
+            perror("bench-catalog");
+            exit(EXIT_FAILURE);
+        }
+    }
+    snprintf(data, sizeof(data), "%s/data", work);
+    snprintf(snapshot, sizeof(snapshot), "%s/catalog.snapshot", work);
+    snprintf(log, sizeof(log), "%s/catalog.log", work);
+
+    if (stat(data, &fileInfo) < 0)
+        generate_library(data, count);
+    unlink(snapshot);
+
+    printf("%-8s %10s %14s %14s\n", "start", "entries", "startup ms", "settled ms");
+    report("cold", run_catalog(data, snapshot, log));
+    report("warm", run_catalog(data, snapshot, log));
+    touch_library(data, count, changed);
+    report("changed", run_catalog(data, snapshot, log));
+    if (stat(snapshot, &fileInfo) == 0)
+        printf("snapshot file: %.1f MB\n", fileInfo.st_size / 1e6);
+
+    if (dir == NULL)
+    {
+        char command[PATH_MAX + 16];
+
+        snprintf(command, sizeof(command), "rm -rf '%s'", work);
+        system(command);
+    }
+    return EXIT_SUCCESS;
+}
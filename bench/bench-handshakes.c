@@ -0,0 +1,197 @@
+/******************************************************************************
+
+PROGRAM:  bench-handshakes.c
+SYNOPSIS: Handshake rate of ssl-server, with and without session resumption.
+
+          Each client thread connects, completes the TLS handshake and the
+          protocol hello, and disconnects, over and over.  Without -r every
+          handshake is a full one.  With -r every connection offers the
+          session the previous one was given, as a reconnecting client
+          does, so the handshakes are resumed; the session is replaced after
+          every connection because a stateful server session may only be
+          resumed once.
+
+          bench-handshakes [-n handshakes] [-t threads] [-r] <host>:<port>
+
+          Reports handshakes per second and how many of them the server
+          actually resumed.
+
+******************************************************************************/
+#define _GNU_SOURCE
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "../protocol.h"
+
+struct bench
+{
+    pthread_t thread;
+    int handshakes;
+    int completed;
+    int resumed;
+    int failed;
+};
+
+static SSL_CTX *ssl_ctx;
+static struct addrinfo *addr;
+static bool resume;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// One connection.  Returns the session to offer next time, or NULL.
+static SSL_SESSION *connect_once(struct bench *bench, SSL_SESSION *session)
+{
+    unsigned char hello[2] = {PROTO_MAGIC, PROTO_VERSION};
+    SSL_SESSION *next = NULL;
+    SSL *ssl = NULL;
+    int one = 1;
+    int fd;
+
+    fd = socket(addr->ai_family, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, addr->ai_addr, addr->ai_addrlen) < 0)
+        goto failed;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    ssl = SSL_new(ssl_ctx);
+    SSL_set_fd(ssl, fd);
+    if (session != NULL)
+        SSL_set_session(ssl, session);
+    if (SSL_connect(ssl) != 1)
+        goto failed;
+
+    // TLS 1.3 tickets arrive after the handshake, so read the server's
+    // answer to the hello before taking the session
+    if (SSL_write(ssl, hello, sizeof(hello)) != sizeof(hello) || SSL_read(ssl, hello, sizeof(hello)) <= 0)
+        goto failed;
+
+    bench->completed++;
+    if (SSL_session_reused(ssl))
+        bench->resumed++;
+    if (resume)
+        next = SSL_get1_session(ssl);
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(fd);
+    return next;
+
+failed:
+    bench->failed++;
+    ERR_clear_error();
+    if (ssl != NULL)
+        SSL_free(ssl);
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+static void *run_bench(void *arg)
+{
+    struct bench *bench = arg;
+    SSL_SESSION *session = NULL;
+
+    for (int i = 0; i < bench->handshakes; i++)
+    {
+        SSL_SESSION *next = connect_once(bench, session);
+
+        // Keep the old session if the connection failed to give a new one
+        if (next != NULL)
+        {
+            SSL_SESSION_free(session);
+            session = next;
+        }
+    }
+    SSL_SESSION_free(session);
+    return NULL;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: bench-handshakes [-n handshakes] [-t threads] [-r] <host>:<port>\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct bench *benches;
+    int handshakes = 1000, threads = 1, completed = 0, resumed = 0, failed = 0;
+    char host[256], *port;
+    double start, elapsed;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:t:r")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            handshakes = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'r':
+            resume = true;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind != 1 || handshakes < 1 || threads < 1)
+        usage();
+
+    snprintf(host, sizeof(host), "%s", argv[optind]);
+    if ((port = strrchr(host, ':')) == NULL)
+        usage();
+    *port++ = '\0';
+    if (getaddrinfo(host, port, &hints, &addr) != 0)
+    {
+        fprintf(stderr, "bench-handshakes: Could not resolve %s\n", host);
+        exit(EXIT_FAILURE);
+    }
+
+    ssl_ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_OFF);
+
+    benches = calloc(threads, sizeof(*benches));
+    start = now();
+    for (int i = 0; i < threads; i++)
+    {
+        benches[i].handshakes = handshakes / threads + (i < handshakes % threads);
+        pthread_create(&benches[i].thread, NULL, run_bench, &benches[i]);
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(benches[i].thread, NULL);
+        completed += benches[i].completed;
+        resumed += benches[i].resumed;
+        failed += benches[i].failed;
+    }
+    elapsed = now() - start;
+
+    printf("handshakes:   %d (%d resumed, %d failed)\n", completed, resumed, failed);
+    printf("elapsed:      %.3f s\n", elapsed);
+    printf("rate:         %.1f handshakes/s\n", completed / elapsed);
+    printf("latency:      %.2f ms\n", elapsed * 1e3 * threads / (completed > 0 ? completed : 1));
+
+    SSL_CTX_free(ssl_ctx);
+    free(benches);
+    return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
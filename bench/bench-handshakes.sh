@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# Compare the handshake rate of ssl-server for full and resumed handshakes.
+#
+# Starts the server with session tickets and then with --no-tickets (so that
+# sessions are resumed from the shared session cache), always with two
+# workers so resumption has to work whichever worker a connection lands on,
+# and runs bench-handshakes without and with -r against each.
+#
+# Usage: bench/bench-handshakes.sh [handshakes]
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+COUNT=${1:-2000}
+PORT=${PORT:-4499}
+
+make -C "$ROOT" ssl-server bench >/dev/null
+
+WORK=$(mktemp -d)
+SERVER=
+trap 'kill $SERVER 2>/dev/null || true; rm -rf "$WORK"' EXIT
+cd "$WORK"
+openssl req -newkey rsa:2048 -nodes -keyout key.pem -x509 -days 1 -out cert.pem -subj /CN=localhost 2>/dev/null
+mkdir data
+
+printf "%-10s %-8s %12s %10s %12s\n" server client handshakes resumed handshakes/s
+for mode in tickets cache; do
+    [ $mode = cache ] && FLAGS=--no-tickets || FLAGS=
+    "$ROOT/ssl-server" --workers 2 $FLAGS $PORT >/dev/null 2>&1 &
+    SERVER=$!
+    sleep 0.5
+    for client in full resumed; do
+        [ $client = resumed ] && R=-r || R=
+        "$ROOT/bench/bench-handshakes" -n $COUNT $R localhost:$PORT |
+            awk -v mode=$mode -v client=$client '
+                /^handshakes/ { n = $2; r = substr($3, 2) }
+                /^rate/ { rate = $2 }
+                END { printf "%-10s %-8s %12d %10d %12s\n", mode, client, n, r, rate }'
+    done
+    kill $SERVER
+    wait $SERVER 2>/dev/null || true
+done
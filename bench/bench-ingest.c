@@ -0,0 +1,435 @@
+/******************************************************************************
+
+PROGRAM:  bench-ingest.c
+SYNOPSIS: Throughput of the server's ingest pool on a synthetic library.
+
+          Generates a directory of MP3 files made of real MPEG audio frame
+          headers (with random bytes for the audio), a mix of what turns up
+          in a library:
+
+          cbr        constant bitrate, 32, 44.1 or 48 kHz
+          vbr        variable bitrate with a Xing header
+          vbri       variable bitrate with a VBRI header
+          truncated  either kind, cut off in the middle of a frame
+          corrupt    either kind, with junk in the middle of the audio
+
+          Most have an ID3v2 tag in front and some an ID3v1 tag at the end.
+          Then every file is read the way the catalog reads a new one, with
+          the pool at each thread count from 1 up to -t, doubling, and the
+          files per second and megabytes per second are reported, along with
+          how many files came out with a duration or state other than the
+          one they were made with (which should be none).
+
+          bench-ingest [-n files] [-t threads] [-l seconds] [-d directory] [-c]
+
+          -l is the longest track, -c drops the files from the page cache
+          before each run so they are read from the disk.  The library is
+          generated in the directory given with -d (kept for the next run,
+          which then skips generating it) or in a scratch directory that is
+          removed afterwards.
+
+******************************************************************************/
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "../id3.h"
+#include "../ingest.h"
+
+#define NOISE_SIZE 65536
+
+enum kind
+{
+    KIND_CBR,
+    KIND_VBR,
+    KIND_VBRI,
+    KIND_TRUNCATED,
+    KIND_CORRUPT,
+    KINDS
+};
+
+static const char *kind_names[KINDS] = {"cbr", "vbr", "vbri", "truncated", "corrupt"};
+
+// What a generated file should be read as.  Kept in the file's name, so a
+// library kept with -d can be checked again.
+struct expected
+{
+    unsigned int duration;
+    enum id3_audio audio;
+};
+
+struct corpus
+{
+    char dir[PATH_MAX];
+    int dirfd;
+    int count;
+    char **names;
+    off_t bytes;
+    atomic_int wrong;
+};
+
+static uint64_t rng_state = 1;
+static unsigned char noise[NOISE_SIZE];
+
+static uint64_t next_random(void)
+{
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1Dull;
+}
+
+static size_t random_below(size_t n)
+{
+    return next_random() % n;
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// An MPEG-1 layer III frame header, and the frame's length
+static size_t frame_header(unsigned char *p, int rate_index, int bitrate_index, bool padding)
+{
+    static const unsigned int bitrates[] = {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320};
+    static const unsigned int rates[] = {44100, 48000, 32000};
+
+    p[0] = 0xff;
+    p[1] = 0xfb;
+    p[2] = bitrate_index << 4 | rate_index << 2 | padding << 1;
+    p[3] = 0x40; // Joint stereo
+    return 144 * bitrates[bitrate_index] * 1000 / rates[rate_index] + padding;
+}
+
+// Write 'len' bytes of frame: the header already in 'frame', then noise
+static void write_frame(FILE *file, unsigned char *frame, size_t len)
+{
+    size_t at = random_below(NOISE_SIZE - len);
+
+    memcpy(frame + 4, noise + at, len - 4);
+    fwrite(frame, 1, len, file);
+}
+
+static void write_id3v2(FILE *file, int i)
+{
+    unsigned char tag[10 + 10 + 64] = "ID3\3";
+    int len = snprintf((char *)tag + 21, 63, "Track %d", i) + 1;
+
+    // Version 2.3, one TIT2 frame
+    tag[9] = 10 + len;
+    memcpy(tag + 10, "TIT2", 4);
+    put_be32(tag + 14, len);
+    tag[18] = tag[19] = 0;
+    tag[20] = 0; // ISO-8859-1
+    fwrite(tag, 1, 20 + len, file);
+}
+
+static void write_id3v1(FILE *file, int i)
+{
+    char tag[128] = "TAG";
+
+    snprintf(tag + 3, 30, "Track %d", i);
+    fwrite(tag, 1, sizeof(tag), file);
+}
+
+/******************************************************************************
+
+Write one file of the given kind and work out how it should be read.  A
+variable bitrate file starts with a frame holding only its header, which
+counts the frames after it.  A truncated file has a frame cut short or, if
+it has a VBR header, a frame missing.  A corrupt file has a run of junk
+(never all zeros) between two of its frames, after the second.
+
+******************************************************************************/
+static void write_track(FILE *file, int i, enum kind kind, int seconds, struct expected *expected)
+{
+    static const unsigned int rates[] = {44100, 48000, 32000};
+    unsigned char frame[2048];
+    int rate = random_below(3), cbr = 5 + random_below(10);
+    size_t frames = (size_t)seconds * rates[rate] / 1152, junk_at = 0, cut = 0;
+    enum kind base = kind;
+
+    if (kind == KIND_TRUNCATED || kind == KIND_CORRUPT)
+        base = random_below(2) ? KIND_CBR : KIND_VBR;
+    if (kind == KIND_CORRUPT)
+        junk_at = 2 + random_below(frames - 3);
+    if (kind == KIND_TRUNCATED)
+        cut = base == KIND_CBR || random_below(2) ? 1 : 2;
+
+    if (random_below(10) < 8)
+        write_id3v2(file, i);
+    if (base != KIND_CBR)
+    {
+        size_t len = frame_header(frame, rate, cbr, false);
+
+        memset(frame + 4, 0, len - 4);
+        if (base == KIND_VBR)
+        {
+            memcpy(frame + 4 + 32, "Xing", 4);
+            put_be32(frame + 4 + 32 + 4, 1);
+            put_be32(frame + 4 + 32 + 8, frames);
+        }
+        else
+        {
+            memcpy(frame + 36, "VBRI", 4);
+            put_be32(frame + 36 + 14, frames);
+        }
+        fwrite(frame, 1, len, file);
+    }
+
+    for (size_t f = 0; f < frames; f++)
+    {
+        size_t len = frame_header(frame, rate, base == KIND_CBR ? cbr : 1 + random_below(14), random_below(2));
+
+        if (f == junk_at && junk_at > 0)
+        {
+            size_t n = 16 + random_below(200);
+
+            fwrite(noise + random_below(NOISE_SIZE - n), 1, n, file);
+            fputc(1 + random_below(255), file);
+        }
+        if (f == frames - 1 && cut == 1)
+            len = 4 + random_below(len - 4);
+        if (f == frames - 1 && cut == 2)
+            break;
+        write_frame(file, frame, len);
+    }
+    if (random_below(2))
+        write_id3v1(file, i);
+
+    expected->duration = (uint64_t)(frames - (cut > 0)) * 1152 * 1000 / rates[rate];
+    expected->audio = kind == KIND_CORRUPT ? ID3_AUDIO_CORRUPT : cut ? ID3_AUDIO_TRUNCATED : ID3_AUDIO_OK;
+}
+
+static void generate_library(struct corpus *corpus, int count, int longest)
+{
+    double start = now_ms();
+    int made[KINDS] = {0};
+
+    for (size_t i = 0; i < NOISE_SIZE; i++)
+        noise[i] = next_random();
+    for (int i = 0; i < count; i++)
+    {
+        int roll = random_below(100), seconds = 2 + random_below(longest - 1);
+        enum kind kind = roll < 60 ? KIND_CBR : roll < 85 ? KIND_VBR : roll < 90 ? KIND_VBRI
+                                                    : roll < 95 ? KIND_TRUNCATED : KIND_CORRUPT;
+        struct expected expected;
+        char name[NAME_MAX + 1];
+        FILE *file;
+        int fd;
+
+        // The name is only known once the file has been written
+        if ((fd = openat(corpus->dirfd, "new.tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 ||
+            (file = fdopen(fd, "w")) == NULL)
+        {
+            perror("bench-ingest: new.tmp");
+            exit(EXIT_FAILURE);
+        }
+        write_track(file, i, kind, seconds, &expected);
+        fclose(file);
+        snprintf(name, sizeof(name), "%06d-%s-%u-%d.mp3", i, kind_names[kind], expected.duration, expected.audio);
+        renameat(corpus->dirfd, "new.tmp", corpus->dirfd, name);
+        made[kind]++;
+    }
+    printf("generated %d files (", count);
+    for (int k = 0; k < KINDS; k++)
+        printf("%s%d %s", k > 0 ? ", " : "", made[k], kind_names[k]);
+    printf(") in %.0f ms\n", now_ms() - start);
+}
+
+static void load_library(struct corpus *corpus)
+{
+    DIR *dir = fdopendir(dup(corpus->dirfd));
+    struct dirent *entry;
+    size_t size = 0;
+
+    // The copy shares its offset with the original, which may be at the end
+    if (dir != NULL)
+        rewinddir(dir);
+    corpus->count = 0;
+    corpus->bytes = 0;
+    while (dir != NULL && (entry = readdir(dir)) != NULL)
+    {
+        struct stat st;
+
+        if (strstr(entry->d_name, ".mp3") == NULL || fstatat(corpus->dirfd, entry->d_name, &st, 0) < 0)
+            continue;
+        if ((size_t)corpus->count == size)
+        {
+            size = size ? size * 2 : 1024;
+            corpus->names = realloc(corpus->names, size * sizeof(*corpus->names));
+        }
+        corpus->names[corpus->count++] = strdup(entry->d_name);
+        corpus->bytes += st.st_size;
+    }
+    if (dir != NULL)
+        closedir(dir);
+}
+
+// Read one file the way the catalog does and check it came out as made
+static void ingest_file(void *ctx, size_t i)
+{
+    struct corpus *corpus = ctx;
+    struct expected expected = {0};
+    struct id3_info info;
+    struct stat st;
+    int fd, audio;
+
+    sscanf(corpus->names[i], "%*d-%*[a-z]-%u-%d", &expected.duration, &audio);
+    expected.audio = audio;
+    if ((fd = openat(corpus->dirfd, corpus->names[i], O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0)
+    {
+        atomic_fetch_add(&corpus->wrong, 1);
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    id3_read(fd, st.st_size, &info);
+    close(fd);
+    if (info.duration != expected.duration || info.audio != expected.audio)
+    {
+        if (atomic_fetch_add(&corpus->wrong, 1) < 5)
+            fprintf(stderr, "bench-ingest: %s read as %u ms, state %d\n", corpus->names[i], info.duration,
+                    info.audio);
+    }
+}
+
+// Push the library out of the page cache
+static void drop_library(struct corpus *corpus)
+{
+    syncfs(corpus->dirfd);
+    for (int i = 0; i < corpus->count; i++)
+    {
+        int fd = openat(corpus->dirfd, corpus->names[i], O_RDONLY | O_CLOEXEC);
+
+        if (fd >= 0)
+        {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+}
+
+static void remove_library(struct corpus *corpus)
+{
+    for (int i = 0; i < corpus->count; i++)
+        unlinkat(corpus->dirfd, corpus->names[i], 0);
+    rmdir(corpus->dir);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: bench-ingest [-n files] [-t threads] [-l seconds] [-d directory] [-c]\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    struct corpus corpus = {0};
+    int count = 5000, maxthreads = 8, longest = 20, opt;
+    const char *keep = NULL;
+    bool cold = false;
+
+    while ((opt = getopt(argc, argv, "n:t:l:d:c")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 't':
+            maxthreads = atoi(optarg);
+            break;
+        case 'l':
+            longest = atoi(optarg);
+            break;
+        case 'd':
+            keep = optarg;
+            break;
+        case 'c':
+            cold = true;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc || count < 1 || maxthreads < 1 || longest < 3)
+        usage();
+
+    if (keep != NULL)
+    {
+        snprintf(corpus.dir, sizeof(corpus.dir), "%s", keep);
+        mkdir(corpus.dir, 0755);
+    }
+    else
+    {
+        snprintf(corpus.dir, sizeof(corpus.dir), "/tmp/bench-ingest-XXXXXX");
+        if (mkdtemp(corpus.dir) == NULL)
+        {
+            perror("bench-ingest: mkdtemp");
+            return EXIT_FAILURE;
+        }
+    }
+    if ((corpus.dirfd = open(corpus.dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    {
+        perror(corpus.dir);
+        return EXIT_FAILURE;
+    }
+    load_library(&corpus);
+    if (corpus.count == 0)
+    {
+        generate_library(&corpus, count, longest);
+        load_library(&corpus);
+    }
+    printf("library: %d files, %.0f MB in %s, %s cache\n", corpus.count, corpus.bytes / 1048576.0, corpus.dir,
+           cold ? "cold" : "warm");
+
+    printf("%8s %10s %10s %10s %8s\n", "threads", "ms", "files/s", "MB/s", "wrong");
+    for (int threads = 1; threads <= maxthreads; threads *= 2)
+    {
+        struct ingest_pool *pool = ingest_start(threads);
+        double start, ms;
+
+        if (pool == NULL)
+        {
+            fprintf(stderr, "bench-ingest: Could not start %d threads\n", threads);
+            break;
+        }
+        if (cold)
+            drop_library(&corpus);
+        atomic_store(&corpus.wrong, 0);
+        start = now_ms();
+        ingest_run(pool, corpus.count, ingest_file, &corpus);
+        ms = now_ms() - start;
+        printf("%8d %10.0f %10.0f %10.1f %8d\n", threads, ms, corpus.count * 1000.0 / ms,
+               corpus.bytes / 1048576.0 * 1000.0 / ms, atomic_load(&corpus.wrong));
+        ingest_stop(pool);
+    }
+
+    if (keep == NULL)
+        remove_library(&corpus);
+    close(corpus.dirfd);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,670 @@
+/******************************************************************************
+
+PROGRAM:  bench-micro.c
+SYNOPSIS: Microbenchmarks of the server's hot paths, each on its own, with
+          no network involved.
+
+          transfer   reading a file a chunk at a time and SSL_write()ing
+                     each chunk, as getfile does from userspace, at the old
+                     264 byte chunk and at 4, 16 (TRANSFER_SIZE) and 64 kB.
+                     The TLS session runs over an in-memory BIO pair, with
+                     the client reading everything back, so the cost is the
+                     read, the encryption and the decryption.
+          ls-scan    reading a directory of 1000 and 100000 files and
+                     stat'ing each, as the catalog does when it starts
+          ls-text    laying out the text and binary listings of 1000 and
+          ls-binary  100000 entries with catalog_format_entry(), measured
+                     and then written, as the catalog does
+          auth       a crypt() password check with each hashing method and
+                     round count libcrypt supports that a credential file
+                     might hold
+          parse      parsing text protocol commands, and a binary getfile,
+                     with request.c
+          trace      a request's trace record, with tracing at debug and
+                     off.  Nothing drains the ring, the benchmark empties it
+                     itself, so this is what a worker pays and not the file.
+
+          Each benchmark is run for a while to settle and then timed several
+          times, the median run counting.  Results are in nanoseconds per MB
+          moved, entry, hash or request.  With -b they are compared with a
+          baseline file and the run fails if any is more than -t percent
+          slower, except for those under COMPARE_MIN_NS; -w writes the
+          results as a new baseline.  Baselines only mean something on the
+          machine that recorded them.
+
+          bench-micro [-b baseline] [-w baseline] [-t percent] [-f filter]
+
+******************************************************************************/
+#define _GNU_SOURCE
+#include <crypt.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include "../catalog.h"
+#include "../request.h"
+#include "../trace.h"
+
+// Each benchmark is timed REPEATS times for about RUN_NS each
+#define REPEATS 10
+#define RUN_NS 20000000.0
+
+// Results faster than this move by their own size from run to run, so they
+// are shown against the baseline but never fail it
+#define COMPARE_MIN_NS 10.0
+
+#define TRANSFER_FILE_SIZE (4 * 1024 * 1024)
+#define PAIR_BUFFER (256 * 1024)
+#define MB (1024 * 1024)
+
+#define MAX_RESULTS 64
+
+struct micro
+{
+    const char *name;
+    const char *unit;
+    void (*run)(void *arg, size_t ops);
+    void *arg;
+    double scale; // Units per op
+};
+
+struct result
+{
+    char name[64];
+    const char *unit;
+    double ns;       // Per unit
+    double baseline; // 0 if none
+};
+
+static struct result results[MAX_RESULTS];
+static int nresults;
+static volatile unsigned long sink; // Keeps results from being optimized away
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/******************************************************************************
+
+TLS over a BIO pair.  The server's certificate is a throwaway P-256 one made
+on the spot.
+
+******************************************************************************/
+struct tls_pair
+{
+    SSL_CTX *server_ctx, *client_ctx;
+    SSL *server, *client;
+};
+
+static bool make_certificate(SSL_CTX *ctx)
+{
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *cert = X509_new();
+    bool ok = key != NULL && cert != NULL;
+
+    if (ok)
+    {
+        X509_NAME *name = X509_get_subject_name(cert);
+
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+        X509_set_pubkey(cert, key);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"bench-micro", -1, -1, 0);
+        X509_set_issuer_name(cert, name);
+        ok = X509_sign(cert, key, EVP_sha256()) > 0 && SSL_CTX_use_certificate(ctx, cert) == 1 &&
+             SSL_CTX_use_PrivateKey(ctx, key) == 1;
+    }
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return ok;
+}
+
+static bool tls_pair_open(struct tls_pair *t)
+{
+    BIO *server_bio, *client_bio;
+    int done = 0;
+
+    t->server_ctx = SSL_CTX_new(TLS_server_method());
+    t->client_ctx = SSL_CTX_new(TLS_client_method());
+    if (t->server_ctx == NULL || t->client_ctx == NULL || !make_certificate(t->server_ctx) ||
+        BIO_new_bio_pair(&server_bio, PAIR_BUFFER, &client_bio, PAIR_BUFFER) != 1)
+        return false;
+    t->server = SSL_new(t->server_ctx);
+    t->client = SSL_new(t->client_ctx);
+    SSL_set_bio(t->server, server_bio, server_bio);
+    SSL_set_bio(t->client, client_bio, client_bio);
+    SSL_set_accept_state(t->server);
+    SSL_set_connect_state(t->client);
+
+    // Each side goes as far as it can until both are through
+    for (int round = 0; round < 100 && done != 3; round++)
+    {
+        if (SSL_do_handshake(t->client) == 1)
+            done |= 1;
+        if (SSL_do_handshake(t->server) == 1)
+            done |= 2;
+    }
+    return done == 3;
+}
+
+static void tls_pair_close(struct tls_pair *t)
+{
+    SSL_free(t->server);
+    SSL_free(t->client);
+    SSL_CTX_free(t->server_ctx);
+    SSL_CTX_free(t->client_ctx);
+}
+
+struct transfer
+{
+    struct tls_pair *tls;
+    int fd;
+    size_t chunk;
+};
+
+// Let the client read whatever the server has sent
+static void drain(SSL *client)
+{
+    static char buffer[64 * 1024];
+    int n;
+
+    while ((n = SSL_read(client, buffer, sizeof(buffer))) > 0)
+        sink += n;
+}
+
+// Send 'ops' MB of the file, a chunk at a time
+static void run_transfer(void *arg, size_t ops)
+{
+    struct transfer *t = arg;
+    static char buffer[64 * 1024];
+    size_t left = ops * MB;
+    off_t offset = 0;
+
+    while (left > 0)
+    {
+        size_t want = t->chunk < left ? t->chunk : left;
+        ssize_t got = pread(t->fd, buffer, want, offset);
+
+        if (got <= 0)
+        {
+            offset = 0;
+            continue;
+        }
+        offset = (offset + got) % TRANSFER_FILE_SIZE;
+        while (SSL_write(t->tls->server, buffer, got) <= 0)
+            drain(t->tls->client);
+        drain(t->tls->client);
+        left -= got;
+    }
+}
+
+/******************************************************************************
+
+Directories and listings of made-up files
+
+******************************************************************************/
+struct listing
+{
+    char **names;
+    uint64_t *sizes;
+    size_t count;
+    char *dirname;
+    char *buffer;
+};
+
+static void make_listing(struct listing *l, size_t count)
+{
+    l->count = count;
+    l->names = calloc(count, sizeof(*l->names));
+    l->sizes = calloc(count, sizeof(*l->sizes));
+    for (size_t i = 0; i < count; i++)
+    {
+        if (asprintf(&l->names[i], "%06zu Artist %zu - Title %zu.mp3", i, i % 997, i * 7919 % 100003) < 0)
+            exit(EXIT_FAILURE);
+        l->sizes[i] = 1000000 + i * 7919 % 9000000;
+    }
+    l->buffer = malloc(count * (LS_ENTRY_HEADER_SIZE + NAME_MAX + 32));
+}
+
+// Put a file for every name in a directory of its own
+static bool make_directory(struct listing *l)
+{
+    char template[] = "/tmp/bench-micro.XXXXXX";
+    int dirfd;
+
+    if (mkdtemp(template) == NULL || (dirfd = open(template, O_RDONLY | O_DIRECTORY)) < 0)
+        return false;
+    l->dirname = strdup(template);
+    for (size_t i = 0; i < l->count; i++)
+    {
+        int fd = openat(dirfd, l->names[i], O_WRONLY | O_CREAT | O_EXCL, 0644);
+
+        if (fd < 0)
+        {
+            close(dirfd);
+            return false;
+        }
+        close(fd);
+    }
+    close(dirfd);
+    return true;
+}
+
+static void remove_directory(struct listing *l)
+{
+    int dirfd;
+
+    if (l->dirname == NULL || (dirfd = open(l->dirname, O_RDONLY | O_DIRECTORY)) < 0)
+        return;
+    for (size_t i = 0; i < l->count; i++)
+        unlinkat(dirfd, l->names[i], 0);
+    close(dirfd);
+    rmdir(l->dirname);
+}
+
+// Read the names and stat every file, as the catalog's scan does
+static void run_scan(void *arg, size_t ops)
+{
+    struct listing *l = arg;
+
+    for (size_t op = 0; op < ops; op++)
+    {
+        int dirfd = open(l->dirname, O_RDONLY | O_DIRECTORY), fd = dup(dirfd);
+        DIR *dir = fdopendir(fd);
+        struct dirent *entry;
+        struct stat info;
+
+        while (dir != NULL && (entry = readdir(dir)) != NULL)
+        {
+            char *name;
+
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+            name = strdup(entry->d_name);
+            if (fstatat(dirfd, name, &info, 0) == 0)
+                sink += info.st_size;
+            free(name);
+        }
+        if (dir != NULL)
+            closedir(dir);
+        close(dirfd);
+    }
+}
+
+static void lay_out(struct listing *l, bool binary)
+{
+    size_t len = 0;
+
+    for (size_t i = 0; i < l->count; i++)
+        len += catalog_format_entry(NULL, 0, l->names[i], strlen(l->names[i]), LS_ENTRY_FILE, l->sizes[i], binary);
+    for (size_t i = 0, at = 0; i < l->count; i++)
+        at += catalog_format_entry(l->buffer + at, len - at + 1, l->names[i], strlen(l->names[i]), LS_ENTRY_FILE,
+                                   l->sizes[i], binary);
+    sink += len;
+}
+
+static void run_text_listing(void *arg, size_t ops)
+{
+    for (size_t op = 0; op < ops; op++)
+        lay_out(arg, false);
+}
+
+static void run_binary_listing(void *arg, size_t ops)
+{
+    for (size_t op = 0; op < ops; op++)
+        lay_out(arg, true);
+}
+
+/******************************************************************************
+
+Password checks and request parsing
+
+******************************************************************************/
+struct hash_method
+{
+    const char *name;
+    const char *prefix;
+    unsigned long rounds; // 0 for the method's default
+    char setting[CRYPT_GENSALT_OUTPUT_SIZE];
+};
+
+static void run_crypt(void *arg, size_t ops)
+{
+    struct hash_method *method = arg;
+    static struct crypt_data data;
+
+    for (size_t op = 0; op < ops; op++)
+    {
+        const char *hash = crypt_r("correct horse battery staple", method->setting, &data);
+
+        sink += hash != NULL ? (unsigned char)hash[strlen(hash) - 1] : 0;
+    }
+}
+
+static void run_parse_text(void *arg, size_t ops)
+{
+    struct request req;
+
+    for (size_t op = 0; op < ops; op++)
+    {
+        parse_text_request(arg, &req);
+        sink += req.opcode + req.error;
+    }
+}
+
+static void run_parse_frame(void *arg, size_t ops)
+{
+    const unsigned char *frame = arg;
+    struct frame_header hdr;
+    struct request req;
+
+    for (size_t op = 0; op < ops; op++)
+    {
+        decode_frame_header(frame, &hdr);
+        parse_frame_request(&hdr, frame + FRAME_HEADER_SIZE, PROTO_VERSION, &req);
+        sink += req.opcode + req.error;
+    }
+}
+
+static void run_trace(void *arg, size_t ops)
+{
+    struct trace_ring *ring = arg;
+
+    for (size_t op = 0; op < ops; op++)
+    {
+        trace(ring, TRACE_DEBUG, TRACE_REQUEST, 1, op, OP_GETFILE, "./data/song1.mp3");
+
+        // Stand in for the drain thread before the ring fills
+        if (ring != NULL && op % (TRACE_RING_SIZE / 2) == 0)
+            atomic_store(&ring->tail, atomic_load(&ring->head));
+    }
+}
+
+static int by_value(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/******************************************************************************
+
+Run a benchmark until one run takes about RUN_NS, then time REPEATS runs of
+that many ops and keep the median.  The best run is too easily a lucky one
+to compare with a baseline.
+
+******************************************************************************/
+static void measure(const struct micro *m)
+{
+    struct result *r = &results[nresults];
+    double runs[REPEATS], elapsed = 0;
+    size_t ops = 1;
+
+    while (true)
+    {
+        double start = now_ns();
+
+        m->run(m->arg, ops);
+        elapsed = now_ns() - start;
+        if (elapsed >= RUN_NS / 4 || ops >= (size_t)1 << 40)
+            break;
+        ops *= 2;
+    }
+    if (elapsed < RUN_NS)
+        ops = (size_t)(ops * RUN_NS / (elapsed > 0 ? elapsed : 1)) + 1;
+    for (int i = 0; i < REPEATS; i++)
+    {
+        double start = now_ns();
+
+        m->run(m->arg, ops);
+        runs[i] = now_ns() - start;
+    }
+    qsort(runs, REPEATS, sizeof(runs[0]), by_value);
+
+    snprintf(r->name, sizeof(r->name), "%s", m->name);
+    r->unit = m->unit;
+    r->ns = (runs[(REPEATS - 1) / 2] + runs[REPEATS / 2]) / 2 / ops / m->scale;
+    if (nresults < MAX_RESULTS - 1)
+        nresults++;
+    printf("%-24s %14.1f ns/%s\n", r->name, r->ns, r->unit);
+    fflush(stdout);
+}
+
+static bool wanted(const char *name, const char *filter)
+{
+    return filter == NULL || strstr(name, filter) != NULL;
+}
+
+// Read "name ns" lines into the results' baselines.  Returns false if the
+// file can't be read.
+static bool load_baseline(const char *path)
+{
+    char line[256], name[64];
+    double ns;
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL)
+        return false;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        if (line[0] == '#' || sscanf(line, "%63s %lf", name, &ns) != 2)
+            continue;
+        for (int i = 0; i < nresults; i++)
+            if (strcmp(results[i].name, name) == 0)
+                results[i].baseline = ns;
+    }
+    fclose(f);
+    return true;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: bench-micro [-b baseline] [-w baseline] [-t percent] [-f filter]\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t chunks[] = {264, 4 * 1024, 16 * 1024, 64 * 1024};
+    static const size_t counts[] = {1000, 100000};
+    static struct hash_method methods[] = {
+        {"auth/md5", "$1$", 0, ""},
+        {"auth/sha256-5000", "$5$", 5000, ""},
+        {"auth/sha512-5000", "$6$", 5000, ""},
+        {"auth/sha512-50000", "$6$", 50000, ""},
+        {"auth/bcrypt-10", "$2b$", 10, ""},
+        {"auth/yescrypt", "$y$", 0, ""},
+    };
+    static const char *commands[][2] = {
+        {"parse/getfile", "getfile ./data/song1.mp3"},
+        {"parse/getfile-at", "getfile ./data/mix.mp3 @1:02:03.5"},
+        {"parse/getfile-bad", "getfile ./data/song1.mp3 two three"},
+        {"parse/ls-paged", "ls -n 50 -s size -r *.mp3"},
+        {"parse/search", "search artist the beatles"},
+    };
+    const char *baseline = NULL, *write_to = NULL, *filter = NULL;
+    unsigned char frame[FRAME_HEADER_SIZE + GETFILE_HEADER_SIZE + 32] = {0};
+    struct listing listings[2];
+    struct tls_pair tls;
+    struct transfer transfer;
+    char template[] = "/tmp/bench-micro-file.XXXXXX";
+    char name[64], long_getfile[REQUEST_SIZE];
+    double tolerance = 50;
+    int opt, regressions = 0;
+
+    while ((opt = getopt(argc, argv, "b:w:t:f:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            baseline = optarg;
+            break;
+        case 'w':
+            write_to = optarg;
+            break;
+        case 't':
+            tolerance = atof(optarg);
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc || tolerance < 0)
+        usage();
+
+    // The transfer loop, over a file that stays in the page cache
+    if (!tls_pair_open(&tls) || (transfer.fd = mkstemp(template)) < 0)
+    {
+        fprintf(stderr, "bench-micro: Could not set up TLS over a BIO pair\n");
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+    unlink(template);
+    for (size_t at = 0; at < TRANSFER_FILE_SIZE; at += 4096)
+    {
+        unsigned char block[4096];
+
+        for (size_t i = 0; i < sizeof(block); i++)
+            block[i] = (at + i) * 2654435761u >> 13;
+        if (write(transfer.fd, block, sizeof(block)) != sizeof(block))
+            exit(EXIT_FAILURE);
+    }
+    transfer.tls = &tls;
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+    {
+        if (chunks[i] < 1024)
+            snprintf(name, sizeof(name), "transfer/%zu", chunks[i]);
+        else
+            snprintf(name, sizeof(name), "transfer/%zuk", chunks[i] / 1024);
+        transfer.chunk = chunks[i];
+        if (wanted(name, filter))
+            measure(&(struct micro){name, "MB", run_transfer, &transfer, 1});
+    }
+    close(transfer.fd);
+    tls_pair_close(&tls);
+
+    // Listings
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+    {
+        struct listing *l = &listings[i];
+        const char *size = counts[i] >= 1000000 ? "m" : "k";
+        size_t shown = counts[i] >= 1000000 ? counts[i] / 1000000 : counts[i] / 1000;
+
+        memset(l, 0, sizeof(*l));
+        make_listing(l, counts[i]);
+        snprintf(name, sizeof(name), "ls-scan/%zu%s", shown, size);
+        if (wanted(name, filter))
+        {
+            if (make_directory(l))
+                measure(&(struct micro){name, "entry", run_scan, l, counts[i]});
+            else
+                fprintf(stderr, "bench-micro: Could not make %zu files: %s\n", counts[i], strerror(errno));
+            remove_directory(l);
+        }
+        snprintf(name, sizeof(name), "ls-text/%zu%s", shown, size);
+        if (wanted(name, filter))
+            measure(&(struct micro){name, "entry", run_text_listing, l, counts[i]});
+        snprintf(name, sizeof(name), "ls-binary/%zu%s", shown, size);
+        if (wanted(name, filter))
+            measure(&(struct micro){name, "entry", run_binary_listing, l, counts[i]});
+    }
+
+    // Password hashing, with whichever methods this libcrypt has
+    for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++)
+    {
+        struct hash_method *m = &methods[i];
+
+        if (!wanted(m->name, filter))
+            continue;
+        if (crypt_gensalt_rn(m->prefix, m->rounds, NULL, 0, m->setting, sizeof(m->setting)) == NULL)
+        {
+            printf("%-24s %14s\n", m->name, "unsupported");
+            continue;
+        }
+        measure(&(struct micro){m->name, "hash", run_crypt, m, 1});
+    }
+
+    // Parsing
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+        if (wanted(commands[i][0], filter))
+            measure(&(struct micro){commands[i][0], "request", run_parse_text, (void *)commands[i][1], 1});
+
+    // A name as long as a request may be, far longer than PATH_LENGTH, which
+    // must be refused without overrunning the parser's buffers
+    snprintf(long_getfile, sizeof(long_getfile), "getfile %0*d", (int)(REQUEST_SIZE - 1 - strlen("getfile ")), 0);
+    if (wanted("parse/getfile-long", filter))
+        measure(&(struct micro){"parse/getfile-long", "request", run_parse_text, long_getfile, 1});
+    encode_frame_header(frame, OP_GETFILE, 1, GETFILE_HEADER_SIZE + strlen("./data/song1.mp3"));
+    memcpy(frame + FRAME_HEADER_SIZE + GETFILE_HEADER_SIZE, "./data/song1.mp3", strlen("./data/song1.mp3"));
+    if (wanted("parse/frame-getfile", filter))
+        measure(&(struct micro){"parse/frame-getfile", "request", run_parse_frame, frame, 1});
+
+    // Tracing, without trace_start() and so without a drain thread or file
+    if (wanted("trace/off", filter))
+        measure(&(struct micro){"trace/off", "record", run_trace, NULL, 1});
+    trace_level = TRACE_DEBUG;
+    if (wanted("trace/debug", filter))
+        measure(&(struct micro){"trace/debug", "record", run_trace, trace_ring_new(0), 1});
+    trace_level = TRACE_OFF;
+
+    if (baseline != NULL)
+    {
+        if (!load_baseline(baseline))
+        {
+            fprintf(stderr, "bench-micro: Could not read %s: %s\n", baseline, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        printf("\n%-24s %14s %14s %9s\n", "benchmark", "ns", "baseline ns", "change");
+        for (int i = 0; i < nresults; i++)
+        {
+            struct result *r = &results[i];
+            bool slower = r->baseline >= COMPARE_MIN_NS && r->ns > r->baseline * (1 + tolerance / 100);
+
+            if (r->baseline <= 0)
+                printf("%-24s %14.1f %14s\n", r->name, r->ns, "-");
+            else
+                printf("%-24s %14.1f %14.1f %+8.1f%%%s\n", r->name, r->ns, r->baseline,
+                       (r->ns / r->baseline - 1) * 100,
+                       slower ? "  SLOWER" : r->baseline < COMPARE_MIN_NS ? "  (too fast to judge)" : "");
+            regressions += slower;
+        }
+        if (regressions > 0)
+            printf("%d benchmark(s) more than %.0f%% slower than the baseline\n", regressions, tolerance);
+    }
+
+    if (write_to != NULL)
+    {
+        FILE *f = fopen(write_to, "w");
+
+        if (f == NULL)
+        {
+            fprintf(stderr, "bench-micro: Could not write %s: %s\n", write_to, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        fprintf(f, "# bench-micro baseline: benchmark, nanoseconds per unit\n");
+        for (int i = 0; i < nresults; i++)
+            fprintf(f, "%s %.1f\n", results[i].name, results[i].ns);
+        fclose(f);
+    }
+    return regressions > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# Measure how ssl-client --parallel copes with a long, window-limited link.
+#
+# Starts a server and a latency-proxy in front of it, then downloads a large
+# file through the proxy with ssl-client --parallel N for each connection
+# count, and prints the throughput the client reported.  Set DELAY_MS (one
+# way, default 50) and WINDOW_KB (per connection, default 256) to shape the
+# link.
+#
+# Usage: bench/bench-parallel.sh [file-size-mb] [connection counts...]
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+SIZE_MB=${1:-32}
+[ $# -gt 0 ] && shift
+COUNTS=${*:-"1 2 4 8 16"}
+PORT=${PORT:-4499}
+PROXY_PORT=$((PORT + 1))
+DELAY_MS=${DELAY_MS:-50}
+WINDOW_KB=${WINDOW_KB:-256}
+
+make -C "$ROOT" ssl-server ssl-client bench >/dev/null
+
+WORK=$(mktemp -d)
+SERVER=
+PROXY=
+trap 'kill $SERVER $PROXY 2>/dev/null || true; rm -rf "$WORK"' EXIT
+cd "$WORK"
+openssl req -newkey rsa:2048 -nodes -keyout key.pem -x509 -days 1 -out cert.pem -subj /CN=localhost 2>/dev/null
+mkdir data localData
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > data/bench.mp3
+
+"$ROOT/ssl-server" $PORT >/dev/null 2>&1 &
+SERVER=$!
+"$ROOT/bench/latency-proxy" -d $DELAY_MS -w $WINDOW_KB $PROXY_PORT localhost:$PORT &
+PROXY=$!
+sleep 0.5
+
+echo "$SIZE_MB MB file, ${DELAY_MS} ms each way, $WINDOW_KB kB window per connection"
+printf "%11s %12s %10s\n" connections MB/s seconds
+for n in $COUNTS; do
+    rm -f localData/bench.mp3 localData/.bench.mp3.etag
+    printf 'GroupProject\nhello\n2\nbench.mp3\n4\n' |
+        "$ROOT/ssl-client" --parallel $n localhost:$PROXY_PORT 2>&1 |
+        sed -n 's/.*over \([0-9]*\) connections in \([0-9.]*\) s, \([0-9.]*\) MB\/s.*/\1 \3 \2/p' |
+        awk '{ printf "%11d %12s %10s\n", $1, $2, $3 }'
+    cmp -s data/bench.mp3 localData/bench.mp3 || echo "download with $n connections differs" >&2
+done
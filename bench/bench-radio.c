@@ -0,0 +1,489 @@
+/******************************************************************************
+
+PROGRAM:  bench-radio.c
+SYNOPSIS: What a radio listener costs ssl-server.  It tunes many sessions in
+          to one channel at once from a single epoll loop, speaking the
+          binary protocol, lets them listen for a while and measures the
+          server's CPU time and resident memory over that time, per
+          listener, and how steadily each listener was fed.
+
+          With -S some of the listeners stop reading as soon as their audio
+          starts, the way a stalled client would, and the rest show whether
+          they held anybody else up.  Whether the server skips those ahead
+          or disconnects them is up to its --radio-slow.
+
+          bench-radio [-s listeners] [-S stalled] [-d seconds] [-c channel]
+                      [-u user] [-p password] [-P server-pid] <host>:<port>
+
+******************************************************************************/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "../protocol.h"
+
+#define MAX_EVENTS 256
+#define READ_SIZE (32 * 1024)
+
+enum client_state
+{
+    CLIENT_CONNECTING,
+    CLIENT_HANDSHAKE,
+    CLIENT_SENDING,
+    CLIENT_LISTENING,
+    CLIENT_STALLED, // Stopped reading on purpose
+    CLIENT_FAILED
+};
+
+struct client
+{
+    int fd;
+    SSL *ssl;
+    enum client_state state;
+    bool stall; // Stop reading once the audio starts
+    unsigned char request[512];
+    size_t request_len;
+
+    // The frame being received: its header, then how much payload is left
+    unsigned char header[FRAME_HEADER_SIZE];
+    size_t header_len;
+    size_t payload_left;
+    uint8_t opcode;
+    bool hello; // The server's answer to the hello has arrived
+
+    bool tuned;               // Audio has started
+    unsigned long long bytes; // of audio during the measurement
+    double last;              // Time audio last arrived
+    double max_gap;           // Longest wait for audio during the measurement
+};
+
+SSL_CTX *ssl_ctx;
+int epollfd;
+int listening, failed, closed;
+bool measuring;
+
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Resident set size of a process in kilobytes, or -1 if it can't be read
+long rss_kb(int pid)
+{
+    char path[64], line[256];
+    long kb = -1;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    if ((f = fopen(path, "r")) == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f) != NULL)
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+            break;
+    fclose(f);
+    return kb;
+}
+
+// CPU time a process has used, user and system, in seconds, or -1
+double cpu_seconds(int pid)
+{
+    char path[64], line[1024], *p;
+    unsigned long utime, stime;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if ((f = fopen(path, "r")) == NULL)
+        return -1;
+    p = fgets(line, sizeof(line), f);
+    fclose(f);
+
+    // Fields 14 and 15, counted after the command name, which may hold spaces
+    if (p == NULL || (p = strrchr(line, ')')) == NULL ||
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return -1;
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+void set_events(struct client *c, uint32_t events)
+{
+    struct epoll_event ev = {.events = events, .data.ptr = c};
+
+    epoll_ctl(epollfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+void fail(struct client *c)
+{
+    if (c->state == CLIENT_FAILED)
+        return;
+    if (c->tuned)
+    {
+        listening--;
+        closed++;
+    }
+    else
+        failed++;
+    c->state = CLIENT_FAILED;
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+}
+
+// The hello and every request a listener makes, all sent at once
+void make_requests(struct client *c, const char *user, const char *password, const char *channel)
+{
+    const char *args[3] = {user, password, channel};
+    const uint8_t ops[3] = {OP_USER, OP_PASS, OP_TUNE};
+    size_t len = 0;
+
+    c->request[len++] = PROTO_MAGIC;
+    c->request[len++] = PROTO_VERSION;
+    for (int i = 0; i < 3; i++)
+    {
+        size_t arglen = strlen(args[i]);
+
+        encode_frame_header(c->request + len, ops[i], i + 1, arglen);
+        memcpy(c->request + len + FRAME_HEADER_SIZE, args[i], arglen);
+        len += FRAME_HEADER_SIZE + arglen;
+    }
+    c->request_len = len;
+}
+
+// Take in what was received: the two byte hello, then frames
+bool receive(struct client *c, const unsigned char *p, size_t len)
+{
+    while (len > 0)
+    {
+        if (!c->hello)
+        {
+            // Both bytes come in the same record
+            c->hello = true;
+            p += 2;
+            len -= len < 2 ? len : 2;
+            continue;
+        }
+        if (c->payload_left == 0 && c->header_len < FRAME_HEADER_SIZE)
+        {
+            size_t take = FRAME_HEADER_SIZE - c->header_len < len ? FRAME_HEADER_SIZE - c->header_len : len;
+            struct frame_header hdr;
+
+            memcpy(c->header + c->header_len, p, take);
+            c->header_len += take;
+            p += take;
+            len -= take;
+            if (c->header_len < FRAME_HEADER_SIZE)
+                break;
+            decode_frame_header(c->header, &hdr);
+            if (hdr.opcode == OP_ERROR)
+            {
+                fprintf(stderr, "bench-radio: the server refused request %u\n", hdr.request_id);
+                return false;
+            }
+            c->opcode = hdr.opcode;
+            c->payload_left = hdr.length;
+            if (c->payload_left > 0)
+                continue;
+        }
+
+        size_t take = c->payload_left < len ? c->payload_left : len;
+
+        if (c->opcode == OP_RADIO_DATA)
+        {
+            double t = now();
+
+            if (!c->tuned)
+            {
+                c->tuned = true;
+                listening++;
+            }
+            if (measuring)
+            {
+                c->bytes += take;
+                if (t - c->last > c->max_gap)
+                    c->max_gap = t - c->last;
+            }
+            c->last = t;
+        }
+        c->payload_left -= take;
+        p += take;
+        len -= take;
+        if (c->payload_left == 0)
+            c->header_len = 0;
+    }
+    return true;
+}
+
+void drive(struct client *c)
+{
+    static unsigned char buffer[READ_SIZE];
+    int ret, err;
+
+    while (true)
+    {
+        switch (c->state)
+        {
+        case CLIENT_CONNECTING:
+        {
+            int error = 0;
+            socklen_t len = sizeof(error);
+
+            getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+            if (error != 0)
+            {
+                fail(c);
+                return;
+            }
+            c->state = CLIENT_HANDSHAKE;
+            break;
+        }
+
+        case CLIENT_HANDSHAKE:
+        case CLIENT_SENDING:
+            ret = c->state == CLIENT_HANDSHAKE ? SSL_connect(c->ssl) : SSL_write(c->ssl, c->request, c->request_len);
+            if (ret <= 0)
+            {
+                err = SSL_get_error(c->ssl, ret);
+                if (err == SSL_ERROR_WANT_READ)
+                    set_events(c, EPOLLIN);
+                else if (err == SSL_ERROR_WANT_WRITE)
+                    set_events(c, EPOLLOUT);
+                else
+                    fail(c);
+                return;
+            }
+            c->state = c->state == CLIENT_HANDSHAKE ? CLIENT_SENDING : CLIENT_LISTENING;
+            break;
+
+        case CLIENT_LISTENING:
+            ret = SSL_read(c->ssl, buffer, sizeof(buffer));
+            if (ret <= 0)
+            {
+                err = SSL_get_error(c->ssl, ret);
+                if (err == SSL_ERROR_WANT_READ)
+                    set_events(c, EPOLLIN);
+                else if (err == SSL_ERROR_WANT_WRITE)
+                    set_events(c, EPOLLOUT);
+                else
+                    fail(c);
+                return;
+            }
+            if (!receive(c, buffer, ret))
+            {
+                fail(c);
+                return;
+            }
+            if (c->tuned && c->stall)
+            {
+                c->state = CLIENT_STALLED;
+                set_events(c, 0);
+                return;
+            }
+            break;
+
+        case CLIENT_STALLED:
+        case CLIENT_FAILED:
+            return;
+        }
+    }
+}
+
+int total;
+
+// Run the event loop for 'seconds', or only until every listener's audio
+// has started or it has failed
+void run(double seconds, bool until_tuned)
+{
+    struct epoll_event events[MAX_EVENTS];
+    double end = now() + seconds;
+
+    while (now() < end && !(until_tuned && listening + failed >= total))
+    {
+        int n = epoll_wait(epollfd, events, MAX_EVENTS, 100);
+
+        for (int i = 0; i < n; i++)
+            drive(events[i].data.ptr);
+    }
+}
+
+void usage(void)
+{
+    fprintf(stderr, "Usage: bench-radio [-s listeners] [-S stalled] [-d seconds] [-c channel] [-u user] [-p password] "
+                    "[-P server-pid] <host>:<port>\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM}, *ai;
+    const char *user = "GroupProject", *password = "hello", *channel = "pop";
+    struct client *clients;
+    struct rlimit rl;
+    int listeners = 1000, stalled = 0, server_pid = 0, fed = 0;
+    double seconds = 10, start, tuned, cpu_before = -1, cpu_after = -1, worst_gap = 0;
+    unsigned long long bytes = 0, least = ~0ULL;
+    long rss_before = -1, rss_after = -1;
+    char host[256], *port;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:S:d:c:u:p:P:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            listeners = atoi(optarg);
+            break;
+        case 'S':
+            stalled = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atof(optarg);
+            break;
+        case 'c':
+            channel = optarg;
+            break;
+        case 'u':
+            user = optarg;
+            break;
+        case 'p':
+            password = optarg;
+            break;
+        case 'P':
+            server_pid = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1 || (port = strchr(argv[optind], ':')) == NULL || listeners < 1 || stalled < 0 ||
+        stalled >= listeners || seconds <= 0)
+        usage();
+    snprintf(host, sizeof(host), "%.*s", (int)(port - argv[optind]), argv[optind]);
+    port++;
+
+    if (getaddrinfo(host, port, &hints, &ai) != 0)
+    {
+        fprintf(stderr, "bench-radio: Cannot resolve %s\n", host);
+        exit(EXIT_FAILURE);
+    }
+
+    // Each listener needs a descriptor
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    ssl_ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_mode(ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
+    clients = calloc(listeners, sizeof(*clients));
+    epollfd = epoll_create1(0);
+    total = listeners;
+    if (server_pid > 0)
+        rss_before = rss_kb(server_pid);
+
+    // The stalled listeners are spread evenly among the others
+    start = now();
+    for (int i = 0; i < listeners; i++)
+    {
+        struct client *c = &clients[i];
+        struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = c};
+
+        c->stall = (long)i * stalled / listeners != (long)(i + 1) * stalled / listeners;
+        c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (c->fd < 0 || (connect(c->fd, ai->ai_addr, ai->ai_addrlen) < 0 && errno != EINPROGRESS))
+        {
+            fprintf(stderr, "bench-radio: connect: %s\n", strerror(errno));
+            c->state = CLIENT_FAILED;
+            failed++;
+            continue;
+        }
+        c->ssl = SSL_new(ssl_ctx);
+        SSL_set_fd(c->ssl, c->fd);
+        make_requests(c, user, password, channel);
+        c->state = CLIENT_CONNECTING;
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+
+    // Wait for every listener's audio to start, then listen
+    run(120, true);
+    tuned = now();
+    if (listening == 0)
+    {
+        fprintf(stderr, "bench-radio: no listener was tuned in\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < listeners; i++)
+        clients[i].last = tuned;
+    if (server_pid > 0)
+        cpu_before = cpu_seconds(server_pid);
+    measuring = true;
+    run(seconds, false);
+    if (server_pid > 0)
+    {
+        cpu_after = cpu_seconds(server_pid);
+        rss_after = rss_kb(server_pid);
+    }
+
+    // Only the listeners still reading at the end say how well they were fed
+    for (int i = 0; i < listeners; i++)
+    {
+        struct client *c = &clients[i];
+
+        if (c->state != CLIENT_LISTENING)
+            continue;
+        if (tuned + seconds - c->last > c->max_gap)
+            c->max_gap = tuned + seconds - c->last;
+        fed++;
+        bytes += c->bytes;
+        if (c->bytes < least)
+            least = c->bytes;
+        if (c->max_gap > worst_gap)
+            worst_gap = c->max_gap;
+    }
+
+    printf("listeners:          %d (%d stalled, %d failed, %d disconnected)\n", listeners, stalled, failed, closed);
+    printf("all tuned in:       %.3f s\n", tuned - start);
+    if (fed > 0)
+    {
+        printf("audio/listener:     %.1f kB/s average, %.1f kB/s least\n", bytes / seconds / fed / 1e3,
+               least / seconds / 1e3);
+        printf("longest wait:       %.0f ms\n", worst_gap * 1e3);
+    }
+    if (cpu_before >= 0 && cpu_after >= 0)
+        printf("server CPU:         %.1f%% of a core, %.1f us/s per listener\n",
+               (cpu_after - cpu_before) / seconds * 100, (cpu_after - cpu_before) / seconds / listening * 1e6);
+    if (rss_before >= 0 && rss_after >= 0)
+        printf("server RSS:         %ld kB idle, %ld kB listening, %.1f kB/listener\n", rss_before, rss_after,
+               (double)(rss_after - rss_before) / listeners);
+
+    for (int i = 0; i < listeners; i++)
+    {
+        if (clients[i].ssl != NULL)
+        {
+            if (clients[i].state == CLIENT_LISTENING || clients[i].state == CLIENT_STALLED)
+                SSL_shutdown(clients[i].ssl);
+            SSL_free(clients[i].ssl);
+        }
+        if (clients[i].fd > 0)
+            close(clients[i].fd);
+    }
+    free(clients);
+    SSL_CTX_free(ssl_ctx);
+    freeaddrinfo(ai);
+
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
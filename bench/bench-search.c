@@ -0,0 +1,388 @@
+/******************************************************************************
+
+PROGRAM:  bench-search.c
+SYNOPSIS: Query latency and memory of the server's trigram index on a
+          synthetic library.
+
+          Generates a library of made-up tracks (one million by default),
+          with artists, albums and titles made of words drawn from a
+          vocabulary with a skewed distribution, so that some words are
+          everywhere and most are rare, as in a real library.  Each track
+          is named "NN Artist - Title.mp3".  The index is built over it the
+          way the catalog builds it, and then each kind of query is run
+          against it:
+
+          substring  4 to 8 characters from anywhere in a track's tags
+          words      a word of a track's artist and a word of its title
+          prefix     the first three letters of a word of a title
+          typo       a word of a title with two letters swapped, which only
+                     the near miss search finds
+          scan       substrings again, checking every track without the
+                     index, as the server does before the index is built
+
+          For each it reports the median, 99th percentile and mean latency,
+          the average number of results and how often the track the query
+          was made from was among them.
+
+          bench-search [-n tracks] [-q queries] [-k results] [-s seed]
+
+******************************************************************************/
+#define _GNU_SOURCE
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../protocol.h"
+#include "../trigram.h"
+
+#define VOCABULARY 20000
+#define SCAN_QUERIES 20
+
+struct track
+{
+    const char *title;
+    const char *artist;
+    const char *album;
+    const char *name;
+};
+
+struct library
+{
+    struct track *tracks;
+    size_t count;
+};
+
+struct query_kind
+{
+    const char *name;
+    bool use_index;
+    int queries;
+};
+
+static uint64_t rng_state;
+
+static uint64_t next_random(void)
+{
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1Dull;
+}
+
+static size_t random_below(size_t n)
+{
+    return next_random() % n;
+}
+
+// Skewed towards 0: a few values are very common, most are rare
+static size_t random_skewed(size_t n)
+{
+    double u = (next_random() >> 11) * (1.0 / 9007199254740992.0);
+
+    return (size_t)(pow(u, 3.0) * n);
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static char *xstrdup(const char *s)
+{
+    char *copy = strdup(s);
+
+    if (copy == NULL)
+    {
+        fprintf(stderr, "bench-search: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return copy;
+}
+
+// A made-up word of two to four syllables
+static void make_word(char *word)
+{
+    static const char *consonants[] = {"b",  "c",  "d",  "f",  "g",  "h",  "j",  "k",  "l",  "m",  "n",
+                                       "p",  "qu", "r",  "s",  "t",  "v",  "w",  "x",  "z",  "ch", "sh",
+                                       "th", "st", "br", "tr", "gr", "pl", "cl", "fr", "sp", "nd", "ck"};
+    static const char *vowels[] = {"a", "e", "i", "o", "u", "y", "ai", "ea", "ou", "oo", "ie", "au", "ee"};
+    int syllables = 2 + random_below(3);
+
+    word[0] = '\0';
+    for (int i = 0; i < syllables; i++)
+    {
+        strcat(word, consonants[random_below(sizeof(consonants) / sizeof(consonants[0]))]);
+        strcat(word, vowels[random_below(sizeof(vowels) / sizeof(vowels[0]))]);
+    }
+}
+
+// Words from the vocabulary, the first of them capitalized
+static char *make_phrase(char **vocabulary, int minwords, int maxwords)
+{
+    char phrase[256] = "";
+    int words = minwords + random_below(maxwords - minwords + 1);
+
+    for (int i = 0; i < words; i++)
+    {
+        if (i > 0)
+            strcat(phrase, " ");
+        strcat(phrase, vocabulary[random_skewed(VOCABULARY)]);
+    }
+    phrase[0] = phrase[0] - 'a' + 'A';
+    return xstrdup(phrase);
+}
+
+static void generate_library(struct library *lib, size_t count)
+{
+    size_t nartists = count / 16 + 1, nalbums = count / 8 + 1;
+    char **vocabulary = malloc(VOCABULARY * sizeof(*vocabulary));
+    char **artists = malloc(nartists * sizeof(*artists));
+    char **albums = malloc(nalbums * sizeof(*albums));
+    size_t *album_artist = malloc(nalbums * sizeof(*album_artist));
+    double start = now_ms();
+
+    lib->tracks = malloc(count * sizeof(*lib->tracks));
+    lib->count = count;
+    if (vocabulary == NULL || artists == NULL || albums == NULL || album_artist == NULL || lib->tracks == NULL)
+    {
+        fprintf(stderr, "bench-search: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < VOCABULARY; i++)
+    {
+        char word[64];
+
+        make_word(word);
+        vocabulary[i] = xstrdup(word);
+    }
+    for (size_t i = 0; i < nartists; i++)
+        artists[i] = make_phrase(vocabulary, 1, 3);
+    for (size_t i = 0; i < nalbums; i++)
+    {
+        albums[i] = make_phrase(vocabulary, 1, 4);
+        album_artist[i] = random_skewed(nartists);
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        struct track *t = &lib->tracks[i];
+        size_t album = random_skewed(nalbums);
+        char name[768];
+
+        t->title = make_phrase(vocabulary, 1, 5);
+        t->artist = artists[album_artist[album]];
+        t->album = albums[album];
+        snprintf(name, sizeof(name), "%02zu %s - %s.mp3", 1 + random_below(20), t->artist, t->title);
+        t->name = xstrdup(name);
+    }
+    printf("generated %zu tracks (%zu artists, %zu albums) in %.0f ms\n", count, nartists, nalbums,
+           now_ms() - start);
+    free(vocabulary);
+    free(artists);
+    free(albums);
+    free(album_artist);
+}
+
+// The catalog's order: tags, then the name
+static const char *track_field(const void *ctx, uint32_t doc, int field)
+{
+    const struct track *t = &((const struct library *)ctx)->tracks[doc];
+
+    switch (field)
+    {
+    case 0:
+        return t->title;
+    case 1:
+        return t->artist;
+    case 2:
+        return t->album;
+    default:
+        return t->name;
+    }
+}
+
+// A random word of 'text' of at least 'minlen' letters into 'word', or false
+static bool pick_word(const char *text, size_t minlen, char *word)
+{
+    const char *starts[64];
+    int n = 0;
+
+    for (const char *p = text; *p != '\0' && n < 64; p++)
+    {
+        if ((p == text || p[-1] == ' ') && strcspn(p, " ") >= minlen)
+            starts[n++] = p;
+    }
+    if (n == 0)
+        return false;
+    const char *start = starts[random_below(n)];
+    size_t len = strcspn(start, " ");
+
+    memcpy(word, start, len);
+    word[len] = '\0';
+    return true;
+}
+
+// Make a query of the given kind from a random track, and return the track
+static uint32_t make_query(const struct library *lib, const char *kind, char *query)
+{
+    while (true)
+    {
+        uint32_t doc = random_below(lib->count);
+        const struct track *t = &lib->tracks[doc];
+        char word[128], other[128];
+
+        if (strcmp(kind, "substring") == 0 || strcmp(kind, "scan") == 0)
+        {
+            const char *text = track_field(lib, doc, random_below(3));
+            size_t len = strlen(text), want = 4 + random_below(5), at;
+
+            if (len < want)
+                continue;
+            at = random_below(len - want + 1);
+            memcpy(query, text + at, want);
+            query[want] = '\0';
+            return doc;
+        }
+        if (strcmp(kind, "words") == 0)
+        {
+            if (!pick_word(t->artist, 1, word) || !pick_word(t->title, 1, other))
+                continue;
+            snprintf(query, SEARCH_QUERY_MAX + 1, "%.31s %.31s", word, other);
+            return doc;
+        }
+        if (strcmp(kind, "prefix") == 0)
+        {
+            if (!pick_word(t->title, 3, word))
+                continue;
+            word[3] = '\0';
+            strcpy(query, word);
+            return doc;
+        }
+
+        // A typo: swap two letters in the middle of a long word
+        if (!pick_word(t->title, 6, word))
+            continue;
+        size_t at = 1 + random_below(strlen(word) - 3);
+        char c = word[at];
+
+        if (word[at] == word[at + 1])
+            continue;
+        word[at] = word[at + 1];
+        word[at + 1] = c;
+        strcpy(query, word);
+        return doc;
+    }
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: bench-search [-n tracks] [-q queries] [-k results] [-s seed]\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    struct query_kind kinds[] = {
+        {"substring", true, 0}, {"words", true, 0}, {"prefix", true, 0},
+        {"typo", true, 0},      {"scan", false, SCAN_QUERIES},
+    };
+    size_t count = 1000000, limit = SEARCH_RANKED_MAX, postings, lists, memory;
+    int queries = 1000, opt;
+    struct trigram_index *index;
+    struct trigram_source src;
+    struct library lib;
+    uint32_t *results;
+    double start, build_ms;
+
+    rng_state = 1;
+    while ((opt = getopt(argc, argv, "n:q:k:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            count = strtoul(optarg, NULL, 10);
+            break;
+        case 'q':
+            queries = atoi(optarg);
+            break;
+        case 'k':
+            limit = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            rng_state = strtoull(optarg, NULL, 10) | 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc || count < 1 || queries < 1 || limit < 1)
+        usage();
+
+    generate_library(&lib, count);
+    src = (struct trigram_source){lib.count, track_field, &lib};
+    start = now_ms();
+    if ((index = trigram_build(&src)) == NULL)
+    {
+        fprintf(stderr, "bench-search: Out of memory building the index\n");
+        return EXIT_FAILURE;
+    }
+    build_ms = now_ms() - start;
+    memory = trigram_memory(index, &postings, &lists);
+    printf("index: %zu lists, %zu postings, %.1f MB (%.2f bytes/posting), built in %.0f ms\n", lists, postings,
+           memory / 1048576.0, (double)memory / postings, build_ms);
+
+    results = malloc(limit * sizeof(*results));
+    printf("%-10s %8s %10s %10s %10s %10s %8s\n", "query", "queries", "p50 ms", "p99 ms", "mean ms", "results",
+           "found");
+    for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++)
+    {
+        int n = kinds[k].queries ? kinds[k].queries : queries, found = 0;
+        double *latency = malloc(n * sizeof(*latency)), total = 0;
+        size_t nresults = 0;
+
+        for (int i = 0; i < n; i++)
+        {
+            char query[SEARCH_QUERY_MAX + 1];
+            uint32_t doc = make_query(&lib, kinds[k].name, query);
+            size_t got;
+
+            start = now_ms();
+            got = trigram_search(kinds[k].use_index ? index : NULL, &src, query, results, limit);
+            latency[i] = now_ms() - start;
+            total += latency[i];
+            nresults += got;
+            for (size_t r = 0; r < got; r++)
+            {
+                if (results[r] == doc)
+                {
+                    found++;
+                    break;
+                }
+            }
+        }
+        qsort(latency, n, sizeof(*latency), compare_doubles);
+        printf("%-10s %8d %10.3f %10.3f %10.3f %10.1f %7.1f%%\n", kinds[k].name, n, latency[n / 2],
+               latency[(size_t)(n * 0.99)], total / n, (double)nresults / n, 100.0 * found / n);
+        free(latency);
+    }
+
+    free(results);
+    trigram_free(index);
+    return EXIT_SUCCESS;
+}
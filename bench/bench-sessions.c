@@ -0,0 +1,430 @@
+/******************************************************************************
+
+PROGRAM:  bench-sessions.c
+SYNOPSIS: Load generator for ssl-server.  It opens many TLS sessions at once
+          from a single epoll loop, logs each of them in, downloads a file a
+          number of times on every session and reports how many sessions the
+          server kept open concurrently and the aggregate throughput.
+
+          Every session stays open until all of them have finished their
+          downloads, so the requested session count really is the number of
+          concurrent sessions the server had to hold.  With -t the sessions
+          are spread over several client threads, so that decrypting on the
+          client side doesn't become the bottleneck when measuring a
+          multi-worker server.
+
+          bench-sessions [-s sessions] [-r requests] [-t threads] [-f file]
+                         [-u user] [-p password] [-P server-pid] <host>:<port>
+
+******************************************************************************/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#define MAX_EVENTS 256
+#define READ_SIZE (32 * 1024)
+
+SSL_CTX *ssl_ctx;
+
+enum client_state
+{
+    CLIENT_CONNECTING,
+    CLIENT_HANDSHAKE,
+    CLIENT_SENDING,
+    CLIENT_RECEIVING,
+    CLIENT_WAITING, // Finished its requests, holding the session open
+    CLIENT_FAILED
+};
+
+struct client
+{
+    int fd;
+    SSL *ssl;
+    enum client_state state;
+    char request[512];
+    size_t request_len;
+    int remaining;   // getfile requests still to send
+    bool first_record;
+};
+
+// One client thread.  The settings are the same for every thread, the
+// counters are per thread and added up at the end.
+struct bench
+{
+    const char *user;
+    const char *password;
+    const char *file;
+    const struct addrinfo *addr;
+    int requests;
+    struct client *clients;
+    int sessions;
+    pthread_t thread;
+    int epollfd;
+    int established; // sessions that completed the handshake
+    int finished;    // sessions that are waiting or failed
+    int failed;
+    unsigned long long bytes;
+    double start;
+    double all_established;
+};
+
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Resident set size of a process in kilobytes, or -1 if it can't be read
+long rss_kb(int pid)
+{
+    char path[64], line[256];
+    long kb = -1;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    if ((f = fopen(path, "r")) == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f) != NULL)
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+            break;
+    fclose(f);
+    return kb;
+}
+
+void set_events(struct bench *b, struct client *c, uint32_t events)
+{
+    struct epoll_event ev = {.events = events, .data.ptr = c};
+
+    epoll_ctl(b->epollfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+void fail(struct bench *b, struct client *c)
+{
+    if (c->state == CLIENT_FAILED)
+        return;
+    if (c->state >= CLIENT_SENDING)
+        b->established--;
+    c->state = CLIENT_FAILED;
+    b->failed++;
+    b->finished++;
+    epoll_ctl(b->epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+}
+
+// Prepare the next request: the login commands plus the first getfile right
+// after the handshake, then one getfile at a time.  Every command is NUL
+// terminated the way ssl-client sends them.
+void next_request(struct bench *b, struct client *c, bool login)
+{
+    size_t len = 0;
+
+    if (login)
+    {
+        len += snprintf(c->request + len, sizeof(c->request) - len, "user %s", b->user) + 1;
+        len += snprintf(c->request + len, sizeof(c->request) - len, "pass %s", b->password) + 1;
+    }
+    len += snprintf(c->request + len, sizeof(c->request) - len, "getfile %s", b->file) + 1;
+    c->request_len = len;
+    c->remaining--;
+    c->first_record = true;
+    c->state = CLIENT_SENDING;
+}
+
+void drive(struct bench *b, struct client *c)
+{
+    static __thread char buffer[READ_SIZE];
+    int ret, err;
+
+    while (true)
+    {
+        switch (c->state)
+        {
+        case CLIENT_CONNECTING:
+        {
+            int error = 0;
+            socklen_t len = sizeof(error);
+
+            getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+            if (error != 0)
+            {
+                fail(b, c);
+                return;
+            }
+            c->state = CLIENT_HANDSHAKE;
+            break;
+        }
+
+        case CLIENT_HANDSHAKE:
+            ret = SSL_connect(c->ssl);
+            if (ret <= 0)
+            {
+                err = SSL_get_error(c->ssl, ret);
+                if (err == SSL_ERROR_WANT_READ)
+                    set_events(b, c, EPOLLIN);
+                else if (err == SSL_ERROR_WANT_WRITE)
+                    set_events(b, c, EPOLLOUT);
+                else
+                    fail(b, c);
+                return;
+            }
+            b->established++;
+            next_request(b, c, true);
+            break;
+
+        case CLIENT_SENDING:
+            ret = SSL_write(c->ssl, c->request, c->request_len);
+            if (ret <= 0)
+            {
+                err = SSL_get_error(c->ssl, ret);
+                if (err == SSL_ERROR_WANT_READ)
+                    set_events(b, c, EPOLLIN);
+                else if (err == SSL_ERROR_WANT_WRITE)
+                    set_events(b, c, EPOLLOUT);
+                else
+                    fail(b, c);
+                return;
+            }
+            c->state = CLIENT_RECEIVING;
+            break;
+
+        case CLIENT_RECEIVING:
+            ret = SSL_read(c->ssl, buffer, sizeof(buffer));
+            if (ret <= 0)
+            {
+                err = SSL_get_error(c->ssl, ret);
+                if (err == SSL_ERROR_WANT_READ)
+                    set_events(b, c, EPOLLIN);
+                else if (err == SSL_ERROR_WANT_WRITE)
+                    set_events(b, c, EPOLLOUT);
+                else
+                    fail(b, c);
+                return;
+            }
+
+            // The server ends a transfer with a record containing just "EOF"
+            if (ret == 4 && memcmp(buffer, "EOF", 4) == 0)
+            {
+                if (c->remaining > 0)
+                {
+                    next_request(b, c, false);
+                    break;
+                }
+                c->state = CLIENT_WAITING;
+                b->finished++;
+                set_events(b, c, 0);
+                return;
+            }
+            if (c->first_record && (strncmp(buffer, "fileerror", 9) == 0 || strncmp(buffer, "rpcerror", 8) == 0))
+            {
+                fprintf(stderr, "bench-sessions: server replied %s\n", buffer);
+                fail(b, c);
+                return;
+            }
+            c->first_record = false;
+            b->bytes += ret;
+            break;
+
+        case CLIENT_WAITING:
+        case CLIENT_FAILED:
+            return;
+        }
+    }
+}
+
+// Open this thread's sessions and run them until every one has finished
+void *run_bench(void *arg)
+{
+    struct bench *b = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    b->epollfd = epoll_create1(0);
+    for (int i = 0; i < b->sessions; i++)
+    {
+        struct client *c = &b->clients[i];
+        struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = c};
+
+        c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (c->fd < 0 || (connect(c->fd, b->addr->ai_addr, b->addr->ai_addrlen) < 0 && errno != EINPROGRESS))
+        {
+            fprintf(stderr, "bench-sessions: connect: %s\n", strerror(errno));
+            c->state = CLIENT_FAILED;
+            b->failed++;
+            b->finished++;
+            continue;
+        }
+        c->ssl = SSL_new(ssl_ctx);
+        SSL_set_fd(c->ssl, c->fd);
+        c->remaining = b->requests;
+        c->state = CLIENT_CONNECTING;
+        epoll_ctl(b->epollfd, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+
+    while (b->finished < b->sessions)
+    {
+        int n = epoll_wait(b->epollfd, events, MAX_EVENTS, 10000);
+        if (n == 0)
+        {
+            fprintf(stderr, "bench-sessions: timed out with %d of %d sessions finished\n", b->finished, b->sessions);
+            break;
+        }
+        for (int i = 0; i < n; i++)
+            drive(b, events[i].data.ptr);
+        if (b->all_established == 0 && b->established + b->failed == b->sessions)
+            b->all_established = now();
+    }
+
+    return NULL;
+}
+
+void usage(void)
+{
+    fprintf(stderr, "Usage: bench-sessions [-s sessions] [-r requests] [-t threads] [-f file] [-u user] [-p password] [-P server-pid] <host>:<port>\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench config = {.user = "GroupProject", .password = "hello", .file = "./data/song1.txt", .requests = 1};
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM}, *ai;
+    struct bench *threads;
+    struct client *clients;
+    struct rlimit rl;
+    int sessions = 100;
+    int nthreads = 1;
+    int server_pid = 0;
+    int failed = 0;
+    long rss_before = -1, rss_peak = -1;
+    unsigned long long bytes = 0;
+    double start, established = 0;
+    char host[256], *port;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:r:t:f:u:p:P:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            sessions = atoi(optarg);
+            break;
+        case 'r':
+            config.requests = atoi(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'f':
+            config.file = optarg;
+            break;
+        case 'u':
+            config.user = optarg;
+            break;
+        case 'p':
+            config.password = optarg;
+            break;
+        case 'P':
+            server_pid = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1 || (port = strchr(argv[optind], ':')) == NULL || nthreads < 1 || sessions < nthreads)
+        usage();
+    snprintf(host, sizeof(host), "%.*s", (int)(port - argv[optind]), argv[optind]);
+    port++;
+
+    if (getaddrinfo(host, port, &hints, &ai) != 0)
+    {
+        fprintf(stderr, "bench-sessions: Cannot resolve %s\n", host);
+        exit(EXIT_FAILURE);
+    }
+    config.addr = ai;
+
+    // Each session needs a descriptor
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    ssl_ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_mode(ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
+    clients = calloc(sessions, sizeof(*clients));
+    threads = calloc(nthreads, sizeof(*threads));
+    if (server_pid > 0)
+        rss_before = rss_kb(server_pid);
+
+    start = now();
+    for (int i = 0, first = 0; i < nthreads; i++)
+    {
+        threads[i] = config;
+        threads[i].clients = clients + first;
+        threads[i].sessions = sessions / nthreads + (i < sessions % nthreads);
+        threads[i].start = start;
+        first += threads[i].sessions;
+        pthread_create(&threads[i].thread, NULL, run_bench, &threads[i]);
+    }
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        failed += threads[i].failed;
+        bytes += threads[i].bytes;
+        if (threads[i].all_established > established)
+            established = threads[i].all_established;
+    }
+    double elapsed = now() - start;
+
+    // Every session that didn't fail is still open, so this is the peak
+    if (server_pid > 0)
+        rss_peak = rss_kb(server_pid);
+
+    printf("sessions:           %d (%d failed)\n", sessions, failed);
+    printf("requests/session:   %d\n", config.requests);
+    if (established > 0)
+        printf("all established in: %.3f s (%.0f handshakes/s)\n", established - start,
+               (sessions - failed) / (established - start));
+    printf("elapsed:            %.3f s\n", elapsed);
+    printf("bytes received:     %llu\n", bytes);
+    printf("throughput:         %.2f MB/s\n", bytes / elapsed / 1e6);
+    if (rss_before >= 0 && rss_peak >= 0 && sessions > failed)
+        printf("server RSS:         %ld kB idle, %ld kB peak, %.1f kB/session\n", rss_before, rss_peak,
+               (double)(rss_peak - rss_before) / (sessions - failed));
+
+    for (int i = 0; i < sessions; i++)
+    {
+        if (clients[i].ssl != NULL)
+        {
+            if (clients[i].state == CLIENT_WAITING)
+            {
+                SSL_write(clients[i].ssl, "exit", 5);
+                SSL_shutdown(clients[i].ssl);
+            }
+            SSL_free(clients[i].ssl);
+        }
+        if (clients[i].fd > 0)
+            close(clients[i].fd);
+    }
+    free(clients);
+    free(threads);
+    SSL_CTX_free(ssl_ctx);
+    freeaddrinfo(ai);
+
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
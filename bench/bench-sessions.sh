@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# Measure how ssl-server scales with the number of concurrent sessions.
+#
+# Starts a server in a scratch directory with a generated certificate and a
+# test file, then runs bench-sessions at increasing session counts and prints
+# one line per run: sessions, handshakes/s, aggregate MB/s and server memory
+# per session.
+#
+# Usage: bench/bench-sessions.sh [file-size-kb] [session counts...]
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+SIZE_KB=${1:-256}
+[ $# -gt 0 ] && shift
+COUNTS=${*:-"1 10 100 500 1000 2000"}
+PORT=${PORT:-4499}
+
+make -C "$ROOT" ssl-server bench >/dev/null
+
+WORK=$(mktemp -d)
+trap 'kill $SERVER 2>/dev/null || true; rm -rf "$WORK"' EXIT
+cd "$WORK"
+openssl req -newkey rsa:2048 -nodes -keyout key.pem -x509 -days 1 -out cert.pem -subj /CN=localhost 2>/dev/null
+mkdir data
+head -c $((SIZE_KB * 1024)) /dev/zero | tr '\0' 'x' > data/bench.mp3
+
+"$ROOT/ssl-server" $PORT >/dev/null 2>&1 &
+SERVER=$!
+sleep 0.5
+
+printf "%10s %14s %12s %14s\n" sessions handshakes/s MB/s kB/session
+for n in $COUNTS; do
+    "$ROOT/bench/bench-sessions" -s $n -r 4 -f ./data/bench.mp3 -P $SERVER localhost:$PORT |
+        awk -v n=$n '/all established/ { hs = $6; sub(/\(/, "", hs) }
+                     /throughput/ { mbs = $2 }
+                     /server RSS/ { kb = $(NF-1) }
+                     END { printf "%10d %14s %12s %14s\n", n, hs, mbs, kb }'
+done
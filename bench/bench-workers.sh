@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# Measure aggregate download throughput of ssl-server with 1, 2, 4 and 8
+# workers on loopback.
+#
+# For each worker count a fresh server is started with --workers N --pin and
+# bench-sessions downloads a large file over many sessions, using as many
+# client threads as the server has workers.  Prints one line per run.
+#
+# Usage: bench/bench-workers.sh [file-size-mb] [worker counts...]
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+SIZE_MB=${1:-16}
+[ $# -gt 0 ] && shift
+COUNTS=${*:-"1 2 4 8"}
+PORT=${PORT:-4499}
+SESSIONS=${SESSIONS:-64}
+
+make -C "$ROOT" ssl-server bench >/dev/null
+
+WORK=$(mktemp -d)
+SERVER=
+trap 'kill $SERVER 2>/dev/null || true; rm -rf "$WORK"' EXIT
+cd "$WORK"
+openssl req -newkey rsa:2048 -nodes -keyout key.pem -x509 -days 1 -out cert.pem -subj /CN=localhost 2>/dev/null
+mkdir data
+head -c $((SIZE_MB * 1024 * 1024)) /dev/zero | tr '\0' 'x' > data/bench.mp3
+
+printf "%8s %12s %10s\n" workers MB/s seconds
+for n in $COUNTS; do
+    "$ROOT/ssl-server" --workers $n --pin $PORT >/dev/null 2>&1 &
+    SERVER=$!
+    sleep 0.5
+    "$ROOT/bench/bench-sessions" -s $SESSIONS -r 2 -t $n -f ./data/bench.mp3 localhost:$PORT |
+        awk -v n=$n '/throughput/ { mbs = $2 }
+                     /elapsed/ { secs = $2 }
+                     END { printf "%8d %12s %10s\n", n, mbs, secs }'
+    kill $SERVER
+    wait $SERVER 2>/dev/null || true
+done
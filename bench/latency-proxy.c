@@ -0,0 +1,312 @@
+/******************************************************************************
+
+PROGRAM:  latency-proxy.c
+SYNOPSIS: A TCP proxy that makes loopback behave like a long, window-limited
+          link, for measuring downloads the way a distant client sees them.
+
+          Every byte is held for the given one-way delay in each direction,
+          and at most one window of data per direction of a connection is
+          in flight at a time, the way an unscaled TCP window limits a real
+          connection.  A single connection can therefore move at most one
+          window per delay, whatever the bandwidth, which is what makes
+          spreading a download over several connections pay off.  Loopback
+          itself has neither limit, so the proxy applies both.
+
+          latency-proxy [-d delay-ms] [-w window-kb] <listen-port> <host>:<port>
+
+          Every direction of every connection has a thread that reads into
+          a queue and one that writes the queue out once each piece is due.
+
+******************************************************************************/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define CHUNK_SIZE (16 * 1024)
+
+// A piece of data on its way, and when it may be passed on
+struct chunk
+{
+    struct chunk *next;
+    struct timespec due;
+    size_t len;
+    char data[CHUNK_SIZE];
+};
+
+// One direction of a connection
+struct direction
+{
+    int from, to;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct chunk *head, *tail;
+    size_t queued; // Bytes in flight
+    bool eof;      // Nothing more will be queued
+    bool broken;   // Nothing more will be written
+    pthread_t reader, writer;
+};
+
+struct connection
+{
+    int client, server;
+    struct direction up, down;
+};
+
+static long delay_ms = 50;
+static size_t window = 256 * 1024;
+static struct addrinfo *target;
+
+static void add_delay(struct timespec *ts)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += delay_ms / 1000;
+    ts->tv_nsec += (delay_ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static void *read_direction(void *arg)
+{
+    struct direction *dir = arg;
+
+    while (true)
+    {
+        struct chunk *c = malloc(sizeof(*c));
+        bool broken;
+        size_t room;
+        ssize_t n;
+
+        pthread_mutex_lock(&dir->lock);
+        while (dir->queued >= window && !dir->broken)
+            pthread_cond_wait(&dir->changed, &dir->lock);
+        room = window - dir->queued;
+        broken = dir->broken;
+        pthread_mutex_unlock(&dir->lock);
+
+        n = c == NULL || broken ? -1 : read(dir->from, c->data, room < CHUNK_SIZE ? room : CHUNK_SIZE);
+        if (n <= 0)
+        {
+            free(c);
+            break;
+        }
+        c->len = n;
+        c->next = NULL;
+        add_delay(&c->due);
+
+        pthread_mutex_lock(&dir->lock);
+        if (dir->tail != NULL)
+            dir->tail->next = c;
+        else
+            dir->head = c;
+        dir->tail = c;
+        dir->queued += n;
+        pthread_cond_signal(&dir->changed);
+        pthread_mutex_unlock(&dir->lock);
+    }
+
+    pthread_mutex_lock(&dir->lock);
+    dir->eof = true;
+    pthread_cond_signal(&dir->changed);
+    pthread_mutex_unlock(&dir->lock);
+    return NULL;
+}
+
+static bool write_all(int fd, const char *p, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void *write_direction(void *arg)
+{
+    struct direction *dir = arg;
+
+    while (true)
+    {
+        struct chunk *c;
+        bool ok;
+
+        pthread_mutex_lock(&dir->lock);
+        while (dir->head == NULL && !dir->eof)
+            pthread_cond_wait(&dir->changed, &dir->lock);
+        c = dir->head;
+        pthread_mutex_unlock(&dir->lock);
+        if (c == NULL)
+            break;
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &c->due, NULL) == EINTR)
+            ;
+        ok = write_all(dir->to, c->data, c->len);
+
+        pthread_mutex_lock(&dir->lock);
+        dir->head = c->next;
+        if (dir->head == NULL)
+            dir->tail = NULL;
+        dir->queued -= c->len;
+        dir->broken = !ok;
+        pthread_cond_signal(&dir->changed);
+        pthread_mutex_unlock(&dir->lock);
+        free(c);
+
+        if (!ok)
+        {
+            // The receiving end is gone, so the sending end may as well go
+            // too.  That also wakes the reader, wherever it is blocked.
+            shutdown(dir->from, SHUT_RDWR);
+            break;
+        }
+    }
+    shutdown(dir->to, SHUT_WR);
+    return NULL;
+}
+
+static void start_direction(struct direction *dir, int from, int to)
+{
+    dir->from = from;
+    dir->to = to;
+    pthread_mutex_init(&dir->lock, NULL);
+    pthread_cond_init(&dir->changed, NULL);
+    pthread_create(&dir->reader, NULL, read_direction, dir);
+    pthread_create(&dir->writer, NULL, write_direction, dir);
+}
+
+static void finish_direction(struct direction *dir)
+{
+    pthread_join(dir->writer, NULL);
+    pthread_join(dir->reader, NULL);
+    while (dir->head != NULL)
+    {
+        struct chunk *c = dir->head;
+
+        dir->head = c->next;
+        free(c);
+    }
+}
+
+// Connect to the server and pass data both ways until both sides are done
+static void *run_connection(void *arg)
+{
+    struct connection *conn = arg;
+    int one = 1;
+
+    conn->server = socket(target->ai_family, SOCK_STREAM, 0);
+    if (conn->server < 0 || connect(conn->server, target->ai_addr, target->ai_addrlen) < 0)
+    {
+        fprintf(stderr, "latency-proxy: connect: %s\n", strerror(errno));
+        if (conn->server >= 0)
+            close(conn->server);
+        close(conn->client);
+        free(conn);
+        return NULL;
+    }
+    setsockopt(conn->server, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(conn->client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    start_direction(&conn->up, conn->client, conn->server);
+    start_direction(&conn->down, conn->server, conn->client);
+    finish_direction(&conn->up);
+    finish_direction(&conn->down);
+
+    close(conn->client);
+    close(conn->server);
+    free(conn);
+    return NULL;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: latency-proxy [-d delay-ms] [-w window-kb] <listen-port> <host>:<port>\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    char host[256], *port;
+    int listener, opt, one = 1;
+
+    while ((opt = getopt(argc, argv, "d:w:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            delay_ms = atol(optarg);
+            break;
+        case 'w':
+            window = (size_t)atol(optarg) * 1024;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind != 2 || delay_ms < 0 || window == 0)
+        usage();
+
+    snprintf(host, sizeof(host), "%s", argv[optind + 1]);
+    if ((port = strrchr(host, ':')) == NULL)
+        usage();
+    *port++ = '\0';
+    if (getaddrinfo(host, port, &hints, &target) != 0)
+    {
+        fprintf(stderr, "latency-proxy: Could not resolve %s\n", host);
+        exit(EXIT_FAILURE);
+    }
+
+    addr.sin_port = htons(atoi(argv[optind]));
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 64) < 0)
+    {
+        perror("latency-proxy");
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    while (true)
+    {
+        struct connection *conn;
+        pthread_t thread;
+        int fd = accept(listener, NULL, NULL);
+
+        if (fd < 0)
+            continue;
+        if ((conn = calloc(1, sizeof(*conn))) == NULL)
+        {
+            close(fd);
+            continue;
+        }
+        conn->client = fd;
+        if (pthread_create(&thread, NULL, run_connection, conn) != 0)
+        {
+            close(fd);
+            free(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
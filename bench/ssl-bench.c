@@ -0,0 +1,1013 @@
+/******************************************************************************
+
+PROGRAM:  ssl-bench.c
+SYNOPSIS: Load generator for ssl-server that measures latency per operation.
+
+          Opens -c sessions at once, spread over -t client threads with an
+          epoll loop each, and takes every session through the TCP connect,
+          TLS handshake and protocol hello, then a USER/PASS login, timing
+          both.  The sessions then run requests from a script, one at a time
+          each, until -d seconds have passed or -n requests have been sent:
+
+              # weight  command
+              4 getfile ./data/song1.mp3
+              1 ls
+              1 search any love
+
+          Each request is drawn at random by weight.  The commands are those
+          of the text protocol: "ls", "getfile <file>", "search <field>
+          <text>" and "meta <file>", sent as binary protocol frames.  With no
+          script the mix is one ls to one getfile of -f.
+
+          Without -R every session sends its next request as soon as the
+          last is answered.  With -R the requests are sent at that many per
+          second in all, and a request's latency counts from when it was due
+          rather than from when a free session got round to sending it, so
+          a server that falls behind isn't flattered by the requests that
+          were never sent while it was busy.
+
+          A trace replays requests at the times they were made, one per
+          line as "<ms from start> <command>", each due at its time and
+          timed from it.  -w writes the requests of a run as a trace, so
+          that a mix can be recorded once and replayed exactly against
+          another build.
+
+          Reports the count, errors and 50th, 99th and 99.9th percentile
+          and maximum latency of each operation, and the time to the first
+          reply frame and throughput of each kind of request, as a table
+          and, with -j, as JSON.
+
+          ssl-bench [-c sessions] [-t threads] [-d seconds] [-n requests]
+                    [-R rate] [-m script] [-r trace] [-w trace] [-j file]
+                    [-f file] [-u user] [-p password] <host>:<port>
+
+******************************************************************************/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "../protocol.h"
+
+#define MAX_EVENTS 256
+#define READ_SIZE (64 * 1024)
+#define REQUEST_MAX 1024
+
+// What is timed: the two steps of setting up a session, then each kind of
+// request
+enum op_kind
+{
+    OP_KIND_HANDSHAKE,
+    OP_KIND_AUTH,
+    OP_KIND_LS,
+    OP_KIND_GETFILE,
+    OP_KIND_SEARCH,
+    OP_KIND_META,
+    OP_KINDS
+};
+
+static const char *kind_names[OP_KINDS] = {"handshake", "auth", "ls", "getfile", "search", "meta"};
+
+struct command
+{
+    char *text;
+    enum op_kind kind;
+    double weight; // In a script
+    double at;     // In a trace, seconds from the start
+    uint8_t opcode;
+    unsigned char payload[REQUEST_MAX];
+    size_t len;
+};
+
+struct samples
+{
+    double *values; // Seconds
+    size_t count;
+    size_t capacity;
+};
+
+struct op_stats
+{
+    struct samples latency;
+    struct samples first_byte;
+    unsigned long errors;
+    unsigned long long bytes;
+};
+
+enum client_state
+{
+    CLIENT_CONNECTING,
+    CLIENT_HANDSHAKE,
+    CLIENT_HELLO,
+    CLIENT_LOGIN,
+    CLIENT_IDLE,
+    CLIENT_BUSY,
+    CLIENT_FAILED
+};
+
+struct client
+{
+    int fd;
+    SSL *ssl;
+    enum client_state state;
+    double started; // Of the step or request being timed
+    bool replied;   // Anything of the answer has arrived
+
+    unsigned char out[2 * FRAME_HEADER_SIZE + 2 * REQUEST_MAX];
+    size_t outlen;
+
+    // The frame being read, and how much of its payload is still to come
+    unsigned char header[FRAME_HEADER_SIZE];
+    size_t have;
+    uint32_t left;
+    struct frame_header frame;
+
+    const struct command *cmd;
+    uint32_t request_id;
+};
+
+struct record
+{
+    double at;
+    const struct command *cmd;
+};
+
+// One client thread.  The settings are the same for every thread, the
+// counters are per thread and added up at the end.
+struct bench
+{
+    pthread_t thread;
+    int epollfd;
+    struct client *clients;
+    int sessions;
+    struct client **idle;
+    int nidle;
+    int ready;  // Logged in, or failed
+    int failed; // Sessions lost
+    int busy;
+    uint64_t rng;
+
+    // This thread's share of the work
+    double rate;           // Requests per second, 0 for as fast as possible
+    long requests;         // Left to send, -1 for no limit
+    const struct command **trace;
+    size_t tracelen, traced;
+
+    double start, stop, next_due;
+    struct op_stats stats[OP_KINDS];
+    struct record *records;
+    size_t nrecords, records_capacity;
+};
+
+static SSL_CTX *ssl_ctx;
+static struct addrinfo *addr;
+static const char *user = "GroupProject", *password = "hello";
+static struct command *script;
+static size_t script_len;
+static double script_weight;
+static double duration = 10;
+static bool recording;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+    if ((p = realloc(p, size)) == NULL)
+    {
+        fprintf(stderr, "ssl-bench: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static void add_sample(struct samples *s, double value)
+{
+    if (s->count == s->capacity)
+    {
+        s->capacity = s->capacity > 0 ? 2 * s->capacity : 1024;
+        s->values = xrealloc(s->values, s->capacity * sizeof(*s->values));
+    }
+    s->values[s->count++] = value;
+}
+
+static void merge_samples(struct samples *into, const struct samples *from)
+{
+    for (size_t i = 0; i < from->count; i++)
+        add_sample(into, from->values[i]);
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int compare_records(const void *a, const void *b)
+{
+    return compare_doubles(&((const struct record *)a)->at, &((const struct record *)b)->at);
+}
+
+// The value 'p' of the way up the sorted samples, in milliseconds
+static double percentile(const struct samples *s, double p)
+{
+    size_t i = (size_t)ceil(p * s->count);
+
+    if (s->count == 0)
+        return 0;
+    return s->values[i > 0 ? i - 1 : 0] * 1e3;
+}
+
+static double mean(const struct samples *s)
+{
+    double sum = 0;
+
+    for (size_t i = 0; i < s->count; i++)
+        sum += s->values[i];
+    return s->count > 0 ? sum / s->count * 1e3 : 0;
+}
+
+/******************************************************************************
+
+Read a command in the text protocol's words into the frame that asks for it
+in the binary protocol.  Returns false if it isn't one ssl-bench sends.
+
+******************************************************************************/
+static bool parse_command(const char *text, struct command *cmd)
+{
+    static const char *fields[] = {"title", "artist", "album", "year", "any"};
+    char word[16], arg[REQUEST_MAX];
+    int used = 0;
+
+    memset(cmd, 0, sizeof(*cmd));
+    if (sscanf(text, " %15s %n", word, &used) != 1)
+        return false;
+    snprintf(arg, sizeof(arg), "%s", text + used);
+    arg[strcspn(arg, "\r\n")] = '\0';
+
+    if (strcmp(word, "ls") == 0)
+    {
+        cmd->kind = OP_KIND_LS;
+        cmd->opcode = OP_LS;
+    }
+    else if (strcmp(word, "getfile") == 0 && arg[0] != '\0' && strlen(arg) <= REQUEST_MAX - GETFILE_HEADER_SIZE)
+    {
+        cmd->kind = OP_KIND_GETFILE;
+        cmd->opcode = OP_GETFILE;
+        cmd->len = GETFILE_HEADER_SIZE + strlen(arg);
+        memcpy(cmd->payload + GETFILE_HEADER_SIZE, arg, strlen(arg));
+    }
+    else if (strcmp(word, "meta") == 0 && arg[0] != '\0')
+    {
+        cmd->kind = OP_KIND_META;
+        cmd->opcode = OP_META;
+        cmd->len = strlen(arg);
+        memcpy(cmd->payload, arg, cmd->len);
+    }
+    else if (strcmp(word, "search") == 0 && sscanf(arg, "%15s %n", word, &used) == 1 &&
+             strlen(arg + used) <= SEARCH_QUERY_MAX)
+    {
+        cmd->kind = OP_KIND_SEARCH;
+        cmd->opcode = OP_SEARCH;
+        cmd->payload[0] = 0xFF;
+        for (int i = 0; i < (int)(sizeof(fields) / sizeof(fields[0])); i++)
+            if (strcmp(word, fields[i]) == 0)
+                cmd->payload[0] = i;
+        if (cmd->payload[0] == 0xFF)
+            return false;
+        cmd->len = 1 + strlen(arg + used);
+        memcpy(cmd->payload + 1, arg + used, cmd->len - 1);
+    }
+    else
+        return false;
+
+    text += strspn(text, " \t");
+    cmd->text = xrealloc(NULL, strlen(text) + 1);
+    strcpy(cmd->text, text);
+    cmd->text[strcspn(cmd->text, "\r\n")] = '\0';
+    return true;
+}
+
+// Read a script, "<weight> <command>" a line, or a trace, "<ms> <command>"
+static struct command *load_commands(const char *path, bool trace, size_t *count)
+{
+    struct command *cmds = NULL;
+    char line[2 * REQUEST_MAX];
+    size_t capacity = 0;
+    int lineno = 0;
+    FILE *f = fopen(path, "r");
+
+    *count = 0;
+    if (f == NULL)
+    {
+        fprintf(stderr, "ssl-bench: Could not open %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        char *rest;
+        double number;
+
+        lineno++;
+        if (line[strspn(line, " \t\r\n")] == '\0' || line[strspn(line, " \t")] == '#')
+            continue;
+        if (*count == capacity)
+        {
+            capacity = capacity > 0 ? 2 * capacity : 64;
+            cmds = xrealloc(cmds, capacity * sizeof(*cmds));
+        }
+        number = strtod(line, &rest);
+        if (rest == line || number < 0 || !parse_command(rest, &cmds[*count]))
+        {
+            fprintf(stderr, "ssl-bench: %s:%d: Expected a %s and a command\n", path, lineno,
+                    trace ? "time" : "weight");
+            exit(EXIT_FAILURE);
+        }
+        if (trace)
+            cmds[*count].at = number / 1e3;
+        else
+            cmds[*count].weight = number;
+        (*count)++;
+    }
+    fclose(f);
+    return cmds;
+}
+
+static uint64_t next_random(struct bench *b)
+{
+    // xorshift64*
+    b->rng ^= b->rng >> 12;
+    b->rng ^= b->rng << 25;
+    b->rng ^= b->rng >> 27;
+    return b->rng * 0x2545F4914F6CDD1Dull;
+}
+
+static const struct command *pick_command(struct bench *b)
+{
+    double x = (next_random(b) >> 11) * (1.0 / 9007199254740992.0) * script_weight;
+    size_t i = 0;
+
+    while (i + 1 < script_len && (x -= script[i].weight) >= 0)
+        i++;
+    return &script[i];
+}
+
+static void set_events(struct bench *b, struct client *c, uint32_t events)
+{
+    struct epoll_event ev = {.events = events, .data.ptr = c};
+
+    epoll_ctl(b->epollfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void fail(struct bench *b, struct client *c)
+{
+    if (c->state == CLIENT_FAILED)
+        return;
+    if (c->state == CLIENT_LOGIN)
+        b->stats[OP_KIND_AUTH].errors++;
+    else if (c->state < CLIENT_LOGIN)
+        b->stats[OP_KIND_HANDSHAKE].errors++;
+    else if (c->state == CLIENT_BUSY)
+    {
+        b->stats[c->cmd->kind].errors++;
+        b->busy--;
+    }
+    else if (c->state == CLIENT_IDLE)
+    {
+        for (int i = 0; i < b->nidle; i++)
+            if (b->idle[i] == c)
+                b->idle[i] = b->idle[--b->nidle];
+    }
+    if (c->state < CLIENT_IDLE)
+        b->ready++;
+    c->state = CLIENT_FAILED;
+    b->failed++;
+    ERR_clear_error();
+    epoll_ctl(b->epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+}
+
+static void queue_frame(struct client *c, uint8_t opcode, const void *payload, size_t len)
+{
+    encode_frame_header(c->out + c->outlen, opcode, ++c->request_id, len);
+    memcpy(c->out + c->outlen + FRAME_HEADER_SIZE, payload, len);
+    c->outlen += FRAME_HEADER_SIZE + len;
+}
+
+static void send_command(struct bench *b, struct client *c, const struct command *cmd, double due)
+{
+    queue_frame(c, cmd->opcode, cmd->payload, cmd->len);
+    c->cmd = cmd;
+    c->started = due;
+    c->replied = false;
+    c->state = CLIENT_BUSY;
+    b->busy++;
+    if (recording)
+    {
+        if (b->nrecords == b->records_capacity)
+        {
+            b->records_capacity = b->records_capacity > 0 ? 2 * b->records_capacity : 1024;
+            b->records = xrealloc(b->records, b->records_capacity * sizeof(*b->records));
+        }
+        b->records[b->nrecords++] = (struct record){due - b->start, cmd};
+    }
+}
+
+// Whether a reply frame is the last one of the answer to a request
+static bool last_frame(enum op_kind kind, uint8_t opcode)
+{
+    if (opcode == OP_ERROR)
+        return true;
+    switch (kind)
+    {
+    case OP_KIND_LS:
+        return opcode == OP_LS_END;
+    case OP_KIND_GETFILE:
+        return opcode == OP_FILE_END;
+    case OP_KIND_SEARCH:
+        return opcode == OP_TRACKS_END;
+    case OP_KIND_META:
+        return opcode == OP_TRACKS;
+    default:
+        return true;
+    }
+}
+
+// A whole frame has arrived
+static void frame_done(struct bench *b, struct client *c)
+{
+    double t = now();
+
+    if (c->state == CLIENT_LOGIN)
+    {
+        // The OK or ERROR answering PASS; USER has no answer of its own
+        if (c->frame.opcode != OP_OK)
+        {
+            fprintf(stderr, "ssl-bench: Login as %s failed\n", user);
+            fail(b, c);
+            return;
+        }
+        add_sample(&b->stats[OP_KIND_AUTH].latency, t - c->started);
+        c->state = CLIENT_IDLE;
+        b->ready++;
+        b->idle[b->nidle++] = c;
+        set_events(b, c, EPOLLIN);
+        return;
+    }
+    if (c->state != CLIENT_BUSY || !last_frame(c->cmd->kind, c->frame.opcode))
+        return;
+    add_sample(&b->stats[c->cmd->kind].latency, t - c->started);
+    if (c->frame.opcode == OP_ERROR)
+        b->stats[c->cmd->kind].errors++;
+    c->state = CLIENT_IDLE;
+    b->busy--;
+    b->idle[b->nidle++] = c;
+}
+
+// Take apart what has been read into frames, counting the payload bytes
+static void consume(struct bench *b, struct client *c, const unsigned char *data, size_t len)
+{
+    while (len > 0 && c->state != CLIENT_FAILED)
+    {
+        if (c->have < FRAME_HEADER_SIZE)
+        {
+            size_t n = FRAME_HEADER_SIZE - c->have < len ? FRAME_HEADER_SIZE - c->have : len;
+
+            memcpy(c->header + c->have, data, n);
+            c->have += n;
+            data += n;
+            len -= n;
+            if (c->have < FRAME_HEADER_SIZE)
+                return;
+            decode_frame_header(c->header, &c->frame);
+            c->left = c->frame.length;
+            if (c->state == CLIENT_BUSY && !c->replied)
+            {
+                add_sample(&b->stats[c->cmd->kind].first_byte, now() - c->started);
+                c->replied = true;
+            }
+        }
+        else
+        {
+            size_t n = c->left < len ? c->left : len;
+
+            if (c->state == CLIENT_BUSY)
+                b->stats[c->cmd->kind].bytes += n;
+            c->left -= n;
+            data += n;
+            len -= n;
+        }
+        if (c->have == FRAME_HEADER_SIZE && c->left == 0)
+        {
+            c->have = 0;
+            frame_done(b, c);
+        }
+    }
+}
+
+// Returns false and waits for the socket if SSL can't go on
+static bool ssl_retry(struct bench *b, struct client *c, int ret)
+{
+    int err = SSL_get_error(c->ssl, ret);
+
+    if (err == SSL_ERROR_WANT_READ)
+        set_events(b, c, EPOLLIN);
+    else if (err == SSL_ERROR_WANT_WRITE)
+        set_events(b, c, EPOLLOUT);
+    else
+        fail(b, c);
+    return false;
+}
+
+/******************************************************************************
+
+Take a session as far as it can go without waiting: through connecting,
+the handshake and the login, then sending what is queued and reading what
+has arrived.
+
+******************************************************************************/
+static void drive(struct bench *b, struct client *c)
+{
+    static __thread unsigned char buffer[READ_SIZE];
+    unsigned char hello[2] = {PROTO_MAGIC, PROTO_VERSION};
+    int ret;
+
+    while (c->state != CLIENT_FAILED)
+    {
+        if (c->state == CLIENT_CONNECTING)
+        {
+            int error = 0;
+            socklen_t len = sizeof(error);
+
+            getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+            if (error != 0)
+            {
+                fail(b, c);
+                return;
+            }
+            c->state = CLIENT_HANDSHAKE;
+        }
+        else if (c->state == CLIENT_HANDSHAKE)
+        {
+            if ((ret = SSL_connect(c->ssl)) <= 0)
+            {
+                ssl_retry(b, c, ret);
+                return;
+            }
+            memcpy(c->out, hello, sizeof(hello));
+            c->outlen = sizeof(hello);
+            c->state = CLIENT_HELLO;
+        }
+        else if (c->outlen > 0)
+        {
+            if ((ret = SSL_write(c->ssl, c->out, c->outlen)) <= 0)
+            {
+                ssl_retry(b, c, ret);
+                return;
+            }
+            c->outlen = 0;
+        }
+        else if (c->state == CLIENT_IDLE)
+        {
+            set_events(b, c, EPOLLIN);
+            return;
+        }
+        else if ((ret = SSL_read(c->ssl, buffer, c->state == CLIENT_HELLO ? 2 - c->have : sizeof(buffer))) <= 0)
+        {
+            ssl_retry(b, c, ret);
+            return;
+        }
+        else if (c->state == CLIENT_HELLO)
+        {
+            // The server's answer to the hello is two bytes, not a frame
+            memcpy(c->header + c->have, buffer, ret);
+            if ((c->have += ret) < 2)
+                continue;
+            c->have = 0;
+            if (c->header[0] != PROTO_MAGIC)
+            {
+                fprintf(stderr, "ssl-bench: The server doesn't speak the binary protocol\n");
+                fail(b, c);
+                return;
+            }
+            add_sample(&b->stats[OP_KIND_HANDSHAKE].latency, now() - c->started);
+            c->started = now();
+            queue_frame(c, OP_USER, user, strlen(user));
+            queue_frame(c, OP_PASS, password, strlen(password));
+            c->state = CLIENT_LOGIN;
+        }
+        else
+            consume(b, c, buffer, ret);
+    }
+}
+
+// Hand requests that are due to idle sessions.  Returns false once there is
+// nothing more to send.
+static bool dispatch(struct bench *b)
+{
+    double t = now();
+
+    while (b->nidle > 0)
+    {
+        const struct command *cmd;
+        double due;
+
+        if (b->trace != NULL)
+        {
+            if (b->traced == b->tracelen)
+                return false;
+            if ((due = b->start + b->trace[b->traced]->at) > t)
+                return true;
+            cmd = b->trace[b->traced++];
+        }
+        else
+        {
+            if (b->requests == 0 || t >= b->stop)
+                return false;
+            if (b->rate > 0)
+            {
+                if ((due = b->next_due) > t)
+                    return true;
+                b->next_due += 1 / b->rate;
+            }
+            else
+                due = t;
+            if (b->requests > 0)
+                b->requests--;
+            cmd = pick_command(b);
+        }
+
+        struct client *c = b->idle[--b->nidle];
+
+        send_command(b, c, cmd, due);
+        drive(b, c);
+    }
+    return b->trace != NULL ? b->traced < b->tracelen : b->requests != 0 && t < b->stop;
+}
+
+static void *run_bench(void *arg)
+{
+    struct bench *b = arg;
+    struct epoll_event events[MAX_EVENTS];
+    bool sending = true;
+    int n;
+
+    b->epollfd = epoll_create1(0);
+    b->idle = calloc(b->sessions, sizeof(*b->idle));
+    for (int i = 0; i < b->sessions; i++)
+    {
+        struct client *c = &b->clients[i];
+        struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = c};
+        int one = 1;
+
+        c->started = now();
+        c->fd = socket(addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (c->fd < 0 || (connect(c->fd, addr->ai_addr, addr->ai_addrlen) < 0 && errno != EINPROGRESS))
+        {
+            fprintf(stderr, "ssl-bench: connect: %s\n", strerror(errno));
+            c->state = CLIENT_FAILED;
+            b->stats[OP_KIND_HANDSHAKE].errors++;
+            b->failed++;
+            b->ready++;
+            continue;
+        }
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c->ssl = SSL_new(ssl_ctx);
+        SSL_set_fd(c->ssl, c->fd);
+        c->state = CLIENT_CONNECTING;
+        epoll_ctl(b->epollfd, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+
+    // Every session logs in before the clock for the requests starts
+    while (b->ready < b->sessions && (n = epoll_wait(b->epollfd, events, MAX_EVENTS, 10000)) > 0)
+        for (int i = 0; i < n; i++)
+            drive(b, events[i].data.ptr);
+    if (b->ready < b->sessions)
+        fprintf(stderr, "ssl-bench: Timed out with %d of %d sessions logged in\n", b->ready, b->sessions);
+
+    b->start = b->next_due = now();
+    b->stop = b->start + duration;
+    while (b->nidle + b->busy > 0 && ((sending = sending && dispatch(b)) || b->busy > 0))
+    {
+        int timeout = 100;
+
+        if (sending && b->nidle > 0)
+        {
+            double due = b->trace != NULL ? b->start + b->trace[b->traced]->at : b->next_due;
+
+            timeout = (int)ceil((due - now()) * 1e3);
+            timeout = timeout < 0 ? 0 : timeout > 100 ? 100 : timeout;
+        }
+        if ((n = epoll_wait(b->epollfd, events, MAX_EVENTS, sending ? timeout : 10000)) == 0 && !sending)
+        {
+            fprintf(stderr, "ssl-bench: Timed out with %d requests unanswered\n", b->busy);
+            break;
+        }
+        for (int i = 0; i < n; i++)
+            drive(b, events[i].data.ptr);
+    }
+    b->stop = now();
+    return NULL;
+}
+
+static void print_row(const char *name, const struct samples *s, unsigned long errors, double mbps)
+{
+    printf("%-16s %9zu %7lu %9.3f %9.3f %9.3f %9.3f %9.3f", name, s->count, errors, percentile(s, 0.5),
+           percentile(s, 0.99), percentile(s, 0.999), s->count > 0 ? s->values[s->count - 1] * 1e3 : 0, mean(s));
+    if (mbps >= 0)
+        printf(" %9.2f", mbps);
+    printf("\n");
+}
+
+static void print_json_samples(FILE *f, const struct samples *s)
+{
+    fprintf(f, "\"count\": %zu, \"p50_ms\": %.3f, \"p99_ms\": %.3f, \"p999_ms\": %.3f, ", s->count,
+            percentile(s, 0.5), percentile(s, 0.99), percentile(s, 0.999));
+    fprintf(f, "\"max_ms\": %.3f, \"mean_ms\": %.3f", s->count > 0 ? s->values[s->count - 1] * 1e3 : 0, mean(s));
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: ssl-bench [-c sessions] [-t threads] [-d seconds] [-n requests]\n"
+                    "                 [-R rate] [-m script] [-r trace] [-w trace] [-j file]\n"
+                    "                 [-f file] [-u user] [-p password] <host>:<port>\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    const char *script_file = NULL, *trace_file = NULL, *record_file = NULL, *json_file = NULL;
+    const char *file = "./data/song1.txt";
+    struct op_stats total[OP_KINDS] = {0};
+    struct command *trace = NULL;
+    struct bench *benches;
+    struct client *clients;
+    struct rlimit rl;
+    int sessions = 10, nthreads = 1, failed = 0;
+    long requests = -1;
+    double rate = 0, elapsed = 0, first = 0, last = 0;
+    unsigned long long bytes = 0;
+    size_t tracelen = 0, completed = 0;
+    char host[256], *port;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:t:d:n:R:m:r:w:j:f:u:p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            sessions = atoi(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'n':
+            requests = atol(optarg);
+            break;
+        case 'R':
+            rate = atof(optarg);
+            break;
+        case 'm':
+            script_file = optarg;
+            break;
+        case 'r':
+            trace_file = optarg;
+            break;
+        case 'w':
+            record_file = optarg;
+            break;
+        case 'j':
+            json_file = optarg;
+            break;
+        case 'f':
+            file = optarg;
+            break;
+        case 'u':
+            user = optarg;
+            break;
+        case 'p':
+            password = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind != 1 || nthreads < 1 || sessions < nthreads || duration <= 0 || rate < 0 ||
+        strlen(user) > REQUEST_MAX || strlen(password) > REQUEST_MAX)
+        usage();
+
+    snprintf(host, sizeof(host), "%s", argv[optind]);
+    if ((port = strrchr(host, ':')) == NULL)
+        usage();
+    *port++ = '\0';
+    if (getaddrinfo(host, port, &hints, &addr) != 0)
+    {
+        fprintf(stderr, "ssl-bench: Could not resolve %s\n", host);
+        exit(EXIT_FAILURE);
+    }
+
+    if (trace_file != NULL)
+        trace = load_commands(trace_file, true, &tracelen);
+    else if (script_file != NULL)
+        script = load_commands(script_file, false, &script_len);
+    else
+    {
+        char getfile[REQUEST_MAX + 8];
+
+        script = calloc(2, sizeof(*script));
+        snprintf(getfile, sizeof(getfile), "getfile %s", file);
+        if (!parse_command("ls", &script[0]) || !parse_command(getfile, &script[1]))
+            usage();
+        script[0].weight = script[1].weight = 1;
+        script_len = 2;
+    }
+    for (size_t i = 0; i < script_len; i++)
+        script_weight += script[i].weight;
+    if (trace_file == NULL && script_weight <= 0)
+    {
+        fprintf(stderr, "ssl-bench: The script has nothing to send\n");
+        exit(EXIT_FAILURE);
+    }
+    recording = record_file != NULL;
+
+    // Each session needs a descriptor
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    ssl_ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_OFF);
+    clients = calloc(sessions, sizeof(*clients));
+    benches = calloc(nthreads, sizeof(*benches));
+    for (int i = 0, at = 0; i < nthreads; i++)
+    {
+        struct bench *b = &benches[i];
+
+        b->clients = clients + at;
+        b->sessions = sessions / nthreads + (i < sessions % nthreads);
+        at += b->sessions;
+        b->rng = 0x9E3779B97F4A7C15ull * (i + 1);
+        b->rate = rate / nthreads;
+        b->requests = requests < 0 ? -1 : requests / nthreads + (i < requests % nthreads);
+
+        // The trace is dealt out in turn, so each thread keeps to its times
+        if (trace != NULL)
+        {
+            b->trace = calloc(tracelen / nthreads + 1, sizeof(*b->trace));
+            for (size_t k = i; k < tracelen; k += nthreads)
+                b->trace[b->tracelen++] = &trace[k];
+        }
+        pthread_create(&b->thread, NULL, run_bench, b);
+    }
+    for (int i = 0; i < nthreads; i++)
+    {
+        struct bench *b = &benches[i];
+
+        pthread_join(b->thread, NULL);
+        failed += b->failed;
+        if (first == 0 || b->start < first)
+            first = b->start;
+        if (b->stop > last)
+            last = b->stop;
+        for (int k = 0; k < OP_KINDS; k++)
+        {
+            merge_samples(&total[k].latency, &b->stats[k].latency);
+            merge_samples(&total[k].first_byte, &b->stats[k].first_byte);
+            total[k].errors += b->stats[k].errors;
+            total[k].bytes += b->stats[k].bytes;
+        }
+    }
+    elapsed = last - first;
+    for (int k = 0; k < OP_KINDS; k++)
+    {
+        qsort(total[k].latency.values, total[k].latency.count, sizeof(double), compare_doubles);
+        qsort(total[k].first_byte.values, total[k].first_byte.count, sizeof(double), compare_doubles);
+        bytes += total[k].bytes;
+        if (k >= OP_KIND_LS)
+            completed += total[k].latency.count;
+    }
+
+    printf("sessions:   %d on %d thread(s) (%d failed)\n", sessions, nthreads, failed);
+    printf("requests:   %zu in %.3f s (%.1f/s)\n", completed, elapsed, elapsed > 0 ? completed / elapsed : 0);
+    printf("throughput: %.2f MB/s (%llu bytes)\n", elapsed > 0 ? bytes / elapsed / 1e6 : 0, bytes);
+    printf("%-16s %9s %7s %9s %9s %9s %9s %9s %9s\n", "operation", "count", "errors", "p50 ms", "p99 ms", "p999 ms",
+           "max ms", "mean ms", "MB/s");
+    for (int k = 0; k < OP_KINDS; k++)
+    {
+        char name[32];
+
+        if (k >= OP_KIND_LS && total[k].latency.count == 0 && total[k].errors == 0)
+            continue;
+        print_row(kind_names[k], &total[k].latency, total[k].errors,
+                  k >= OP_KIND_LS && elapsed > 0 ? total[k].bytes / elapsed / 1e6 : -1);
+        if (k >= OP_KIND_LS)
+        {
+            snprintf(name, sizeof(name), "%s ttfb", kind_names[k]);
+            print_row(name, &total[k].first_byte, 0, -1);
+        }
+    }
+
+    if (json_file != NULL)
+    {
+        FILE *f = strcmp(json_file, "-") == 0 ? stdout : fopen(json_file, "w");
+
+        if (f == NULL)
+        {
+            fprintf(stderr, "ssl-bench: Could not write %s: %s\n", json_file, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        fprintf(f, "{\n  \"sessions\": %d, \"threads\": %d, \"failed_sessions\": %d, \"rate\": %.1f,\n", sessions,
+                nthreads, failed, rate);
+        fprintf(f, "  \"seconds\": %.3f, \"requests\": %zu, \"bytes\": %llu, \"mb_per_s\": %.3f,\n", elapsed,
+                completed, bytes, elapsed > 0 ? bytes / elapsed / 1e6 : 0);
+        fprintf(f, "  \"operations\": {");
+        for (int k = 0, n = 0; k < OP_KINDS; k++)
+        {
+            if (k >= OP_KIND_LS && total[k].latency.count == 0 && total[k].errors == 0)
+                continue;
+            fprintf(f, "%s\n    \"%s\": {", n++ > 0 ? "," : "", kind_names[k]);
+            print_json_samples(f, &total[k].latency);
+            fprintf(f, ", \"errors\": %lu", total[k].errors);
+            if (k >= OP_KIND_LS)
+            {
+                fprintf(f, ", \"bytes\": %llu, \"mb_per_s\": %.3f,\n      \"ttfb\": {", total[k].bytes,
+                        elapsed > 0 ? total[k].bytes / elapsed / 1e6 : 0);
+                print_json_samples(f, &total[k].first_byte);
+                fprintf(f, "}");
+            }
+            fprintf(f, "}");
+        }
+        fprintf(f, "\n  }\n}\n");
+        if (f != stdout)
+            fclose(f);
+    }
+
+    // Every thread's requests, in the order they were due
+    if (record_file != NULL)
+    {
+        FILE *f = fopen(record_file, "w");
+        struct record *all = NULL;
+        size_t count = 0;
+
+        for (int i = 0; i < nthreads; i++)
+        {
+            all = xrealloc(all, (count + benches[i].nrecords + 1) * sizeof(*all));
+            memcpy(all + count, benches[i].records, benches[i].nrecords * sizeof(*all));
+            count += benches[i].nrecords;
+        }
+        qsort(all, count, sizeof(*all), compare_records);
+        if (f == NULL)
+            fprintf(stderr, "ssl-bench: Could not write %s: %s\n", record_file, strerror(errno));
+        for (size_t i = 0; f != NULL && i < count; i++)
+            fprintf(f, "%.3f %s\n", all[i].at * 1e3, all[i].cmd->text);
+        if (f != NULL)
+            fclose(f);
+        free(all);
+    }
+
+    for (int i = 0; i < sessions; i++)
+    {
+        if (clients[i].ssl != NULL)
+        {
+            if (clients[i].state == CLIENT_IDLE)
+            {
+                unsigned char exit_frame[FRAME_HEADER_SIZE];
+
+                encode_frame_header(exit_frame, OP_EXIT, clients[i].request_id + 1, 0);
+                SSL_write(clients[i].ssl, exit_frame, sizeof(exit_frame));
+            }
+            SSL_free(clients[i].ssl);
+        }
+        if (clients[i].fd > 0)
+            close(clients[i].fd);
+    }
+    SSL_CTX_free(ssl_ctx);
+    freeaddrinfo(addr);
+    return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
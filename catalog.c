@@ -0,0 +1,1480 @@
+/******************************************************************************
+
+PROGRAM:  catalog.c
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: The in-memory catalog of the server's data directory, see catalog.h.
+
+          At startup the catalog is either mapped from the snapshot file or,
+          when there is no usable one, read from the directory.  After that a
+          thread waits for inotify events and collects the names they report.
+          Once the directory has been quiet for CATALOG_QUIET_MS (or changes
+          have been arriving for CATALOG_MAX_DELAY_MS, as they do while a big
+          file is copied in) only those names are stat'ed again and merged
+          into the current snapshot to produce the next one.  The stat'ing
+          and reading is spread over the ingest pool's threads.
+
+          A snapshot image, in memory and on disk, is a header followed by
+          sections, each at an 8 byte aligned offset:
+
+              header       struct snapshot_header
+              entries      struct catalog_entry[count], sorted by name
+              names        NUL terminated names, referred to by offset
+              text         text protocol listing
+              text_cuts    uint64_t[pieces + 1], piece boundaries in text
+              binary       binary protocol listing
+              binary_cuts  uint64_t[pieces + 1], piece boundaries in binary
+              durations    uint32_t[count], milliseconds
+              titles       uint32_t[count], offsets in tags
+              artists      uint32_t[count], offsets in tags
+              albums       uint32_t[count], offsets in tags
+              years        uint16_t[count]
+              bitrates     uint16_t[count], kbit/s
+              samplerates  uint16_t[count], Hz
+              audio        uint8_t[count], enum id3_audio
+              tags         NUL terminated tag strings, each stored once
+
+          The metadata is kept a column per field rather than a record per
+          file, so a search reads only the column it looks in.  Offset 0 in
+          tags is the empty string.  A file's tags are read when it first
+          appears or changes; everything else carries its metadata over from
+          the previous snapshot.
+
+          Integers are in host byte order, so an image can be used exactly as
+          it is mapped.  An image from another byte order, another version
+          or one that doesn't hold together is ignored and the directory is
+          read instead.
+
+******************************************************************************/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "catalog.h"
+#include "id3.h"
+#include "ingest.h"
+#include "protocol.h"
+#include "trigram.h"
+
+#define CATALOG_QUIET_MS 50
+#define CATALOG_MAX_DELAY_MS 1000
+
+// More changed names than this and reading the whole directory again is cheaper
+#define CATALOG_MAX_PENDING 65536
+
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO)
+
+// The index knows a track by its tags and then its name
+_Static_assert(TRIGRAM_FIELDS == CATALOG_TAGS + 1, "index fields");
+
+#define SNAPSHOT_MAGIC "MP3CATLG"
+#define SNAPSHOT_VERSION 4
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+struct snapshot_section
+{
+    uint64_t offset;
+    uint64_t length; // In bytes
+};
+
+struct snapshot_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; // SNAPSHOT_BYTE_ORDER as written by the host
+    uint64_t generation;
+    uint64_t count;
+    uint64_t size; // Of the whole image
+    struct snapshot_section entries;
+    struct snapshot_section names;
+    struct snapshot_section text;
+    struct snapshot_section text_cuts;
+    struct snapshot_section binary;
+    struct snapshot_section binary_cuts;
+    struct snapshot_section durations;
+    struct snapshot_section tag_columns[CATALOG_TAGS];
+    struct snapshot_section years;
+    struct snapshot_section bitrates;
+    struct snapshot_section samplerates;
+    struct snapshot_section audio;
+    struct snapshot_section tags;
+};
+
+// An entry collected for the next snapshot
+struct scan_entry
+{
+    const char *name;
+    uint64_t size;
+    int64_t mtime;
+    uint8_t type;
+    const char *tags[CATALOG_TAGS]; // NULL for none
+    uint16_t year;
+    uint16_t bitrate;
+    uint16_t samplerate;
+    uint8_t audio;
+    uint32_t duration;
+    char *owned; // Tags read from the file for this snapshot, rather than carried over
+    bool read;   // The file was read for this snapshot
+    bool gone;   // and had gone by the time it was stat'ed
+};
+
+// Files to stat and read for the next snapshot, on the ingest pool
+struct read_batch
+{
+    struct scan_entry *entries;
+    const size_t *which; // Indexes of the entries to read, NULL for all of them
+    const struct catalog *old;
+};
+
+// Tag strings for a new snapshot, each added once however many files share it
+struct tag_pool
+{
+    char *data;
+    size_t len, size;
+    uint32_t *slots; // Open addressing hash table of offset + 1, 0 when free
+    size_t nslots;
+};
+
+static pthread_mutex_t current_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct catalog *current;
+
+static char catalog_dirname[PATH_MAX];
+static char snapshot_path[PATH_MAX];
+static bool loaded_snapshot;
+static int catalog_dirfd = -1;
+static int inotify_fd = -1;
+static struct ingest_pool *ingest;
+
+// Names reported by inotify since the last snapshot was published
+static char **pending;
+static size_t npending;
+static size_t pending_size;
+
+static int compare_scan_entries(const void *a, const void *b)
+{
+    return strcmp(((const struct scan_entry *)a)->name, ((const struct scan_entry *)b)->name);
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static size_t align8(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+// Fill in an entry from what stat returned, or return false if it isn't listed
+static bool stat_entry(const char *name, struct scan_entry *entry)
+{
+    struct stat fileInfo;
+
+    if (fstatat(catalog_dirfd, name, &fileInfo, 0) < 0)
+    {
+        if (errno != ENOENT)
+            fprintf(stderr, "Catalog: stat: %s: %s\n", name, strerror(errno));
+        return false;
+    }
+    memset(entry, 0, sizeof(*entry));
+    entry->name = name;
+    entry->size = fileInfo.st_size;
+    entry->mtime = fileInfo.st_mtim.tv_sec * 1000000000LL + fileInfo.st_mtim.tv_nsec;
+    entry->type = S_ISDIR(fileInfo.st_mode) ? LS_ENTRY_DIR : LS_ENTRY_FILE;
+    return true;
+}
+
+/******************************************************************************
+
+Give a file its metadata.  If the previous snapshot has the file with the
+same size and modification time its metadata is carried over, otherwise the
+file's tags are read.
+
+******************************************************************************/
+static void read_metadata(struct scan_entry *entry, const struct catalog *old)
+{
+    const struct catalog_entry *known;
+    struct id3_info info;
+    int fd;
+
+    if (entry->type != LS_ENTRY_FILE)
+        return;
+    if (old != NULL && (known = catalog_lookup(old, entry->name)) != NULL && known->size == entry->size &&
+        known->mtime == entry->mtime)
+    {
+        size_t i = known - old->entries;
+
+        for (int t = 0; t < CATALOG_TAGS; t++)
+            entry->tags[t] = catalog_tag(old, i, t);
+        entry->year = old->years[i];
+        entry->bitrate = old->bitrates[i];
+        entry->samplerate = old->samplerates[i];
+        entry->audio = old->audio[i];
+        entry->duration = old->durations[i];
+        return;
+    }
+
+    entry->read = true;
+    if ((fd = openat(catalog_dirfd, entry->name, O_RDONLY | O_CLOEXEC)) < 0)
+        return;
+    if (id3_read(fd, entry->size, &info))
+    {
+        const char *fields[CATALOG_TAGS] = {info.title, info.artist, info.album};
+        size_t len = 0;
+
+        for (int t = 0; t < CATALOG_TAGS; t++)
+            len += strlen(fields[t]) + 1;
+        if ((entry->owned = malloc(len)) != NULL)
+        {
+            char *p = entry->owned;
+
+            for (int t = 0; t < CATALOG_TAGS; t++)
+            {
+                entry->tags[t] = strcpy(p, fields[t]);
+                p += strlen(p) + 1;
+            }
+        }
+        entry->year = info.year;
+        entry->bitrate = info.bitrate < UINT16_MAX ? info.bitrate : UINT16_MAX;
+        entry->samplerate = info.samplerate;
+        entry->audio = info.audio;
+        entry->duration = info.duration;
+    }
+    close(fd);
+}
+
+static void read_entry(void *ctx, size_t i)
+{
+    struct read_batch *batch = ctx;
+    struct scan_entry *entry = &batch->entries[batch->which != NULL ? batch->which[i] : i];
+
+    if (!stat_entry(entry->name, entry))
+        entry->gone = true;
+    else
+        read_metadata(entry, batch->old);
+}
+
+/******************************************************************************
+
+Stat and read a batch of entries, which have only their names, on the ingest
+pool, and report how the files that were read turned out.  Entries for files
+that have gone are marked, for the caller to drop.
+
+******************************************************************************/
+static void read_entries(struct scan_entry *entries, const size_t *which, size_t count, const struct catalog *old)
+{
+    struct read_batch batch = {entries, which, old};
+    size_t nread = 0, found[ID3_AUDIO_TRUNCATED + 1] = {0};
+    long long start = now_ms();
+
+    ingest_run(ingest, count, read_entry, &batch);
+    for (size_t i = 0; i < count; i++)
+    {
+        const struct scan_entry *entry = &entries[which != NULL ? which[i] : i];
+
+        if (!entry->read)
+            continue;
+        nread++;
+        found[entry->audio]++;
+        if (entry->audio == ID3_AUDIO_CORRUPT || entry->audio == ID3_AUDIO_TRUNCATED)
+            printf("Catalog: %s is %s\n", entry->name, entry->audio == ID3_AUDIO_CORRUPT ? "corrupt" : "truncated");
+    }
+    if (nread > 0)
+        printf("Catalog: Read %zu files in %lld ms on %d thread(s): %zu corrupt, %zu truncated, %zu without audio\n",
+               nread, now_ms() - start, ingest_threads(ingest), found[ID3_AUDIO_CORRUPT],
+               found[ID3_AUDIO_TRUNCATED], found[ID3_AUDIO_NONE]);
+}
+
+// Drop the entries read_entries() found gone, keeping the rest in order
+static size_t drop_gone(struct scan_entry *entries, size_t count, bool owned_names)
+{
+    size_t kept = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!entries[i].gone)
+            entries[kept++] = entries[i];
+        else if (owned_names)
+            free((char *)entries[i].name);
+    }
+    return kept;
+}
+
+// Add a tag to the pool and return its offset, or UINT32_MAX if out of memory
+static uint32_t add_tag(struct tag_pool *pool, const char *tag)
+{
+    size_t len = strlen(tag), slot;
+    unsigned int hash = 2166136261u;
+
+    if (len == 0)
+        return 0;
+    for (const char *p = tag; *p != '\0'; p++)
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    for (slot = hash & (pool->nslots - 1); pool->slots[slot] != 0; slot = (slot + 1) & (pool->nslots - 1))
+    {
+        if (strcmp(pool->data + pool->slots[slot] - 1, tag) == 0)
+            return pool->slots[slot] - 1;
+    }
+
+    if (pool->len + len + 1 > pool->size || pool->len + len + 1 >= UINT32_MAX)
+    {
+        size_t size = (pool->size + len + 1) * 2;
+        char *grown = size < UINT32_MAX ? realloc(pool->data, size) : NULL;
+
+        if (grown == NULL)
+            return UINT32_MAX;
+        pool->data = grown;
+        pool->size = size;
+    }
+    memcpy(pool->data + pool->len, tag, len + 1);
+    pool->slots[slot] = pool->len + 1;
+    pool->len += len + 1;
+    return pool->slots[slot] - 1;
+}
+
+size_t catalog_format_entry(char *p, size_t room, const char *name, size_t namelen, int type, uint64_t size,
+                            bool binary)
+{
+    if (binary)
+    {
+        if (p != NULL)
+        {
+            p[0] = type;
+            put_u64((unsigned char *)p + 1, size);
+            put_u16((unsigned char *)p + 9, namelen);
+            memcpy(p + LS_ENTRY_HEADER_SIZE, name, namelen);
+        }
+        return LS_ENTRY_HEADER_SIZE + namelen;
+    }
+    if (type == LS_ENTRY_DIR)
+        return 0;
+    return snprintf(p, room, "%-30s\t%llu bytes\n", name, (unsigned long long)size) + 1;
+}
+
+/******************************************************************************
+
+Serialize the listing for one protocol.  The text protocol lists files only,
+each as its own NUL terminated line with its size, just as they used to be
+sent one record at a time.  The binary protocol lists everything as LS_DATA
+payload entries.  Entries are packed into pieces of at most 'limit' bytes.
+With 'data' NULL the listing is only measured.
+
+******************************************************************************/
+static void lay_out_listing(const struct scan_entry *entries, size_t count, bool binary, size_t limit, char *data,
+                            uint64_t *cuts, size_t *length, size_t *pieces)
+{
+    size_t piece = 0, len = 0, n = 0;
+
+    if (cuts != NULL)
+        cuts[0] = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        const struct scan_entry *entry = &entries[i];
+        size_t namelen = strlen(entry->name);
+        size_t size = catalog_format_entry(NULL, 0, entry->name, namelen, entry->type, entry->size, binary);
+
+        if (size == 0)
+            continue;
+        if (piece + size > limit)
+        {
+            if (cuts != NULL)
+                cuts[n + 1] = len;
+            n++;
+            piece = 0;
+        }
+        if (data != NULL)
+            catalog_format_entry(data + len, size, entry->name, namelen, entry->type, entry->size, binary);
+        len += size;
+        piece += size;
+    }
+    if (piece > 0)
+    {
+        if (cuts != NULL)
+            cuts[n + 1] = len;
+        n++;
+    }
+    *length = len;
+    *pieces = n;
+}
+
+/******************************************************************************
+
+Check that an image holds together before anything is read through it: every
+section lies inside the image, every name inside the names section, entries
+are in order and no listing piece is larger than a session can send.
+
+******************************************************************************/
+static bool check_section(const struct snapshot_section *section, size_t imagelen)
+{
+    return section->offset % 8 == 0 && section->offset <= imagelen && section->length <= imagelen - section->offset;
+}
+
+static bool check_listing(const char *image, const struct snapshot_section *data,
+                          const struct snapshot_section *cuts, size_t limit)
+{
+    const uint64_t *cut = (const uint64_t *)(image + cuts->offset);
+    size_t n = cuts->length / sizeof(uint64_t);
+
+    if (cuts->length % sizeof(uint64_t) != 0 || n == 0 || cut[0] != 0 || cut[n - 1] != data->length)
+        return false;
+    for (size_t i = 1; i < n; i++)
+    {
+        if (cut[i] < cut[i - 1] || cut[i] - cut[i - 1] > limit)
+            return false;
+    }
+    return true;
+}
+
+// A metadata column holds one value of 'size' bytes per entry
+static bool check_column(const struct snapshot_section *section, size_t imagelen, size_t count, size_t size)
+{
+    return check_section(section, imagelen) && section->length == count * size;
+}
+
+static const char *check_image(const char *image, size_t imagelen)
+{
+    const struct snapshot_header *h = (const struct snapshot_header *)image;
+    const struct catalog_entry *entries;
+    const char *names, *tags;
+
+    if (imagelen < sizeof(*h) || memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0)
+        return "not a catalog snapshot";
+    if (h->version != SNAPSHOT_VERSION || h->byte_order != SNAPSHOT_BYTE_ORDER)
+        return "written by a different version or byte order";
+    if (h->size != imagelen)
+        return "truncated";
+    if (!check_section(&h->entries, imagelen) || !check_section(&h->names, imagelen) ||
+        !check_section(&h->text, imagelen) || !check_section(&h->text_cuts, imagelen) ||
+        !check_section(&h->binary, imagelen) || !check_section(&h->binary_cuts, imagelen) ||
+        h->entries.length / sizeof(*entries) != h->count || h->entries.length % sizeof(*entries) != 0)
+        return "sections out of bounds";
+    if (!check_column(&h->durations, imagelen, h->count, sizeof(uint32_t)) ||
+        !check_column(&h->years, imagelen, h->count, sizeof(uint16_t)) ||
+        !check_column(&h->bitrates, imagelen, h->count, sizeof(uint16_t)) ||
+        !check_column(&h->samplerates, imagelen, h->count, sizeof(uint16_t)) ||
+        !check_column(&h->audio, imagelen, h->count, sizeof(uint8_t)) || !check_section(&h->tags, imagelen))
+        return "metadata out of bounds";
+    for (int t = 0; t < CATALOG_TAGS; t++)
+    {
+        if (!check_column(&h->tag_columns[t], imagelen, h->count, sizeof(uint32_t)))
+            return "metadata out of bounds";
+    }
+
+    entries = (const struct catalog_entry *)(image + h->entries.offset);
+    names = image + h->names.offset;
+    for (size_t i = 0; i < h->count; i++)
+    {
+        if (entries[i].name >= h->names.length || entries[i].namelen >= h->names.length - entries[i].name ||
+            names[entries[i].name + entries[i].namelen] != '\0' || entries[i].type > LS_ENTRY_DIR)
+            return "bad entry";
+        if (i > 0 && strcmp(names + entries[i - 1].name, names + entries[i].name) >= 0)
+            return "entries out of order";
+        if (((const uint8_t *)(image + h->audio.offset))[i] > ID3_AUDIO_TRUNCATED)
+            return "bad metadata";
+    }
+
+    if (!check_listing(image, &h->text, &h->text_cuts, CATALOG_PIECE_SIZE) ||
+        !check_listing(image, &h->binary, &h->binary_cuts, CATALOG_PIECE_SIZE - FRAME_HEADER_SIZE))
+        return "bad listing";
+
+    // Every tag must end inside the tags section, which it does if the
+    // section starts with the empty string and ends with a terminator
+    tags = image + h->tags.offset;
+    if (h->tags.length == 0 || tags[0] != '\0' || tags[h->tags.length - 1] != '\0')
+        return "bad tags";
+    for (int t = 0; t < CATALOG_TAGS; t++)
+    {
+        const uint32_t *column = (const uint32_t *)(image + h->tag_columns[t].offset);
+
+        for (size_t i = 0; i < h->count; i++)
+        {
+            if (column[i] >= h->tags.length)
+                return "bad tags";
+        }
+    }
+    return NULL;
+}
+
+// Make a snapshot of an image, which it then owns, or return NULL if the image is bad
+static struct catalog *open_image(char *image, size_t imagelen, bool mapped)
+{
+    const struct snapshot_header *h = (const struct snapshot_header *)image;
+    const char *problem = check_image(image, imagelen);
+    struct catalog *cat;
+
+    if (problem != NULL)
+    {
+        fprintf(stderr, "Catalog: Ignoring snapshot %s: %s\n", snapshot_path, problem);
+        return NULL;
+    }
+    if ((cat = calloc(1, sizeof(*cat))) == NULL)
+        return NULL;
+
+    atomic_init(&cat->refs, 1);
+    cat->generation = h->generation;
+    cat->count = h->count;
+    cat->entries = (const struct catalog_entry *)(image + h->entries.offset);
+    cat->names = image + h->names.offset;
+    cat->text.data = image + h->text.offset;
+    cat->text.cuts = (const uint64_t *)(image + h->text_cuts.offset);
+    cat->text.pieces = h->text_cuts.length / sizeof(uint64_t) - 1;
+    cat->binary.data = image + h->binary.offset;
+    cat->binary.cuts = (const uint64_t *)(image + h->binary_cuts.offset);
+    cat->binary.pieces = h->binary_cuts.length / sizeof(uint64_t) - 1;
+    for (int t = 0; t < CATALOG_TAGS; t++)
+        cat->tag_columns[t] = (const uint32_t *)(image + h->tag_columns[t].offset);
+    cat->tags = image + h->tags.offset;
+    cat->years = (const uint16_t *)(image + h->years.offset);
+    cat->bitrates = (const uint16_t *)(image + h->bitrates.offset);
+    cat->samplerates = (const uint16_t *)(image + h->samplerates.offset);
+    cat->audio = (const uint8_t *)(image + h->audio.offset);
+    cat->durations = (const uint32_t *)(image + h->durations.offset);
+    cat->image = image;
+    cat->imagelen = imagelen;
+    cat->mapped = mapped;
+    return cat;
+}
+
+/******************************************************************************
+
+Build a snapshot image from entries sorted by name.  The names and tags are
+copied, so the caller keeps ownership of whatever 'entries' points to.
+
+******************************************************************************/
+static struct catalog *build_catalog(const struct scan_entry *entries, size_t count, unsigned long generation)
+{
+    struct snapshot_header h = {.version = SNAPSHOT_VERSION, .byte_order = SNAPSHOT_BYTE_ORDER};
+    size_t namebytes = 0, textlen, textpieces, binarylen, binarypieces;
+    struct tag_pool pool = {0};
+    uint32_t *offsets = NULL;
+    struct catalog_entry *out;
+    struct catalog *cat = NULL;
+    size_t off, name;
+    char *image;
+
+    // Collect the distinct tags first, as the image can't be sized without them
+    for (pool.nslots = 64; pool.nslots < count * CATALOG_TAGS * 2; pool.nslots *= 2)
+        ;
+    pool.slots = calloc(pool.nslots, sizeof(*pool.slots));
+    pool.data = calloc(1, pool.size = 4096);
+    offsets = malloc((count * CATALOG_TAGS + 1) * sizeof(*offsets));
+    if (pool.slots == NULL || pool.data == NULL || offsets == NULL)
+        goto out;
+    pool.len = 1; // The empty string at offset 0
+    for (size_t i = 0; i < count; i++)
+    {
+        for (int t = 0; t < CATALOG_TAGS; t++)
+        {
+            offsets[i * CATALOG_TAGS + t] = add_tag(&pool, entries[i].tags[t] != NULL ? entries[i].tags[t] : "");
+            if (offsets[i * CATALOG_TAGS + t] == UINT32_MAX)
+                goto out;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++)
+        namebytes += strlen(entries[i].name) + 1;
+    lay_out_listing(entries, count, false, CATALOG_PIECE_SIZE, NULL, NULL, &textlen, &textpieces);
+    lay_out_listing(entries, count, true, CATALOG_PIECE_SIZE - FRAME_HEADER_SIZE, NULL, NULL, &binarylen,
+                    &binarypieces);
+
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+    h.generation = generation;
+    h.count = count;
+    off = align8(sizeof(h));
+    h.entries = (struct snapshot_section){off, count * sizeof(*out)};
+    off += h.entries.length;
+    h.names = (struct snapshot_section){off, namebytes};
+    off = align8(off + namebytes);
+    h.text = (struct snapshot_section){off, textlen};
+    off = align8(off + textlen);
+    h.text_cuts = (struct snapshot_section){off, (textpieces + 1) * sizeof(uint64_t)};
+    off += h.text_cuts.length;
+    h.binary = (struct snapshot_section){off, binarylen};
+    off = align8(off + binarylen);
+    h.binary_cuts = (struct snapshot_section){off, (binarypieces + 1) * sizeof(uint64_t)};
+    off += h.binary_cuts.length;
+    h.durations = (struct snapshot_section){off, count * sizeof(uint32_t)};
+    off = align8(off + h.durations.length);
+    for (int t = 0; t < CATALOG_TAGS; t++)
+    {
+        h.tag_columns[t] = (struct snapshot_section){off, count * sizeof(uint32_t)};
+        off = align8(off + h.tag_columns[t].length);
+    }
+    h.years = (struct snapshot_section){off, count * sizeof(uint16_t)};
+    off = align8(off + h.years.length);
+    h.bitrates = (struct snapshot_section){off, count * sizeof(uint16_t)};
+    off = align8(off + h.bitrates.length);
+    h.samplerates = (struct snapshot_section){off, count * sizeof(uint16_t)};
+    off = align8(off + h.samplerates.length);
+    h.audio = (struct snapshot_section){off, count * sizeof(uint8_t)};
+    off = align8(off + h.audio.length);
+    h.tags = (struct snapshot_section){off, pool.len};
+    off = align8(off + pool.len);
+    h.size = off;
+
+    // calloc() so that padding is zero in the snapshot file too
+    if ((image = calloc(1, h.size)) == NULL)
+        goto out;
+    memcpy(image, &h, sizeof(h));
+
+    out = (struct catalog_entry *)(image + h.entries.offset);
+    name = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t len = strlen(entries[i].name);
+
+        out[i].name = name;
+        out[i].size = entries[i].size;
+        out[i].mtime = entries[i].mtime;
+        out[i].namelen = len;
+        out[i].type = entries[i].type;
+        memcpy(image + h.names.offset + name, entries[i].name, len + 1);
+        name += len + 1;
+
+        ((uint32_t *)(image + h.durations.offset))[i] = entries[i].duration;
+        ((uint16_t *)(image + h.years.offset))[i] = entries[i].year;
+        ((uint16_t *)(image + h.bitrates.offset))[i] = entries[i].bitrate;
+        ((uint16_t *)(image + h.samplerates.offset))[i] = entries[i].samplerate;
+        ((uint8_t *)(image + h.audio.offset))[i] = entries[i].audio;
+        for (int t = 0; t < CATALOG_TAGS; t++)
+            ((uint32_t *)(image + h.tag_columns[t].offset))[i] = offsets[i * CATALOG_TAGS + t];
+    }
+    memcpy(image + h.tags.offset, pool.data, pool.len);
+    lay_out_listing(entries, count, false, CATALOG_PIECE_SIZE, image + h.text.offset,
+                    (uint64_t *)(image + h.text_cuts.offset), &textlen, &textpieces);
+    lay_out_listing(entries, count, true, CATALOG_PIECE_SIZE - FRAME_HEADER_SIZE, image + h.binary.offset,
+                    (uint64_t *)(image + h.binary_cuts.offset), &binarylen, &binarypieces);
+
+    if ((cat = open_image(image, h.size, false)) == NULL)
+        free(image);
+out:
+    free(pool.data);
+    free(pool.slots);
+    free(offsets);
+    return cat;
+}
+
+// Map the snapshot file, or return NULL if there isn't a usable one
+static struct catalog *load_snapshot(void)
+{
+    struct catalog *cat;
+    struct stat fileInfo;
+    void *image;
+    int fd;
+
+    if ((fd = open(snapshot_path, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        if (errno != ENOENT)
+            fprintf(stderr, "Catalog: Could not open snapshot %s: %s\n", snapshot_path, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &fileInfo) < 0 || fileInfo.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    // The mapping stays valid after the descriptor is closed, and snapshots
+    // are replaced by rename(), never rewritten in place
+    image = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+    {
+        fprintf(stderr, "Catalog: Could not map snapshot %s: %s\n", snapshot_path, strerror(errno));
+        return NULL;
+    }
+    if ((cat = open_image(image, fileInfo.st_size, true)) == NULL)
+        munmap(image, fileInfo.st_size);
+    return cat;
+}
+
+// Write a snapshot to the snapshot file, replacing the old one in one step
+static void save_snapshot(const struct catalog *cat)
+{
+    char tmppath[PATH_MAX + 4];
+    const char *p = cat->image;
+    size_t left = cat->imagelen;
+    int fd;
+
+    if (snapshot_path[0] == '\0')
+        return;
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", snapshot_path);
+    if ((fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+    {
+        fprintf(stderr, "Catalog: Could not write snapshot %s: %s\n", tmppath, strerror(errno));
+        return;
+    }
+    while (left > 0)
+    {
+        ssize_t written = write(fd, p, left);
+
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+        {
+            fprintf(stderr, "Catalog: Could not write snapshot %s: %s\n", tmppath, strerror(errno));
+            close(fd);
+            unlink(tmppath);
+            return;
+        }
+        p += written;
+        left -= written;
+    }
+    close(fd);
+    if (rename(tmppath, snapshot_path) < 0)
+    {
+        fprintf(stderr, "Catalog: Could not replace snapshot %s: %s\n", snapshot_path, strerror(errno));
+        unlink(tmppath);
+    }
+}
+
+// Read the whole directory and build a snapshot of it, carrying over what
+// metadata it can from 'old' (if not NULL)
+static struct catalog *scan_directory(unsigned long generation, const struct catalog *old)
+{
+    struct scan_entry *entries = NULL;
+    struct catalog *cat = NULL;
+    size_t count = 0, size = 0;
+    struct dirent *currentEntry;
+    int fd;
+    DIR *dir;
+
+    // Read through a descriptor of its own, closedir() closes it
+    fd = catalog_dirfd >= 0 ? openat(catalog_dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+    dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (dir == NULL)
+    {
+        fprintf(stderr, "Catalog: Could not open directory %s: %s\n", catalog_dirname, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return build_catalog(NULL, 0, generation);
+    }
+
+    while ((currentEntry = readdir(dir)) != NULL)
+    {
+        if (strcmp(currentEntry->d_name, ".") == 0 || strcmp(currentEntry->d_name, "..") == 0)
+            continue;
+        if (count == size)
+        {
+            struct scan_entry *grown;
+
+            size = size ? size * 2 : 256;
+            if ((grown = realloc(entries, size * sizeof(*entries))) == NULL)
+                goto out;
+            entries = grown;
+        }
+        entries[count] = (struct scan_entry){.name = strdup(currentEntry->d_name)};
+        if (entries[count].name == NULL)
+            goto out;
+        count++;
+    }
+
+    // The names are all in, now every file is stat'ed and read
+    read_entries(entries, NULL, count, old);
+    count = drop_gone(entries, count, true);
+    qsort(entries, count, sizeof(*entries), compare_scan_entries);
+    cat = build_catalog(entries, count, generation);
+out:
+    if (cat == NULL)
+        fprintf(stderr, "Catalog: Out of memory reading %s\n", catalog_dirname);
+    for (size_t i = 0; i < count; i++)
+    {
+        free((char *)entries[i].name);
+        free(entries[i].owned);
+    }
+    free(entries);
+    closedir(dir);
+    return cat;
+}
+
+/******************************************************************************
+
+Build the next snapshot from the current one and the names that changed.
+Both lists are sorted, so this is a single merge: a changed name is stat'ed
+again and kept if it still exists, everything else is carried over as is.
+
+******************************************************************************/
+static struct catalog *apply_changes(const struct catalog *old)
+{
+    struct scan_entry *entries;
+    struct catalog *cat;
+    size_t i = 0, j = 0, count = 0, nfresh = 0;
+    size_t *fresh;
+
+    entries = malloc((old->count + npending + 1) * sizeof(*entries));
+    fresh = malloc((npending + 1) * sizeof(*fresh));
+    if (entries == NULL || fresh == NULL)
+    {
+        free(entries);
+        free(fresh);
+        return NULL;
+    }
+
+    qsort(pending, npending, sizeof(*pending), compare_names);
+    while (i < old->count || j < npending)
+    {
+        const struct catalog_entry *entry = &old->entries[i];
+        int order;
+
+        if (j == npending)
+            order = -1;
+        else if (i == old->count)
+            order = 1;
+        else
+            order = strcmp(catalog_name(old, entry), pending[j]);
+
+        if (order < 0)
+        {
+            struct scan_entry *kept = &entries[count++];
+
+            *kept = (struct scan_entry){
+                .name = catalog_name(old, entry),
+                .size = entry->size,
+                .mtime = entry->mtime,
+                .type = entry->type,
+            };
+            for (int t = 0; t < CATALOG_TAGS; t++)
+                kept->tags[t] = catalog_tag(old, i, t);
+            kept->year = old->years[i];
+            kept->bitrate = old->bitrates[i];
+            kept->samplerate = old->samplerates[i];
+            kept->audio = old->audio[i];
+            kept->duration = old->durations[i];
+            i++;
+            continue;
+        }
+        fresh[nfresh++] = count;
+        entries[count++] = (struct scan_entry){.name = pending[j]};
+
+        // Skip the old entry and any repeats of the same name
+        if (order == 0)
+            i++;
+        for (j++; j < npending && strcmp(pending[j], pending[j - 1]) == 0; j++)
+            ;
+    }
+
+    // Only the changed names are stat'ed and read again
+    read_entries(entries, fresh, nfresh, old);
+    count = drop_gone(entries, count, false);
+    cat = build_catalog(entries, count, old->generation + 1);
+    for (size_t k = 0; k < count; k++)
+        free(entries[k].owned);
+    free(entries);
+    free(fresh);
+    return cat;
+}
+
+static void clear_pending(void)
+{
+    for (size_t i = 0; i < npending; i++)
+        free(pending[i]);
+    npending = 0;
+}
+
+// Remember a name to stat again, or return false to read the whole directory
+static bool add_pending(const char *name)
+{
+    if (npending == CATALOG_MAX_PENDING)
+        return false;
+    if (npending == pending_size)
+    {
+        size_t size = pending_size ? pending_size * 2 : 64;
+        char **grown = realloc(pending, size * sizeof(*pending));
+
+        if (grown == NULL)
+            return false;
+        pending = grown;
+        pending_size = size;
+    }
+    if ((pending[npending] = strdup(name)) == NULL)
+        return false;
+    npending++;
+    return true;
+}
+
+// Whether two snapshots list the same entries
+static bool same_entries(const struct catalog *a, const struct catalog *b)
+{
+    if (a->count != b->count)
+        return false;
+    for (size_t i = 0; i < a->count; i++)
+    {
+        const struct catalog_entry *x = &a->entries[i], *y = &b->entries[i];
+
+        if (x->size != y->size || x->mtime != y->mtime || x->type != y->type || x->namelen != y->namelen ||
+            strcmp(catalog_name(a, x), catalog_name(b, y)) != 0)
+            return false;
+    }
+    return true;
+}
+
+// What the index knows the i'th entry by: its tags, then its name.
+// Directories have nothing, so no search finds them.
+static const char *track_field(const void *ctx, uint32_t i, int field)
+{
+    const struct catalog *cat = ctx;
+
+    if (cat->entries[i].type != LS_ENTRY_FILE)
+        return "";
+    if (field < CATALOG_TAGS)
+        return catalog_tag(cat, i, field);
+    return catalog_name(cat, &cat->entries[i]);
+}
+
+static const uint32_t *catalog_order(struct catalog *cat, int sort);
+
+// Sort a snapshot for listing pages.  If that fails the first page that
+// needs an order tries again.
+static void sort_catalog(struct catalog *cat)
+{
+    for (int sort = LS_SORT_SIZE; sort < LS_SORT_SIZE + CATALOG_ORDERS; sort++)
+        catalog_order(cat, sort);
+}
+
+// Build the index of a snapshot.  If that fails it is searched without one.
+static void index_catalog(struct catalog *cat)
+{
+    struct trigram_source src = {cat->count, track_field, cat};
+    long long start = now_ms();
+    struct trigram_index *index = trigram_build(&src);
+    size_t postings, memory;
+
+    if (index == NULL)
+    {
+        fprintf(stderr, "Catalog: Out of memory indexing %s, searches will be slow\n", catalog_dirname);
+        return;
+    }
+    memory = trigram_memory(index, &postings, NULL);
+    atomic_store_explicit(&cat->index, index, memory_order_release);
+    printf("Catalog: Indexed %zu entries in %lld ms (%zu postings, %.1f MB)\n", cat->count, now_ms() - start,
+           postings, memory / 1048576.0);
+}
+
+// Make 'cat' the current snapshot
+static void publish(struct catalog *cat)
+{
+    struct catalog *old;
+
+    pthread_mutex_lock(&current_lock);
+    old = current;
+    current = cat;
+    pthread_mutex_unlock(&current_lock);
+
+    if (old != NULL)
+        catalog_release(old);
+    printf("Catalog: %s has %zu entries (generation %lu)\n", catalog_dirname, cat->count, cat->generation);
+}
+
+/******************************************************************************
+
+Check a snapshot loaded from the file against the directory.  Everything is
+stat'ed again, but the server has been answering from the snapshot all along,
+and if nothing changed while it was down there is nothing more to do.
+
+******************************************************************************/
+static void reconcile(void)
+{
+    struct catalog *old = catalog_acquire();
+    long long start = now_ms();
+    struct catalog *cat = scan_directory(old->generation + 1, old);
+
+    if (cat == NULL)
+        fprintf(stderr, "Catalog: Could not check snapshot %s against %s\n", snapshot_path, catalog_dirname);
+    else if (same_entries(old, cat))
+    {
+        printf("Catalog: Snapshot %s is up to date (checked in %lld ms)\n", snapshot_path, now_ms() - start);
+        catalog_release(cat);
+    }
+    else
+    {
+        sort_catalog(cat);
+        index_catalog(cat);
+        publish(cat);
+        save_snapshot(cat);
+    }
+    catalog_release(old);
+}
+
+/******************************************************************************
+
+The catalog thread.  It first brings the snapshot file up to date, then
+sleeps in poll() until inotify has something to say and keeps collecting
+events until the directory goes quiet before building a new snapshot, so a
+burst of changes produces one snapshot rather than one per file.  Only this
+thread replaces the current snapshot, so the one it just published stays
+valid while it writes it out.
+
+******************************************************************************/
+static void *catalog_thread(void *arg)
+{
+    char events[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = {.fd = inotify_fd, .events = POLLIN};
+    long long first = 0;
+    bool rescan = false;
+
+    (void)arg;
+
+    // The first snapshot was published without waiting for its orders and
+    // index
+    struct catalog *started = catalog_acquire();
+
+    sort_catalog(started);
+    index_catalog(started);
+    catalog_release(started);
+
+    if (loaded_snapshot)
+        reconcile();
+    else
+        save_snapshot(current);
+
+    if (inotify_fd < 0)
+        return NULL;
+
+    while (1)
+    {
+        int timeout = -1;
+        ssize_t len;
+
+        if (npending > 0 || rescan)
+        {
+            long long left = first + CATALOG_MAX_DELAY_MS - now_ms();
+
+            timeout = left < CATALOG_QUIET_MS ? (left > 0 ? left : 0) : CATALOG_QUIET_MS;
+        }
+
+        int ready = poll(&pfd, 1, timeout);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Catalog: poll: %s\n", strerror(errno));
+            return NULL;
+        }
+
+        // Quiet, or changes have waited long enough: publish them
+        if (ready == 0)
+        {
+            struct catalog *old = catalog_acquire();
+            struct catalog *cat = rescan ? scan_directory(old->generation + 1, old) : apply_changes(old);
+
+            catalog_release(old);
+            if (cat == NULL)
+            {
+                fprintf(stderr, "Catalog: Out of memory, will read %s again\n", catalog_dirname);
+                rescan = true;
+                first = now_ms();
+                continue;
+            }
+            sort_catalog(cat);
+            index_catalog(cat);
+            publish(cat);
+            save_snapshot(cat);
+            clear_pending();
+            rescan = false;
+            continue;
+        }
+
+        len = read(inotify_fd, events, sizeof(events));
+        if (len <= 0)
+        {
+            if (len < 0 && (errno == EINTR || errno == EAGAIN))
+                continue;
+            fprintf(stderr, "Catalog: read: %s\n", len < 0 ? strerror(errno) : "end of file");
+            return NULL;
+        }
+
+        if (npending == 0 && !rescan)
+            first = now_ms();
+        for (char *p = events; p < events + len;)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+
+            // The kernel dropped events, so nothing short of a rescan is right
+            if (event->mask & IN_Q_OVERFLOW)
+                rescan = true;
+            else if (event->len > 0 && !rescan && !add_pending(event->name))
+                rescan = true;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+        if (rescan)
+            clear_pending();
+    }
+}
+
+/******************************************************************************
+
+Build the first snapshot and start the thread that keeps it current.  A data
+directory that is missing or can't be watched is reported, and the server
+carries on with what it could read.
+
+******************************************************************************/
+int catalog_start(const char *dirname, const char *snapshot, int threads)
+{
+    pthread_t thread;
+    struct catalog *cat = NULL;
+
+    snprintf(catalog_dirname, sizeof(catalog_dirname), "%s", dirname);
+    catalog_dirfd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if ((ingest = ingest_start(threads)) == NULL)
+        fprintf(stderr, "Catalog: Could not start %d ingest threads, files will be read one at a time\n", threads);
+
+    // Watch before reading so that nothing changed in between is missed
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0 || inotify_add_watch(inotify_fd, dirname, WATCH_EVENTS) < 0)
+    {
+        fprintf(stderr, "Catalog: Can't watch %s, changes won't be listed: %s\n", dirname, strerror(errno));
+        if (inotify_fd >= 0)
+            close(inotify_fd);
+        inotify_fd = -1;
+    }
+
+    if (snapshot != NULL)
+    {
+        snprintf(snapshot_path, sizeof(snapshot_path), "%s", snapshot);
+        if ((cat = load_snapshot()) != NULL)
+        {
+            loaded_snapshot = true;
+            printf("Catalog: Loaded snapshot %s\n", snapshot_path);
+        }
+    }
+    if (cat == NULL && (cat = scan_directory(0, NULL)) == NULL)
+        return -1;
+    publish(cat);
+
+    if (pthread_create(&thread, NULL, catalog_thread, NULL) == 0)
+        pthread_detach(thread);
+    return 0;
+}
+
+struct catalog *catalog_acquire(void)
+{
+    struct catalog *cat;
+
+    pthread_mutex_lock(&current_lock);
+    cat = current;
+    atomic_fetch_add(&cat->refs, 1);
+    pthread_mutex_unlock(&current_lock);
+    return cat;
+}
+
+void catalog_release(struct catalog *cat)
+{
+    if (atomic_fetch_sub(&cat->refs, 1) != 1)
+        return;
+    trigram_free(atomic_load(&cat->index));
+    for (int o = 0; o < CATALOG_ORDERS; o++)
+        free(atomic_load(&cat->orders[o]));
+    if (cat->mapped)
+        munmap(cat->image, cat->imagelen);
+    else
+        free(cat->image);
+    free(cat);
+}
+
+const struct catalog_entry *catalog_lookup(const struct catalog *cat, const char *name)
+{
+    size_t lo = 0, hi = cat->count;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        int order = strcmp(name, catalog_name(cat, &cat->entries[mid]));
+
+        if (order == 0)
+            return &cat->entries[mid];
+        if (order < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return NULL;
+}
+
+size_t catalog_search(const struct catalog *cat, int field, const char *query, size_t from, size_t limit)
+{
+    if (from >= cat->count)
+        return cat->count;
+
+    size_t end = limit < cat->count - from ? from + limit : cat->count;
+
+    if (field == SEARCH_YEAR)
+    {
+        unsigned long year = strtoul(query, NULL, 10);
+
+        for (size_t i = from; i < end; i++)
+        {
+            if (year != 0 && cat->years[i] == year)
+                return i;
+        }
+        return end;
+    }
+    if (field < 0 || field >= CATALOG_TAGS)
+        return end;
+
+    // Files by the same artist or from the same album tend to sit together
+    // and share one copy of the tag, so remember the last one tried
+    const uint32_t *column = cat->tag_columns[field];
+    uint32_t last = UINT32_MAX;
+    bool matched = false;
+
+    for (size_t i = from; i < end; i++)
+    {
+        if (column[i] != last)
+        {
+            last = column[i];
+            matched = last != 0 && strcasestr(cat->tags + last, query) != NULL;
+        }
+        if (matched)
+            return i;
+    }
+    return end;
+}
+
+size_t catalog_rank(const struct catalog *cat, const char *query, uint32_t *results, size_t limit)
+{
+    struct trigram_source src = {cat->count, track_field, cat};
+
+    return trigram_search(atomic_load_explicit(&cat->index, memory_order_acquire), &src, query, results, limit);
+}
+
+/******************************************************************************
+
+Listing pages.  The entries are sorted by name, and the orders by size and by
+modification time break ties by name too, so every entry has its own place
+in each and wherever a page starts is found with a binary search.  A page
+then costs only the entries it looks at, however large the library.  Where a
+page has got to is the sort key and name of the last entry it looked at,
+which still means something in a later snapshot, with entries added or
+removed since.
+
+Sorting by name with a pattern that starts with anything but a wildcard only
+looks at the names starting with that.
+
+******************************************************************************/
+struct sort_item
+{
+    uint64_t key;
+    uint32_t entry;
+};
+
+static int compare_sort_items(const void *a, const void *b)
+{
+    const struct sort_item *x = a, *y = b;
+
+    if (x->key != y->key)
+        return x->key < y->key ? -1 : 1;
+    return x->entry < y->entry ? -1 : x->entry > y->entry;
+}
+
+// The value an entry is sorted by.  Modification times are offset so that
+// they sort as unsigned numbers.
+static uint64_t sort_key(const struct catalog *cat, size_t i, int sort)
+{
+    if (sort == LS_SORT_SIZE)
+        return cat->entries[i].size;
+    if (sort == LS_SORT_MTIME)
+        return (uint64_t)cat->entries[i].mtime ^ (1ull << 63);
+    return 0;
+}
+
+// The entries in order of 'sort', or NULL if out of memory.  Whichever
+// thread sorts them first publishes its order and any other drops its own.
+static const uint32_t *catalog_order(struct catalog *cat, int sort)
+{
+    _Atomic(uint32_t *) *slot = &cat->orders[sort - LS_SORT_SIZE];
+    uint32_t *order = atomic_load_explicit(slot, memory_order_acquire), *expected = NULL;
+    struct sort_item *items;
+
+    if (order != NULL)
+        return order;
+    items = malloc((cat->count + 1) * sizeof(*items));
+    order = malloc((cat->count + 1) * sizeof(*order));
+    if (items == NULL || order == NULL)
+    {
+        free(items);
+        free(order);
+        return NULL;
+    }
+    for (size_t i = 0; i < cat->count; i++)
+        items[i] = (struct sort_item){sort_key(cat, i, sort), i};
+    qsort(items, cat->count, sizeof(*items), compare_sort_items);
+    for (size_t i = 0; i < cat->count; i++)
+        order[i] = items[i].entry;
+    free(items);
+
+    if (!atomic_compare_exchange_strong_explicit(slot, &expected, order, memory_order_acq_rel, memory_order_acquire))
+    {
+        free(order);
+        return expected;
+    }
+    return order;
+}
+
+// Where an entry is against a sort key and name
+static int compare_place(const struct catalog *cat, size_t i, int sort, uint64_t key, const char *name)
+{
+    uint64_t k = sort_key(cat, i, sort);
+
+    if (k != key)
+        return k < key ? -1 : 1;
+    return strcmp(catalog_name(cat, &cat->entries[i]), name);
+}
+
+// The first place in an order whose entry comes after the key and name, or
+// at them if 'at'
+static size_t find_place(const struct catalog *cat, const uint32_t *order, int sort, uint64_t key, const char *name,
+                         bool at)
+{
+    size_t lo = 0, hi = cat->count;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        int c = compare_place(cat, order != NULL ? order[mid] : mid, sort, key, name);
+
+        if (c < 0 || (c == 0 && !at))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// The first name from 'lo' on that comes after every name starting with
+// 'prefix'
+static size_t prefix_end(const struct catalog *cat, size_t lo, const char *prefix, size_t len)
+{
+    size_t hi = cat->count;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (strncmp(catalog_name(cat, &cat->entries[mid]), prefix, len) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static bool page_matches(const struct catalog_page *page, const struct catalog_entry *entry, const char *name,
+                         bool glob)
+{
+    if (page->files_only && entry->type != LS_ENTRY_FILE)
+        return false;
+    if (page->pattern == NULL)
+        return true;
+    if (glob)
+        return fnmatch(page->pattern, name, 0) == 0;
+    return strncmp(name, page->pattern, strlen(page->pattern)) == 0;
+}
+
+ssize_t catalog_page(struct catalog *cat, struct catalog_page *page, uint32_t *out, size_t limit, size_t budget,
+                     bool *done)
+{
+    const uint32_t *order = NULL;
+    size_t lo = 0, hi = cat->count, n = 0, fixed = 0;
+    bool glob = false;
+
+    if (page->sort != LS_SORT_NAME && (order = catalog_order(cat, page->sort)) == NULL)
+        return -1;
+    if (page->pattern != NULL)
+    {
+        fixed = strcspn(page->pattern, "*?[");
+        glob = page->pattern[fixed] != '\0';
+    }
+
+    // Only the names starting with the pattern's fixed part can match it
+    if (page->sort == LS_SORT_NAME && fixed > 0)
+    {
+        char prefix[NAME_MAX + 1];
+
+        snprintf(prefix, sizeof(prefix), "%.*s", (int)fixed, page->pattern);
+        lo = find_place(cat, NULL, LS_SORT_NAME, 0, prefix, true);
+        hi = prefix_end(cat, lo, prefix, strlen(prefix));
+    }
+    if (page->after != NULL && !page->reverse)
+    {
+        size_t from = find_place(cat, order, page->sort, page->key, page->after, false);
+
+        lo = from > lo ? from : lo;
+    }
+    else if (page->after != NULL)
+    {
+        size_t to = find_place(cat, order, page->sort, page->key, page->after, true);
+
+        hi = to < hi ? to : hi;
+    }
+
+    while (lo < hi && n < limit && budget > 0)
+    {
+        size_t i = page->reverse ? --hi : lo++;
+        const struct catalog_entry *entry = &cat->entries[order != NULL ? order[i] : i];
+        const char *name = catalog_name(cat, entry);
+
+        page->key = sort_key(cat, entry - cat->entries, page->sort);
+        page->after = name;
+        budget--;
+        if (page_matches(page, entry, name, glob))
+            out[n++] = entry - cat->entries;
+    }
+    *done = lo >= hi;
+    return n;
+}
+
+void catalog_cursor(const struct catalog_page *page, char *text)
+{
+    int len = sprintf(text, "%02x%02x%016llx", page->sort, page->reverse ? LS_REVERSE : 0,
+                      (unsigned long long)page->key);
+
+    for (const unsigned char *p = (const unsigned char *)page->after; *p != '\0' && len < LS_CURSOR_MAX; p++)
+        len += sprintf(text + len, "%02x", *p);
+}
+
+bool catalog_parse_cursor(const char *text, struct catalog_page *page, char *name)
+{
+    size_t len = strlen(text);
+    unsigned int sort, flags;
+    unsigned long long key;
+    int used;
+
+    if (len < 20 || len % 2 != 0 || len > LS_CURSOR_MAX || strspn(text, "0123456789abcdef") != len ||
+        sscanf(text, "%2x%2x%16llx%n", &sort, &flags, &key, &used) != 3 || used != 20 || sort > LS_SORT_MTIME)
+        return false;
+    for (size_t i = 20; i < len; i += 2)
+    {
+        unsigned int c;
+
+        if (sscanf(text + i, "%2x", &c) != 1 || c == 0)
+            return false;
+        name[(i - 20) / 2] = c;
+    }
+    name[(len - 20) / 2] = '\0';
+    page->sort = sort;
+    page->reverse = flags & LS_REVERSE;
+    page->key = key;
+    page->after = name;
+    return true;
+}
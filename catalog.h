@@ -0,0 +1,183 @@
+/******************************************************************************
+
+PROGRAM:  catalog.h
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: An in-memory index of the files in the server's data directory.
+
+          The catalog is built when the server starts and then kept current
+          by a background thread that watches the directory with inotify, so
+          listing the library never has to touch the file system.  Every
+          version of the catalog is an immutable snapshot.  Readers take a
+          reference to the current snapshot with catalog_acquire() and keep
+          using it for as long as they need, even after a newer snapshot has
+          replaced it, and drop it with catalog_release().
+
+          Each snapshot also holds the directory listing already serialized
+          for both protocols, cut at entry boundaries into pieces that each
+          fit in one TLS record, so an ls is answered by sending those pieces
+          as they are.  A listing can also be read a page at a time, in
+          order of name, size or modification time (see catalog_page()).
+
+          Every file's metadata, read from its ID3 tags and MPEG frames when
+          the file is first seen (see id3.h), is kept in the snapshot too, so
+          clients can look up and search tracks without downloading them.
+          New files are read by a pool of threads (see ingest.h), as a batch
+          of them can take a while: every frame of every file is walked, to
+          find its exact duration and any file that is corrupt or truncated.
+
+          Each snapshot also gets a trigram index of its names and tags (see
+          trigram.h), built by the catalog thread before the snapshot
+          replaces the previous one.  Only the snapshot the server starts
+          with is published before its index is ready, and until then it is
+          searched the slow way.
+
+          A snapshot is a single flat image with no pointers in it, and every
+          new one is also written to a snapshot file.  The next time the
+          server starts it maps that file and serves from it straight away,
+          while the catalog thread checks it against the directory.
+
+******************************************************************************/
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// The most a listing piece holds: one full TLS record, frame header included
+#define CATALOG_PIECE_SIZE (16 * 1024)
+
+// Tag columns: title, artist and album, indexed by SEARCH_TITLE and so on
+// (see protocol.h)
+#define CATALOG_TAGS 3
+
+// Orders of the entries besides their own, by name: LS_SORT_SIZE and
+// LS_SORT_MTIME (see protocol.h)
+#define CATALOG_ORDERS 2
+
+struct trigram_index;
+
+// One entry of a snapshot image, exactly as it is stored in the snapshot file
+struct catalog_entry
+{
+    uint64_t name; // Offset of the NUL terminated name in the names section
+    uint64_t size;
+    int64_t mtime; // Nanoseconds since the epoch
+    uint32_t namelen;
+    uint8_t type; // LS_ENTRY_FILE or LS_ENTRY_DIR
+    uint8_t reserved[3];
+};
+
+// A serialized listing.  Piece i is data[cuts[i]] up to data[cuts[i + 1]].
+struct catalog_listing
+{
+    const char *data;
+    const uint64_t *cuts;
+    size_t pieces;
+};
+
+struct catalog
+{
+    atomic_int refs;
+    unsigned long generation;
+    size_t count;
+    const struct catalog_entry *entries; // Sorted by name
+    const char *names;
+    struct catalog_listing text;   // Text protocol: a NUL terminated line per file
+    struct catalog_listing binary; // Binary protocol: LS_DATA payloads
+
+    // Metadata, one column per field with a value for each entry.  A tag
+    // is an offset into 'tags', where 0 is the empty string.
+    const uint32_t *tag_columns[CATALOG_TAGS];
+    const char *tags;
+    const uint16_t *years;       // 0 if unknown
+    const uint16_t *bitrates;    // kbit/s
+    const uint32_t *durations;   // Milliseconds
+    const uint16_t *samplerates; // Hz, 0 without MPEG audio
+    const uint8_t *audio;        // What walking the frames found: ID3_AUDIO_OK, ...
+
+    // Index for catalog_rank(), NULL until the catalog thread has built it
+    _Atomic(struct trigram_index *) index;
+
+    // The entries by size and by modification time, ties by name, sorted
+    // by the catalog thread or else by the first page that needs them
+    _Atomic(uint32_t *) orders[CATALOG_ORDERS];
+
+    // The image all of the above points into, either built in memory or
+    // mapped from the snapshot file
+    void *image;
+    size_t imagelen;
+    bool mapped;
+};
+
+// Build the catalog of 'dirname' and start watching it for changes.  If
+// 'snapshot' names a usable snapshot file, the catalog starts out as that
+// file and is reconciled with the directory in the background.  Every new
+// snapshot is written back to it.  Pass NULL to always read the directory.
+// New files are read by 'threads' threads.
+int catalog_start(const char *dirname, const char *snapshot, int threads);
+
+// Take and drop a reference to the current snapshot
+struct catalog *catalog_acquire(void);
+void catalog_release(struct catalog *cat);
+
+static inline const char *catalog_name(const struct catalog *cat, const struct catalog_entry *entry)
+{
+    return cat->names + entry->name;
+}
+
+// A tag of the i'th entry, "" if it has none
+static inline const char *catalog_tag(const struct catalog *cat, size_t i, int tag)
+{
+    return cat->tags + cat->tag_columns[tag][i];
+}
+
+// Find an entry by name, or NULL
+const struct catalog_entry *catalog_lookup(const struct catalog *cat, const char *name);
+
+// Write an entry the way a listing has it into 'p', which has room for
+// 'room' bytes: as an LS_DATA entry, or as a NUL terminated text line with
+// its size, which directories don't get.  Returns the length, 0 for a
+// directory in text.  With 'p' NULL the entry is only measured.
+size_t catalog_format_entry(char *p, size_t room, const char *name, size_t namelen, int type, uint64_t size,
+                            bool binary);
+
+// Find the first of at most 'limit' entries from 'from' on whose 'field'
+// (SEARCH_TITLE, ...) matches 'query', and return its index.  A tag matches
+// if it contains the query, ignoring case; a year only if it is the query.
+// Returns from + limit, or the entry count if that is less, if none do.
+size_t catalog_search(const struct catalog *cat, int field, const char *query, size_t from, size_t limit);
+
+// A page of a listing, and where it has got to
+struct catalog_page
+{
+    int sort; // LS_SORT_NAME, LS_SORT_SIZE or LS_SORT_MTIME
+    bool reverse;
+    bool files_only;     // Leave out directories
+    const char *pattern; // A prefix or glob the names must match, NULL for all
+    uint64_t key;        // Sort key of the last entry looked at
+    const char *after;   // and its name, NULL before the first
+};
+
+// Find up to 'limit' of the entries after where 'page' has got to, in its
+// order, looking at no more than 'budget' entries, and put their indexes in
+// 'out'.  The page is moved on past the last entry looked at, and 'done'
+// set if there are no more.  Returns how many were found, or -1 if out of
+// memory for sorting.
+ssize_t catalog_page(struct catalog *cat, struct catalog_page *page, uint32_t *out, size_t limit, size_t budget,
+                     bool *done);
+
+// Write where 'page' has got to as a cursor of at most LS_CURSOR_MAX hex
+// digits, and read one back into 'page', with the name in 'name', which
+// has room for NAME_MAX + 1 bytes.  Returns false if 'text' isn't a cursor.
+void catalog_cursor(const struct catalog_page *page, char *text);
+bool catalog_parse_cursor(const char *text, struct catalog_page *page, char *name);
+
+// Find the tracks best matching 'query' anywhere in their names and tags
+// (see trigram.h) and put the indexes of up to 'limit' of them in
+// 'results', best first.  Returns how many were found.
+size_t catalog_rank(const struct catalog *cat, const char *query, uint32_t *results, size_t limit);
+
+#endif
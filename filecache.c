@@ -0,0 +1,318 @@
+/******************************************************************************
+
+PROGRAM:  filecache.c
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: The cache of recently sent files, see filecache.h.
+
+          Files are found by path in a hash table and kept in a list ordered
+          by when they were last asked for.  Every worker shares the cache,
+          so both are protected by one lock, which is only held to look a
+          file up or to add one; mapping a file and copying from it happen
+          outside it.
+
+******************************************************************************/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "filecache.h"
+
+#define FILECACHE_BUCKETS 4096
+
+// No single file may take more than this fraction of the cache
+#define FILECACHE_MAX_SHARE 4
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cached_file *buckets[FILECACHE_BUCKETS];
+static struct cached_file *lru_head, *lru_tail; // Most and least recently used
+static size_t cache_capacity;
+static size_t cache_bytes;
+static size_t cache_files;
+
+static atomic_ulong hits, misses, evictions;
+
+// Where to go if the copy this thread is making faults.  It is volatile
+// because only the signal handler reads it, which the compiler can't see.
+static __thread sigjmp_buf *volatile copy_fault;
+
+static unsigned int hash_path(const char *path)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*path != '\0')
+        hash = (hash ^ (unsigned char)*path++) * 16777619u;
+    return hash % FILECACHE_BUCKETS;
+}
+
+static int64_t mtime_ns(const struct stat *fileInfo)
+{
+    return fileInfo->st_mtim.tv_sec * 1000000000LL + fileInfo->st_mtim.tv_nsec;
+}
+
+// Whether a cached file is still the one at its path
+static bool is_current(const struct cached_file *file, const struct stat *fileInfo)
+{
+    return !atomic_load(&file->stale) && file->dev == fileInfo->st_dev && file->ino == fileInfo->st_ino &&
+           file->size == fileInfo->st_size && file->mtime == mtime_ns(fileInfo);
+}
+
+void filecache_put(struct cached_file *file)
+{
+    if (atomic_fetch_sub(&file->refs, 1) != 1)
+        return;
+    if (file->data != NULL)
+        munmap((void *)file->data, file->size);
+    free(file->path);
+    free(file);
+}
+
+static struct cached_file *find_file(const char *path)
+{
+    struct cached_file *file = buckets[hash_path(path)];
+
+    while (file != NULL && strcmp(file->path, path) != 0)
+        file = file->hash_next;
+    return file;
+}
+
+static void lru_unlink(struct cached_file *file)
+{
+    if (file->lru_prev != NULL)
+        file->lru_prev->lru_next = file->lru_next;
+    else
+        lru_head = file->lru_next;
+    if (file->lru_next != NULL)
+        file->lru_next->lru_prev = file->lru_prev;
+    else
+        lru_tail = file->lru_prev;
+    file->lru_prev = file->lru_next = NULL;
+}
+
+static void lru_push(struct cached_file *file)
+{
+    file->lru_prev = NULL;
+    file->lru_next = lru_head;
+    if (lru_head != NULL)
+        lru_head->lru_prev = file;
+    else
+        lru_tail = file;
+    lru_head = file;
+}
+
+// Take a file out of the cache.  Sessions still sending it keep it mapped.
+static void remove_file(struct cached_file *file)
+{
+    struct cached_file **link = &buckets[hash_path(file->path)];
+
+    while (*link != file)
+        link = &(*link)->hash_next;
+    *link = file->hash_next;
+    lru_unlink(file);
+    file->cached = false;
+    cache_bytes -= file->size;
+    cache_files--;
+    filecache_put(file);
+}
+
+// Add a file, then drop the least recently used files until the cache fits
+static void insert_file(struct cached_file *file)
+{
+    unsigned int bucket = hash_path(file->path);
+
+    file->hash_next = buckets[bucket];
+    buckets[bucket] = file;
+    lru_push(file);
+    file->cached = true;
+    cache_bytes += file->size;
+    cache_files++;
+
+    while (cache_bytes > cache_capacity && lru_tail != file)
+    {
+        remove_file(lru_tail);
+        atomic_fetch_add(&evictions, 1);
+    }
+}
+
+// Map a file that isn't in the cache, or return NULL with *error set as for filecache_get()
+static struct cached_file *map_file(const char *path, int *error)
+{
+    struct cached_file *file;
+    struct stat fileInfo;
+    void *data = NULL;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        *error = errno;
+        return NULL;
+    }
+    if (fstat(fd, &fileInfo) < 0 || !S_ISREG(fileInfo.st_mode) ||
+        fileInfo.st_size > (off_t)(cache_capacity / FILECACHE_MAX_SHARE))
+    {
+        close(fd);
+        return NULL;
+    }
+    if (fileInfo.st_size > 0)
+    {
+        data = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            fprintf(stderr, "File cache: Could not map %s: %s\n", path, strerror(errno));
+            close(fd);
+            return NULL;
+        }
+
+        // Start reading it in now, every session will need all of it
+        madvise(data, fileInfo.st_size, MADV_WILLNEED);
+    }
+    close(fd);
+
+    if ((file = calloc(1, sizeof(*file))) == NULL || (file->path = strdup(path)) == NULL)
+    {
+        if (data != NULL)
+            munmap(data, fileInfo.st_size);
+        free(file);
+        return NULL;
+    }
+    file->data = data;
+    file->size = fileInfo.st_size;
+    file->dev = fileInfo.st_dev;
+    file->ino = fileInfo.st_ino;
+    file->mtime = mtime_ns(&fileInfo);
+    atomic_init(&file->refs, 1);
+    atomic_init(&file->stale, false);
+    return file;
+}
+
+/******************************************************************************
+
+Look a file up, mapping it on a miss.  Every lookup stats the path, which is
+what tells a cached file that is still current from one that has since been
+replaced.  The lock isn't held while a missing file is mapped, so two
+sessions may map the same new file at once; the second to finish finds the
+first one's copy in the cache and uses that instead.
+
+******************************************************************************/
+struct cached_file *filecache_get(const char *path, int *error)
+{
+    struct cached_file *file, *mapped;
+    struct stat fileInfo;
+
+    *error = 0;
+    if (cache_capacity == 0)
+        return NULL;
+    if (stat(path, &fileInfo) < 0)
+    {
+        *error = errno;
+        return NULL;
+    }
+    if (!S_ISREG(fileInfo.st_mode) || fileInfo.st_size > (off_t)(cache_capacity / FILECACHE_MAX_SHARE))
+        return NULL;
+
+    pthread_mutex_lock(&cache_lock);
+    file = find_file(path);
+    if (file != NULL && is_current(file, &fileInfo))
+    {
+        lru_unlink(file);
+        lru_push(file);
+        atomic_fetch_add(&file->refs, 1);
+        pthread_mutex_unlock(&cache_lock);
+        atomic_fetch_add(&hits, 1);
+        return file;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    atomic_fetch_add(&misses, 1);
+    if ((mapped = map_file(path, error)) == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&cache_lock);
+    file = find_file(path);
+    if (file != NULL && !atomic_load(&file->stale) && file->dev == mapped->dev && file->ino == mapped->ino &&
+        file->size == mapped->size && file->mtime == mapped->mtime)
+    {
+        atomic_fetch_add(&file->refs, 1);
+        pthread_mutex_unlock(&cache_lock);
+        filecache_put(mapped);
+        return file;
+    }
+    if (file != NULL)
+        remove_file(file);
+    atomic_fetch_add(&mapped->refs, 1);
+    insert_file(mapped);
+    pthread_mutex_unlock(&cache_lock);
+    return mapped;
+}
+
+static void copy_fault_handler(int sig, siginfo_t *info, void *context)
+{
+    (void)info;
+    (void)context;
+    if (copy_fault != NULL)
+        siglongjmp(*copy_fault, 1);
+
+    // Not one of ours
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/******************************************************************************
+
+Copy from a mapping.  If the file has been truncated since it was mapped,
+touching the missing pages raises SIGBUS; the handler jumps back here and the
+copy is reported as a short read.  SA_NODEFER keeps SIGBUS unblocked after
+the jump, so the mask never has to be saved and restored on every copy.
+
+******************************************************************************/
+size_t filecache_copy(struct cached_file *file, off_t offset, void *dst, size_t len)
+{
+    sigjmp_buf env;
+
+    if (offset >= file->size)
+        return 0;
+    if ((off_t)len > file->size - offset)
+        return filecache_copy(file, offset, dst, file->size - offset);
+
+    if (sigsetjmp(env, 0) != 0)
+    {
+        copy_fault = NULL;
+        atomic_store(&file->stale, true);
+        return 0;
+    }
+    copy_fault = &env;
+    memcpy(dst, file->data + offset, len);
+    copy_fault = NULL;
+    return len;
+}
+
+void filecache_init(size_t capacity)
+{
+    struct sigaction action = {.sa_sigaction = copy_fault_handler, .sa_flags = SA_SIGINFO | SA_NODEFER};
+
+    cache_capacity = capacity;
+    if (capacity > 0)
+    {
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGBUS, &action, NULL);
+    }
+}
+
+void filecache_get_stats(struct filecache_stats *stats)
+{
+    stats->hits = atomic_load(&hits);
+    stats->misses = atomic_load(&misses);
+    stats->evictions = atomic_load(&evictions);
+    pthread_mutex_lock(&cache_lock);
+    stats->files = cache_files;
+    stats->bytes = cache_bytes;
+    pthread_mutex_unlock(&cache_lock);
+}
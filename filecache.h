@@ -0,0 +1,73 @@
+/******************************************************************************
+
+PROGRAM:  filecache.h
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: A cache of recently sent files, shared by every session.
+
+          A cached file is mapped into memory once and every session that
+          sends it copies straight from the mapping, so a burst of listeners
+          asking for the same track costs one read from disk and no system
+          calls per record.  Sessions hold a reference to the file while they
+          send it.  The cache keeps the most recently used files up to its
+          memory limit and drops the least recently used ones beyond it; a
+          dropped file stays mapped until the last session sending it lets
+          go.
+
+          A file is checked against the file system every time it is asked
+          for, so a file that has been replaced is mapped again.  A file that
+          is truncated while it is being sent is detected when a copy from
+          the mapping faults, and reported as a short read.
+
+******************************************************************************/
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct cached_file
+{
+    const char *data; // The mapping, NULL for an empty file
+    off_t size;
+
+    // Identity of the file when it was mapped
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    int64_t mtime; // Nanoseconds since the epoch
+
+    atomic_int refs;    // The cache's own reference and one per sender
+    atomic_bool stale;  // A copy faulted, map it again next time
+    bool cached;        // Still in the cache
+    struct cached_file *hash_next;
+    struct cached_file *lru_prev, *lru_next;
+};
+
+struct filecache_stats
+{
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    size_t files;
+    size_t bytes; // Mapped by files in the cache
+};
+
+// Set the memory limit in bytes, 0 disables the cache
+void filecache_init(size_t capacity);
+
+// Get a reference to the file at 'path'.  Returns NULL with *error set to an
+// errno value if it can't be opened, or NULL with *error 0 if it isn't cached
+// (the cache is disabled or the file is too large) and should be read instead.
+struct cached_file *filecache_get(const char *path, int *error);
+void filecache_put(struct cached_file *file);
+
+// Copy up to 'len' bytes at 'offset' and return how many were copied, which
+// is 0 at the end of the file or if the file was truncated under the mapping
+size_t filecache_copy(struct cached_file *file, off_t offset, void *dst, size_t len);
+
+void filecache_get_stats(struct filecache_stats *stats);
+
+#endif
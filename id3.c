@@ -0,0 +1,702 @@
+/******************************************************************************
+
+PROGRAM:  id3.c
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: MP3 metadata, see id3.h.
+
+          Everything is read with pread(), so the caller's file offset is
+          left alone.  The ID3v2 frames are walked header by header and only
+          the contents of the text frames wanted are read; everything else,
+          cover images included, is skipped over.  The audio is read a
+          chunk at a time, of which only the frame headers are looked at,
+          and a walk through it can stop after any chunk and carry on later.
+
+******************************************************************************/
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "id3.h"
+
+#define ID3V2_HEADER_SIZE 10
+#define ID3V1_SIZE 128
+
+// Most of a text frame that is read.  UTF-16 takes up to four bytes for
+// every three of UTF-8, and a frame also has its encoding byte and possibly
+// a data length indicator.
+#define FRAME_CONTENT_MAX (ID3_TEXT_MAX * 2 + 16)
+
+// How far past the tag to look for the first MPEG audio frame
+#define SYNC_SEARCH_SIZE (64 * 1024)
+
+// Largest MPEG audio frame (layer II at 384 kbit/s and 32 kHz) and then some
+#define MPEG_FRAME_MAX 2048
+
+// How much audio is read at a time while its frames are walked
+#define WALK_CHUNK (256 * 1024)
+
+// The bits of a frame header every frame of a stream has in common: the
+// sync pattern, version, layer and sample rate
+#define STREAM_HEADER_MASK 0xfffe0c00u
+
+enum text_field
+{
+    FIELD_NONE,
+    FIELD_TITLE,
+    FIELD_ARTIST,
+    FIELD_ALBUM,
+    FIELD_YEAR,
+    FIELD_LENGTH
+};
+
+struct mpeg_frame
+{
+    bool mpeg1;
+    bool mono;
+    unsigned int layer;       // 1, 2 or 3
+    unsigned int bitrate;     // kbit/s
+    unsigned int samplerate;  // Hz
+    unsigned int samples;     // Per frame
+    unsigned int length;      // Bytes, header included
+};
+
+// kbit/s by [MPEG-1 or not][layer - 1][bitrate index]
+static const unsigned short bitrates[2][3][15] = {
+    {{0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+     {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+     {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320}},
+    {{0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+     {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+     {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160}}};
+
+// Hz by [version bits][sample rate index]; version 1 is reserved
+static const unsigned int samplerates[4][3] = {
+    {11025, 12000, 8000}, {0, 0, 0}, {22050, 24000, 16000}, {44100, 48000, 32000}};
+
+static uint32_t get_be32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// ID3v2 sizes keep the top bit of every byte clear
+static uint32_t get_syncsafe(const unsigned char *p)
+{
+    return (uint32_t)(p[0] & 0x7f) << 21 | (uint32_t)(p[1] & 0x7f) << 14 | (uint32_t)(p[2] & 0x7f) << 7 |
+           (p[3] & 0x7f);
+}
+
+static void put_syncsafe(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 21 & 0x7f;
+    p[1] = v >> 14 & 0x7f;
+    p[2] = v >> 7 & 0x7f;
+    p[3] = v & 0x7f;
+}
+
+static bool full_pread(int fd, void *buf, size_t len, off_t offset)
+{
+    return pread(fd, buf, len, offset) == (ssize_t)len;
+}
+
+// Append a character to a UTF-8 string.  Returns false once it doesn't fit.
+static bool put_utf8(char *out, size_t *len, uint32_t c)
+{
+    unsigned char buf[4];
+    size_t n;
+
+    if (c < 0x80)
+    {
+        buf[0] = c;
+        n = 1;
+    }
+    else if (c < 0x800)
+    {
+        buf[0] = 0xc0 | c >> 6;
+        buf[1] = 0x80 | (c & 0x3f);
+        n = 2;
+    }
+    else if (c < 0x10000)
+    {
+        buf[0] = 0xe0 | c >> 12;
+        buf[1] = 0x80 | (c >> 6 & 0x3f);
+        buf[2] = 0x80 | (c & 0x3f);
+        n = 3;
+    }
+    else
+    {
+        buf[0] = 0xf0 | c >> 18;
+        buf[1] = 0x80 | (c >> 12 & 0x3f);
+        buf[2] = 0x80 | (c >> 6 & 0x3f);
+        buf[3] = 0x80 | (c & 0x3f);
+        n = 4;
+    }
+
+    if (*len + n > ID3_TEXT_MAX)
+        return false;
+    memcpy(out + *len, buf, n);
+    *len += n;
+    return true;
+}
+
+/******************************************************************************
+
+Convert text in one of the ID3 encodings to UTF-8, up to the first NUL:
+0 is ISO-8859-1, 1 is UTF-16 with a byte order mark, 2 is UTF-16BE and 3 is
+UTF-8.  Trailing spaces, which ID3v1 pads its fields with, are dropped.
+
+******************************************************************************/
+static void decode_text(const unsigned char *p, size_t n, unsigned int encoding, char *out)
+{
+    size_t len = 0;
+
+    if (encoding == 1 || encoding == 2)
+    {
+        bool little = false;
+
+        if (encoding == 1 && n >= 2 && (p[0] == 0xff || p[0] == 0xfe) && (p[1] == 0xff || p[1] == 0xfe))
+        {
+            little = p[0] == 0xff;
+            p += 2;
+            n -= 2;
+        }
+        for (size_t i = 0; i + 1 < n; i += 2)
+        {
+            uint32_t c = little ? (p[i] | p[i + 1] << 8) : (p[i] << 8 | p[i + 1]);
+
+            if (c == 0)
+                break;
+            if (c >= 0xd800 && c < 0xdc00 && i + 3 < n)
+            {
+                uint32_t low = little ? (p[i + 2] | p[i + 3] << 8) : (p[i + 2] << 8 | p[i + 3]);
+
+                if (low >= 0xdc00 && low < 0xe000)
+                {
+                    c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                    i += 2;
+                }
+            }
+            if (!put_utf8(out, &len, c))
+                break;
+        }
+    }
+    else if (encoding == 3)
+    {
+        while (len < n && len < ID3_TEXT_MAX && p[len] != '\0')
+        {
+            out[len] = p[len];
+            len++;
+        }
+
+        // Don't leave half a character behind if it was cut short
+        if (len == ID3_TEXT_MAX && len < n && (p[len] & 0xc0) == 0x80)
+        {
+            while (len > 0 && (out[len - 1] & 0xc0) == 0x80)
+                len--;
+            if (len > 0)
+                len--;
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < n && p[i] != '\0'; i++)
+        {
+            if (!put_utf8(out, &len, p[i]))
+                break;
+        }
+    }
+
+    while (len > 0 && out[len - 1] == ' ')
+        len--;
+    out[len] = '\0';
+}
+
+static enum text_field frame_field(const unsigned char *id, unsigned int version)
+{
+    static const struct
+    {
+        const char *v22, *v23;
+        enum text_field field;
+    } frames[] = {
+        {"TT2", "TIT2", FIELD_TITLE},  {"TP1", "TPE1", FIELD_ARTIST}, {"TAL", "TALB", FIELD_ALBUM},
+        {"TYE", "TYER", FIELD_YEAR},   {"TYE", "TDRC", FIELD_YEAR},   {"TLE", "TLEN", FIELD_LENGTH},
+    };
+
+    for (size_t i = 0; i < sizeof(frames) / sizeof(frames[0]); i++)
+    {
+        if (version == 2 ? memcmp(id, frames[i].v22, 3) == 0 : memcmp(id, frames[i].v23, 4) == 0)
+            return frames[i].field;
+    }
+    return FIELD_NONE;
+}
+
+// Undo unsynchronisation: every 0xFF 0x00 was written for a plain 0xFF
+static size_t resync(unsigned char *p, size_t n)
+{
+    size_t out = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        p[out++] = p[i];
+        if (p[i] == 0xff && i + 1 < n && p[i + 1] == 0x00)
+            i++;
+    }
+    return out;
+}
+
+// Keep the first value of a field the tags give
+static void set_field(struct id3_info *info, enum text_field field, const char *text, unsigned int *length)
+{
+    char *dest = field == FIELD_TITLE ? info->title : field == FIELD_ARTIST ? info->artist
+                                                   : field == FIELD_ALBUM  ? info->album
+                                                                           : NULL;
+
+    if (dest != NULL)
+    {
+        if (dest[0] == '\0')
+            strcpy(dest, text);
+    }
+    else if (field == FIELD_YEAR && info->year == 0)
+        info->year = strtoul(text, NULL, 10) % 10000;
+    else if (field == FIELD_LENGTH && *length == 0)
+        *length = strtoul(text, NULL, 10);
+}
+
+/******************************************************************************
+
+Read an ID3v2 tag at the start of the file, if there is one.  Returns where
+the audio starts: just after the tag, or 0 without one.  A TLEN frame's
+length is left in 'length' in case the audio itself can't be measured.
+
+******************************************************************************/
+static off_t read_id3v2(int fd, off_t size, struct id3_info *info, unsigned int *length)
+{
+    unsigned char h[ID3V2_HEADER_SIZE];
+    unsigned char content[FRAME_CONTENT_MAX];
+    unsigned int version, headersize;
+    off_t pos, end;
+    bool unsync;
+
+    if (size < ID3V2_HEADER_SIZE || !full_pread(fd, h, sizeof(h), 0) || memcmp(h, "ID3", 3) != 0 || h[3] < 2 ||
+        h[3] > 4 || ((h[6] | h[7] | h[8] | h[9]) & 0x80))
+        return 0;
+
+    version = h[3];
+    end = ID3V2_HEADER_SIZE + (off_t)get_syncsafe(h + 6);
+    if (end > size)
+        end = size;
+    unsync = version < 4 && (h[5] & 0x80);
+    headersize = version == 2 ? 6 : 10;
+    pos = ID3V2_HEADER_SIZE;
+
+    // Skip an extended header.  Version 2.3 doesn't count the size itself.
+    if (version >= 3 && (h[5] & 0x40))
+    {
+        unsigned char ext[4];
+
+        if (!full_pread(fd, ext, sizeof(ext), pos))
+            return end;
+        pos += version == 3 ? 4 + (off_t)get_be32(ext) : (off_t)get_syncsafe(ext);
+    }
+
+    while (pos + headersize <= end)
+    {
+        unsigned char fh[10];
+        enum text_field field;
+        uint32_t framesize;
+        size_t n, skip = 0;
+        bool frameunsync = unsync;
+
+        if (!full_pread(fd, fh, headersize, pos) || fh[0] == '\0') // Padding
+            break;
+        if (version == 2)
+            framesize = (uint32_t)fh[3] << 16 | fh[4] << 8 | fh[5];
+        else if (version == 3)
+            framesize = get_be32(fh + 4);
+        else
+            framesize = get_syncsafe(fh + 4);
+        if (framesize > end - pos - headersize)
+            break;
+
+        field = frame_field(fh, version);
+        if (field != FIELD_NONE && framesize > 1)
+        {
+            // Compressed and encrypted frames are left alone
+            bool readable = version == 2 || (version == 3 ? (fh[9] & 0xc0) == 0 : (fh[9] & 0x0c) == 0);
+
+            if (version == 4)
+            {
+                frameunsync = fh[9] & 0x02;
+                if (fh[9] & 0x01) // Data length indicator
+                    skip = 4;
+            }
+            n = framesize < sizeof(content) ? framesize : sizeof(content);
+            if (readable && n > skip + 1 && full_pread(fd, content, n, pos + headersize))
+            {
+                char text[ID3_TEXT_MAX + 1];
+
+                if (frameunsync)
+                    n = resync(content, n);
+                decode_text(content + skip + 1, n - skip - 1, content[skip], text);
+                set_field(info, field, text, length);
+            }
+        }
+        pos += headersize + framesize;
+    }
+
+    // A footer repeats the header after the tag
+    return end + (version == 4 && (h[5] & 0x10) ? ID3V2_HEADER_SIZE : 0);
+}
+
+// Fill in what an ID3v1 tag has and the ID3v2 tag didn't.  Returns whether there is one.
+static bool read_id3v1(int fd, off_t size, struct id3_info *info)
+{
+    unsigned char tag[ID3V1_SIZE];
+    char text[ID3_TEXT_MAX + 1];
+    unsigned int unused = 0;
+
+    if (size < ID3V1_SIZE || !full_pread(fd, tag, sizeof(tag), size - ID3V1_SIZE) || memcmp(tag, "TAG", 3) != 0)
+        return false;
+
+    decode_text(tag + 3, 30, 0, text);
+    set_field(info, FIELD_TITLE, text, &unused);
+    decode_text(tag + 33, 30, 0, text);
+    set_field(info, FIELD_ARTIST, text, &unused);
+    decode_text(tag + 63, 30, 0, text);
+    set_field(info, FIELD_ALBUM, text, &unused);
+    decode_text(tag + 93, 4, 0, text);
+    set_field(info, FIELD_YEAR, text, &unused);
+    return true;
+}
+
+static bool parse_frame_header(const unsigned char *p, struct mpeg_frame *f)
+{
+    unsigned int version = p[1] >> 3 & 3, layer = 4 - (p[1] >> 1 & 3);
+    unsigned int index = p[2] >> 4, rate = p[2] >> 2 & 3, padding = p[2] >> 1 & 1;
+
+    // Free format bitrates aren't supported
+    if (p[0] != 0xff || (p[1] & 0xe0) != 0xe0 || version == 1 || layer == 4 || index == 0 || index == 15 ||
+        rate == 3)
+        return false;
+
+    f->mpeg1 = version == 3;
+    f->mono = (p[3] >> 6) == 3;
+    f->layer = layer;
+    f->bitrate = bitrates[!f->mpeg1][layer - 1][index];
+    f->samplerate = samplerates[version][rate];
+    f->samples = layer == 1 ? 384 : layer == 2 || f->mpeg1 ? 1152 : 576;
+    if (layer == 1)
+        f->length = (12 * f->bitrate * 1000 / f->samplerate + padding) * 4;
+    else
+        f->length = f->samples / 8 * f->bitrate * 1000 / f->samplerate + padding;
+    return f->length >= 4;
+}
+
+// The number of frames a Xing or VBRI header in the first frame counts, or 0
+static uint32_t vbr_frames(const unsigned char *p, size_t avail, const struct mpeg_frame *f)
+{
+    size_t xing = 4 + (f->mpeg1 ? (f->mono ? 17 : 32) : (f->mono ? 9 : 17));
+
+    if (avail >= xing + 12 && (memcmp(p + xing, "Xing", 4) == 0 || memcmp(p + xing, "Info", 4) == 0) &&
+        (get_be32(p + xing + 4) & 1))
+        return get_be32(p + xing + 8);
+    if (avail >= 36 + 18 && memcmp(p + 36, "VBRI", 4) == 0)
+        return get_be32(p + 36 + 14);
+    return 0;
+}
+
+// Tags some files have after the audio, ahead of any ID3v1 tag
+static bool trailing_tag(const unsigned char *p, size_t avail)
+{
+    return (avail >= 8 && memcmp(p, "APETAGEX", 8) == 0) || (avail >= 11 && memcmp(p, "LYRICSBEGIN", 11) == 0);
+}
+
+// The part of a file being walked that is in memory
+struct window
+{
+    unsigned char *buf;
+    off_t start;
+    size_t len;
+};
+
+// Make sure the window holds 'want' bytes from 'pos', or as many as there
+// are before 'end', and return a pointer to 'pos'.  Returns NULL on a read
+// error.
+static const unsigned char *window_at(int fd, struct window *w, off_t pos, off_t end, size_t want, size_t *avail)
+{
+    if (pos < w->start || pos + (off_t)want > w->start + (off_t)w->len)
+    {
+        size_t len = end - pos < WALK_CHUNK ? (size_t)(end - pos) : WALK_CHUNK, got = 0;
+
+        while (got < len)
+        {
+            ssize_t n = pread(fd, w->buf + got, len - got, pos + got);
+
+            if (n <= 0)
+                return NULL;
+            got += n;
+        }
+        w->start = pos;
+        w->len = len;
+    }
+    *avail = w->start + w->len - pos;
+    return w->buf + (pos - w->start);
+}
+
+// Whether 'p' is a frame of the stream whose headers have 'stream' in
+// common, followed by another or by the end of the audio
+static bool frame_at(const unsigned char *p, size_t avail, uint32_t stream, struct mpeg_frame *f)
+{
+    struct mpeg_frame next;
+
+    if ((get_be32(p) & STREAM_HEADER_MASK) != stream || !parse_frame_header(p, f))
+        return false;
+    if (f->length == avail)
+        return true;
+    return f->length + 4 <= avail && (get_be32(p + f->length) & STREAM_HEADER_MASK) == stream &&
+           parse_frame_header(p + f->length, &next);
+}
+
+/******************************************************************************
+
+A walk through the audio between 'start' and 'end'.  The first frame is the
+first valid frame header followed by another one where its length says,
+which rules out the stray sync patterns that turn up in tags and junk.  From
+there the frames are walked one header after another.  Where a header isn't
+found the walk goes on a byte at a time until two frames in a row turn up
+again; the bytes passed over make the file corrupt, unless they are zeros or
+a tag running to the end of the audio.
+
+******************************************************************************/
+struct id3_walk
+{
+    int fd;
+    struct window w;
+    off_t pos, end;
+    uint64_t frames, samples, audio;
+    uint32_t stream, promised;
+    bool truncated, junk, lost, nonzero, done;
+    struct mpeg_frame first;
+    void (*frame)(void *ctx, const struct id3_frame *frame);
+    void *ctx;
+};
+
+static struct id3_walk *start_walk(int fd, off_t start, off_t end,
+                                   void (*frame)(void *ctx, const struct id3_frame *frame), void *ctx)
+{
+    struct id3_walk *walk;
+    struct mpeg_frame f;
+    size_t avail, i;
+    const unsigned char *p;
+
+    if (end - start < 4 || (walk = calloc(1, sizeof(*walk))) == NULL)
+        return NULL;
+    if ((walk->w.buf = malloc(WALK_CHUNK)) == NULL)
+    {
+        free(walk);
+        return NULL;
+    }
+    walk->fd = fd;
+    walk->w.start = start;
+    walk->end = end;
+    walk->frame = frame;
+    walk->ctx = ctx;
+    if ((p = window_at(fd, &walk->w, start, end, SYNC_SEARCH_SIZE + MPEG_FRAME_MAX, &avail)) == NULL)
+        goto none;
+
+    for (i = 0; i + 4 <= avail && i < SYNC_SEARCH_SIZE; i++)
+    {
+        if (parse_frame_header(p + i, &walk->first) &&
+            (i + walk->first.length + 4 <= avail ? parse_frame_header(p + i + walk->first.length, &f)
+                                                 : start + (off_t)(i + walk->first.length) == end))
+            break;
+    }
+    if (i + 4 > avail || i == SYNC_SEARCH_SIZE)
+        goto none;
+    walk->stream = get_be32(p + i) & STREAM_HEADER_MASK;
+    walk->promised = vbr_frames(p + i, avail - i, &walk->first);
+    walk->pos = start + i;
+    posix_fadvise(fd, walk->pos, end - walk->pos, POSIX_FADV_SEQUENTIAL);
+    return walk;
+
+none:
+    free(walk->w.buf);
+    free(walk);
+    return NULL;
+}
+
+struct id3_walk *id3_walk_start(int fd, off_t size, void (*frame)(void *ctx, const struct id3_frame *frame),
+                                void *ctx)
+{
+    struct id3_info tags = {0};
+    unsigned int length = 0;
+    off_t start, end = size;
+
+    start = read_id3v2(fd, size, &tags, &length);
+    if (read_id3v1(fd, size, &tags))
+        end -= ID3V1_SIZE;
+    return start < end ? start_walk(fd, start, end, frame, ctx) : NULL;
+}
+
+bool id3_walk_step(struct id3_walk *walk, size_t budget)
+{
+    off_t stop = (uint64_t)(walk->end - walk->pos) > budget ? walk->pos + (off_t)budget : walk->end;
+    struct mpeg_frame f;
+    size_t avail;
+    const unsigned char *p;
+
+    while (!walk->done && walk->pos < stop)
+    {
+        if (walk->end - walk->pos < 4)
+        {
+            walk->done = true;
+            break;
+        }
+        if ((p = window_at(walk->fd, &walk->w, walk->pos, walk->end, MPEG_FRAME_MAX + 4, &avail)) == NULL)
+        {
+            walk->truncated = walk->done = true;
+            break;
+        }
+
+        // Once in step, a frame only needs a header; after junk it must be
+        // followed by another
+        if (walk->lost ? frame_at(p, avail, walk->stream, &f)
+                       : (get_be32(p) & STREAM_HEADER_MASK) == walk->stream && parse_frame_header(p, &f))
+        {
+            if (f.length > avail)
+            {
+                walk->truncated = walk->done = true;
+                walk->pos = walk->end;
+                break;
+            }
+            // The first frame only holds the VBR header, if it has one
+            if (walk->frame != NULL && (walk->promised == 0 || walk->frames > 0))
+            {
+                struct id3_frame frame = {walk->pos, p, f.length, f.samples, f.samplerate};
+
+                walk->frame(walk->ctx, &frame);
+            }
+            walk->frames++;
+            walk->samples += f.samples;
+            walk->audio += f.length;
+            walk->pos += f.length;
+            walk->junk |= walk->lost;
+            walk->lost = false;
+            continue;
+        }
+        if (trailing_tag(p, avail))
+        {
+            walk->pos = walk->end;
+            walk->done = true;
+            break;
+        }
+        if (!walk->lost)
+            walk->nonzero = false;
+        walk->lost = true;
+        walk->nonzero |= p[0] != 0;
+        walk->pos++;
+    }
+    if (walk->end - walk->pos < 4)
+        walk->done = true;
+    return !walk->done;
+}
+
+void id3_walk_end(struct id3_walk *walk, struct id3_info *info)
+{
+    uint64_t frames = walk->frames, samples = walk->samples, audio = walk->audio, ms;
+    bool junk = walk->junk || (walk->lost && walk->nonzero);
+
+    if (walk->promised > 0 && frames > 0)
+    {
+        frames--;
+        samples -= walk->first.samples;
+        audio -= walk->first.length;
+    }
+    if (walk->end - walk->pos > 0 && !walk->lost)
+        walk->truncated = true;
+
+    ms = samples * 1000 / walk->first.samplerate;
+    info->duration = ms;
+    info->bitrate = ms > 0 ? audio * 8 / ms : walk->first.bitrate;
+    info->samplerate = walk->first.samplerate;
+    if (junk)
+        info->audio = ID3_AUDIO_CORRUPT;
+    else if (walk->truncated || frames < walk->promised)
+        info->audio = ID3_AUDIO_TRUNCATED;
+    else
+        info->audio = ID3_AUDIO_OK;
+    free(walk->w.buf);
+    free(walk);
+}
+
+size_t id3_frame_length(const unsigned char *p)
+{
+    struct mpeg_frame f;
+
+    return parse_frame_header(p, &f) ? f.length : 0;
+}
+
+bool id3_read(int fd, off_t size, struct id3_info *info)
+{
+    struct id3_walk *walk;
+    unsigned int length = 0;
+    off_t start, end = size;
+
+    memset(info, 0, sizeof(*info));
+    start = read_id3v2(fd, size, info, &length);
+    if (read_id3v1(fd, size, info))
+        end -= ID3V1_SIZE;
+    if (start < end && (walk = start_walk(fd, start, end, NULL, NULL)) != NULL)
+    {
+        while (id3_walk_step(walk, (size_t)-1))
+            ;
+        id3_walk_end(walk, info);
+    }
+    if (info->duration == 0)
+        info->duration = length;
+
+    return info->title[0] != '\0' || info->artist[0] != '\0' || info->album[0] != '\0' || info->year != 0 ||
+           info->audio != ID3_AUDIO_NONE;
+}
+
+// Append a text frame, unless its text is empty
+static size_t put_text_frame(unsigned char *p, const char *id, const char *text)
+{
+    size_t len = strnlen(text, ID3_TEXT_MAX);
+
+    if (len == 0)
+        return 0;
+    memcpy(p, id, 4);
+    put_syncsafe(p + 4, 1 + len);
+    p[8] = p[9] = 0;
+    p[10] = 3; // UTF-8
+    memcpy(p + 11, text, len);
+    return 11 + len;
+}
+
+size_t id3_make_tag(const struct id3_info *info, unsigned char *buf)
+{
+    char number[11];
+    size_t len = ID3V2_HEADER_SIZE;
+
+    len += put_text_frame(buf + len, "TIT2", info->title);
+    len += put_text_frame(buf + len, "TPE1", info->artist);
+    len += put_text_frame(buf + len, "TALB", info->album);
+    if (info->year > 0 && info->year < 10000)
+    {
+        snprintf(number, sizeof(number), "%u", info->year);
+        len += put_text_frame(buf + len, "TDRC", number);
+    }
+    if (info->duration > 0)
+    {
+        snprintf(number, sizeof(number), "%u", info->duration);
+        len += put_text_frame(buf + len, "TLEN", number);
+    }
+
+    // Version 2.4.0, no flags
+    memcpy(buf, "ID3\x04\x00\x00", 6);
+    put_syncsafe(buf + 6, len - ID3V2_HEADER_SIZE);
+    return len;
+}
@@ -0,0 +1,101 @@
+/******************************************************************************
+
+PROGRAM:  id3.h
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: Reads the metadata of an MP3 file: its ID3 tags and what its MPEG
+          audio frames say about its length and bitrate.
+
+          An ID3v2 tag (versions 2.2 to 2.4) at the start of the file is
+          preferred, and an ID3v1 tag in its last 128 bytes fills in whatever
+          the ID3v2 tag didn't have.  Text is converted to UTF-8 whatever the
+          tag's encoding.  Only the frames that matter are read, so a tag
+          carrying a large cover image costs no more than one without.
+
+          Every MPEG audio frame of the file is walked, header to header, so
+          the duration is exact whether the bitrate is constant or variable,
+          and the bitrate reported is the average over the whole file.  The
+          Xing or VBRI header a variable bitrate encoder leaves in the first
+          frame isn't counted as audio, but the number of frames it promises
+          is checked.  Anything between frames makes the file corrupt, and a
+          last frame cut short or missing frames make it truncated.
+
+******************************************************************************/
+#ifndef ID3_H
+#define ID3_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Longest tag kept, in bytes of UTF-8 (without the terminator)
+#define ID3_TEXT_MAX 255
+
+// Longest tag id3_make_tag() makes: its header, three text frames, a year
+// and a length
+#define ID3_TAG_MAX (10 + 3 * (11 + ID3_TEXT_MAX) + (11 + 4) + (11 + 10))
+
+// What walking a file's MPEG audio frames found
+enum id3_audio
+{
+    ID3_AUDIO_NONE,     // No MPEG audio at all
+    ID3_AUDIO_OK,       // Frame after frame to the end of the file
+    ID3_AUDIO_CORRUPT,  // Junk between the frames
+    ID3_AUDIO_TRUNCATED // The file ends before its audio does
+};
+
+struct id3_info
+{
+    char title[ID3_TEXT_MAX + 1];
+    char artist[ID3_TEXT_MAX + 1];
+    char album[ID3_TEXT_MAX + 1];
+    unsigned int year;     // 0 if unknown
+    unsigned int bitrate;  // kbit/s, 0 if the file has no MPEG audio
+    unsigned int duration;   // Milliseconds
+    unsigned int samplerate; // Hz, 0 if the file has no MPEG audio
+    enum id3_audio audio;
+};
+
+// Read the metadata of the open file 'fd', which is 'size' bytes long.
+// Returns false, with 'info' all empty, if it has neither tags nor audio.
+// All of its audio is read.
+bool id3_read(int fd, off_t size, struct id3_info *info);
+
+// The same walk through a file's audio frames that id3_read() makes, taken a
+// step at a time by a caller that can't wait for all of a long file
+struct id3_walk;
+
+// An audio frame as the walk passes it
+struct id3_frame
+{
+    off_t offset;              // Where it starts in the file
+    const unsigned char *data; // All of it, header included, until the next step
+    size_t length;
+    unsigned int samples;    // It holds
+    unsigned int samplerate; // Hz
+};
+
+// Find the first audio frame of the open file 'fd', which is 'size' bytes
+// long.  frame(ctx, frame), if not NULL, is then called for every audio frame
+// walked, in order; a Xing or VBRI header frame isn't audio.  Returns NULL if
+// the file has no MPEG audio.
+struct id3_walk *id3_walk_start(int fd, off_t size, void (*frame)(void *ctx, const struct id3_frame *frame),
+                                void *ctx);
+
+// Walk on through about 'budget' bytes.  Returns false once the end of the
+// audio has been reached.
+bool id3_walk_step(struct id3_walk *walk, size_t budget);
+
+// Fill in what the walk found about the audio, its duration, bitrate,
+// samplerate and state, and free it.  It can be ended at any step.
+void id3_walk_end(struct id3_walk *walk, struct id3_info *info);
+
+// Write an ID3v2.4 tag holding just the title, artist, album, year and
+// duration of 'info' that it has, as UTF-8, to 'buf', which has room for
+// ID3_TAG_MAX bytes.  Returns its length.
+size_t id3_make_tag(const struct id3_info *info, unsigned char *buf);
+
+// The length of the MPEG audio frame whose 4 byte header 'p' points to, or
+// 0 if it isn't one
+size_t id3_frame_length(const unsigned char *p);
+
+#endif
@@ -0,0 +1,227 @@
+/******************************************************************************
+
+PROGRAM:  ingest.c
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: The ingest thread pool, see ingest.h.
+
+          Each thread's share of a batch is a range of indexes under a lock
+          of its own.  The owner takes from the front and thieves from the
+          back, so the lock is only ever contended when a thread is out of
+          work, and a thread that finds every range empty is done with the
+          batch: work only moves from one range to another, never back into
+          one that was empty.
+
+******************************************************************************/
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "ingest.h"
+
+// What is left of one thread's share of the batch.  Each on a cache line of
+// its own, as the owner takes from it for every file.
+struct ingest_range
+{
+    pthread_mutex_t lock;
+    size_t next, end;
+} __attribute__((aligned(64)));
+
+struct ingest_pool
+{
+    int threads; // Including the caller of ingest_run(), whose range is 0
+    pthread_t *ids;
+    struct ingest_range *ranges;
+
+    pthread_mutex_t lock;
+    pthread_cond_t started, finished;
+    unsigned long batch; // Counts batches, so a thread knows a new one from the last
+    int running;         // Pool threads still working on the batch
+    bool stopping;
+    void (*job)(void *ctx, size_t i);
+    void *ctx;
+};
+
+struct ingest_thread
+{
+    struct ingest_pool *pool;
+    int self;
+};
+
+// Take the next index from the front of a thread's own range
+static bool take(struct ingest_range *range, size_t *i)
+{
+    bool found;
+
+    pthread_mutex_lock(&range->lock);
+    if ((found = range->next < range->end))
+        *i = range->next++;
+    pthread_mutex_unlock(&range->lock);
+    return found;
+}
+
+// Move the back half of another thread's range, at least one index, to
+// 'self's own, which is empty.  Returns false if every range is empty.
+static bool steal(struct ingest_pool *pool, int self)
+{
+    for (int k = 1; k < pool->threads; k++)
+    {
+        struct ingest_range *victim = &pool->ranges[(self + k) % pool->threads];
+        size_t from, to;
+
+        pthread_mutex_lock(&victim->lock);
+        to = victim->end;
+        from = victim->next + (to - victim->next) / 2;
+        victim->end = from;
+        pthread_mutex_unlock(&victim->lock);
+        if (from == to)
+            continue;
+
+        pthread_mutex_lock(&pool->ranges[self].lock);
+        pool->ranges[self].next = from;
+        pool->ranges[self].end = to;
+        pthread_mutex_unlock(&pool->ranges[self].lock);
+        return true;
+    }
+    return false;
+}
+
+static void work(struct ingest_pool *pool, int self)
+{
+    size_t i;
+
+    do
+    {
+        while (take(&pool->ranges[self], &i))
+            pool->job(pool->ctx, i);
+    } while (steal(pool, self));
+}
+
+static void *run_ingest_thread(void *arg)
+{
+    struct ingest_thread *thread = arg;
+    struct ingest_pool *pool = thread->pool;
+    int self = thread->self;
+    unsigned long seen = 0;
+
+    free(thread);
+    while (1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->batch == seen && !pool->stopping)
+            pthread_cond_wait(&pool->started, &pool->lock);
+        if (pool->stopping)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        seen = pool->batch;
+        pthread_mutex_unlock(&pool->lock);
+
+        work(pool, self);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0)
+            pthread_cond_signal(&pool->finished);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+struct ingest_pool *ingest_start(int threads)
+{
+    struct ingest_pool *pool = calloc(1, sizeof(*pool));
+
+    if (pool == NULL)
+        return NULL;
+    pool->threads = threads > 1 ? threads : 1;
+    pool->ids = calloc(pool->threads, sizeof(*pool->ids));
+    pool->ranges = aligned_alloc(64, pool->threads * sizeof(*pool->ranges));
+    if (pool->ids == NULL || pool->ranges == NULL)
+    {
+        free(pool->ids);
+        free(pool->ranges);
+        free(pool);
+        return NULL;
+    }
+    for (int t = 0; t < pool->threads; t++)
+    {
+        pthread_mutex_init(&pool->ranges[t].lock, NULL);
+        pool->ranges[t].next = pool->ranges[t].end = 0;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->started, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+
+    for (int t = 1; t < pool->threads; t++)
+    {
+        struct ingest_thread *thread = malloc(sizeof(*thread));
+
+        if (thread != NULL)
+            *thread = (struct ingest_thread){pool, t};
+        if (thread == NULL || pthread_create(&pool->ids[t], NULL, run_ingest_thread, thread) != 0)
+        {
+            free(thread);
+            pool->threads = t;
+            ingest_stop(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+int ingest_threads(const struct ingest_pool *pool)
+{
+    return pool != NULL ? pool->threads : 1;
+}
+
+void ingest_run(struct ingest_pool *pool, size_t count, void (*job)(void *ctx, size_t i), void *ctx)
+{
+    if (pool == NULL || pool->threads == 1 || count < 2)
+    {
+        for (size_t i = 0; i < count; i++)
+            job(ctx, i);
+        return;
+    }
+
+    // Every thread is waiting, so the ranges can be set without their locks
+    for (int t = 0; t < pool->threads; t++)
+    {
+        pool->ranges[t].next = count * t / pool->threads;
+        pool->ranges[t].end = count * (t + 1) / pool->threads;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->ctx = ctx;
+    pool->running = pool->threads - 1;
+    pool->batch++;
+    pthread_cond_broadcast(&pool->started);
+    pthread_mutex_unlock(&pool->lock);
+
+    work(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0)
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void ingest_stop(struct ingest_pool *pool)
+{
+    if (pool == NULL)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->started);
+    pthread_mutex_unlock(&pool->lock);
+    for (int t = 1; t < pool->threads; t++)
+        pthread_join(pool->ids[t], NULL);
+
+    for (int t = 0; t < pool->threads; t++)
+        pthread_mutex_destroy(&pool->ranges[t].lock);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->started);
+    pthread_cond_destroy(&pool->finished);
+    free(pool->ids);
+    free(pool->ranges);
+    free(pool);
+}
@@ -0,0 +1,43 @@
+/******************************************************************************
+
+PROGRAM:  ingest.h
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: The thread pool that reads new files into the catalog.
+
+          When a batch of files arrives, or the whole directory is read, each
+          file has to be stat'ed and every one of its MPEG frames walked (see
+          id3.h), which is mostly waiting for the disk and takes from next to
+          nothing for a short file to seconds for a long one.  The pool
+          spreads the files over its threads and keeps them all busy however
+          the work is distributed: each thread starts with an equal share of
+          the batch, takes its files one at a time from the front, and once
+          it runs out steals the back half of what another thread has left.
+
+          The thread that hands a batch to the pool works on it too and
+          returns when every file has been dealt with, so a pool of one
+          thread has no threads of its own and simply runs the batch.
+
+******************************************************************************/
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <stddef.h>
+
+struct ingest_pool;
+
+// Start a pool of 'threads' threads, counting the caller of ingest_run().
+// Returns NULL if the threads can't be started.
+struct ingest_pool *ingest_start(int threads);
+
+// Threads a batch is spread over, 1 for a NULL pool
+int ingest_threads(const struct ingest_pool *pool);
+
+// Call job(ctx, i) for every i below 'count', on the pool's threads and
+// the caller's, and return once every call has.  Only one batch runs at a
+// time.  With a NULL pool the caller makes every call itself.
+void ingest_run(struct ingest_pool *pool, size_t count, void (*job)(void *ctx, size_t i), void *ctx);
+
+// Stop the pool's threads and free it
+void ingest_stop(struct ingest_pool *pool);
+
+#endif
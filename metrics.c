@@ -0,0 +1,302 @@
+/******************************************************************************
+
+PROGRAM:  metrics.c
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: Server metrics, see metrics.h.
+
+          The threads' metrics are kept on a list that only grows, under a
+          lock that is only taken to add to it or read them all, never to
+          count.  The HTTP listener answers one scrape at a time, which is
+          all Prometheus ever makes.
+
+******************************************************************************/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "metrics.h"
+
+// Longest a scraper may take to send its request
+#define SCRAPE_TIMEOUT 2
+
+static const uint64_t bounds[METRICS_BUCKETS - 1] = METRICS_BOUNDS;
+
+// How each counter is exported: its family, its labels within the family
+// if it has any, and the family's help and type
+static const struct
+{
+    const char *family;
+    const char *labels;
+    const char *help;
+    const char *type;
+} counters[METRIC_COUNT] = {
+    [METRIC_ACCEPTS] = {"ssl_server_accepts_total", NULL, "TCP connections accepted.", "counter"},
+    [METRIC_HANDSHAKES_FULL] = {"ssl_server_handshakes_total", "mode=\"full\"", "TLS handshakes completed.",
+                                "counter"},
+    [METRIC_HANDSHAKES_RESUMED] = {"ssl_server_handshakes_total", "mode=\"resumed\"", NULL, NULL},
+    [METRIC_HANDSHAKE_FAILURES] = {"ssl_server_handshake_failures_total", NULL, "TLS handshakes that failed.",
+                                   "counter"},
+    [METRIC_LOGINS_OK] = {"ssl_server_logins_total", "result=\"ok\"", "Logins by password or token.", "counter"},
+    [METRIC_LOGINS_REJECTED] = {"ssl_server_logins_total", "result=\"rejected\"", NULL, NULL},
+    [METRIC_LOGINS_BUSY] = {"ssl_server_logins_total", "result=\"busy\"", NULL, NULL},
+    [METRIC_REQUESTS_LS] = {"ssl_server_requests_total", "op=\"ls\"", "Requests taken from logged in clients.",
+                            "counter"},
+    [METRIC_REQUESTS_GETFILE] = {"ssl_server_requests_total", "op=\"getfile\"", NULL, NULL},
+    [METRIC_REQUESTS_META] = {"ssl_server_requests_total", "op=\"meta\"", NULL, NULL},
+    [METRIC_REQUESTS_SEARCH] = {"ssl_server_requests_total", "op=\"search\"", NULL, NULL},
+    [METRIC_REQUESTS_TUNE] = {"ssl_server_requests_total", "op=\"tune\"", NULL, NULL},
+    [METRIC_REQUESTS_MANIFEST] = {"ssl_server_requests_total", "op=\"manifest\"", NULL, NULL},
+    [METRIC_REQUESTS_SEGMENT] = {"ssl_server_requests_total", "op=\"segment\"", NULL, NULL},
+    [METRIC_REQUESTS_PREVIEW] = {"ssl_server_requests_total", "op=\"preview\"", NULL, NULL},
+    [METRIC_REQUESTS_STATS] = {"ssl_server_requests_total", "op=\"stats\"", NULL, NULL},
+    [METRIC_REQUESTS_INVALID] = {"ssl_server_requests_total", "op=\"invalid\"", NULL, NULL},
+    [METRIC_BYTES_SENT] = {"ssl_server_sent_bytes_total", NULL, "Bytes of replies and files sent, before TLS.",
+                           "counter"},
+    [METRIC_TRANSFERS_SENDFILE] = {"ssl_server_transfers_total", "path=\"sendfile\"",
+                                   "Files and ranges sent to the end, by kernel TLS or from userspace.", "counter"},
+    [METRIC_TRANSFERS_USERSPACE] = {"ssl_server_transfers_total", "path=\"userspace\"", NULL, NULL},
+    [METRIC_THROTTLED] = {"ssl_server_throttled_total", NULL, "Times file data waited for a rate limit.", "counter"},
+    [METRIC_SESSIONS] = {"ssl_server_sessions", NULL, "Sessions open.", "gauge"},
+};
+
+static const struct
+{
+    const char *family;
+    const char *labels;
+    const char *help;
+} histograms[HIST_COUNT] = {
+    [HIST_HANDSHAKE] = {"ssl_server_handshake_seconds", NULL, "From accepting a connection to its TLS handshake."},
+    [HIST_LOGIN] = {"ssl_server_login_seconds", NULL, "Password checks, queueing included."},
+    [HIST_LS] = {"ssl_server_request_seconds", "op=\"ls\"", "Streamed requests, from being taken until they end."},
+    [HIST_SEARCH] = {"ssl_server_request_seconds", "op=\"search\"", NULL},
+    [HIST_TRANSFER] = {"ssl_server_request_seconds", "op=\"transfer\"", NULL},
+};
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics *registry;
+static size_t (*collector)(char *buffer, size_t size);
+
+void metrics_observe(struct metrics *m, enum histogram histogram, uint64_t since)
+{
+    struct histogram_counts *h = &m->histograms[histogram];
+    uint64_t now = metrics_now(), us = now > since ? now - since : 0;
+    int bucket = 0;
+
+    while (bucket < METRICS_BUCKETS - 1 && us > bounds[bucket])
+        bucket++;
+    atomic_store_explicit(&h->buckets[bucket], atomic_load_explicit(&h->buckets[bucket], memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_store_explicit(&h->sum, atomic_load_explicit(&h->sum, memory_order_relaxed) + us, memory_order_relaxed);
+}
+
+void metrics_register(struct metrics *m)
+{
+    pthread_mutex_lock(&registry_lock);
+    m->next = registry;
+    registry = m;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+uint64_t metrics_total(enum metric metric)
+{
+    uint64_t total = 0;
+
+    pthread_mutex_lock(&registry_lock);
+    for (struct metrics *m = registry; m != NULL; m = m->next)
+        total += atomic_load_explicit(&m->counters[metric], memory_order_relaxed);
+    pthread_mutex_unlock(&registry_lock);
+    return total;
+}
+
+// Add to the text, as much as fits
+static void append(char *buffer, size_t size, size_t *len, const char *format, ...)
+{
+    va_list args;
+    int n;
+
+    if (*len + 1 >= size)
+        return;
+    va_start(args, format);
+    n = vsnprintf(buffer + *len, size - *len, format, args);
+    va_end(args);
+    if (n > 0)
+        *len += (size_t)n < size - *len ? (size_t)n : size - *len - 1;
+}
+
+void metrics_collect(size_t (*format)(char *buffer, size_t size))
+{
+    collector = format;
+}
+
+/******************************************************************************
+
+Add up every thread's metrics and write them out.  A family's HELP and TYPE
+come before its first series.  Histogram buckets are cumulative, as the
+format wants, with their bounds in seconds.
+
+******************************************************************************/
+size_t metrics_format(char *buffer, size_t size)
+{
+    uint64_t totals[METRIC_COUNT] = {0};
+    uint64_t buckets[HIST_COUNT][METRICS_BUCKETS] = {{0}}, sums[HIST_COUNT] = {0};
+    size_t len = 0;
+
+    if (size > METRICS_TEXT_MAX)
+        size = METRICS_TEXT_MAX;
+    pthread_mutex_lock(&registry_lock);
+    for (struct metrics *m = registry; m != NULL; m = m->next)
+    {
+        for (int i = 0; i < METRIC_COUNT; i++)
+            totals[i] += atomic_load_explicit(&m->counters[i], memory_order_relaxed);
+        for (int i = 0; i < HIST_COUNT; i++)
+        {
+            for (int b = 0; b < METRICS_BUCKETS; b++)
+                buckets[i][b] += atomic_load_explicit(&m->histograms[i].buckets[b], memory_order_relaxed);
+            sums[i] += atomic_load_explicit(&m->histograms[i].sum, memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    buffer[0] = '\0';
+    for (int i = 0; i < METRIC_COUNT; i++)
+    {
+        if (counters[i].help != NULL)
+            append(buffer, size, &len, "# HELP %s %s\n# TYPE %s %s\n", counters[i].family, counters[i].help,
+                   counters[i].family, counters[i].type);
+        if (counters[i].labels != NULL)
+            append(buffer, size, &len, "%s{%s} %llu\n", counters[i].family, counters[i].labels,
+                   (unsigned long long)totals[i]);
+        else
+            append(buffer, size, &len, "%s %llu\n", counters[i].family, (unsigned long long)totals[i]);
+    }
+
+    for (int i = 0; i < HIST_COUNT; i++)
+    {
+        const char *family = histograms[i].family;
+        const char *labels = histograms[i].labels != NULL ? histograms[i].labels : "";
+        const char *comma = histograms[i].labels != NULL ? "," : "";
+        uint64_t count = 0;
+
+        if (histograms[i].help != NULL)
+            append(buffer, size, &len, "# HELP %s %s\n# TYPE %s histogram\n", family, histograms[i].help, family);
+        for (int b = 0; b < METRICS_BUCKETS; b++)
+        {
+            count += buckets[i][b];
+            if (b < METRICS_BUCKETS - 1)
+                append(buffer, size, &len, "%s_bucket{%s%sle=\"%g\"} %llu\n", family, labels, comma,
+                       bounds[b] / 1e6, (unsigned long long)count);
+            else
+                append(buffer, size, &len, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", family, labels, comma,
+                       (unsigned long long)count);
+        }
+        append(buffer, size, &len, "%s_sum%s%s%s %.6f\n", family, *labels ? "{" : "", labels, *labels ? "}" : "",
+               sums[i] / 1e6);
+        append(buffer, size, &len, "%s_count%s%s%s %llu\n", family, *labels ? "{" : "", labels, *labels ? "}" : "",
+               (unsigned long long)count);
+    }
+    if (collector != NULL && len + 1 < size)
+        len += collector(buffer + len, size - len);
+    return len;
+}
+
+/******************************************************************************
+
+The HTTP listener.  Whatever is asked for, GET /metrics or anything else,
+the answer is the metrics, and the connection is closed after it.  It only
+listens on the loopback interface: the metrics are not for everyone who can
+reach the server, and there is no TLS or login in front of them.
+
+******************************************************************************/
+static bool write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void *serve_metrics(void *arg)
+{
+    static char text[METRICS_TEXT_MAX];
+    int listenfd = (int)(intptr_t)arg;
+
+    while (true)
+    {
+        struct timeval timeout = {.tv_sec = SCRAPE_TIMEOUT};
+        char request[4096], header[256];
+        size_t got = 0, len;
+        int client = accept(listenfd, NULL, NULL);
+
+        if (client < 0)
+        {
+            if (errno != EINTR && errno != ECONNABORTED)
+                fprintf(stderr, "Server: Metrics listener: %s\n", strerror(errno));
+            continue;
+        }
+
+        // Read up to the end of the request's headers, which are ignored
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        while (got < sizeof(request) - 1)
+        {
+            ssize_t n = read(client, request + got, sizeof(request) - 1 - got);
+
+            if (n <= 0)
+                break;
+            got += n;
+            request[got] = '\0';
+            if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+                break;
+        }
+
+        len = metrics_format(text, sizeof(text));
+        snprintf(header, sizeof(header),
+                 "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n"
+                 "Connection: close\r\n\r\n",
+                 len);
+        if (write_all(client, header, strlen(header)))
+            write_all(client, text, len);
+        close(client);
+    }
+    return NULL;
+}
+
+int metrics_serve(unsigned int port)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    pthread_t thread;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0 ||
+        pthread_create(&thread, NULL, serve_metrics, (void *)(intptr_t)fd) != 0)
+    {
+        int error = errno;
+
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    pthread_detach(thread);
+    fprintf(stdout, "Server: Metrics on http://127.0.0.1:%u/metrics\n", port);
+    return 0;
+}
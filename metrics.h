@@ -0,0 +1,130 @@
+/******************************************************************************
+
+PROGRAM:  metrics.h
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: Counters and latency histograms of what the server has been doing,
+          for capacity planning.
+
+          Every worker thread counts into a struct metrics of its own, which
+          nothing else ever writes, so counting is a plain load, add and
+          store: no lock and no locked instruction.  The counters are atomic
+          only so that a reader sees whole values.  Reading the metrics adds
+          up every worker's, and they are read out in the Prometheus text
+          format, both by the stats request (see protocol.h) and by a plain
+          HTTP listener on localhost that a Prometheus server can scrape.
+
+          A histogram counts durations into fixed buckets, from a
+          millisecond to half a minute, and keeps their sum.
+
+******************************************************************************/
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+enum metric
+{
+    METRIC_ACCEPTS,             // TCP connections accepted
+    METRIC_HANDSHAKES_FULL,     // TLS handshakes completed
+    METRIC_HANDSHAKES_RESUMED,  // of which resumed a session
+    METRIC_HANDSHAKE_FAILURES,  // TLS handshakes that failed
+    METRIC_LOGINS_OK,           // by password or token
+    METRIC_LOGINS_REJECTED,     // wrong username, password or token
+    METRIC_LOGINS_BUSY,         // refused, too many logins in progress
+    METRIC_REQUESTS_LS,         // Requests taken, by opcode
+    METRIC_REQUESTS_GETFILE,
+    METRIC_REQUESTS_META,
+    METRIC_REQUESTS_SEARCH,
+    METRIC_REQUESTS_TUNE,
+    METRIC_REQUESTS_MANIFEST,
+    METRIC_REQUESTS_SEGMENT,
+    METRIC_REQUESTS_PREVIEW,
+    METRIC_REQUESTS_STATS,
+    METRIC_REQUESTS_INVALID,
+    METRIC_BYTES_SENT,          // Plaintext bytes sent, of every reply and file
+    METRIC_TRANSFERS_SENDFILE,  // Files sent in full, by kernel TLS
+    METRIC_TRANSFERS_USERSPACE, // or through a buffer
+    METRIC_THROTTLED,           // Times file data waited for a rate limit
+    METRIC_SESSIONS,            // Sessions open now, a gauge
+    METRIC_COUNT
+};
+
+enum histogram
+{
+    HIST_HANDSHAKE, // From accepting the connection to the end of the TLS handshake
+    HIST_LOGIN,     // Password checks, from the PASS to the answer
+    HIST_LS,        // Streamed requests, from being taken until they end
+    HIST_SEARCH,
+    HIST_TRANSFER,  // getfile, segment and preview
+    HIST_COUNT
+};
+
+// Upper bounds of the buckets in microseconds, the last one being infinite
+#define METRICS_BUCKETS 15
+#define METRICS_BOUNDS {1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, \
+                        2500000, 5000000, 10000000, 30000000}
+
+struct histogram_counts
+{
+    atomic_ullong buckets[METRICS_BUCKETS];
+    atomic_ullong sum; // Microseconds
+};
+
+struct metrics
+{
+    atomic_ullong counters[METRIC_COUNT];
+    struct histogram_counts histograms[HIST_COUNT];
+    struct metrics *next; // Every registered one, see metrics_register()
+};
+
+// The largest the text of the metrics gets
+#define METRICS_TEXT_MAX (12 * 1024)
+
+// Monotonic time in microseconds, for timing what goes in the histograms
+static inline uint64_t metrics_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Only the thread that owns 'm' may call these
+static inline void metrics_add(struct metrics *m, enum metric metric, uint64_t n)
+{
+    atomic_ullong *c = &m->counters[metric];
+
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void metrics_set(struct metrics *m, enum metric metric, uint64_t value)
+{
+    atomic_store_explicit(&m->counters[metric], value, memory_order_relaxed);
+}
+
+// Count a duration that started at 'since' (from metrics_now())
+void metrics_observe(struct metrics *m, enum histogram histogram, uint64_t since);
+
+// Add a thread's metrics to those that are read out.  Never removed.
+void metrics_register(struct metrics *m);
+
+// Every registered thread's metrics added up
+uint64_t metrics_total(enum metric metric);
+
+// Have metrics_format() end with what 'format' writes, metrics that are kept
+// elsewhere.  It gets the room that is left and returns what it used, at most
+// size - 1.  Set once, before metrics are read.
+void metrics_collect(size_t (*format)(char *buffer, size_t size));
+
+// Write the metrics in the Prometheus text format into 'buffer' and return
+// their length, at most size - 1 and METRICS_TEXT_MAX
+size_t metrics_format(char *buffer, size_t size);
+
+// Answer HTTP requests for the metrics on localhost:'port' from a thread of
+// its own.  Returns -1 if the port can't be listened on.
+int metrics_serve(unsigned int port);
+
+#endif
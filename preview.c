@@ -0,0 +1,209 @@
+/******************************************************************************
+
+PROGRAM:  preview.c
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: The cache of preview clips, see preview.h.
+
+          Laid out like the file cache (see filecache.c): clips are found in
+          a hash table and kept in a list ordered by when they were last
+          asked for, both under one lock that is only held to look a clip up
+          or to add one.  A clip is cut outside it, by the session that
+          asked first.
+
+******************************************************************************/
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "preview.h"
+
+#define PREVIEW_BUCKETS 1024
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct preview *buckets[PREVIEW_BUCKETS];
+static struct preview *lru_head, *lru_tail; // Most and least recently used
+static size_t cache_capacity;
+static size_t cache_bytes;
+static size_t cache_clips;
+
+static atomic_ulong hits, misses, evictions;
+
+static unsigned int hash_clip(const char *path, uint32_t start, uint32_t length)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*path != '\0')
+        hash = (hash ^ (unsigned char)*path++) * 16777619u;
+    hash = (hash ^ start) * 16777619u;
+    hash = (hash ^ length) * 16777619u;
+    return hash % PREVIEW_BUCKETS;
+}
+
+void preview_put(struct preview *clip)
+{
+    if (atomic_fetch_sub(&clip->refs, 1) != 1)
+        return;
+    free(clip->data);
+    free(clip->path);
+    free(clip);
+}
+
+// The clip of the same part of the same file, whichever version of it
+static struct preview *find_clip(const char *path, uint32_t start, uint32_t length)
+{
+    struct preview *clip = buckets[hash_clip(path, start, length)];
+
+    while (clip != NULL && (clip->start != start || clip->length != length || strcmp(clip->path, path) != 0))
+        clip = clip->hash_next;
+    return clip;
+}
+
+static void lru_unlink(struct preview *clip)
+{
+    if (clip->lru_prev != NULL)
+        clip->lru_prev->lru_next = clip->lru_next;
+    else
+        lru_head = clip->lru_next;
+    if (clip->lru_next != NULL)
+        clip->lru_next->lru_prev = clip->lru_prev;
+    else
+        lru_tail = clip->lru_prev;
+    clip->lru_prev = clip->lru_next = NULL;
+}
+
+static void lru_push(struct preview *clip)
+{
+    clip->lru_prev = NULL;
+    clip->lru_next = lru_head;
+    if (lru_head != NULL)
+        lru_head->lru_prev = clip;
+    else
+        lru_tail = clip;
+    lru_head = clip;
+}
+
+// Take a clip out of the cache.  Sessions still sending it keep it.
+static void remove_clip(struct preview *clip)
+{
+    struct preview **link = &buckets[hash_clip(clip->path, clip->start, clip->length)];
+
+    while (*link != clip)
+        link = &(*link)->hash_next;
+    *link = clip->hash_next;
+    lru_unlink(clip);
+    clip->cached = false;
+    cache_bytes -= clip->size;
+    cache_clips--;
+    preview_put(clip);
+}
+
+struct preview *preview_get(const char *path, uint64_t filesize, int64_t mtime, uint32_t start, uint32_t length)
+{
+    struct preview *clip;
+
+    if (cache_capacity == 0)
+        return NULL;
+    pthread_mutex_lock(&cache_lock);
+    clip = find_clip(path, start, length);
+    if (clip != NULL && clip->filesize == filesize && clip->mtime == mtime)
+    {
+        lru_unlink(clip);
+        lru_push(clip);
+        atomic_fetch_add(&clip->refs, 1);
+        pthread_mutex_unlock(&cache_lock);
+        atomic_fetch_add(&hits, 1);
+        return clip;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    atomic_fetch_add(&misses, 1);
+    return NULL;
+}
+
+struct preview *preview_new(const char *path, uint64_t filesize, int64_t mtime, uint32_t start, uint32_t length,
+                            size_t size)
+{
+    struct preview *clip = calloc(1, sizeof(*clip));
+
+    if (clip == NULL || (clip->path = strdup(path)) == NULL || (clip->data = malloc(size > 0 ? size : 1)) == NULL)
+    {
+        if (clip != NULL)
+            free(clip->path);
+        free(clip);
+        return NULL;
+    }
+    clip->size = size;
+    clip->filesize = filesize;
+    clip->mtime = mtime;
+    clip->start = start;
+    clip->length = length;
+    atomic_init(&clip->refs, 1);
+    return clip;
+}
+
+size_t preview_copy(const struct preview *clip, off_t offset, void *dst, size_t len)
+{
+    if (offset < 0 || (size_t)offset >= clip->size)
+        return 0;
+    if (len > clip->size - (size_t)offset)
+        len = clip->size - (size_t)offset;
+    memcpy(dst, clip->data + offset, len);
+    return len;
+}
+
+/******************************************************************************
+
+Add a clip, replacing the one of an older version of the file if there is
+one, then drop the least recently used clips until the cache fits.  If two
+sessions cut the same clip at once, the second finds the first one's there
+and leaves it.
+
+******************************************************************************/
+void preview_add(struct preview *clip)
+{
+    struct preview *old;
+    unsigned int bucket;
+
+    if (cache_capacity == 0 || clip->size > cache_capacity)
+        return;
+    pthread_mutex_lock(&cache_lock);
+    if ((old = find_clip(clip->path, clip->start, clip->length)) != NULL)
+    {
+        if (old->filesize == clip->filesize && old->mtime == clip->mtime)
+        {
+            pthread_mutex_unlock(&cache_lock);
+            return;
+        }
+        remove_clip(old);
+    }
+
+    bucket = hash_clip(clip->path, clip->start, clip->length);
+    clip->hash_next = buckets[bucket];
+    buckets[bucket] = clip;
+    lru_push(clip);
+    clip->cached = true;
+    atomic_fetch_add(&clip->refs, 1);
+    cache_bytes += clip->size;
+    cache_clips++;
+    while (cache_bytes > cache_capacity && lru_tail != clip)
+    {
+        remove_clip(lru_tail);
+        atomic_fetch_add(&evictions, 1);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void preview_init(size_t capacity)
+{
+    cache_capacity = capacity;
+}
+
+void preview_get_stats(struct preview_stats *stats)
+{
+    stats->hits = atomic_load(&hits);
+    stats->misses = atomic_load(&misses);
+    stats->evictions = atomic_load(&evictions);
+    pthread_mutex_lock(&cache_lock);
+    stats->clips = cache_clips;
+    stats->bytes = cache_bytes;
+    pthread_mutex_unlock(&cache_lock);
+}
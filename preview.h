@@ -0,0 +1,84 @@
+/******************************************************************************
+
+PROGRAM:  preview.h
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: Preview clips of MP3 files, and a cache of recently sent ones
+          shared by every session.
+
+          A clip is a few seconds of a file's audio, cut on its frames by the
+          file's seek table (see seektable.h), behind a small ID3v2 tag of
+          its own (see id3.h).  Nothing is decoded: the frames are copied as
+          they are, so a clip plays like any MP3 file and costs the server a
+          read of just that part of the track.
+
+          Clips are kept once made.  A clip is known by the file it was cut
+          from, that file's size and modification time, and the time and
+          length asked for, so a clip of a file that has since changed is
+          never found again and ages out.  Like the file cache, the cache
+          keeps the most recently used clips up to its memory limit, and a
+          session holds a reference to the clip it is sending.
+
+******************************************************************************/
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// A clip's length when none is asked for, and the longest there is
+#define PREVIEW_DEFAULT_MS 30000
+#define PREVIEW_MAX_MS 60000
+
+struct preview
+{
+    unsigned char *data;
+    size_t size;
+
+    // What it is a clip of
+    char *path;
+    uint64_t filesize;
+    int64_t mtime;   // Nanoseconds since the epoch
+    uint32_t start;  // Milliseconds into the audio
+    uint32_t length; // Milliseconds asked for
+
+    atomic_int refs; // The cache's own reference and one per sender
+    bool cached;     // In the cache
+    struct preview *hash_next;
+    struct preview *lru_prev, *lru_next;
+};
+
+struct preview_stats
+{
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    size_t clips;
+    size_t bytes;
+};
+
+// Set the memory limit in bytes, 0 disables the cache
+void preview_init(size_t capacity);
+
+// Get a reference to the clip 'length' ms from 'start' of the file 'path',
+// as it is now, 'filesize' bytes modified at 'mtime', or NULL if there is
+// none cached
+struct preview *preview_get(const char *path, uint64_t filesize, int64_t mtime, uint32_t start, uint32_t length);
+
+// Make an empty clip of 'size' bytes to cut into, or return NULL
+struct preview *preview_new(const char *path, uint64_t filesize, int64_t mtime, uint32_t start, uint32_t length,
+                            size_t size);
+
+// Offer a clip that has been cut to the cache.  The caller keeps its reference.
+void preview_add(struct preview *clip);
+
+void preview_put(struct preview *clip);
+
+// Copy up to 'len' bytes of a clip from 'offset', returning how many
+size_t preview_copy(const struct preview *clip, off_t offset, void *dst, size_t len);
+
+void preview_get_stats(struct preview_stats *stats);
+
+#endif
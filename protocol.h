@@ -0,0 +1,302 @@
+/******************************************************************************
+
+PROGRAM:  protocol.h
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: The binary protocol spoken between ssl-client and ssl-server.
+
+          Right after the TLS handshake the client sends two bytes,
+          PROTO_MAGIC and the highest protocol version it speaks, and the
+          server answers with PROTO_MAGIC and the version it will use.  A
+          client that starts with anything else (the original clients start
+          with "user ...") gets the legacy text protocol instead, where every
+          message is a NUL terminated string and replies end with "EOF".
+
+          After negotiation every message in either direction is a frame: a
+          FRAME_HEADER_SIZE byte header followed by 'length' bytes of payload.
+          All integers are big-endian.
+
+              0       1       2       3       4                8               12
+              +-------+-------+-------+-------+----------------+----------------+
+              |opcode | flags |   reserved    |   request id   | payload length |
+              +-------+-------+-------+-------+----------------+----------------+
+
+          Every reply carries the request id of the request it answers.  A
+          file is announced by FILE_BEGIN with its size, followed by FILE_DATA
+          frames holding the bytes and a closing FILE_END, so the receiver
+          always knows how much data to expect and never has to look inside
+          it for a terminator.
+
+          Version 2 adds byte ranges.  A getfile request carries the offset
+          and length it wants and, optionally, the ETag of the copy the
+          client already has part of.  The ETag is the file's mtime and size,
+          so it changes whenever the file does.  Like HTTP's If-Range, the
+          range is only honoured if the ETag still matches (or none was
+          given); otherwise the whole file is sent, and FILE_BEGIN always
+          says which part of which version of the file follows.
+
+          Version 3 adds session tokens.  The OK answering a successful PASS
+          carries a token the client can present with TOKEN instead of
+          USER/PASS on later connections, which saves the server hashing the
+          password again.  A token is only good on the server that issued it
+          and only until it restarts; a rejected one is answered with an
+          ERROR and the client logs in with its password instead.
+
+          Version 4 adds track metadata, read by the server from the files'
+          ID3 tags.  META asks for one file's, and SEARCH for every file
+          whose title, artist or album contains some text, or whose year is
+          the one given.  Both are answered with TRACKS frames, each packed
+          with track records; a search ends with TRACKS_END.
+
+          Version 5 adds ranked searches.  A SEARCH in SEARCH_ANY looks for
+          the words of the query in every file's name and tags at once,
+          tolerating typing mistakes, and answers with at most
+          SEARCH_RANKED_MAX tracks, the best match first.
+
+          Version 6 lets an ls ask for one page of the listing: at most so
+          many entries, sorted by name, size or modification time, either
+          way, and only those whose names start with a prefix or match a
+          glob.  A page that isn't the last ends with a cursor, an opaque
+          token that the next request passes back, along with the same
+          pattern, to carry on where the page stopped, even if the
+          directory has changed in between.
+
+          Version 7 lets a getfile start at a time rather than a byte: an
+          offset with GETFILE_TIME set is a number of milliseconds into an
+          MP3 file's audio, and the range starts at the audio frame nearest
+          it, or at the end of the file if the audio is shorter.  FILE_BEGIN
+          then says which byte that is.  A file without MPEG audio is
+          answered with ERR_NO_AUDIO.
+
+          Version 8 adds radio channels.  TUNE names a channel, which the
+          server plays in real time, one track after another, to everyone
+          tuned in to it.  After the OK, RADIO_DATA frames carry the MPEG
+          audio as it is played, starting a couple of seconds back, for as
+          long as the connection lasts; the session takes no more requests.
+          A listener that can't keep up either skips ahead to what is being
+          played now or is disconnected, however the server is configured.
+          An unknown channel is answered with ERR_NO_CHANNEL.
+
+          Version 9 adds segments.  The server cuts an MP3 file into pieces
+          of about SEGMENT_MS of audio each, on frame boundaries, that play
+          on their own and together make up the whole file.  MANIFEST asks
+          for a file's list, answered with SEGMENTS frames packed with
+          segment records, in order, and a SEGMENTS_END with the ETag of the
+          file they were cut from.  SEGMENT then fetches one by the SHA-256
+          of its bytes, answered like a getfile of its range, so the same
+          segment always has the same name and any copy of it can be checked
+          against that.  A hash that isn't one of the file's segments, say
+          because the file has changed since the manifest, is answered with
+          ERR_NO_SEGMENT.
+
+          Version 10 adds previews.  PREVIEW asks for a clip of an MP3 file,
+          by default its first PREVIEW_DEFAULT_MS (see preview.h), cut on
+          frame boundaries behind an ID3v2 tag of its own with the track's
+          tags and the clip's length.  It is answered like a getfile of a
+          file that is just the clip, with the ETag of the file it was cut
+          from, or with ERR_NO_AUDIO.
+
+          Version 11 adds STATS, which asks for the server's counters and
+          latency histograms (see metrics.h), answered with one STATS_DATA
+          frame holding them in the Prometheus text format.
+
+******************************************************************************/
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROTO_MAGIC 0xB5
+#define PROTO_VERSION 11
+
+#define FRAME_HEADER_SIZE 12
+
+// The largest payload a receiver has to accept in a single frame
+#define FRAME_MAX_PAYLOAD (1024 * 1024)
+
+// Requests, sent by the client
+#define OP_USER 0x01     // payload: username
+#define OP_PASS 0x02     // payload: password, answered with OK (a token in v3) or ERROR
+#define OP_LS 0x03       // payload: none or see LS_REQUEST_SIZE, answered with LS_DATA frames and LS_END
+#define OP_GETFILE 0x04  // payload: see GETFILE_HEADER_SIZE, answered with FILE_BEGIN or ERROR
+#define OP_EXIT 0x05     // no payload, no reply
+#define OP_TOKEN 0x06    // payload: a token, answered with OK (a renewed token) or ERROR
+#define OP_META 0x07     // payload: file name, answered with one TRACKS frame or ERROR
+#define OP_SEARCH 0x08   // payload: u8 field, query, answered with TRACKS frames and TRACKS_END
+#define OP_TUNE 0x09     // payload: channel name, answered with OK and RADIO_DATA frames, or ERROR
+#define OP_MANIFEST 0x0A // payload: file name, answered with SEGMENTS frames and SEGMENTS_END, or ERROR
+#define OP_SEGMENT 0x0B  // payload: segment hash, file name, answered with FILE_BEGIN or ERROR
+#define OP_PREVIEW 0x0C  // payload: see PREVIEW_HEADER_SIZE, answered with FILE_BEGIN or ERROR
+#define OP_STATS 0x0D    // no payload, answered with STATS_DATA
+
+// Replies, sent by the server
+#define OP_OK 0x80           // no payload, except in answer to PASS and TOKEN
+#define OP_ERROR 0x81        // payload: u8 error kind, u32 error code
+#define OP_LS_DATA 0x82      // payload: one or more directory entries, see below
+#define OP_LS_END 0x83       // payload: the cursor of the next page, if any
+#define OP_FILE_BEGIN 0x84   // payload: see FILE_BEGIN_SIZE
+#define OP_FILE_DATA 0x85    // payload: file contents
+#define OP_FILE_END 0x86     // no payload
+#define OP_TRACKS 0x87       // payload: one or more track records, see below
+#define OP_TRACKS_END 0x88   // no payload
+#define OP_RADIO_DATA 0x89   // payload: MPEG audio, not necessarily whole frames
+#define OP_SEGMENTS 0x8A     // payload: one or more segment records, see below
+#define OP_SEGMENTS_END 0x8B // payload: the ETag of the file the segments were cut from
+#define OP_STATS_DATA 0x8C   // payload: metrics as text
+
+// A file's version: u64 mtime in nanoseconds, u64 size.  All zero means none.
+#define ETAG_SIZE 16
+
+// A getfile payload is u64 offset, u64 length (0 for the rest of the file),
+// the ETag the range must match, then the file name.  In version 1 it is
+// just the name.
+#define GETFILE_HEADER_SIZE (16 + ETAG_SIZE)
+
+// An offset with this bit set is a time in milliseconds, since version 7
+#define GETFILE_TIME (1ULL << 63)
+
+// A FILE_BEGIN payload is u64 file size, u64 offset and u64 length of the
+// data that follows, and the file's ETag.  In version 1 it is just the size.
+#define FILE_BEGIN_SIZE (24 + ETAG_SIZE)
+
+// A session token is u64 expiry time, u8 username length, the username and
+// an HMAC-SHA256 of all that
+#define TOKEN_HEADER_SIZE 9
+#define TOKEN_MAC_SIZE 32
+#define TOKEN_MAX_SIZE (TOKEN_HEADER_SIZE + 255 + TOKEN_MAC_SIZE)
+
+// Each entry in an LS_DATA payload: u8 type, u64 size, u16 name length, name
+#define LS_ENTRY_FILE 0
+#define LS_ENTRY_DIR 1
+#define LS_ENTRY_HEADER_SIZE 11
+
+// A paged ls payload is u16 page size (0 for no limit), u8 sort key, u8
+// flags, u16 pattern length, the pattern, then the cursor the previous page
+// ended with, if any.  A pattern with any of "*?[" in it is a glob, and
+// anything else a prefix.
+#define LS_REQUEST_SIZE 6
+#define LS_SORT_NAME 0
+#define LS_SORT_SIZE 1
+#define LS_SORT_MTIME 2
+#define LS_REVERSE 0x01
+
+// Longest cursor: a hex digit pair for each byte of a u8 sort key, u8
+// flags, u64 size or modification time and a name
+#define LS_CURSOR_MAX (2 * (10 + 255))
+
+// Fields a search can look in
+#define SEARCH_TITLE 0
+#define SEARCH_ARTIST 1
+#define SEARCH_ALBUM 2
+#define SEARCH_YEAR 3
+#define SEARCH_ANY 4 // Names and tags, ranked, since version 5
+
+// Most tracks a SEARCH_ANY answers with
+#define SEARCH_RANKED_MAX 100
+
+// Longest query a search may carry
+#define SEARCH_QUERY_MAX 64
+
+// Each track record in a TRACKS payload: u32 duration in milliseconds,
+// u16 bitrate in kbit/s, u16 year, u16 name length, u8 title, artist and
+// album lengths, then the name, title, artist and album.  Missing values
+// are 0 or empty.
+#define TRACK_HEADER_SIZE 13
+
+// Audio a segment holds, give or take a fraction of a second
+#define SEGMENT_MS 6000
+
+// Each segment record in a SEGMENTS payload: u64 offset and u64 length in
+// the file, u32 start and u32 duration in milliseconds, and the SHA-256 of
+// its bytes
+#define SEGMENT_HASH_SIZE 32
+#define SEGMENT_RECORD_SIZE (24 + SEGMENT_HASH_SIZE)
+
+// PREVIEW payload: u32 start and u32 length in milliseconds, length 0 for
+// the default, then the file name
+#define PREVIEW_HEADER_SIZE 8
+
+// Kinds of error carried by an ERROR frame
+#define ERR_KIND_RPC 1  // code is one of the ERR_* values below
+#define ERR_KIND_FILE 2 // code is an errno value
+#define ERR_KIND_AUTH 3 // username or password rejected
+
+// Error codes for malformed requests.  The legacy text protocol sends these
+// as "rpcerror <code>".
+#define ERR_TOO_FEW_ARGS 1
+#define ERR_TOO_MANY_ARGS 2
+#define ERR_INVALID_OP 3
+#define ERR_BUSY 4       // too many logins in progress, try again later
+#define ERR_CURSOR 5     // an ls cursor that can't be read
+#define ERR_NO_AUDIO 6   // a getfile by time, manifest or preview of a file that isn't MPEG audio
+#define ERR_NO_CHANNEL 7 // a tune to a channel the server doesn't have
+#define ERR_NO_SEGMENT 8 // a segment hash the file has none of
+
+struct frame_header
+{
+    uint8_t opcode;
+    uint8_t flags;
+    uint32_t request_id;
+    uint32_t length;
+};
+
+static inline void put_u16(unsigned char *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline void put_u32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static inline void put_u64(unsigned char *p, uint64_t v)
+{
+    put_u32(p, v >> 32);
+    put_u32(p + 4, v);
+}
+
+static inline uint16_t get_u16(const unsigned char *p)
+{
+    return (uint16_t)p[0] << 8 | p[1];
+}
+
+static inline uint32_t get_u32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline uint64_t get_u64(const unsigned char *p)
+{
+    return (uint64_t)get_u32(p) << 32 | get_u32(p + 4);
+}
+
+static inline void encode_etag(unsigned char *p, int64_t mtime, uint64_t size)
+{
+    put_u64(p, mtime);
+    put_u64(p + 8, size);
+}
+
+static inline void encode_frame_header(unsigned char *p, uint8_t opcode, uint32_t request_id, uint32_t length)
+{
+    p[0] = opcode;
+    p[1] = 0;
+    p[2] = 0;
+    p[3] = 0;
+    put_u32(p + 4, request_id);
+    put_u32(p + 8, length);
+}
+
+static inline void decode_frame_header(const unsigned char *p, struct frame_header *hdr)
+{
+    hdr->opcode = p[0];
+    hdr->flags = p[1];
+    hdr->request_id = get_u32(p + 4);
+    hdr->length = get_u32(p + 8);
+}
+
+#endif
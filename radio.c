@@ -0,0 +1,328 @@
+/******************************************************************************
+
+PROGRAM:  radio.c
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: Radio channels, see radio.h.
+
+          A channel's audio is one endless stream of bytes, and a position
+          in it is a byte count from the start, which never wraps.  Byte p
+          is kept at ring[p % RADIO_RING_SIZE] until the thread gets to
+          p + RADIO_RING_SIZE.  'head' is how far has been played and
+          'reserved' how far the thread may be writing; marks[] has where
+          each of the last RADIO_MARKS ticks starts, always on a frame.
+
+          The thread sleeps between ticks on CLOCK_MONOTONIC, keeping the
+          audio it has played a tick ahead of the time it has been running.
+          If it falls further behind than RADIO_RESYNC_MS, say on a slow
+          disk, it carries on from where it is rather than rushing to catch
+          up.
+
+******************************************************************************/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "catalog.h"
+#include "id3.h"
+#include "protocol.h"
+#include "radio.h"
+
+#define RADIO_WATCHERS_MAX 64
+
+// Ten seconds of even the highest MPEG bitrate fit, so a listener is
+// normally RADIO_LAG_BLOCKS behind long before the ring has moved on
+#define RADIO_RING_SIZE (1024 * 1024)
+#define RADIO_MARKS 64
+
+#define RADIO_RESYNC_MS 1000
+
+// Bytes of a file read between checks of the clock
+#define RADIO_READ_SIZE (16 * 1024)
+
+_Static_assert(RADIO_MARKS > RADIO_LAG_BLOCKS && RADIO_LAG_BLOCKS > RADIO_PREROLL_BLOCKS,
+               "a listener must fall behind before its tick's mark is reused");
+
+struct radio_channel
+{
+    char name[RADIO_NAME_MAX + 1];
+    char pattern[NAME_MAX + 1];
+    char dirname[PATH_MAX];
+    pthread_t thread;
+
+    unsigned char *ring;
+    _Atomic uint64_t head;     // Played up to here
+    _Atomic uint64_t reserved; // and being written up to here
+    _Atomic uint64_t marks[RADIO_MARKS];
+    _Atomic uint64_t blocks; // Ticks played
+
+    // Only the channel's thread uses these
+    char track[NAME_MAX + 1]; // Playing, or played last
+    uint64_t written;         // Copied into the ring, not yet played
+    uint64_t block;           // Where the tick being copied starts
+    uint64_t pending;         // and how long it plays, in nanoseconds
+    uint64_t clock;           // CLOCK_MONOTONIC time the audio played so far takes us to
+    uint64_t frames;          // Copied from the current track
+};
+
+static struct radio_channel channels[RADIO_CHANNELS_MAX];
+static int nchannels;
+
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static int watchers[RADIO_WATCHERS_MAX];
+static int nwatchers;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int radio_watch(int eventfd)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&watch_lock);
+    if (nwatchers < RADIO_WATCHERS_MAX)
+    {
+        watchers[nwatchers++] = eventfd;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&watch_lock);
+    return ret;
+}
+
+static void wake_watchers(void)
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&watch_lock);
+    for (int i = 0; i < nwatchers; i++)
+    {
+        if (write(watchers[i], &one, sizeof(one)) < 0 && errno != EAGAIN)
+            fprintf(stderr, "Radio: Could not wake a worker: %s\n", strerror(errno));
+    }
+    pthread_mutex_unlock(&watch_lock);
+}
+
+// Play the tick that has been copied, then wait until it is time for the next
+static void publish(struct radio_channel *ch)
+{
+    uint64_t b = atomic_load_explicit(&ch->blocks, memory_order_relaxed);
+    uint64_t now, ahead = RADIO_TICK_MS * 1000000ULL;
+
+    atomic_store_explicit(&ch->marks[b % RADIO_MARKS], ch->block, memory_order_relaxed);
+    atomic_store_explicit(&ch->head, ch->written, memory_order_release);
+    atomic_store_explicit(&ch->blocks, b + 1, memory_order_release);
+    wake_watchers();
+
+    ch->clock += ch->pending;
+    ch->block = ch->written;
+    ch->pending = 0;
+    now = now_ns();
+    if (ch->clock + RADIO_RESYNC_MS * 1000000ULL < now)
+    {
+        fprintf(stderr, "Radio: Channel %s fell %llu ms behind\n", ch->name,
+                (unsigned long long)(now - ch->clock) / 1000000);
+        ch->clock = now;
+    }
+    if (ch->clock > now + ahead)
+    {
+        struct timespec until = {(ch->clock - ahead) / 1000000000, (ch->clock - ahead) % 1000000000};
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+            ;
+    }
+}
+
+// Called for every audio frame of the track being played
+static void add_frame(void *ctx, const struct id3_frame *frame)
+{
+    struct radio_channel *ch = ctx;
+    size_t at = ch->written % RADIO_RING_SIZE;
+    size_t first = frame->length < RADIO_RING_SIZE - at ? frame->length : RADIO_RING_SIZE - at;
+
+    // Say which bytes are about to change before changing them
+    atomic_store_explicit(&ch->reserved, ch->written + frame->length, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(ch->ring + at, frame->data, first);
+    memcpy(ch->ring, frame->data + first, frame->length - first);
+
+    ch->written += frame->length;
+    ch->pending += frame->samples * 1000000000ULL / frame->samplerate;
+    ch->frames++;
+    if (ch->pending >= RADIO_TICK_MS * 1000000ULL)
+        publish(ch);
+}
+
+// Find the track after the one played last, going round to the first after
+// the last, and put its path in 'path'.  Returns false if there is none.
+static bool next_track(struct radio_channel *ch, char *path, size_t size)
+{
+    struct catalog *cat = catalog_acquire();
+    size_t lo = 0, hi = cat->count;
+    bool found = false;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (strcmp(catalog_name(cat, &cat->entries[mid]), ch->track) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (size_t k = 0; k < cat->count && !found; k++)
+    {
+        size_t i = (lo + k) % cat->count;
+        const char *name = catalog_name(cat, &cat->entries[i]);
+
+        if (cat->entries[i].type == LS_ENTRY_FILE && cat->audio[i] != ID3_AUDIO_NONE &&
+            fnmatch(ch->pattern, name, 0) == 0 && strlen(name) < sizeof(ch->track))
+        {
+            strcpy(ch->track, name);
+            snprintf(path, size, "%s/%s", ch->dirname, name);
+            found = true;
+        }
+    }
+    catalog_release(cat);
+    return found;
+}
+
+// Play a whole track.  Returns false if it had no audio after all.
+static bool play(struct radio_channel *ch, const char *path)
+{
+    struct id3_walk *walk;
+    struct id3_info info;
+    struct stat fileInfo;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0 || fstat(fd, &fileInfo) < 0 || (walk = id3_walk_start(fd, fileInfo.st_size, add_frame, ch)) == NULL)
+    {
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    fprintf(stdout, "Radio: Channel %s is playing %s\n", ch->name, ch->track);
+    ch->frames = 0;
+    while (id3_walk_step(walk, RADIO_READ_SIZE))
+        ;
+    id3_walk_end(walk, &info);
+    close(fd);
+    return ch->frames > 0;
+}
+
+static void *run_channel(void *arg)
+{
+    struct radio_channel *ch = arg;
+    char path[PATH_MAX + NAME_MAX + 2];
+
+    ch->clock = now_ns();
+    while (true)
+    {
+        if (next_track(ch, path, sizeof(path)) && play(ch, path))
+            continue;
+
+        // Nothing to play for now.  What has been copied still goes out,
+        // and the channel tries again a little later.
+        if (ch->pending > 0)
+            publish(ch);
+        usleep(RADIO_TICK_MS * 1000);
+    }
+    return NULL;
+}
+
+int radio_start(const char *name, const char *pattern, const char *dirname)
+{
+    struct radio_channel *ch;
+
+    if (nchannels == RADIO_CHANNELS_MAX || strlen(name) > RADIO_NAME_MAX || strlen(pattern) > NAME_MAX ||
+        radio_find(name) != NULL)
+        return -1;
+    ch = &channels[nchannels];
+    if ((ch->ring = malloc(RADIO_RING_SIZE)) == NULL)
+        return -1;
+    strcpy(ch->name, name);
+    strcpy(ch->pattern, pattern);
+    snprintf(ch->dirname, sizeof(ch->dirname), "%s", dirname);
+    fprintf(stdout, "Radio: Channel %s plays %s\n", name, pattern);
+    if (pthread_create(&ch->thread, NULL, run_channel, ch) != 0)
+    {
+        free(ch->ring);
+        return -1;
+    }
+    nchannels++;
+    return 0;
+}
+
+struct radio_channel *radio_find(const char *name)
+{
+    for (int i = 0; i < nchannels; i++)
+        if (strcmp(channels[i].name, name) == 0)
+            return &channels[i];
+    return NULL;
+}
+
+const char *radio_name(const struct radio_channel *ch)
+{
+    return ch->name;
+}
+
+// Where the tick 'back' ticks before the last one played starts
+static uint64_t mark(struct radio_channel *ch, uint64_t back)
+{
+    uint64_t b = atomic_load_explicit(&ch->blocks, memory_order_acquire);
+
+    if (b <= back)
+        return 0;
+    return atomic_load_explicit(&ch->marks[(b - 1 - back) % RADIO_MARKS], memory_order_relaxed);
+}
+
+uint64_t radio_tune(struct radio_channel *ch)
+{
+    return mark(ch, RADIO_PREROLL_BLOCKS - 1);
+}
+
+uint64_t radio_live(struct radio_channel *ch)
+{
+    return mark(ch, 0);
+}
+
+bool radio_behind(struct radio_channel *ch, uint64_t pos)
+{
+    return pos < mark(ch, RADIO_LAG_BLOCKS - 1) ||
+           pos + RADIO_RING_SIZE < atomic_load_explicit(&ch->reserved, memory_order_relaxed);
+}
+
+ssize_t radio_read(struct radio_channel *ch, uint64_t *pos, void *buf, size_t len)
+{
+    uint64_t head = atomic_load_explicit(&ch->head, memory_order_acquire);
+    size_t at = *pos % RADIO_RING_SIZE, first;
+
+    if (radio_behind(ch, *pos))
+        return -1;
+    if (len > head - *pos)
+        len = head - *pos;
+    first = len < RADIO_RING_SIZE - at ? len : RADIO_RING_SIZE - at;
+    memcpy(buf, ch->ring + at, first);
+    memcpy((char *)buf + first, ch->ring, len - first);
+
+    // Had the thread already started overwriting any of it?
+    atomic_thread_fence(memory_order_acquire);
+    if (*pos + RADIO_RING_SIZE < atomic_load_explicit(&ch->reserved, memory_order_relaxed))
+        return -1;
+    *pos += len;
+    return len;
+}
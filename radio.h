@@ -0,0 +1,79 @@
+/******************************************************************************
+
+PROGRAM:  radio.h
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: Radio channels: MP3 files played in real time, one after another,
+          to any number of listeners at once.
+
+          Each channel has a thread of its own that reads the next track
+          once, frame by frame (see id3.h), and copies the frames into a ring
+          buffer as fast as they would play, RADIO_TICK_MS of audio at a
+          time.  Listeners never touch the file or each other: each has only
+          a position in the channel's ring and copies out whatever has been
+          played since it last looked, so a listener costs its connection
+          and nothing else.
+
+          The ring isn't locked.  The thread announces the bytes it is about
+          to overwrite before writing them, and a listener checks after
+          copying that none of what it copied was among them; if it was, the
+          listener has fallen behind.  So has one still further back than
+          RADIO_LAG_BLOCKS ticks.  Either way it is told, and can start again
+          from what is being played now.
+
+          A worker waiting for more audio is woken through an eventfd, the
+          way the auth threads wake it (see auth.h), whenever any channel
+          has played another tick.
+
+******************************************************************************/
+#ifndef RADIO_H
+#define RADIO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Audio a channel adds to its ring at a time, and how far ahead of real
+// time it stays
+#define RADIO_TICK_MS 200
+
+// Ticks a new listener starts back, so that it starts with a full buffer
+#define RADIO_PREROLL_BLOCKS 10
+
+// Ticks a listener may fall behind before it has to skip ahead
+#define RADIO_LAG_BLOCKS 50
+
+#define RADIO_NAME_MAX 32
+#define RADIO_CHANNELS_MAX 16
+
+struct radio_channel;
+
+// Start a channel called 'name' playing the files of the catalog (see
+// catalog.h) whose names match the glob 'pattern', in name order and round
+// again, from the directory 'dirname'.  Files without MPEG audio are left
+// out.  Returns -1 if the channel can't be started.
+int radio_start(const char *name, const char *pattern, const char *dirname);
+
+// The channel called 'name', or NULL
+struct radio_channel *radio_find(const char *name);
+
+const char *radio_name(const struct radio_channel *ch);
+
+// Have 'eventfd' written to whenever any channel has played another tick
+int radio_watch(int eventfd);
+
+// Where a new listener starts: the first frame RADIO_PREROLL_BLOCKS ticks
+// back, or as far back as the channel goes
+uint64_t radio_tune(struct radio_channel *ch);
+
+// Where the tick being played now starts, for a listener that has to skip
+uint64_t radio_live(struct radio_channel *ch);
+
+// Has the listener at 'pos' fallen behind?
+bool radio_behind(struct radio_channel *ch, uint64_t pos);
+
+// Copy up to 'len' bytes of the channel's audio from 'pos' on to 'buf' and
+// move 'pos' past them.  Returns how many were copied, 0 if there are none
+// yet, or -1 if the listener at 'pos' has fallen behind.
+ssize_t radio_read(struct radio_channel *ch, uint64_t *pos, void *buf, size_t len);
+
+#endif
@@ -0,0 +1,391 @@
+/******************************************************************************
+
+PROGRAM:  request.c
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: Parsing requests, see request.h.
+
+******************************************************************************/
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "request.h"
+
+/******************************************************************************
+
+Read the options of a text ls, any of "-n <entries>", "-s name|size|mtime",
+"-r", "-c <cursor>" and a pattern, which ask for a page of the listing.
+
+******************************************************************************/
+static void parse_ls_options(const char *options, struct request *req)
+{
+    static const char *sorts[] = {"name", "size", "mtime"};
+    char word[PATH_LENGTH], value[PATH_LENGTH];
+    int used;
+
+    while (sscanf(options, " %255s%n", word, &used) == 1)
+    {
+        options += used;
+        req->paged = true;
+        if (strcmp(word, "-r") == 0)
+        {
+            req->reverse = true;
+            continue;
+        }
+        if (word[0] != '-')
+        {
+            if (req->arg[0] != '\0')
+                req->error = ERR_TOO_MANY_ARGS;
+            snprintf(req->arg, sizeof(req->arg), "%s", word);
+            continue;
+        }
+        if (sscanf(options, " %255s%n", value, &used) != 1)
+        {
+            req->error = ERR_TOO_FEW_ARGS;
+            return;
+        }
+        options += used;
+        if (strcmp(word, "-n") == 0)
+            req->page = strtoul(value, NULL, 10);
+        else if (strcmp(word, "-c") == 0 && strlen(value) <= LS_CURSOR_MAX)
+            strcpy(req->cursor, value);
+        else if (strcmp(word, "-s") == 0)
+        {
+            req->sort = -1;
+            for (int i = 0; i < (int)(sizeof(sorts) / sizeof(sorts[0])); i++)
+            {
+                if (strcmp(value, sorts[i]) == 0)
+                    req->sort = i;
+            }
+        }
+        else
+            req->error = word[1] == 'c' ? ERR_CURSOR : ERR_INVALID_OP;
+    }
+    if (req->error != 0)
+        req->opcode = 0;
+}
+
+// Read the time a text getfile starts at, "[[h:]m:]s[.fff]", in milliseconds.
+// A time too long to count in milliseconds is refused.
+static bool parse_time(const char *text, uint64_t *ms)
+{
+    const uint64_t max = (UINT64_MAX - 999) / 1000;
+    uint64_t total = 0;
+    int fields = 0;
+    char *end;
+
+    do
+    {
+        unsigned long value;
+
+        if (*text < '0' || *text > '9' || ++fields > 3)
+            return false;
+        value = strtoul(text, &end, 10);
+        if ((fields > 1 && value >= 60) || value > max || total > (max - value) / 60)
+            return false;
+        total = total * 60 + value;
+        text = end;
+    } while (*text++ == ':');
+    text--;
+
+    total *= 1000;
+    if (*text == '.')
+    {
+        for (unsigned int scale = 100; *++text >= '0' && *text <= '9'; scale /= 10)
+            total += (*text - '0') * scale;
+    }
+    *ms = total;
+    return *text == '\0';
+}
+
+// Read a segment hash written in hex, as a text manifest lists it
+static bool parse_hash(const char *text, unsigned char *hash)
+{
+    static const char digits[] = "0123456789abcdef";
+    const char *digit;
+
+    for (size_t i = 0; i < 2 * SEGMENT_HASH_SIZE; i++)
+    {
+        if (text[i] == '\0' || (digit = strchr(digits, tolower((unsigned char)text[i]))) == NULL)
+            return false;
+        hash[i / 2] = hash[i / 2] << 4 | (digit - digits);
+    }
+    return text[2 * SEGMENT_HASH_SIZE] == '\0';
+}
+
+/******************************************************************************
+
+Parse one text protocol command into a request.  For getfile the checks for
+the number of arguments are the ones the server has always made, except
+that a second one may be "@" and the time to start at.
+
+******************************************************************************/
+void parse_text_request(const char *command, struct request *req)
+{
+    char extra[PATH_LENGTH];
+    char filename[PATH_LENGTH];
+    char more[2];
+
+    memset(req, 0, offsetof(struct request, arg));
+    req->arg[0] = '\0';
+
+    if (sscanf(command, "user %31s", req->arg) == 1)
+    {
+        req->opcode = OP_USER;
+    }
+    else if (sscanf(command, "pass %31s", req->arg) == 1)
+    {
+        req->opcode = OP_PASS;
+    }
+    else if (strcmp("ls", command) == 0 || strncmp("ls ", command, 3) == 0)
+    {
+        req->opcode = OP_LS;
+        parse_ls_options(command + 2, req);
+    }
+    else if (strncmp("getfile ", command, 8) == 0)
+    {
+        int args = sscanf(command, "getfile %255s %255s %1s", filename, extra, more);
+
+        if (args == 2 && extra[0] == '@' && parse_time(extra + 1, &req->offset))
+        {
+            req->timed = true;
+            args = 1;
+        }
+
+        // Check for too many parameters
+        if (args >= 2)
+        {
+            req->error = ERR_TOO_MANY_ARGS;
+
+            // Check for too few parameters
+        }
+        else if (args != 1)
+        {
+            req->error = ERR_TOO_FEW_ARGS;
+
+            // Check for the correct number of parameters
+        }
+        else
+        {
+            req->opcode = OP_GETFILE;
+            strcpy(req->arg, filename);
+        }
+    }
+    else if (strncmp("meta ", command, 5) == 0)
+    {
+        if (sscanf(command, "meta %255s", filename) == 1)
+        {
+            req->opcode = OP_META;
+            strcpy(req->arg, filename);
+        }
+        else
+            req->error = ERR_TOO_FEW_ARGS;
+    }
+    else if (strncmp("search ", command, 7) == 0)
+    {
+        static const char *fields[] = {"title", "artist", "album", "year", "any"};
+        int start = 0;
+
+        // The query is everything after the field, spaces included
+        if (sscanf(command, "search %31s %n", extra, &start) == 1 && start > 0 && command[start] != '\0')
+        {
+            req->opcode = OP_SEARCH;
+            req->field = -1;
+            for (int i = 0; i < (int)(sizeof(fields) / sizeof(fields[0])); i++)
+            {
+                if (strcmp(extra, fields[i]) == 0)
+                    req->field = i;
+            }
+            snprintf(req->arg, sizeof(req->arg), "%s", command + start);
+            req->arg[strcspn(req->arg, "\r")] = '\0';
+        }
+        else
+            req->error = ERR_TOO_FEW_ARGS;
+    }
+    else if (strncmp("tune ", command, 5) == 0)
+    {
+        if (sscanf(command, "tune %255s", filename) == 1)
+        {
+            req->opcode = OP_TUNE;
+            strcpy(req->arg, filename);
+        }
+        else
+            req->error = ERR_TOO_FEW_ARGS;
+    }
+    else if (strncmp("manifest ", command, 9) == 0)
+    {
+        if (sscanf(command, "manifest %255s", filename) == 1)
+        {
+            req->opcode = OP_MANIFEST;
+            strcpy(req->arg, filename);
+        }
+        else
+            req->error = ERR_TOO_FEW_ARGS;
+    }
+    else if (strncmp("segment ", command, 8) == 0)
+    {
+        int args = sscanf(command, "segment %255s %255s %1s", filename, extra, more);
+
+        if (args > 2)
+            req->error = ERR_TOO_MANY_ARGS;
+        else if (args < 2)
+            req->error = ERR_TOO_FEW_ARGS;
+        else if (!parse_hash(extra, req->hash))
+            req->error = ERR_NO_SEGMENT;
+        else
+        {
+            req->opcode = OP_SEGMENT;
+            strcpy(req->arg, filename);
+        }
+    }
+    else if (strncmp("preview ", command, 8) == 0)
+    {
+        char length[PATH_LENGTH];
+        int args = sscanf(command, "preview %255s %255s %255s %1s", filename, extra, length, more);
+
+        if (args > 3)
+            req->error = ERR_TOO_MANY_ARGS;
+        else if (args < 1)
+            req->error = ERR_TOO_FEW_ARGS;
+        else if ((args >= 2 && !parse_time(extra, &req->offset)) || (args == 3 && !parse_time(length, &req->length)))
+            req->error = ERR_INVALID_OP;
+        else
+        {
+            req->opcode = OP_PREVIEW;
+            strcpy(req->arg, filename);
+        }
+    }
+    else if (strcmp("stats", command) == 0)
+    {
+        req->opcode = OP_STATS;
+    }
+    else if (strncmp("exit", command, 4) == 0)
+    {
+        req->opcode = OP_EXIT;
+    }
+    else
+    {
+        req->error = ERR_INVALID_OP;
+    }
+}
+
+/******************************************************************************
+
+Parse a binary frame.  Most requests carry just an argument, a name or a
+token, but some start with fixed fields that come first.
+
+******************************************************************************/
+void parse_frame_request(const struct frame_header *hdr, const unsigned char *payload, int version,
+                         struct request *req)
+{
+    size_t skip = 0;
+
+    memset(req, 0, offsetof(struct request, arg));
+    req->opcode = hdr->opcode;
+    req->id = hdr->request_id;
+
+    // Since version 2 a getfile starts with the range it asks for
+    if (hdr->opcode == OP_GETFILE && version >= 2)
+    {
+        if (hdr->length < GETFILE_HEADER_SIZE)
+        {
+            req->opcode = 0;
+            req->error = ERR_TOO_FEW_ARGS;
+        }
+        else
+        {
+            req->offset = get_u64(payload);
+            req->length = get_u64(payload + 8);
+            if (version >= 7 && (req->offset & GETFILE_TIME))
+            {
+                req->timed = true;
+                req->offset &= ~GETFILE_TIME;
+            }
+            memcpy(req->if_match, payload + 16, ETAG_SIZE);
+            skip = GETFILE_HEADER_SIZE;
+        }
+    }
+
+    // A search starts with the field to look in
+    if (hdr->opcode == OP_SEARCH)
+    {
+        if (hdr->length < 1)
+        {
+            req->opcode = 0;
+            req->error = ERR_TOO_FEW_ARGS;
+        }
+        else
+        {
+            req->field = payload[0];
+            skip = 1;
+        }
+    }
+    // A preview starts with the times it asks for
+    if (hdr->opcode == OP_PREVIEW)
+    {
+        if (hdr->length < PREVIEW_HEADER_SIZE)
+        {
+            req->opcode = 0;
+            req->error = ERR_TOO_FEW_ARGS;
+        }
+        else
+        {
+            req->offset = get_u32(payload);
+            req->length = get_u32(payload + 4);
+            skip = PREVIEW_HEADER_SIZE;
+        }
+    }
+    // A segment starts with its hash
+    if (hdr->opcode == OP_SEGMENT)
+    {
+        if (hdr->length < SEGMENT_HASH_SIZE)
+        {
+            req->opcode = 0;
+            req->error = ERR_TOO_FEW_ARGS;
+        }
+        else
+        {
+            memcpy(req->hash, payload, SEGMENT_HASH_SIZE);
+            skip = SEGMENT_HASH_SIZE;
+        }
+    }
+    // Since version 6 an ls may ask for a page, and its pattern and
+    // cursor follow in the argument
+    size_t patternlen = 0;
+
+    if (hdr->opcode == OP_LS && version >= 6 && hdr->length > 0)
+    {
+        if (hdr->length < LS_REQUEST_SIZE ||
+            (patternlen = get_u16(payload + 4)) > hdr->length - LS_REQUEST_SIZE)
+        {
+            req->opcode = 0;
+            req->error = ERR_TOO_FEW_ARGS;
+        }
+        else
+        {
+            req->paged = true;
+            req->page = get_u16(payload);
+            req->sort = payload[2];
+            req->reverse = payload[3] & LS_REVERSE;
+            skip = LS_REQUEST_SIZE;
+        }
+    }
+    if (hdr->length >= skip)
+    {
+        req->arglen = hdr->length - skip;
+        memcpy(req->arg, payload + skip, req->arglen);
+        req->arg[req->arglen] = '\0';
+    }
+    if (req->paged)
+    {
+        if (req->arglen - patternlen > LS_CURSOR_MAX)
+        {
+            req->opcode = 0;
+            req->error = ERR_CURSOR;
+        }
+        else
+            strcpy(req->cursor, req->arg + patternlen);
+        req->arg[patternlen] = '\0';
+    }
+}
@@ -0,0 +1,57 @@
+/******************************************************************************
+
+PROGRAM:  request.h
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: Requests as ssl-server reads them from either protocol.
+
+          A text protocol command or a binary protocol frame is parsed into
+          the same struct request, so the server acts on both the same way.
+          A malformed one leaves 'opcode' 0 and says why in 'error'.
+          Parsing is kept apart from the sessions that read the requests,
+          so that it can be measured on its own (see bench/bench-micro.c).
+
+******************************************************************************/
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+#define PATH_LENGTH 256
+
+// Largest request a client may send
+#define REQUEST_SIZE 1024
+
+// A request from either protocol
+struct request
+{
+    uint8_t opcode; // OP_USER, OP_LS, ... or 0 if the request was malformed
+    int error;      // ERR_* code explaining why a request is malformed
+    uint32_t id;    // Request id, always 0 in the text protocol
+    uint64_t offset; // Byte range of a getfile, length 0 for the rest of the file, or time range of a preview
+    uint64_t length;
+    bool timed;      // The offset is milliseconds into the audio
+    unsigned char if_match[ETAG_SIZE]; // Only send the range from this version of the file
+    int field;                         // What a search looks in, SEARCH_TITLE, ... or -1
+    bool paged;                        // An ls asks for a page, with the pattern in 'arg'
+    size_t page;                       // Entries in the page, 0 for no limit
+    int sort;                          // LS_SORT_NAME, ...
+    bool reverse;
+    char cursor[LS_CURSOR_MAX + 1]; // Where the page starts, "" at the beginning
+    unsigned char hash[SEGMENT_HASH_SIZE]; // Segment a SEGMENT asks for
+    size_t arglen;                     // Length of a binary argument such as a token
+    char arg[REQUEST_SIZE];
+};
+
+// Parse one text protocol command
+void parse_text_request(const char *command, struct request *req);
+
+// Parse a binary protocol frame whose payload is all in 'payload', from a
+// client speaking 'version'
+void parse_frame_request(const struct frame_header *hdr, const unsigned char *payload, int version,
+                         struct request *req);
+
+#endif
@@ -0,0 +1,339 @@
+/******************************************************************************
+
+PROGRAM:  resumption.c
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: TLS session resumption shared by every worker, see resumption.h.
+
+          The ticket keys and the session cache are each protected by a lock
+          of their own.  Both are only held long enough to copy a key or to
+          find or add a serialized session; encrypting a ticket and turning a
+          cached session back into an SSL_SESSION happen outside them.
+
+******************************************************************************/
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "resumption.h"
+
+// Ticket keys that still decrypt tickets: the current one and its predecessors
+#define TICKET_KEYS 3
+
+// Most sessions the session cache holds, and its hash table size
+#define SESSION_CACHE_SIZE 20000
+#define SESSION_CACHE_BUCKETS 4096
+
+// Distinguishes this server's sessions from any other application's
+#define SESSION_ID_CONTEXT "ssl-server"
+
+struct ticket_key
+{
+    unsigned char name[16];
+    unsigned char aes[32];
+    unsigned char hmac[32];
+    time_t created;
+};
+
+struct cached_session
+{
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    unsigned int idlen;
+    time_t expires;
+    unsigned char *der; // The session serialized with i2d_SSL_SESSION()
+    int derlen;
+    struct cached_session *hash_next;
+    struct cached_session *older, *newer;
+};
+
+static pthread_mutex_t key_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ticket_key keys[TICKET_KEYS]; // Newest first
+static int nkeys;
+static unsigned int key_lifetime;
+static bool use_tickets;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cached_session *buckets[SESSION_CACHE_BUCKETS];
+static struct cached_session *oldest, *newest;
+static size_t cached;
+
+static atomic_ulong full, resumed, renewed, rotations, cache_hits, cache_misses;
+
+static void new_key(struct ticket_key *key)
+{
+    if (RAND_bytes(key->name, sizeof(key->name)) != 1 || RAND_bytes(key->aes, sizeof(key->aes)) != 1 ||
+        RAND_bytes(key->hmac, sizeof(key->hmac)) != 1)
+    {
+        fprintf(stderr, "Server: Unable to generate a ticket key:\n");
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+    key->created = time(NULL);
+}
+
+// Replace the current key if it has served its time.  Called with key_lock held.
+static void rotate_keys(void)
+{
+    if (time(NULL) - keys[0].created < (time_t)key_lifetime)
+        return;
+    memmove(&keys[1], &keys[0], (TICKET_KEYS - 1) * sizeof(keys[0]));
+    if (nkeys < TICKET_KEYS)
+        nkeys++;
+    new_key(&keys[0]);
+    atomic_fetch_add(&rotations, 1);
+}
+
+/******************************************************************************
+
+OpenSSL calls this to encrypt every new ticket (enc = 1) and to decrypt every
+ticket a client offers (enc = 0).  A ticket names the key that made it.  One
+made with an older key is still accepted, but returning 2 tells OpenSSL to
+issue the client a new ticket under the current key; one whose key is gone
+(returning 0) simply means a full handshake.
+
+******************************************************************************/
+static int ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char *iv, EVP_CIPHER_CTX *cipher,
+                         EVP_MAC_CTX *mac, int enc)
+{
+    struct ticket_key key;
+    OSSL_PARAM params[3];
+    int found = -1;
+
+    (void)ssl;
+    pthread_mutex_lock(&key_lock);
+    rotate_keys();
+    if (enc)
+        found = 0;
+    else
+    {
+        for (int i = 0; i < nkeys && found < 0; i++)
+            if (memcmp(keys[i].name, key_name, sizeof(keys[i].name)) == 0)
+                found = i;
+    }
+    if (found >= 0)
+        key = keys[found];
+    pthread_mutex_unlock(&key_lock);
+
+    if (found < 0)
+        return 0;
+
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac, sizeof(key.hmac));
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+    if (EVP_MAC_CTX_set_params(mac, params) != 1)
+        return -1;
+
+    if (enc)
+    {
+        memcpy(key_name, key.name, sizeof(key.name));
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1 ||
+            EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aes, iv) != 1)
+            return -1;
+        return 1;
+    }
+    if (EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aes, iv) != 1)
+        return -1;
+    if (found > 0)
+    {
+        atomic_fetch_add(&renewed, 1);
+        return 2;
+    }
+    return 1;
+}
+
+static unsigned int hash_id(const unsigned char *id, unsigned int len)
+{
+    unsigned int hash = 2166136261u;
+
+    while (len-- > 0)
+        hash = (hash ^ *id++) * 16777619u;
+    return hash % SESSION_CACHE_BUCKETS;
+}
+
+// The cached session with this id, or NULL.  Called with cache_lock held.
+static struct cached_session *find_session(const unsigned char *id, unsigned int len)
+{
+    struct cached_session *entry = buckets[hash_id(id, len)];
+
+    while (entry != NULL && (entry->idlen != len || memcmp(entry->id, id, len) != 0))
+        entry = entry->hash_next;
+    return entry;
+}
+
+// Take a session out of the cache and free it.  Called with cache_lock held.
+static void drop_session(struct cached_session *entry)
+{
+    struct cached_session **link = &buckets[hash_id(entry->id, entry->idlen)];
+
+    while (*link != entry)
+        link = &(*link)->hash_next;
+    *link = entry->hash_next;
+
+    if (entry->older != NULL)
+        entry->older->newer = entry->newer;
+    else
+        oldest = entry->newer;
+    if (entry->newer != NULL)
+        entry->newer->older = entry->older;
+    else
+        newest = entry->older;
+
+    cached--;
+    free(entry->der);
+    free(entry);
+}
+
+// OpenSSL has a new stateful session.  It is stored serialized, so OpenSSL
+// keeps no reference to it and 0 is returned.
+static int new_session_cb(SSL *ssl, SSL_SESSION *session)
+{
+    struct cached_session *entry, *old;
+    const unsigned char *id;
+    unsigned char *p;
+    unsigned int idlen;
+    unsigned int bucket;
+
+    (void)ssl;
+    id = SSL_SESSION_get_id(session, &idlen);
+    if (idlen == 0 || (entry = calloc(1, sizeof(*entry))) == NULL)
+        return 0;
+    entry->derlen = i2d_SSL_SESSION(session, NULL);
+    if (entry->derlen <= 0 || (entry->der = malloc(entry->derlen)) == NULL)
+    {
+        free(entry);
+        return 0;
+    }
+    p = entry->der;
+    i2d_SSL_SESSION(session, &p);
+    memcpy(entry->id, id, idlen);
+    entry->idlen = idlen;
+    entry->expires = SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session);
+
+    pthread_mutex_lock(&cache_lock);
+    if ((old = find_session(id, idlen)) != NULL)
+        drop_session(old);
+    while (cached >= SESSION_CACHE_SIZE)
+        drop_session(oldest);
+    bucket = hash_id(id, idlen);
+    entry->hash_next = buckets[bucket];
+    buckets[bucket] = entry;
+    entry->older = newest;
+    if (newest != NULL)
+        newest->newer = entry;
+    else
+        oldest = entry;
+    newest = entry;
+    cached++;
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+// A client offers a session id.  The session is rebuilt from its serialized
+// form, so the caller gets the only reference to it (*copy = 0).
+static SSL_SESSION *get_session_cb(SSL *ssl, const unsigned char *id, int len, int *copy)
+{
+    struct cached_session *entry;
+    SSL_SESSION *session = NULL;
+    unsigned char *der = NULL;
+    const unsigned char *p;
+    int derlen = 0;
+
+    (void)ssl;
+    *copy = 0;
+    pthread_mutex_lock(&cache_lock);
+    entry = find_session(id, len);
+    if (entry != NULL && entry->expires <= time(NULL))
+    {
+        drop_session(entry);
+        entry = NULL;
+    }
+    if (entry != NULL && (der = malloc(entry->derlen)) != NULL)
+    {
+        memcpy(der, entry->der, entry->derlen);
+        derlen = entry->derlen;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    if (der != NULL)
+    {
+        p = der;
+        session = d2i_SSL_SESSION(NULL, &p, derlen);
+        free(der);
+    }
+    atomic_fetch_add(session != NULL ? &cache_hits : &cache_misses, 1);
+    return session;
+}
+
+// OpenSSL is done with a session, e.g. a TLS 1.3 session that was just
+// resumed and may not be resumed again
+static void remove_session_cb(SSL_CTX *ssl_ctx, SSL_SESSION *session)
+{
+    struct cached_session *entry;
+    const unsigned char *id;
+    unsigned int idlen;
+
+    (void)ssl_ctx;
+    id = SSL_SESSION_get_id(session, &idlen);
+    pthread_mutex_lock(&cache_lock);
+    if ((entry = find_session(id, idlen)) != NULL)
+        drop_session(entry);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void resumption_init(unsigned int lifetime, bool tickets)
+{
+    key_lifetime = lifetime;
+    use_tickets = tickets;
+    new_key(&keys[0]);
+    nkeys = 1;
+}
+
+void resumption_configure(SSL_CTX *ssl_ctx)
+{
+    SSL_CTX_set_session_id_context(ssl_ctx, (const unsigned char *)SESSION_ID_CONTEXT,
+                                   strlen(SESSION_ID_CONTEXT));
+
+    // A session lasts as long as a ticket made at the very end of its key's
+    // turn can still be decrypted
+    SSL_CTX_set_timeout(ssl_ctx, (long)key_lifetime * (TICKET_KEYS - 1));
+
+    // Only the shared cache, never OpenSSL's own per-context one
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb(ssl_ctx, new_session_cb);
+    SSL_CTX_sess_set_get_cb(ssl_ctx, get_session_cb);
+    SSL_CTX_sess_set_remove_cb(ssl_ctx, remove_session_cb);
+
+    if (use_tickets)
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(ssl_ctx, ticket_key_cb);
+    else
+        SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_TICKET);
+}
+
+bool resumption_count(SSL *ssl)
+{
+    bool reused = SSL_session_reused(ssl);
+
+    atomic_fetch_add(reused ? &resumed : &full, 1);
+    return reused;
+}
+
+void resumption_get_stats(struct resumption_stats *stats)
+{
+    stats->full = atomic_load(&full);
+    stats->resumed = atomic_load(&resumed);
+    stats->renewed = atomic_load(&renewed);
+    stats->rotations = atomic_load(&rotations);
+    stats->cache_hits = atomic_load(&cache_hits);
+    stats->cache_misses = atomic_load(&cache_misses);
+    pthread_mutex_lock(&cache_lock);
+    stats->cached = cached;
+    pthread_mutex_unlock(&cache_lock);
+}
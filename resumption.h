@@ -0,0 +1,59 @@
+/******************************************************************************
+
+PROGRAM:  resumption.h
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: TLS session resumption shared by every worker.
+
+          A client that has connected before can skip the expensive part of
+          the handshake by offering the session it was given last time.
+          Every worker has its own SSL_CTX, and the kernel hands each new
+          connection to any of them, so whatever a session is resumed from
+          has to be shared between the workers:
+
+          - Session tickets are encrypted with a ring of ticket keys common
+            to all workers.  The newest key encrypts new tickets and is
+            replaced after a set lifetime; the older ones are kept a while
+            longer to decrypt the tickets they made, which are then renewed.
+
+          - Stateful sessions, used when tickets are turned off and by TLS
+            1.2 clients resuming by session id, go in one session cache for
+            the whole server.  Sessions are kept serialized, and the oldest
+            are dropped once the cache is full.
+
+          Every worker also counts its full and resumed handshakes here.
+
+******************************************************************************/
+#ifndef RESUMPTION_H
+#define RESUMPTION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <openssl/ssl.h>
+
+struct resumption_stats
+{
+    unsigned long full;          // Handshakes that had to do everything
+    unsigned long resumed;       // Handshakes that resumed a session
+    unsigned long renewed;       // Tickets made with an older key, renewed
+    unsigned long rotations;     // Ticket keys replaced
+    unsigned long cache_hits;    // Sessions found in the session cache
+    unsigned long cache_misses;  // Session ids the cache didn't have
+    size_t cached;               // Sessions in the cache
+};
+
+// Create the first ticket key.  A key encrypts new tickets for
+// 'key_lifetime' seconds.  With 'tickets' false the server issues stateful
+// sessions from the session cache instead of tickets.
+void resumption_init(unsigned int key_lifetime, bool tickets);
+
+// Make an SSL_CTX issue and accept the shared tickets and sessions
+void resumption_configure(SSL_CTX *ssl_ctx);
+
+// Count a connection whose handshake has just completed.  Returns whether it
+// resumed a session.
+bool resumption_count(SSL *ssl);
+
+void resumption_get_stats(struct resumption_stats *stats);
+
+#endif
@@ -0,0 +1,523 @@
+/******************************************************************************
+
+PROGRAM:  seektable.c
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: Seek tables and segment lists, see seektable.h.
+
+          A saved table is a header followed by its checkpoints, and a saved
+          segment list a header followed by its segments, in the host's byte
+          order like the catalog snapshot.  Each is written to a temporary
+          file that is renamed over the old one, so two workers building the
+          same table at once each leave a whole one, and a reader never sees
+          half of either.
+
+******************************************************************************/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include "id3.h"
+#include "seektable.h"
+
+#define SEEK_MAGIC "MP3SEEK\0"
+#define SEEK_VERSION 1
+#define SEEK_BYTE_ORDER 0x01020304
+
+#define SEGMENT_MAGIC "MP3SEGS\0"
+#define SEGMENT_VERSION 1
+
+// Largest MPEG audio frame, as in id3.c, and room for the header after it
+#define FRAME_MAX 2048
+
+// Bytes a segment build hashes at a time
+#define SEGMENT_READ_SIZE (64 * 1024)
+
+struct seek_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; // SEEK_BYTE_ORDER as written by the host
+    uint64_t size;
+    int64_t mtime;
+    uint32_t samplerate;
+    uint32_t samples;
+    uint64_t frames;
+    uint64_t count; // Checkpoints that follow
+};
+
+struct seek_build
+{
+    char *path;
+    int fd;
+    struct id3_walk *walk;
+    struct seek_table table;
+    size_t capacity; // Of table.offsets
+    bool failed;     // Out of memory
+};
+
+struct segment_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t size;
+    int64_t mtime;
+    uint64_t count; // Segments that follow
+};
+
+struct segment_build
+{
+    char *path;
+    int fd;
+    struct seek_build *seeking; // Until the file has a seek table
+    struct segment_list list;
+    size_t next;  // Segment being hashed
+    uint64_t pos; // and how far into the file
+    EVP_MD_CTX *md;
+    unsigned char *buf;
+    bool failed; // Out of memory, or the file couldn't be read
+};
+
+static char table_dir[PATH_MAX];
+
+bool seek_init(const char *dirname)
+{
+    if (mkdir(dirname, 0755) < 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "Seek: Could not create %s: %s\n", dirname, strerror(errno));
+        return false;
+    }
+    snprintf(table_dir, sizeof(table_dir), "%s", dirname);
+    return true;
+}
+
+// Where the table of 'path' is kept: the path with '%' and '/' escaped as
+// in a URL, so every file has a name of its own in one directory, and
+// 'suffix' after it
+static bool table_path(const char *path, const char *suffix, char *out, size_t outlen)
+{
+    size_t len = snprintf(out, outlen, "%s/", table_dir);
+
+    if (table_dir[0] == '\0')
+        return false;
+    for (; *path != '\0' && len + 4 < outlen; path++)
+    {
+        if (*path == '%' || *path == '/')
+            len += sprintf(out + len, "%%%02X", *path);
+        else
+            out[len++] = *path;
+    }
+    if (*path != '\0' || len + strlen(suffix) + 1 > outlen)
+        return false;
+    strcpy(out + len, suffix);
+    return true;
+}
+
+static bool full_read(int fd, void *buf, size_t len)
+{
+    return read(fd, buf, len) == (ssize_t)len;
+}
+
+struct seek_table *seek_load(const char *path, off_t size, int64_t mtime)
+{
+    char name[PATH_MAX];
+    struct seek_header h;
+    struct seek_table *table;
+    int fd;
+
+    if (!table_path(path, ".seek", name, sizeof(name)) || (fd = open(name, O_RDONLY | O_CLOEXEC)) < 0)
+        return NULL;
+    if (!full_read(fd, &h, sizeof(h)) || memcmp(h.magic, SEEK_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version != SEEK_VERSION || h.byte_order != SEEK_BYTE_ORDER || h.size != (uint64_t)size ||
+        h.mtime != mtime || h.samplerate == 0 || h.samples == 0 || h.count == 0 || h.count > (uint64_t)size ||
+        h.count != (h.frames + SEEK_STRIDE - 1) / SEEK_STRIDE || (table = calloc(1, sizeof(*table))) == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    *table = (struct seek_table){h.size, h.mtime, h.samplerate, h.samples, h.frames, h.count, NULL};
+    if ((table->offsets = malloc(h.count * sizeof(uint64_t))) == NULL ||
+        !full_read(fd, table->offsets, h.count * sizeof(uint64_t)))
+    {
+        seek_free(table);
+        table = NULL;
+    }
+    close(fd);
+    return table;
+}
+
+// Write a header and what follows it where table_path() says, replacing any
+// old file in one step
+static void save_file(const char *path, const char *suffix, const void *header, size_t hlen, const void *body,
+                      size_t blen)
+{
+    char name[PATH_MAX], tmpname[PATH_MAX + 8];
+    int fd;
+
+    if (!table_path(path, suffix, name, sizeof(name)))
+        return;
+    snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", name);
+    if ((fd = mkstemp(tmpname)) < 0)
+    {
+        fprintf(stderr, "Seek: Could not write %s: %s\n", tmpname, strerror(errno));
+        return;
+    }
+    if (write(fd, header, hlen) != (ssize_t)hlen || write(fd, body, blen) != (ssize_t)blen || fchmod(fd, 0644) < 0)
+    {
+        fprintf(stderr, "Seek: Could not write %s: %s\n", tmpname, strerror(errno));
+        close(fd);
+        unlink(tmpname);
+        return;
+    }
+    close(fd);
+    if (rename(tmpname, name) < 0)
+    {
+        fprintf(stderr, "Seek: Could not replace %s: %s\n", name, strerror(errno));
+        unlink(tmpname);
+    }
+}
+
+// Write a table where seek_load() finds it
+static void save_table(const char *path, const struct seek_table *table)
+{
+    struct seek_header h = {.version = SEEK_VERSION, .byte_order = SEEK_BYTE_ORDER};
+
+    memcpy(h.magic, SEEK_MAGIC, sizeof(h.magic));
+    h.size = table->size;
+    h.mtime = table->mtime;
+    h.samplerate = table->samplerate;
+    h.samples = table->samples;
+    h.frames = table->frames;
+    h.count = table->count;
+    save_file(path, ".seek", &h, sizeof(h), table->offsets, table->count * sizeof(uint64_t));
+}
+
+// Called for every audio frame of the file, keeping every SEEK_STRIDE'th
+static void add_frame(void *ctx, const struct id3_frame *frame)
+{
+    struct seek_build *build = ctx;
+    struct seek_table *table = &build->table;
+
+    if (table->frames++ % SEEK_STRIDE != 0 || build->failed)
+        return;
+    if (table->count == build->capacity)
+    {
+        size_t capacity = build->capacity > 0 ? build->capacity * 2 : 1024;
+        uint64_t *offsets = realloc(table->offsets, capacity * sizeof(*offsets));
+
+        if (offsets == NULL)
+        {
+            build->failed = true;
+            return;
+        }
+        table->offsets = offsets;
+        build->capacity = capacity;
+    }
+    if (table->samples == 0)
+        table->samples = frame->samples;
+    table->offsets[table->count++] = frame->offset;
+}
+
+struct seek_build *seek_build_start(const char *path)
+{
+    struct seek_build *build = calloc(1, sizeof(*build));
+    struct stat fileInfo;
+
+    if (build == NULL)
+        return NULL;
+    build->fd = -1;
+    if ((build->path = strdup(path)) == NULL || (build->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 ||
+        fstat(build->fd, &fileInfo) < 0 ||
+        (build->walk = id3_walk_start(build->fd, fileInfo.st_size, add_frame, build)) == NULL)
+    {
+        seek_build_abort(build);
+        return NULL;
+    }
+    build->table.size = fileInfo.st_size;
+    build->table.mtime = fileInfo.st_mtim.tv_sec * 1000000000LL + fileInfo.st_mtim.tv_nsec;
+    return build;
+}
+
+bool seek_build_step(struct seek_build *build, size_t budget)
+{
+    return id3_walk_step(build->walk, budget);
+}
+
+struct seek_table *seek_build_end(struct seek_build *build)
+{
+    struct seek_table *table = NULL;
+    struct id3_info info = {0};
+    struct stat fileInfo;
+
+    id3_walk_end(build->walk, &info);
+    build->walk = NULL;
+    if (!build->failed && build->table.count > 0 && (table = malloc(sizeof(*table))) != NULL)
+    {
+        *table = build->table;
+        table->samplerate = info.samplerate;
+        build->table.offsets = NULL;
+
+        // A file that changed while it was walked gets a table next time
+        if (fstat(build->fd, &fileInfo) == 0 && (uint64_t)fileInfo.st_size == table->size &&
+            fileInfo.st_mtim.tv_sec * 1000000000LL + fileInfo.st_mtim.tv_nsec == table->mtime)
+            save_table(build->path, table);
+    }
+    seek_build_abort(build);
+    return table;
+}
+
+void seek_build_abort(struct seek_build *build)
+{
+    if (build->walk != NULL)
+    {
+        struct id3_info info;
+
+        id3_walk_end(build->walk, &info);
+    }
+    if (build->fd >= 0)
+        close(build->fd);
+    free(build->table.offsets);
+    free(build->path);
+    free(build);
+}
+
+off_t seek_find(const struct seek_table *table, int fd, uint64_t ms)
+{
+    unsigned char buf[SEEK_STRIDE * FRAME_MAX + 4];
+    size_t skip, pos = 0, found = 0, len;
+    uint64_t frame;
+    off_t checkpoint;
+    ssize_t got;
+
+    // Past the end, where the time in samples could also overflow
+    if (ms >= table->frames * table->samples * 1000 / table->samplerate)
+        return table->size;
+    frame = (ms * table->samplerate + 500 * table->samples) / (1000 * (uint64_t)table->samples);
+    if (frame >= table->frames)
+        return table->size;
+    skip = frame % SEEK_STRIDE;
+
+    // Walk the frame headers from the checkpoint before it.  Junk in between
+    // leaves it at the last frame found.
+    checkpoint = table->offsets[frame / SEEK_STRIDE];
+    if ((got = pread(fd, buf, sizeof(buf), checkpoint)) < 4)
+        return checkpoint;
+    while (pos + 4 <= (size_t)got && (len = id3_frame_length(buf + pos)) > 0)
+    {
+        found = pos;
+        if (skip-- == 0)
+            break;
+        pos += len;
+    }
+    return checkpoint + found;
+}
+
+void seek_free(struct seek_table *table)
+{
+    if (table == NULL)
+        return;
+    free(table->offsets);
+    free(table);
+}
+
+struct segment_list *segment_load(const char *path, off_t size, int64_t mtime)
+{
+    char name[PATH_MAX];
+    struct segment_header h;
+    struct segment_list *list;
+    uint64_t end = 0;
+    int fd;
+
+    if (!table_path(path, ".segments", name, sizeof(name)) || (fd = open(name, O_RDONLY | O_CLOEXEC)) < 0)
+        return NULL;
+    if (!full_read(fd, &h, sizeof(h)) || memcmp(h.magic, SEGMENT_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version != SEGMENT_VERSION || h.byte_order != SEEK_BYTE_ORDER || h.size != (uint64_t)size ||
+        h.mtime != mtime || h.count == 0 || h.count > (uint64_t)size || (list = calloc(1, sizeof(*list))) == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    *list = (struct segment_list){h.size, h.mtime, h.count, NULL};
+    if ((list->segments = malloc(h.count * sizeof(struct segment))) == NULL ||
+        !full_read(fd, list->segments, h.count * sizeof(struct segment)))
+    {
+        segment_free(list);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    // The segments must follow one another to the end of the file
+    for (size_t i = 0; i < list->count && end <= list->size; i++)
+        end = list->segments[i].offset == end ? end + list->segments[i].length : UINT64_MAX;
+    if (end != list->size)
+    {
+        segment_free(list);
+        return NULL;
+    }
+    return list;
+}
+
+// Cut the file into segments along its seek table, taking as many whole
+// checkpoints for each as come nearest SEGMENT_MS
+static bool cut_segments(struct segment_build *build, const struct seek_table *table)
+{
+    uint64_t stride = SEEK_STRIDE * (uint64_t)table->samples * 1000; // Per second of samplerate
+    size_t per = (SEGMENT_MS * (uint64_t)table->samplerate + stride / 2) / stride;
+    struct segment_list *list = &build->list;
+
+    if (per == 0)
+        per = 1;
+    list->size = table->size;
+    list->mtime = table->mtime;
+    list->count = (table->count + per - 1) / per;
+    if ((list->segments = calloc(list->count, sizeof(struct segment))) == NULL)
+        return false;
+    for (size_t i = 0; i < list->count; i++)
+    {
+        struct segment *seg = &list->segments[i];
+        uint64_t first = i * per * SEEK_STRIDE, last = (i + 1) * per * SEEK_STRIDE;
+        uint64_t end = i + 1 < list->count ? table->offsets[(i + 1) * per] : table->size;
+
+        if (last > table->frames)
+            last = table->frames;
+        seg->offset = i == 0 ? 0 : table->offsets[i * per];
+        seg->length = end - seg->offset;
+        seg->start = first * table->samples * 1000 / table->samplerate;
+        seg->duration = last * table->samples * 1000 / table->samplerate - seg->start;
+    }
+    return true;
+}
+
+struct segment_build *segment_build_start(const char *path, off_t size, int64_t mtime)
+{
+    struct segment_build *build = calloc(1, sizeof(*build));
+    struct seek_table *table;
+
+    if (build == NULL)
+        return NULL;
+    build->fd = -1;
+    if ((build->path = strdup(path)) == NULL || (build->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 ||
+        (build->md = EVP_MD_CTX_new()) == NULL || !EVP_DigestInit_ex(build->md, EVP_sha256(), NULL) ||
+        (build->buf = malloc(SEGMENT_READ_SIZE)) == NULL)
+    {
+        segment_build_abort(build);
+        return NULL;
+    }
+    if ((table = seek_load(path, size, mtime)) != NULL)
+    {
+        build->failed = !cut_segments(build, table);
+        seek_free(table);
+    }
+    else if ((build->seeking = seek_build_start(path)) == NULL)
+    {
+        segment_build_abort(build);
+        return NULL;
+    }
+    return build;
+}
+
+bool segment_build_step(struct segment_build *build, size_t budget)
+{
+    struct segment_list *list = &build->list;
+
+    if (build->seeking != NULL)
+    {
+        struct seek_table *table;
+
+        if (seek_build_step(build->seeking, budget))
+            return true;
+        table = seek_build_end(build->seeking);
+        build->seeking = NULL;
+        build->failed = table == NULL || !cut_segments(build, table);
+        seek_free(table);
+        return !build->failed;
+    }
+
+    while (budget > 0 && build->next < list->count && !build->failed)
+    {
+        struct segment *seg = &list->segments[build->next];
+        uint64_t left = seg->offset + seg->length - build->pos;
+        size_t want = left < SEGMENT_READ_SIZE ? left : SEGMENT_READ_SIZE;
+        ssize_t got;
+
+        if (left == 0)
+        {
+            build->failed = !EVP_DigestFinal_ex(build->md, seg->hash, NULL) ||
+                            !EVP_DigestInit_ex(build->md, EVP_sha256(), NULL);
+            build->next++;
+            continue;
+        }
+        if ((got = pread(build->fd, build->buf, want, build->pos)) <= 0 ||
+            !EVP_DigestUpdate(build->md, build->buf, got))
+        {
+            build->failed = true;
+            break;
+        }
+        build->pos += got;
+        budget = budget > (size_t)got ? budget - got : 0;
+    }
+    return build->next < list->count && !build->failed;
+}
+
+struct segment_list *segment_build_end(struct segment_build *build)
+{
+    struct segment_list *list = NULL;
+    struct segment_header h = {.version = SEGMENT_VERSION, .byte_order = SEEK_BYTE_ORDER};
+    struct stat fileInfo;
+
+    if (!build->failed && build->seeking == NULL && build->next == build->list.count &&
+        (list = malloc(sizeof(*list))) != NULL)
+    {
+        *list = build->list;
+        build->list.segments = NULL;
+
+        // A list cut from a file that changed while it was hashed is not saved
+        memcpy(h.magic, SEGMENT_MAGIC, sizeof(h.magic));
+        h.size = list->size;
+        h.mtime = list->mtime;
+        h.count = list->count;
+        if (fstat(build->fd, &fileInfo) == 0 && (uint64_t)fileInfo.st_size == list->size &&
+            fileInfo.st_mtim.tv_sec * 1000000000LL + fileInfo.st_mtim.tv_nsec == list->mtime)
+            save_file(build->path, ".segments", &h, sizeof(h), list->segments, list->count * sizeof(struct segment));
+    }
+    segment_build_abort(build);
+    return list;
+}
+
+void segment_build_abort(struct segment_build *build)
+{
+    if (build->seeking != NULL)
+        seek_build_abort(build->seeking);
+    if (build->fd >= 0)
+        close(build->fd);
+    EVP_MD_CTX_free(build->md);
+    free(build->buf);
+    free(build->list.segments);
+    free(build->path);
+    free(build);
+}
+
+const struct segment *segment_find(const struct segment_list *list, const unsigned char *hash)
+{
+    for (size_t i = 0; i < list->count; i++)
+        if (memcmp(list->segments[i].hash, hash, SEGMENT_HASH_SIZE) == 0)
+            return &list->segments[i];
+    return NULL;
+}
+
+void segment_free(struct segment_list *list)
+{
+    if (list == NULL)
+        return;
+    free(list->segments);
+    free(list);
+}
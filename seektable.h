@@ -0,0 +1,138 @@
+/******************************************************************************
+
+PROGRAM:  seektable.h
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: Seek tables, which say where in an MP3 file playing from a given
+          time starts, and segment lists, which cut it into pieces of a few
+          seconds each.
+
+          A file's table is built the first time someone asks for a part of
+          it by time, by walking all of its MPEG audio frames (see id3.h), and
+          saved so that no later request has to.  It keeps the offset of
+          every SEEK_STRIDE'th audio frame, a few bytes per second of audio,
+          so finding the frame that starts nearest a time takes the
+          checkpoint before it and reading at most SEEK_STRIDE frame headers
+          from there.
+
+          A table records the size and modification time of the file it was
+          built from, and one that doesn't match the file as it is now is
+          built again.  Tables are saved in a directory of their own, one
+          file each, named after the file they belong to.
+
+          A file's segments are cut from its seek table, at the checkpoint
+          nearest every SEGMENT_MS of audio, so each starts on an audio frame
+          and plays on its own; the first also has whatever comes before the
+          audio and the last whatever comes after it, so together they are
+          the whole file.  Each is known by the SHA-256 of its bytes.  A list
+          is built the first time someone asks for it, hashing the whole
+          file, and saved next to the table, which it is checked against the
+          same way.
+
+******************************************************************************/
+#ifndef SEEKTABLE_H
+#define SEEKTABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "protocol.h"
+
+// Audio frames between checkpoints, 0.84 seconds of MPEG-1 layer III at 44.1 kHz
+#define SEEK_STRIDE 32
+
+struct seek_table
+{
+    // Identity of the file the table was built from
+    uint64_t size;
+    int64_t mtime; // Nanoseconds since the epoch
+
+    uint32_t samplerate; // Hz
+    uint32_t samples;    // Per frame
+    uint64_t frames;     // Audio frames, not counting a VBR header frame
+    size_t count;
+    uint64_t *offsets; // Of audio frames 0, SEEK_STRIDE, 2 * SEEK_STRIDE, ...
+};
+
+// A table being built, a step at a time
+struct seek_build;
+
+struct segment
+{
+    uint64_t offset;
+    uint64_t length;
+    uint32_t start;                        // Milliseconds into the audio
+    uint32_t duration;                     // Milliseconds
+    unsigned char hash[SEGMENT_HASH_SIZE]; // SHA-256 of its bytes
+};
+
+struct segment_list
+{
+    // Identity of the file the list was cut from
+    uint64_t size;
+    int64_t mtime;
+
+    size_t count;
+    struct segment *segments;
+};
+
+// A list being built, a step at a time
+struct segment_build;
+
+// Keep tables in 'dirname', creating it if need be.  Returns false if it
+// can't be, and tables are then built for every request but never saved.
+bool seek_init(const char *dirname);
+
+// The saved table of the file 'path', if there is one and it was built from
+// the file as it is now, 'size' bytes modified at 'mtime'.  NULL otherwise.
+struct seek_table *seek_load(const char *path, off_t size, int64_t mtime);
+
+// Start building the table of the file 'path'.  Returns NULL if the file
+// can't be opened or has no MPEG audio.
+struct seek_build *seek_build_start(const char *path);
+
+// Walk on through about 'budget' bytes of the file.  Returns false once the
+// whole file has been walked.
+bool seek_build_step(struct seek_build *build, size_t budget);
+
+// Finish a build whose steps are done, save its table and return it.
+// Returns NULL if the file turned out to hold no audio frames.
+struct seek_table *seek_build_end(struct seek_build *build);
+
+// Give up on a build
+void seek_build_abort(struct seek_build *build);
+
+// Where the audio frame nearest 'ms' milliseconds into the file starts,
+// reading the frame headers after its checkpoint from 'fd'.  A time past
+// the end of the audio is the end of the file.
+off_t seek_find(const struct seek_table *table, int fd, uint64_t ms);
+
+void seek_free(struct seek_table *table);
+
+// The saved segment list of the file 'path', if there is one and it was cut
+// from the file as it is now, 'size' bytes modified at 'mtime'
+struct segment_list *segment_load(const char *path, off_t size, int64_t mtime);
+
+// Start cutting the file 'path' into segments, building its seek table
+// first if it has none.  Returns NULL if the file can't be opened or has no
+// MPEG audio.
+struct segment_build *segment_build_start(const char *path, off_t size, int64_t mtime);
+
+// Walk or hash on through about 'budget' bytes of the file.  Returns false
+// once there is nothing left to do.
+bool segment_build_step(struct segment_build *build, size_t budget);
+
+// Finish a build whose steps are done, save its list and return it.
+// Returns NULL if the file had no audio frames or couldn't be read.
+struct segment_list *segment_build_end(struct segment_build *build);
+
+// Give up on a build
+void segment_build_abort(struct segment_build *build);
+
+// The segment of 'list' whose hash is 'hash', or NULL
+const struct segment *segment_find(const struct segment_list *list, const unsigned char *hash);
+
+void segment_free(struct segment_list *list);
+
+#endif
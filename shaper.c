@@ -0,0 +1,184 @@
+/******************************************************************************
+
+PROGRAM:  shaper.c
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: Rate limits, see shaper.h.
+
+          Users with limits of their own, and every user whose connections
+          share a bucket, are on one list, which is only searched when
+          somebody logs in.  A user's entry, and so its bucket, is never
+          freed, so a session may keep a pointer to it.
+
+******************************************************************************/
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "auth.h"
+#include "shaper.h"
+
+// What a user's limits are when they haven't been set for the user
+#define RATE_DEFAULT UINT64_MAX
+
+struct user_limits
+{
+    char name[AUTH_NAME_MAX];
+    uint64_t connection_rate; // or RATE_DEFAULT
+    uint64_t user_rate;
+    struct rate_bucket bucket; // Shared by the user's connections
+    bool started;              // once someone has logged in as the user
+    struct user_limits *next;
+};
+
+static pthread_mutex_t users_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct user_limits *users;
+static uint64_t default_connection_rate, default_user_rate;
+
+// The time it takes the bucket's rate to make up for 'bytes'
+static uint64_t cost(const struct rate_bucket *bucket, size_t bytes)
+{
+    return (double)bytes * 1e9 / bucket->rate;
+}
+
+static void bucket_start(struct rate_bucket *bucket, uint64_t rate)
+{
+    uint64_t burst = rate * SHAPER_BURST_MS / 1000;
+
+    bucket->rate = rate;
+    bucket->burst = rate != 0 ? cost(bucket, burst > SHAPER_BURST_MIN ? burst : SHAPER_BURST_MIN) : 0;
+    atomic_store(&bucket->full_at, 0);
+}
+
+size_t bucket_allows(const struct rate_bucket *bucket, uint64_t now, size_t want)
+{
+    uint64_t full_at, owed;
+    double room;
+
+    if (bucket->rate == 0)
+        return want;
+    full_at = atomic_load_explicit(&bucket->full_at, memory_order_relaxed);
+    owed = full_at > now ? full_at - now : 0;
+    if (owed >= bucket->burst)
+        return 0;
+    room = (double)(bucket->burst - owed) * bucket->rate / 1e9;
+    return room < want ? (size_t)room : want;
+}
+
+uint64_t bucket_ready(const struct rate_bucket *bucket, uint64_t now, size_t want)
+{
+    uint64_t ready;
+
+    if (bucket->rate == 0)
+        return now;
+    ready = atomic_load_explicit(&bucket->full_at, memory_order_relaxed) + cost(bucket, want);
+    ready = ready > bucket->burst ? ready - bucket->burst : 0;
+    return ready > now ? ready : now;
+}
+
+void bucket_take(struct rate_bucket *bucket, uint64_t now, size_t bytes)
+{
+    uint64_t full_at, since;
+
+    if (bucket->rate == 0)
+        return;
+    full_at = atomic_load_explicit(&bucket->full_at, memory_order_relaxed);
+    do
+        since = full_at > now ? full_at : now;
+    while (!atomic_compare_exchange_weak_explicit(&bucket->full_at, &full_at, since + cost(bucket, bytes),
+                                                  memory_order_relaxed, memory_order_relaxed));
+}
+
+// The user's entry, made if it isn't there yet.  Called with users_lock held.
+static struct user_limits *find_user(const char *name)
+{
+    struct user_limits *user;
+
+    for (user = users; user != NULL; user = user->next)
+    {
+        if (strcmp(user->name, name) == 0)
+            return user;
+    }
+    if ((user = calloc(1, sizeof(*user))) == NULL)
+        return NULL;
+    snprintf(user->name, sizeof(user->name), "%s", name);
+    user->connection_rate = RATE_DEFAULT;
+    user->user_rate = RATE_DEFAULT;
+    user->next = users;
+    users = user;
+    return user;
+}
+
+int shaper_set_connection_rate(const char *name, uint64_t rate)
+{
+    struct user_limits *user;
+
+    if (name == NULL)
+    {
+        default_connection_rate = rate;
+        return 0;
+    }
+    pthread_mutex_lock(&users_lock);
+    if ((user = find_user(name)) != NULL)
+        user->connection_rate = rate;
+    pthread_mutex_unlock(&users_lock);
+    return user != NULL ? 0 : -1;
+}
+
+int shaper_set_user_rate(const char *name, uint64_t rate)
+{
+    struct user_limits *user;
+
+    if (name == NULL)
+    {
+        default_user_rate = rate;
+        return 0;
+    }
+    pthread_mutex_lock(&users_lock);
+    if ((user = find_user(name)) != NULL)
+        user->user_rate = rate;
+    pthread_mutex_unlock(&users_lock);
+    return user != NULL ? 0 : -1;
+}
+
+/******************************************************************************
+
+A user without limits of their own only gets an entry if every user's
+connections are limited together, and then only once they log in.
+
+******************************************************************************/
+struct rate_bucket *shaper_login(const char *name, struct rate_bucket *connection)
+{
+    struct rate_bucket *bucket = NULL;
+    struct user_limits *user = NULL;
+    uint64_t rate;
+
+    if (default_user_rate == 0 && users == NULL)
+    {
+        bucket_start(connection, default_connection_rate);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&users_lock);
+    for (user = users; user != NULL && strcmp(user->name, name) != 0; user = user->next)
+        ;
+    if (user == NULL && default_user_rate != 0)
+        user = find_user(name);
+
+    rate = user != NULL && user->connection_rate != RATE_DEFAULT ? user->connection_rate : default_connection_rate;
+    bucket_start(connection, rate);
+    if (user != NULL)
+    {
+        if (!user->started)
+        {
+            bucket_start(&user->bucket, user->user_rate != RATE_DEFAULT ? user->user_rate : default_user_rate);
+            user->started = true;
+        }
+        if (user->bucket.rate != 0)
+            bucket = &user->bucket;
+    }
+    pthread_mutex_unlock(&users_lock);
+    return bucket;
+}
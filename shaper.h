@@ -0,0 +1,69 @@
+/******************************************************************************
+
+PROGRAM:  shaper.h
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: Rate limits on the file data the server sends.
+
+          A connection may be held to a rate of its own, and all of a user's
+          connections together to another, each a token bucket: the bytes it
+          lets through fill back at the rate, and it holds SHAPER_BURST_MS
+          of them (at least SHAPER_BURST_MIN) so a transfer can go out in
+          full records.  Limits are set for everyone and may be set
+          differently for any user.  Only file data counts; replies to
+          requests and listings are never held back.
+
+          A bucket is one atomic time, the time at which it would be full
+          again had nothing more been taken (the "generic cell rate
+          algorithm"), so taking from a user's bucket, which any worker may
+          do, is a compare and swap and never a lock.
+
+******************************************************************************/
+#ifndef SHAPER_H
+#define SHAPER_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define SHAPER_BURST_MS 250
+#define SHAPER_BURST_MIN (64 * 1024)
+
+struct rate_bucket
+{
+    atomic_ullong full_at; // CLOCK_MONOTONIC ns at which the bucket is full
+    uint64_t rate;         // Bytes a second, 0 for no limit
+    uint64_t burst;        // ns of the rate the bucket holds
+};
+
+// Monotonic time in nanoseconds, for the buckets
+static inline uint64_t shaper_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Set the limit, in bytes a second with 0 for none, of every connection, or
+// with 'user' of that user's connections.  Only before any are accepted.
+// Returns -1 if out of memory.
+int shaper_set_connection_rate(const char *user, uint64_t rate);
+
+// and of all of every user's, or that user's, connections together
+int shaper_set_user_rate(const char *user, uint64_t rate);
+
+// Find the limits of a user who has just logged in: start the connection's
+// own bucket and return the bucket the user's connections share, or NULL.
+struct rate_bucket *shaper_login(const char *user, struct rate_bucket *connection);
+
+// How many of 'want' bytes a bucket lets through at 'now'
+size_t bucket_allows(const struct rate_bucket *bucket, uint64_t now, size_t want);
+
+// When it will let 'want' bytes through
+uint64_t bucket_ready(const struct rate_bucket *bucket, uint64_t now, size_t want);
+
+// Take 'bytes' from it
+void bucket_take(struct rate_bucket *bucket, uint64_t now, size_t bytes);
+
+#endif
@@ -1,547 +1,2176 @@
-/******************************************************************************
-
-PROGRAM:  ssl-client.c
-AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
-SYNOPSIS: This program is a small client application that establishes a secure TCP
-          connection to a server and simply exchanges messages.  It uses a SSL/TLS
-          connection using X509 certificates generated with the openssl application.
-          The purpose is to demonstrate how to establish and use secure communication
-          channels between a client and server using public key cryptography.
-
-          Some of the code and descriptions can be found in "Network Security with
-          OpenSSL", O'Reilly Media, 2002.
-          
-******************************************************************************/
-#include <netdb.h>
-#include <errno.h>
-#include <resolv.h>
-#include <string.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/stat.h>
-#include <arpa/inet.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <stdbool.h>
-
-#include <openssl/bio.h>
-#include <openssl/ssl.h>
-#include <openssl/err.h>
-#include <openssl/pem.h>
-#include <openssl/x509.h>
-#include <openssl/x509_vfy.h>
-
-#define DEFAULT_PORT 4433
-#define DEFAULT_HOST "localhost"
-#define MAX_HOSTNAME_LENGTH 256
-#define BUFFER_SIZE 256
-#define PATH_LENGTH 248
-
-#define ERR_TOO_FEW_ARGS 1
-#define ERR_TOO_MANY_ARGS 2
-#define ERR_INVALID_OP 3
-
-// For Authentication
-#define PASSWORD_LENGTH 32
-#define USERNAME_LENGTH 32
-#define HASH_LENGTH 264
-#define SEED_LENGTH 8
-
-#include <time.h>
-#include <crypt.h>
-#include <stdio.h>
-#include <string.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <termios.h>
-#include <dirent.h>
-
-#define PASS_BUFFER_SIZE 264
-#define PASSWORD_LENGTH 32
-#define SEED_LENGTH 8
-
-// For file playback
-#include <SDL2/SDL.h>
-#include <SDL2/SDL_mixer.h>
-#include <limits.h> // this is for getting the max file path size
-
-// For downloading
-#define CLIENT_DIR "./localData/"
-#define SERVER_DIR "./data/"
-
-/******************************************************************************
-
-This function does the basic necessary housekeeping to establish a secure TCP
-connection to the server specified by 'hostname'.
-
-*******************************************************************************/
-int create_socket(char *hostname, unsigned int port)
-{
-    int sockfd;
-    struct hostent *host;
-    struct sockaddr_in dest_addr;
-
-    host = gethostbyname(hostname);
-    if (host == NULL)
-    {
-        fprintf(stderr, "Client: Cannot resolve hostname %s\n", hostname);
-        exit(EXIT_FAILURE);
-    }
-
-    // Create a socket (endpoint) for network communication.  The socket()
-    // call returns a socket descriptor, which works exactly like a file
-    // descriptor for file system operations we worked with in CS431
-    //
-    // Sockets are by default blocking, so the server will block while reading
-    // from or writing to a socket. For most applications this is acceptable.
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0)
-    {
-        fprintf(stderr, "Server: Unable to create socket: %s", strerror(errno));
-        exit(EXIT_FAILURE);
-    }
-
-    // First we set up a network socket. An IP socket address is a combination
-    // of an IP interface address plus a 16-bit port number. The struct field
-    // sin_family is *always* set to AF_INET. Anything else returns an error.
-    // The TCP port is stored in sin_port, but needs to be converted to the
-    // format on the host machine to network byte order, which is why htons()
-    // is called. The s_addr field is the network address of the remote host
-    // specified on the command line. The earlier call to gethostbyname()
-    // retrieves the IP address for the given hostname.
-    dest_addr.sin_family = AF_INET;
-    dest_addr.sin_port = htons(port);
-    dest_addr.sin_addr.s_addr = *(long *)(host->h_addr);
-
-    // Now we connect to the remote host.  We pass the connect() system call the
-    // socket descriptor, the address of the remote host, and the size in bytes
-    // of the remote host's address
-    if (connect(sockfd, (struct sockaddr *)&dest_addr, sizeof(struct sockaddr)) < 0)
-    {
-        fprintf(stderr, "Client: Cannot connect to host %s [%s] on port %d: %s\n",
-                hostname, inet_ntoa(dest_addr.sin_addr), port, strerror(errno));
-        exit(EXIT_FAILURE);
-    }
-
-    return sockfd;
-}
-
-// This function reads in a character string that represents a password,
-// but does so while not echoing the characters typed to the console.
-// Doing that requires first saving the terminal settings, changing the
-// echo flag to off, then setting the flags.  Turning the echo back on
-// just reverses the steps using the saved terminal settings.
-
-void getPassword(char *password)
-{
-    static struct termios oldsettings, newsettings;
-    int c, i = 0;
-
-    // Save the current terminal settings and copy settings for resetting
-    tcgetattr(STDIN_FILENO, &oldsettings);
-    newsettings = oldsettings;
-
-    // Hide, i.e., turn off echoing, the characters typed to the console
-    newsettings.c_lflag &= ~(ECHO);
-
-    // Set the new terminal settings
-    tcsetattr(STDIN_FILENO, TCSANOW, &newsettings);
-
-    // Read the password from the console one character at a time
-    while ((c = getchar()) != '\n' && c != EOF && i < BUFFER_SIZE)
-        password[i++] = c;
-
-    password[i] = '\0';
-
-    // Restore the old (saved) terminal settings
-    tcsetattr(STDIN_FILENO, TCSANOW, &oldsettings);
-}
-
-/******************************************************************************
-
-The sequence of steps required to establish a secure SSL/TLS connection is:
-
-1.  Initialize the SSL algorithms
-2.  Create and configure an SSL context object
-3.  Create an SSL session object
-4.  Create a new network socket in the traditional way
-5.  Bind the SSL object to the network socket descriptor
-6.  Establish an SSL session on top of the network connection
-
-Once these steps are completed successfully, use the functions SSL_read() and
-SSL_write() to read from/write to the socket, but using the SSL object rather
-then the socket descriptor.  Once the session is complete, free the memory
-allocated to the SSL object and close the socket descriptor.
-
-******************************************************************************/
-
-// Function prototypes
-int playFile(char input[PATH_MAX]);
-int listFiles(char dirName[PATH_MAX]);
-
-int main(int argc, char **argv)
-{
-    const SSL_METHOD *method;
-    unsigned int port = DEFAULT_PORT;
-    char remote_host[MAX_HOSTNAME_LENGTH];
-    char command[PATH_LENGTH] = {0};
-    char buffer[BUFFER_SIZE] = {0};
-    char *temp_ptr;
-    char playChoice;
-    int sockfd;
-    int writefd;
-    int rcount;
-    int error_code;
-    int total = 0;
-    SSL_CTX *ssl_ctx;
-    SSL *ssl;
-
-    if (argc != 2)
-    {
-        fprintf(stderr, "Client: Usage: ssl-client <server name>:<port>\n");
-        exit(EXIT_FAILURE);
-    }
-    else
-    {
-        // Search for ':' in the argument to see if port is specified
-        temp_ptr = strchr(argv[1], ':');
-        if (temp_ptr == NULL) // Hostname only. Use default port
-            strncpy(remote_host, argv[1], MAX_HOSTNAME_LENGTH);
-        else
-        {
-            // Argument is formatted as <hostname>:<port>. Need to separate
-            // First, split out the hostname from port, delineated with a colon
-            // remote_host will have the <hostname> substring
-            strncpy(remote_host, strtok(argv[1], ":"), MAX_HOSTNAME_LENGTH);
-            // Port number will be the substring after the ':'. At this point
-            // temp is a pointer to the array element containing the ':'
-            port = (unsigned int)atoi(temp_ptr + sizeof(char));
-        }
-    }
-
-    // Initialize OpenSSL ciphers and digests
-    OpenSSL_add_all_algorithms();
-
-    // SSL_library_init() registers the available SSL/TLS ciphers and digests.
-    if (SSL_library_init() < 0)
-    {
-        fprintf(stderr, "Client: Could not initialize the OpenSSL library!\n");
-        exit(EXIT_FAILURE);
-    }
-
-    // Use the SSL/TLS method for clients
-    method = SSLv23_client_method();
-
-    // Create new context instance
-    ssl_ctx = SSL_CTX_new(method);
-    if (ssl_ctx == NULL)
-    {
-        fprintf(stderr, "Unable to create a new SSL context structure.\n");
-        exit(EXIT_FAILURE);
-    }
-
-    // This disables SSLv2, which means only SSLv3 and TLSv1 are available
-    // to be negotiated between client and server
-    SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_SSLv2);
-
-    // Create a new SSL connection state object
-    ssl = SSL_new(ssl_ctx);
-
-    // Create the underlying TCP socket connection to the remote host
-    sockfd = create_socket(remote_host, port);
-    if (sockfd != 0)
-        fprintf(stderr, "Client: Established TCP connection to '%s' on port %u\n", remote_host, port);
-    else
-    {
-        fprintf(stderr, "Client: Could not establish TCP connection to %s on port %u\n", remote_host, port);
-        exit(EXIT_FAILURE);
-    }
-
-    // Bind the SSL object to the network socket descriptor.  The socket descriptor
-    // will be used by OpenSSL to communicate with a server. This function should only
-    // be called once the TCP connection is established, i.e., after create_socket()
-    SSL_set_fd(ssl, sockfd);
-
-    // Initiates an SSL session over the existing socket connection.  SSL_connect()
-    // will return 1 if successful.
-    if (SSL_connect(ssl) == 1)
-        fprintf(stdout, "Client: Established SSL/TLS session to '%s' on port %u\n", remote_host, port);
-    else
-    {
-        fprintf(stderr, "Client: Could not establish SSL session to '%s' on port %u\n", remote_host, port);
-        exit(EXIT_FAILURE);
-    }
-    char pass_buffer[USERNAME_LENGTH + HASH_LENGTH + 1];
-    char password[PASSWORD_LENGTH];
-    char username[USERNAME_LENGTH];
-    char hash[HASH_LENGTH];
-    char subbuff[2];
-    char filename[PATH_LENGTH];
-    char extra[PATH_LENGTH];
-    char nameAndPath[PATH_LENGTH + strlen(filename)];
-
-    fprintf(stdout, "Enter username: \n");
-    fgets(username, USERNAME_LENGTH, stdin);
-    username[strlen(username) - 1] = '\0';
-
-    fprintf(stdout, "Enter password: \n");
-    getPassword(password);
-
-    sprintf(pass_buffer, "user %s", username);
-    SSL_write(ssl, pass_buffer, strlen(pass_buffer) + 1);
-
-    sprintf(pass_buffer, "pass %s", password);
-    SSL_write(ssl, pass_buffer, strlen(pass_buffer) + 1);
-    bzero(buffer, BUFFER_SIZE);
-
-    while (true)
-    {
-        // Request filename from user and strip trailing newline character
-        fprintf(stdout, "Enter 1 to list dir, 2 to download file, 3 to play local file and 4 to exit: ");
-        fgets(command, PATH_LENGTH, stdin);
-        // command[strlen(command)-1] = '\0';
-
-        int cmd = atoi(command);
-        // first if command to check if directory change
-        if (cmd == 1)
-        {
-
-            // Marshal the parameter into an RPC message
-            strcpy(buffer, "ls");
-            SSL_write(ssl, buffer, strlen(buffer) + 1);
-
-            // Clear the buffer and await the reply
-            bzero(buffer, BUFFER_SIZE);
-            rcount = SSL_read(ssl, buffer, BUFFER_SIZE);
-            printf("Available Songs:\n");
-            do
-            {
-                total += rcount;
-                write(1, buffer, rcount);
-                rcount = SSL_read(ssl, buffer, BUFFER_SIZE);
-                if(strncmp("EOF", buffer, 3) == 0){
-                    break;
-                }
-            } while (rcount > 0);
-
-            // else if block for downloading
-        }
-        else if (cmd == 2) //for downloading files
-        {
-            // Request file path from user
-            fprintf(stdout, "Enter filename: ");
-            fgets(filename, PATH_LENGTH, stdin);
-            filename[strlen(filename)-1] = '\0';
-
-            // Combine path to data folder with filename
-            sprintf(nameAndPath, "%s%s", SERVER_DIR, filename);
-
-            // Marshal the parameter into an RPC message
-            sprintf(buffer, "getfile %s", nameAndPath);
-            SSL_write(ssl, buffer, strlen(buffer) + 1);
-
-            // Clear the buffer and await the reply
-            bzero(buffer, BUFFER_SIZE);
-            rcount = SSL_read(ssl, buffer, BUFFER_SIZE);
-            if (sscanf(buffer, "rpcerror %d", &error_code) == 1)
-            {
-                fprintf(stderr, "Client: Bad request: ");
-                switch (error_code)
-                {
-                case ERR_INVALID_OP:
-                    fprintf(stderr, "Invalid message format\n");
-                    break;
-                case ERR_TOO_FEW_ARGS:
-                    fprintf(stderr, "No filename specified\n");
-                    break;
-                case ERR_TOO_MANY_ARGS:
-                    fprintf(stderr, "Too many file names provided\n");
-                    break;
-                }
-            }
-            else if (sscanf(buffer, "fileerror %d", &error_code) == 1)
-            {
-                fprintf(stderr, "Client: Could not retrieve file: %s\n", strerror(error_code));
-            }
-            else
-            {
-                // Clear variable before setting again
-                bzero(nameAndPath, PATH_LENGTH);
-
-                // Combine path to client data folder with filename
-                sprintf(nameAndPath, "%s%s", CLIENT_DIR, filename);
-
-                writefd = creat(nameAndPath, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-                do
-                {
-                    total += rcount;
-                    write(writefd, buffer, rcount);
-                    rcount = SSL_read(ssl, buffer, BUFFER_SIZE);
-                    if(strncmp("EOF", buffer, 3) == 0){
-                        break;
-                    }
-                } while (rcount > 0);
-                close(writefd);
-                fprintf(stdout, "Client: Successfully transferred file '%s' (%d bytes) from server\n", filename, total);
-            }
-        }
-        else if (cmd == 3)
-        {
-            // Prompts user to play local file or not
-            listFiles("./localData");
-            printf("Play local file? (y/n)\n");
-            scanf("%c", &playChoice);
-
-            char filePath[PATH_MAX];
-
-            if (playChoice == 'y')
-            {
-                printf("Enter filename to play song\n");
-
-                // Clear variable before setting again
-                bzero(nameAndPath, PATH_LENGTH);
-
-                //filename input
-                scanf("%s", filename);
-
-                // Combine path to client data folder with filename
-                sprintf(nameAndPath, "%s%s", CLIENT_DIR, filename);
-
-
-                printf("Playing file %s...\n", nameAndPath);
-                playFile(nameAndPath);
-            }
-            else if (playChoice == 'n')
-            {
-                printf("Canceled by user");
-                exit(EXIT_SUCCESS);
-            }
-            else
-            {
-                printf("Invalid input");
-                exit(EXIT_FAILURE);
-            }
-        }
-        else if (cmd == 4) // exit issuing commands
-        {
-            sprintf(buffer, "exit");
-            SSL_write(ssl, buffer, strlen(buffer) + 1);
-            break;
-        }
-    }
-
-    // Deallocate memory for the SSL data structures and close the socket
-    SSL_free(ssl);
-    SSL_CTX_free(ssl_ctx);
-    close(sockfd);
-    fprintf(stdout, "Client: Terminated SSL/TLS connection with server '%s'\n", remote_host);
-
-    return (0);
-}
-
-int playFile(char input[PATH_MAX])
-{
-    // metadata strings from ID3 tag
-    char buffer[128];
-    char title[31];
-    char artist[31];
-    char album[31];
-    char year[5];
-    char filePath[PATH_MAX];
-
-    int fd;
-    int flags = MIX_INIT_MP3;
-    int result;
-
-    fd = open(input, O_RDONLY);
-    if (fd < 0)
-    {
-        fprintf(stderr, "Could not open file. Error: %s\n", strerror(errno));
-        return EXIT_FAILURE;
-    }
-
-    // End of mp3 file contains metadata, so go to end and shift left 128 bytes to read the tag
-    lseek(fd, -128L, SEEK_END);
-
-    // Now, can start reading 128-byte tag from where we seeked to above
-    read(fd, buffer, 128);
-    close(fd);
-
-    // first 3 bytes are just "ID3", every 30 bytes following are each metadata field
-    strncpy(title, buffer + 3, 30);
-    strncpy(artist, buffer + 33, 30);
-    strncpy(album, buffer + 63, 30);
-    strncpy(year, buffer + 93, 4);
-
-    printf("Now Playing:\n");
-    printf("  Title: %s\n", title);
-    printf("  Artist: %s\n", artist);
-    printf("  Album: %s\n", album);
-    printf("  Year: %s\n", year);
-
-    // Start mixer, check for errors
-    result = Mix_Init(flags);
-    if (flags != result)
-    {
-        fprintf(stderr, "Could not initialize mixer (result: %d).\n", result);
-        fprintf(stderr, "playaudio: %s\n", Mix_GetError());
-        return EXIT_FAILURE;
-    }
-
-    // Open MP3 file
-    if (Mix_OpenAudio(44100, AUDIO_S16SYS, 2, 1024) < 0)
-    {
-        fprintf(stderr, "playaudio: %s\n", Mix_GetError());
-        return EXIT_FAILURE;
-    }
-
-    // Load music file passed to method
-    Mix_Music *music = Mix_LoadMUS(input);
-    if (!music)
-    {
-        fprintf(stderr, "playaudio: %s\n", Mix_GetError());
-        return EXIT_FAILURE;
-    }
-
-    // plays song one time
-    Mix_PlayMusic(music, 1);
-
-    // Program ends immediately unless this is here, in which case it ends once music stops
-    while (1)
-    {
-        SDL_Delay(200);
-        if (Mix_PlayingMusic() == 0)
-            break;
-    }
-
-    Mix_FreeMusic(music);
-    Mix_CloseAudio();
-    Mix_Quit();
-
-    return EXIT_SUCCESS;
-}
-
-int listFiles(char dirName[PATH_MAX])
-{
-    struct dirent *de;
-
-    DIR *dr;
-
-    dr = opendir(dirName);
-
-    if (dr == NULL)
-    {
-        printf("Could not open current directory\n");
-        return 0;
-    }
-
-    printf("Locally stored mp3 files:\n");
-
-    while ((de = readdir(dr)) != NULL)
-    {
-        printf("%s\n", de->d_name);
-    }
-    closedir(dr);
-    return 0;
-}
+/******************************************************************************
+
+PROGRAM:  ssl-client.c
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: This program is a small client application that establishes a secure TCP
+          connection to a server and simply exchanges messages.  It uses a SSL/TLS
+          connection using X509 certificates generated with the openssl application.
+          The purpose is to demonstrate how to establish and use secure communication
+          channels between a client and server using public key cryptography.
+
+          Some of the code and descriptions can be found in "Network Security with
+          OpenSSL", O'Reilly Media, 2002.
+          
+******************************************************************************/
+#include <netdb.h>
+#include <errno.h>
+#include <resolv.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include <openssl/bio.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/x509_vfy.h>
+
+#define DEFAULT_PORT 4433
+#define DEFAULT_HOST "localhost"
+#define MAX_HOSTNAME_LENGTH 256
+#define BUFFER_SIZE 256
+#define PATH_LENGTH 248
+
+// Largest request the client sends and reply it expects, matching the
+// server's buffers, and the size of the buffer a download is read into
+#define REQUEST_SIZE 1024
+#define REPLY_SIZE 4096
+#define TRANSFER_SIZE (16 * 1024)
+
+// Files that can be requested at once
+#define MAX_DOWNLOADS 16
+
+// How often a download that loses its connection reconnects to resume
+#define RECONNECT_ATTEMPTS 5
+
+// Most connections one file can be downloaded over with --parallel
+#define MAX_PARALLEL 16
+
+// For Authentication
+#define PASSWORD_LENGTH 32
+#define USERNAME_LENGTH 32
+#define HASH_LENGTH 264
+#define SEED_LENGTH 8
+
+#include <time.h>
+#include <crypt.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <termios.h>
+#include <dirent.h>
+
+#define PASS_BUFFER_SIZE 264
+#define PASSWORD_LENGTH 32
+#define SEED_LENGTH 8
+
+// For file playback
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_mixer.h>
+#include <limits.h> // this is for getting the max file path size
+
+#include "protocol.h"
+
+// For downloading
+#define CLIENT_DIR "./localData/"
+#define SERVER_DIR "./data/"
+
+/******************************************************************************
+
+This function does the basic necessary housekeeping to establish a secure TCP
+connection to the server specified by 'hostname'.  It returns -1 if the
+connection can't be made, so that a lost connection can be retried.
+
+*******************************************************************************/
+int create_socket(char *hostname, unsigned int port)
+{
+    int sockfd;
+    struct hostent *host;
+    struct sockaddr_in dest_addr;
+
+    host = gethostbyname(hostname);
+    if (host == NULL)
+    {
+        fprintf(stderr, "Client: Cannot resolve hostname %s\n", hostname);
+        return -1;
+    }
+
+    // Create a socket (endpoint) for network communication.  The socket()
+    // call returns a socket descriptor, which works exactly like a file
+    // descriptor for file system operations we worked with in CS431
+    //
+    // Sockets are by default blocking, so the server will block while reading
+    // from or writing to a socket. For most applications this is acceptable.
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0)
+    {
+        fprintf(stderr, "Server: Unable to create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    // First we set up a network socket. An IP socket address is a combination
+    // of an IP interface address plus a 16-bit port number. The struct field
+    // sin_family is *always* set to AF_INET. Anything else returns an error.
+    // The TCP port is stored in sin_port, but needs to be converted to the
+    // format on the host machine to network byte order, which is why htons()
+    // is called. The s_addr field is the network address of the remote host
+    // specified on the command line. The earlier call to gethostbyname()
+    // retrieves the IP address for the given hostname.
+    dest_addr.sin_family = AF_INET;
+    dest_addr.sin_port = htons(port);
+    dest_addr.sin_addr.s_addr = *(long *)(host->h_addr);
+
+    // Now we connect to the remote host.  We pass the connect() system call the
+    // socket descriptor, the address of the remote host, and the size in bytes
+    // of the remote host's address
+    if (connect(sockfd, (struct sockaddr *)&dest_addr, sizeof(struct sockaddr)) < 0)
+    {
+        fprintf(stderr, "Client: Cannot connect to host %s [%s] on port %d: %s\n",
+                hostname, inet_ntoa(dest_addr.sin_addr), port, strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+// This function reads in a character string that represents a password,
+// but does so while not echoing the characters typed to the console.
+// Doing that requires first saving the terminal settings, changing the
+// echo flag to off, then setting the flags.  Turning the echo back on
+// just reverses the steps using the saved terminal settings.
+
+void getPassword(char *password)
+{
+    static struct termios oldsettings, newsettings;
+    int c, i = 0;
+
+    // Save the current terminal settings and copy settings for resetting
+    tcgetattr(STDIN_FILENO, &oldsettings);
+    newsettings = oldsettings;
+
+    // Hide, i.e., turn off echoing, the characters typed to the console
+    newsettings.c_lflag &= ~(ECHO);
+
+    // Set the new terminal settings
+    tcsetattr(STDIN_FILENO, TCSANOW, &newsettings);
+
+    // Read the password from the console one character at a time
+    while ((c = getchar()) != '\n' && c != EOF && i < BUFFER_SIZE)
+        password[i++] = c;
+
+    password[i] = '\0';
+
+    // Restore the old (saved) terminal settings
+    tcsetattr(STDIN_FILENO, TCSANOW, &oldsettings);
+}
+
+/******************************************************************************
+
+Helpers for the binary protocol described in protocol.h.  The client's socket
+is blocking, so these simply loop until everything has been sent or received.
+
+******************************************************************************/
+
+// Read exactly 'len' bytes, returning false if the connection fails first
+bool read_full(SSL *ssl, void *buf, size_t len)
+{
+    char *p = buf;
+
+    while (len > 0)
+    {
+        int rcount = SSL_read(ssl, p, len > INT_MAX ? INT_MAX : len);
+        if (rcount <= 0)
+            return false;
+        p += rcount;
+        len -= rcount;
+    }
+    return true;
+}
+
+// Send one frame.  The header and payload go out in a single record.
+bool send_frame(SSL *ssl, uint8_t opcode, uint32_t request_id, const void *payload, size_t len)
+{
+    unsigned char frame[FRAME_HEADER_SIZE + REQUEST_SIZE];
+
+    if (len > REQUEST_SIZE)
+        return false;
+    encode_frame_header(frame, opcode, request_id, len);
+    if (len > 0)
+        memcpy(frame + FRAME_HEADER_SIZE, payload, len);
+    return SSL_write(ssl, frame, FRAME_HEADER_SIZE + len) > 0;
+}
+
+// Receive a frame header, and its payload if it is one of the small replies.
+// File data is left for the caller to read straight into its destination.
+bool read_frame(SSL *ssl, struct frame_header *hdr, unsigned char *payload, size_t max)
+{
+    unsigned char header[FRAME_HEADER_SIZE];
+
+    if (!read_full(ssl, header, FRAME_HEADER_SIZE))
+        return false;
+    decode_frame_header(header, hdr);
+    if (hdr->opcode == OP_FILE_DATA)
+        return hdr->length <= FRAME_MAX_PAYLOAD;
+    return hdr->length <= max && read_full(ssl, payload, hdr->length);
+}
+
+// Explain an ERROR frame's payload
+void print_error(const unsigned char *payload)
+{
+    int error_code = get_u32(payload + 1);
+
+    switch (payload[0])
+    {
+    case ERR_KIND_RPC:
+        if (error_code == ERR_BUSY)
+        {
+            fprintf(stderr, "Client: Server is busy, try again later\n");
+            break;
+        }
+        fprintf(stderr, "Client: Bad request: ");
+        switch (error_code)
+        {
+        case ERR_INVALID_OP:
+            fprintf(stderr, "Invalid message format\n");
+            break;
+        case ERR_TOO_FEW_ARGS:
+            fprintf(stderr, "No filename specified\n");
+            break;
+        case ERR_TOO_MANY_ARGS:
+            fprintf(stderr, "Too many file names provided\n");
+            break;
+        case ERR_CURSOR:
+            fprintf(stderr, "The listing can't carry on from there\n");
+            break;
+        case ERR_NO_AUDIO:
+            fprintf(stderr, "The file has no MPEG audio to start at a time in, cut into segments or preview\n");
+            break;
+        case ERR_NO_CHANNEL:
+            fprintf(stderr, "The server has no such radio channel\n");
+            break;
+        case ERR_NO_SEGMENT:
+            fprintf(stderr, "The file has changed since its segments were listed\n");
+            break;
+        default:
+            fprintf(stderr, "error %d\n", error_code);
+            break;
+        }
+        break;
+    case ERR_KIND_FILE:
+        fprintf(stderr, "Client: Could not retrieve file: %s\n", strerror(error_code));
+        break;
+    case ERR_KIND_AUTH:
+        fprintf(stderr, "Client: Username or password do not match\n");
+        break;
+    default:
+        fprintf(stderr, "Client: Server reported error %d/%d\n", payload[0], error_code);
+        break;
+    }
+}
+
+/******************************************************************************
+
+A connection to the server.  Everything needed to connect again is kept with
+it, so that a download interrupted by a dropped connection can reconnect,
+log in again and carry on by itself.
+
+******************************************************************************/
+struct connection
+{
+    SSL_CTX *ssl_ctx;
+    char *hostname;
+    unsigned int port;
+    const char *username;
+    const char *password;
+    bool quiet; // Don't report connecting, for the extra connections of --parallel
+    char session_file[PATH_MAX]; // Where the TLS session to resume is kept
+    char token_file[PATH_MAX];   // Where the server's session token is kept
+
+    int sockfd;
+    SSL *ssl;
+    uint8_t version;     // Protocol version the server agreed to
+    uint32_t request_id; // Id of the last request sent
+};
+
+void close_connection(struct connection *conn)
+{
+    if (conn->ssl != NULL)
+        SSL_free(conn->ssl);
+    if (conn->sockfd >= 0)
+        close(conn->sockfd);
+    conn->ssl = NULL;
+    conn->sockfd = -1;
+}
+
+/******************************************************************************
+
+The TLS session the server last gave us is kept in a file, so that the next
+connection, even from a later run of the client, can offer it and resume the
+session instead of going through a full handshake.  OpenSSL hands every new
+session (a TLS 1.3 ticket) to save_session() as it arrives, which can be at
+any time after the handshake.
+
+******************************************************************************/
+int save_session(SSL *ssl, SSL_SESSION *session)
+{
+    struct connection *conn = SSL_get_app_data(ssl);
+    char tmp[PATH_MAX + 32];
+    FILE *fp = NULL;
+    bool ok;
+    int fd;
+
+    // Parallel connections may save theirs at the same time, and a session
+    // holds its keys, so only we may read it
+    snprintf(tmp, sizeof(tmp), "%s.%lu", conn->session_file, (unsigned long)pthread_self());
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0 || (fp = fdopen(fd, "w")) == NULL)
+    {
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+    ok = PEM_write_SSL_SESSION(fp, session);
+    if (fclose(fp) != 0 || !ok || rename(tmp, conn->session_file) < 0)
+        unlink(tmp);
+
+    // We kept no reference to the session
+    return 0;
+}
+
+SSL_SESSION *load_session(const char *path)
+{
+    SSL_SESSION *session;
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL)
+        return NULL;
+    session = PEM_read_SSL_SESSION(fp, NULL, NULL, NULL);
+    fclose(fp);
+    return session;
+}
+
+/******************************************************************************
+
+Connect to the server and establish an SSL/TLS session with it:
+
+1.  Create a new network socket in the traditional way
+2.  Create an SSL session object
+3.  Bind the SSL object to the network socket descriptor
+4.  Establish an SSL session on top of the network connection, resuming the
+    saved one if the server still accepts it
+5.  Ask for the binary protocol
+
+Returns false, having said why, if any of them fails.
+
+******************************************************************************/
+bool connect_server(struct connection *conn)
+{
+    unsigned char hello[2] = {PROTO_MAGIC, PROTO_VERSION};
+    SSL_SESSION *session;
+
+    conn->ssl = NULL;
+    conn->request_id = 0;
+
+    // Create the underlying TCP socket connection to the remote host
+    conn->sockfd = create_socket(conn->hostname, conn->port);
+    if (conn->sockfd < 0)
+    {
+        fprintf(stderr, "Client: Could not establish TCP connection to %s on port %u\n", conn->hostname, conn->port);
+        return false;
+    }
+    if (!conn->quiet)
+        fprintf(stderr, "Client: Established TCP connection to '%s' on port %u\n", conn->hostname, conn->port);
+
+    // Create a new SSL connection state object and bind it to the network
+    // socket descriptor.  The socket descriptor will be used by OpenSSL to
+    // communicate with a server.
+    conn->ssl = SSL_new(conn->ssl_ctx);
+    SSL_set_fd(conn->ssl, conn->sockfd);
+    SSL_set_app_data(conn->ssl, conn);
+    if ((session = load_session(conn->session_file)) != NULL)
+    {
+        SSL_set_session(conn->ssl, session);
+        SSL_SESSION_free(session);
+    }
+
+    // Initiates an SSL session over the existing socket connection.  SSL_connect()
+    // will return 1 if successful.
+    if (SSL_connect(conn->ssl) != 1)
+    {
+        fprintf(stderr, "Client: Could not establish SSL session to '%s' on port %u\n", conn->hostname, conn->port);
+        close_connection(conn);
+        return false;
+    }
+    if (!conn->quiet)
+        fprintf(stdout, "Client: %s SSL/TLS session to '%s' on port %u\n",
+                SSL_session_reused(conn->ssl) ? "Resumed" : "Established", conn->hostname, conn->port);
+
+    // Ask for the binary protocol.  The server answers with the version it
+    // will speak.
+    if (SSL_write(conn->ssl, hello, sizeof(hello)) <= 0 || !read_full(conn->ssl, hello, sizeof(hello)) ||
+        hello[0] != PROTO_MAGIC)
+    {
+        fprintf(stderr, "Client: Server '%s' does not speak the binary protocol\n", conn->hostname);
+        close_connection(conn);
+        return false;
+    }
+    conn->version = hello[1];
+    return true;
+}
+
+/******************************************************************************
+
+A server speaking version 3 answers a login with a session token, which is
+kept next to the TLS session.  Presenting it on the next connection logs in
+without the server having to check the password again.  The token says
+which user it belongs to, so it is only used when logging in as that user.
+
+******************************************************************************/
+void save_token(struct connection *conn, const unsigned char *token, size_t len)
+{
+    char tmp[PATH_MAX + 32];
+    int fd;
+
+    // Parallel connections may all be given one at the same time, and a
+    // token is as good as the password, so only we may read it
+    snprintf(tmp, sizeof(tmp), "%s.%lu", conn->token_file, (unsigned long)pthread_self());
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0)
+        return;
+    if (write(fd, token, len) != (ssize_t)len || close(fd) < 0 || rename(tmp, conn->token_file) < 0)
+        unlink(tmp);
+}
+
+// Read the saved token for the connection's user, returning its length or 0
+size_t load_token(struct connection *conn, unsigned char *token)
+{
+    size_t namelen = strlen(conn->username);
+    ssize_t len;
+    int fd;
+
+    if ((fd = open(conn->token_file, O_RDONLY)) < 0)
+        return 0;
+    len = read(fd, token, TOKEN_MAX_SIZE);
+    close(fd);
+    if (len != (ssize_t)(TOKEN_HEADER_SIZE + namelen + TOKEN_MAC_SIZE) || token[8] != namelen ||
+        memcmp(token + TOKEN_HEADER_SIZE, conn->username, namelen) != 0)
+        return 0;
+    return len;
+}
+
+// Log in with the saved token if the server takes it, otherwise with the
+// connection's username and password
+bool login(struct connection *conn)
+{
+    unsigned char payload[REPLY_SIZE];
+    unsigned char token[TOKEN_MAX_SIZE];
+    struct frame_header hdr = {0};
+    size_t len;
+
+    if (conn->version >= 3 && (len = load_token(conn, token)) > 0)
+    {
+        if (!send_frame(conn->ssl, OP_TOKEN, ++conn->request_id, token, len) ||
+            !read_frame(conn->ssl, &hdr, payload, sizeof(payload)))
+        {
+            fprintf(stderr, "Client: Login failed\n");
+            return false;
+        }
+        if (hdr.opcode == OP_OK)
+        {
+            save_token(conn, payload, hdr.length);
+            return true;
+        }
+
+        // Expired, or the server has restarted since
+        unlink(conn->token_file);
+    }
+
+    send_frame(conn->ssl, OP_USER, ++conn->request_id, conn->username, strlen(conn->username));
+    send_frame(conn->ssl, OP_PASS, ++conn->request_id, conn->password, strlen(conn->password));
+    if (!read_frame(conn->ssl, &hdr, payload, sizeof(payload)) || hdr.opcode != OP_OK)
+    {
+        if (hdr.opcode == OP_ERROR)
+            print_error(payload);
+        fprintf(stderr, "Client: Login failed\n");
+        return false;
+    }
+    if (hdr.length > 0)
+        save_token(conn, payload, hdr.length);
+    return true;
+}
+
+/******************************************************************************
+
+Ask the server for a listing of its data directory and print it.  The
+listing arrives as LS_DATA frames, each packed with entries, followed by
+LS_END.  A frame may be as large as FRAME_MAX_PAYLOAD, so the payload
+buffer is allocated rather than kept on the stack.
+
+With 'options' the listing comes a page at a time.  A page that isn't the
+last ends with a cursor, which asks for the next one when the user wants it.
+
+******************************************************************************/
+struct ls_options
+{
+    unsigned int page; // Entries per page, 0 for no limit
+    int sort;          // LS_SORT_NAME, ...
+    bool reverse;
+    char pattern[PATH_LENGTH];
+};
+
+// Read "-n <entries>", "-s name|size|mtime", "-r" and a pattern
+bool parse_ls_options(const char *text, struct ls_options *options)
+{
+    static const char *sorts[] = {"name", "size", "mtime"};
+    char word[PATH_LENGTH];
+    int used;
+
+    memset(options, 0, sizeof(*options));
+    while (sscanf(text, " %255s%n", word, &used) == 1)
+    {
+        text += used;
+        if (strcmp(word, "-r") == 0)
+            options->reverse = true;
+        else if (strcmp(word, "-n") == 0 && sscanf(text, " %u%n", &options->page, &used) == 1 &&
+                 options->page <= UINT16_MAX)
+            text += used;
+        else if (strcmp(word, "-s") == 0 && sscanf(text, " %255s%n", word, &used) == 1)
+        {
+            text += used;
+            options->sort = -1;
+            for (int i = 0; i < (int)(sizeof(sorts) / sizeof(sorts[0])); i++)
+            {
+                if (strcmp(word, sorts[i]) == 0)
+                    options->sort = i;
+            }
+            if (options->sort < 0)
+                return false;
+        }
+        else if (word[0] != '-' && options->pattern[0] == '\0')
+            strcpy(options->pattern, word);
+        else
+            return false;
+    }
+    return true;
+}
+
+bool list_remote(SSL *ssl, uint32_t request_id, const struct ls_options *options)
+{
+    unsigned char *payload = malloc(FRAME_MAX_PAYLOAD);
+    unsigned char request[LS_REQUEST_SIZE + PATH_LENGTH + LS_CURSOR_MAX];
+    size_t patternlen = options != NULL ? strlen(options->pattern) : 0, cursorlen = 0;
+    struct frame_header hdr;
+
+    if (options != NULL)
+    {
+        put_u16(request, options->page);
+        request[2] = options->sort;
+        request[3] = options->reverse ? LS_REVERSE : 0;
+        put_u16(request + 4, patternlen);
+        memcpy(request + LS_REQUEST_SIZE, options->pattern, patternlen);
+    }
+    if (payload == NULL ||
+        !send_frame(ssl, OP_LS, request_id, request, options != NULL ? LS_REQUEST_SIZE + patternlen : 0))
+    {
+        free(payload);
+        return false;
+    }
+
+    printf("Available Songs:\n");
+    while (read_frame(ssl, &hdr, payload, FRAME_MAX_PAYLOAD))
+    {
+        if (hdr.opcode == OP_LS_END && (hdr.length == 0 || hdr.length > LS_CURSOR_MAX))
+        {
+            free(payload);
+            return true;
+        }
+        if (hdr.opcode == OP_LS_END)
+        {
+            char answer[16];
+
+            // Ask for the next page with the cursor this one ended with
+            fprintf(stdout, "Enter for the next page, anything else to stop: ");
+            if (fgets(answer, sizeof(answer), stdin) == NULL || answer[0] != '\n')
+            {
+                free(payload);
+                return true;
+            }
+            cursorlen = hdr.length;
+            memcpy(request + LS_REQUEST_SIZE + patternlen, payload, cursorlen);
+            if (!send_frame(ssl, OP_LS, request_id, request, LS_REQUEST_SIZE + patternlen + cursorlen))
+                break;
+            continue;
+        }
+        if (hdr.opcode == OP_ERROR && hdr.length >= 5)
+        {
+            print_error(payload);
+            free(payload);
+            return true;
+        }
+        if (hdr.opcode != OP_LS_DATA)
+            break;
+
+        for (size_t off = 0; off + LS_ENTRY_HEADER_SIZE <= hdr.length;)
+        {
+            unsigned long long size = get_u64(payload + off + 1);
+            int namelen = get_u16(payload + off + 9);
+
+            if (payload[off] == LS_ENTRY_FILE)
+                printf("%-30.*s\t%llu bytes\n", namelen, payload + off + LS_ENTRY_HEADER_SIZE, size);
+            off += LS_ENTRY_HEADER_SIZE + namelen;
+        }
+    }
+
+    fprintf(stderr, "Client: Listing interrupted\n");
+    free(payload);
+    return false;
+}
+
+/******************************************************************************
+
+Track metadata, which the server reads from the files' ID3 tags.  A meta
+request is answered with a single TRACKS frame, a search with any number of
+them followed by TRACKS_END.  Each record is printed as it is decoded: in
+full for one file, as a line per track for a search.
+
+******************************************************************************/
+void print_tracks(const unsigned char *payload, size_t len, bool full, int *count)
+{
+    size_t off = 0;
+
+    while (off + TRACK_HEADER_SIZE <= len)
+    {
+        const unsigned char *p = payload + off;
+        unsigned int duration = get_u32(p), bitrate = get_u16(p + 4), year = get_u16(p + 6);
+        int namelen = get_u16(p + 8), titlelen = p[10], artistlen = p[11], albumlen = p[12];
+        const char *name = (const char *)p + TRACK_HEADER_SIZE;
+        const char *title = name + namelen, *artist = title + titlelen, *album = artist + artistlen;
+
+        off += TRACK_HEADER_SIZE + namelen + titlelen + artistlen + albumlen;
+        if (off > len)
+            break;
+        if (full)
+        {
+            printf("  File: %.*s\n", namelen, name);
+            printf("  Title: %.*s\n", titlelen, title);
+            printf("  Artist: %.*s\n", artistlen, artist);
+            printf("  Album: %.*s\n", albumlen, album);
+            printf("  Year: %u\n", year);
+            printf("  Duration: %u:%02u\n", duration / 60000, duration / 1000 % 60);
+            printf("  Bitrate: %u kbit/s\n", bitrate);
+        }
+        else
+            printf("%-30.*s\t%.*s - %.*s (%.*s, %u) %u:%02u\n", namelen, name, artistlen, artist, titlelen, title,
+                   albumlen, album, year, duration / 60000, duration / 1000 % 60);
+        (*count)++;
+    }
+}
+
+bool show_metadata(struct connection *conn, const char *name)
+{
+    unsigned char payload[REPLY_SIZE];
+    struct frame_header hdr;
+    int count = 0;
+
+    if (!send_frame(conn->ssl, OP_META, ++conn->request_id, name, strlen(name)) ||
+        !read_frame(conn->ssl, &hdr, payload, sizeof(payload)))
+        return false;
+    if (hdr.opcode == OP_ERROR)
+        print_error(payload);
+    else if (hdr.opcode == OP_TRACKS)
+        print_tracks(payload, hdr.length, true, &count);
+    else
+        return false;
+    return true;
+}
+
+// Print the server's metrics, leaving out the comments that describe them
+bool show_stats(struct connection *conn)
+{
+    unsigned char *payload = malloc(FRAME_MAX_PAYLOAD + 1);
+    struct frame_header hdr;
+    bool ok = payload != NULL && send_frame(conn->ssl, OP_STATS, ++conn->request_id, NULL, 0) &&
+              read_frame(conn->ssl, &hdr, payload, FRAME_MAX_PAYLOAD);
+
+    if (ok && hdr.opcode == OP_STATS_DATA)
+    {
+        payload[hdr.length] = '\0';
+        for (char *line = strtok((char *)payload, "\n"); line != NULL; line = strtok(NULL, "\n"))
+            if (line[0] != '#')
+                printf("%s\n", line);
+    }
+    else if (ok && hdr.opcode == OP_ERROR)
+        print_error(payload);
+    else
+        ok = false;
+    free(payload);
+    return ok;
+}
+
+bool search_remote(struct connection *conn, int field, const char *query)
+{
+    unsigned char request[1 + SEARCH_QUERY_MAX];
+    unsigned char *payload = malloc(FRAME_MAX_PAYLOAD);
+    size_t len = strlen(query);
+    struct frame_header hdr;
+    int count = 0;
+
+    if (len > SEARCH_QUERY_MAX)
+        len = SEARCH_QUERY_MAX;
+    request[0] = field;
+    memcpy(request + 1, query, len);
+    if (payload == NULL || !send_frame(conn->ssl, OP_SEARCH, ++conn->request_id, request, 1 + len))
+    {
+        free(payload);
+        return false;
+    }
+
+    while (read_frame(conn->ssl, &hdr, payload, FRAME_MAX_PAYLOAD))
+    {
+        if (hdr.opcode == OP_TRACKS)
+        {
+            print_tracks(payload, hdr.length, false, &count);
+            continue;
+        }
+        if (hdr.opcode == OP_TRACKS_END)
+            printf("%d track(s) found\n", count);
+        else if (hdr.opcode == OP_ERROR)
+            print_error(payload);
+        else
+            break;
+        free(payload);
+        return true;
+    }
+
+    fprintf(stderr, "Client: Search interrupted\n");
+    free(payload);
+    return false;
+}
+
+// Read the time a download starts at, "[[h:]m:]s[.fff]", in milliseconds
+bool parse_time(const char *text, uint64_t *ms)
+{
+    uint64_t total = 0;
+    int fields = 0;
+    char *end;
+
+    do
+    {
+        unsigned long value;
+
+        if (*text < '0' || *text > '9' || ++fields > 3)
+            return false;
+        value = strtoul(text, &end, 10);
+        if (fields > 1 && value >= 60)
+            return false;
+        total = total * 60 + value;
+        text = end;
+    } while (*text++ == ':');
+    text--;
+
+    total *= 1000;
+    if (*text == '.')
+    {
+        for (unsigned int scale = 100; *++text >= '0' && *text <= '9'; scale /= 10)
+            total += (*text - '0') * scale;
+    }
+    *ms = total;
+    return *text == '\0';
+}
+
+/******************************************************************************
+
+The ETag of a local copy is kept next to it, in ".<name>.etag", so that a
+download that was cut short can be resumed later, and only if the file on
+the server is still the version the partial copy came from.
+
+******************************************************************************/
+void etag_path(char *path, size_t size, const char *local)
+{
+    const char *name = strrchr(local, '/');
+
+    name = name != NULL ? name + 1 : local;
+    snprintf(path, size, "%.*s.%s.etag", (int)(name - local), local, name);
+}
+
+bool read_etag(const char *path, unsigned char *etag)
+{
+    char hex[2 * ETAG_SIZE + 2];
+    FILE *fp = fopen(path, "r");
+    bool ok = fp != NULL && fgets(hex, sizeof(hex), fp) != NULL;
+
+    for (int i = 0; ok && i < ETAG_SIZE; i++)
+    {
+        unsigned int byte;
+
+        ok = sscanf(hex + 2 * i, "%2x", &byte) == 1;
+        etag[i] = byte;
+    }
+    if (fp != NULL)
+        fclose(fp);
+    return ok;
+}
+
+void write_etag(const char *path, const unsigned char *etag)
+{
+    FILE *fp = fopen(path, "w");
+
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Client: Could not write '%s': %s\n", path, strerror(errno));
+        return;
+    }
+    for (int i = 0; i < ETAG_SIZE; i++)
+        fprintf(fp, "%02x", etag[i]);
+    fprintf(fp, "\n");
+    fclose(fp);
+}
+
+/******************************************************************************
+
+Download several files at once over the one connection.  Every request is
+sent straight away, without waiting for the earlier ones to finish, and the
+server interleaves the replies.  Each reply frame carries the id of the
+request it answers, which is how it is matched to its download: FILE_BEGIN
+says which part of the file follows, FILE_DATA payloads are read directly
+into a buffer and written to that file at their place, and FILE_END closes
+it.
+
+A local copy with an ETag is resumed from its current size.  If the file has
+changed on the server since, the server sends all of it instead and the
+local copy is overwritten.  Downloads that are finished are skipped, so after
+a lost connection the same downloads can simply be tried again.  Returns
+false only if the connection itself failed.
+
+A download by time, from version 7, asks for the file from the audio frame
+nearest a time into it and keeps just that part, from the first byte sent.
+It is always fetched afresh, and its ETag isn't kept.
+
+A download can also be a segment of a file that is being fetched over
+several connections at once, see download_parallel().  A segment asks for
+its own range of the file, only if the file is still the version its ETag
+names, and writes into the file that download_parallel() set up.
+
+******************************************************************************/
+struct download
+{
+    uint32_t id;
+    const char *remote;
+    char local[PATH_MAX];
+    char etagfile[PATH_MAX + 8];
+    int fd;
+    bool done;
+    bool segment;                    // One range of a parallel download
+    bool failed;                     // A segment that didn't get all of its range
+    unsigned char etag[ETAG_SIZE];   // The version of the file a segment is part of
+    const char *at;                  // The time a download by time starts at, as entered, or NULL
+    uint64_t ms;                     // and in milliseconds
+    unsigned long long base;         // Where in the file the local copy starts
+    unsigned long long from; // Offset the local copy was resumed at
+    unsigned long long pos;  // Where the next byte goes
+    unsigned long long end;  // Where the data being sent ends
+    unsigned long long size; // Size of the whole file
+};
+
+// Finish a download, successful or not
+void end_download(struct download *d, const unsigned char *error)
+{
+    d->failed = d->failed || error != NULL || d->fd < 0 || d->pos != d->end;
+    if (d->fd >= 0)
+        close(d->fd);
+    d->fd = -1;
+    d->id = 0;
+    d->done = true;
+
+    if (d->segment && error == NULL)
+        return;
+    if (error != NULL)
+    {
+        fprintf(stderr, "Client: '%s': ", d->remote);
+        print_error(error);
+    }
+    else if (d->pos != d->end || d->end != d->size)
+        fprintf(stderr, "Client: Transfer of '%s' ended after %llu of %llu bytes\n", d->remote, d->pos, d->size);
+    else if (d->at != NULL)
+        fprintf(stdout, "Client: Successfully transferred file '%s' from %s (%llu of %llu bytes) from server\n",
+                d->remote, d->at, d->size - d->base, d->size);
+    else if (d->from == d->size)
+        fprintf(stdout, "Client: '%s' is already up to date (%llu bytes)\n", d->remote, d->size);
+    else if (d->from > 0)
+        fprintf(stdout, "Client: Successfully transferred file '%s' (%llu bytes, resumed at %llu) from server\n",
+                d->remote, d->size, d->from);
+    else
+        fprintf(stdout, "Client: Successfully transferred file '%s' (%llu bytes) from server\n", d->remote, d->size);
+}
+
+// Open the local copy and send the request, asking for the rest of the file
+// if part of it is already here
+bool request_download(struct connection *conn, struct download *d)
+{
+    unsigned char request[GETFILE_HEADER_SIZE + PATH_LENGTH + sizeof(SERVER_DIR)];
+    size_t namelen = strlen(d->remote);
+    struct stat fileInfo;
+
+    d->id = ++conn->request_id;
+    memset(request, 0, GETFILE_HEADER_SIZE);
+    if (d->segment)
+    {
+        // Picks up where an earlier connection left off
+        if ((d->fd = open(d->local, O_WRONLY)) < 0)
+            fprintf(stderr, "Client: Could not open '%s': %s\n", d->local, strerror(errno));
+        put_u64(request, d->pos);
+        put_u64(request + 8, d->end - d->pos);
+        memcpy(request + 16, d->etag, ETAG_SIZE);
+        memcpy(request + GETFILE_HEADER_SIZE, d->remote, namelen);
+        return send_frame(conn->ssl, OP_GETFILE, d->id, request, GETFILE_HEADER_SIZE + namelen);
+    }
+
+    d->from = d->pos = d->end = d->size = d->base = 0;
+    etag_path(d->etagfile, sizeof(d->etagfile), d->local);
+
+    d->fd = open(d->local, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (d->fd < 0)
+        fprintf(stderr, "Client: Could not create '%s': %s\n", d->local, strerror(errno));
+    else if (conn->version >= 2 && d->at == NULL && fstat(d->fd, &fileInfo) == 0 && fileInfo.st_size > 0 &&
+             read_etag(d->etagfile, request + 16))
+        d->from = fileInfo.st_size;
+    else
+        memset(request + 16, 0, ETAG_SIZE);
+
+    // Version 1 servers only take the name
+    if (conn->version < 2)
+        return send_frame(conn->ssl, OP_GETFILE, d->id, d->remote, namelen);
+    put_u64(request, d->at != NULL ? GETFILE_TIME | d->ms : d->from);
+    memcpy(request + GETFILE_HEADER_SIZE, d->remote, namelen);
+    return send_frame(conn->ssl, OP_GETFILE, d->id, request, GETFILE_HEADER_SIZE + namelen);
+}
+
+bool download_files(struct connection *conn, struct download *downloads, int count)
+{
+    unsigned char payload[REPLY_SIZE];
+    static __thread char data[TRANSFER_SIZE];
+    struct frame_header hdr;
+    struct download *d;
+    int active = 0;
+
+    for (d = downloads; d < downloads + count; d++)
+    {
+        // A segment may have got all of its data before the connection was lost
+        if (d->segment && (d->failed || d->pos == d->end))
+            d->done = true;
+        if (d->done)
+            continue;
+        if (!request_download(conn, d))
+            goto failed;
+        active++;
+    }
+
+    while (active > 0 && read_frame(conn->ssl, &hdr, payload, sizeof(payload)))
+    {
+        for (d = downloads; d < downloads + count && (d->done || d->id != hdr.request_id); d++)
+            ;
+        if (d == downloads + count)
+            break;
+
+        switch (hdr.opcode)
+        {
+        case OP_FILE_BEGIN:
+            if (d->segment)
+            {
+                // The server sends the whole file instead if it has changed
+                if (hdr.length < FILE_BEGIN_SIZE || get_u64(payload + 8) != d->pos ||
+                    get_u64(payload + 8) + get_u64(payload + 16) != d->end ||
+                    memcmp(payload + 24, d->etag, ETAG_SIZE) != 0)
+                {
+                    fprintf(stderr, "Client: '%s' changed on the server during the download\n", d->remote);
+                    close(d->fd);
+                    d->fd = -1;
+                    d->failed = true;
+                }
+                break;
+            }
+            d->size = get_u64(payload);
+            d->pos = 0;
+            d->end = d->size;
+            if (hdr.length >= FILE_BEGIN_SIZE)
+            {
+                d->pos = get_u64(payload + 8);
+                d->end = d->pos + get_u64(payload + 16);
+                if (d->at != NULL)
+                    d->base = d->pos;
+                else if (d->fd >= 0)
+                    write_etag(d->etagfile, payload + 24);
+            }
+
+            // Anything past where the data starts is from another version
+            if (d->pos != d->from)
+                d->from = 0;
+            if (d->fd >= 0 && ftruncate(d->fd, d->pos - d->base) < 0)
+                fprintf(stderr, "Client: Could not truncate '%s': %s\n", d->local, strerror(errno));
+            break;
+
+        case OP_FILE_DATA:
+            // Read the frame's payload in buffer-sized pieces
+            for (size_t left = hdr.length; left > 0;)
+            {
+                size_t n = left < sizeof(data) ? left : sizeof(data);
+
+                if (!read_full(conn->ssl, data, n))
+                    goto failed;
+                if (d->fd >= 0 && pwrite(d->fd, data, n, d->pos - d->base) != (ssize_t)n)
+                {
+                    fprintf(stderr, "Client: Could not write '%s': %s\n", d->local, strerror(errno));
+                    close(d->fd);
+                    d->fd = -1;
+                    d->failed = true;
+                }
+                left -= n;
+                d->pos += n;
+            }
+            break;
+
+        case OP_FILE_END:
+            end_download(d, NULL);
+            active--;
+            break;
+
+        case OP_ERROR:
+            end_download(d, payload);
+            active--;
+            break;
+
+        default:
+            goto failed;
+        }
+    }
+    if (active == 0)
+        return true;
+
+failed:
+    for (d = downloads; d < downloads + count; d++)
+    {
+        if (d->fd >= 0)
+            close(d->fd);
+        d->fd = -1;
+    }
+    fprintf(stderr, "Client: Connection lost while downloading\n");
+    return false;
+}
+
+/******************************************************************************
+
+Download files, reconnecting if the connection is lost.  Each new connection
+resumes the unfinished downloads from what has already been written.  After
+RECONNECT_ATTEMPTS failed attempts in a row the downloads are given up and
+the connection is left closed.  A connection that isn't open is treated as
+one that was lost.
+
+******************************************************************************/
+bool download_with_retries(struct connection *conn, struct download *downloads, int count)
+{
+    int attempt = 0;
+
+    while (conn->ssl == NULL || !download_files(conn, downloads, count))
+    {
+        close_connection(conn);
+        do
+        {
+            if (++attempt > RECONNECT_ATTEMPTS)
+            {
+                fprintf(stderr, "Client: Giving up after %d attempts to reconnect\n", RECONNECT_ATTEMPTS);
+                return false;
+            }
+            sleep(attempt);
+            fprintf(stderr, "Client: Reconnecting to resume downloads (attempt %d of %d)\n", attempt,
+                    RECONNECT_ATTEMPTS);
+        } while (!connect_server(conn) || !login(conn));
+    }
+    return true;
+}
+
+// Ask for the first byte of a file, which is enough to learn its size and
+// ETag.  *found is false, having said why, if the server refused.  Returns
+// false if the connection failed.
+bool probe_file(struct connection *conn, const char *remote, unsigned long long *size, unsigned char *etag,
+                bool *found)
+{
+    unsigned char request[GETFILE_HEADER_SIZE + PATH_LENGTH + sizeof(SERVER_DIR)] = {0};
+    unsigned char payload[REPLY_SIZE];
+    size_t namelen = strlen(remote);
+    uint32_t id = ++conn->request_id;
+    struct frame_header hdr;
+
+    *found = false;
+    put_u64(request + 8, 1);
+    memcpy(request + GETFILE_HEADER_SIZE, remote, namelen);
+    if (!send_frame(conn->ssl, OP_GETFILE, id, request, GETFILE_HEADER_SIZE + namelen))
+        return false;
+
+    while (read_frame(conn->ssl, &hdr, payload, sizeof(payload)) && hdr.request_id == id)
+    {
+        switch (hdr.opcode)
+        {
+        case OP_FILE_BEGIN:
+            if (hdr.length < FILE_BEGIN_SIZE)
+                return false;
+            *size = get_u64(payload);
+            memcpy(etag, payload + 24, ETAG_SIZE);
+            break;
+
+        case OP_FILE_DATA:
+            if (hdr.length > sizeof(payload) || !read_full(conn->ssl, payload, hdr.length))
+                return false;
+            break;
+
+        case OP_FILE_END:
+            *found = true;
+            return true;
+
+        case OP_ERROR:
+            fprintf(stderr, "Client: '%s': ", remote);
+            print_error(payload);
+            return true;
+
+        default:
+            return false;
+        }
+    }
+    return false;
+}
+
+// One range of a parallel download and the connection it is fetched over
+struct segment_job
+{
+    struct connection *conn;
+    struct download *segment;
+    pthread_t thread;
+    bool ok; // The connection held up, or was restored
+};
+
+void *fetch_segment(void *arg)
+{
+    struct segment_job *job = arg;
+
+    if (job->conn->ssl == NULL && (!connect_server(job->conn) || !login(job->conn)))
+        close_connection(job->conn);
+    job->ok = download_with_retries(job->conn, job->segment, 1);
+    return NULL;
+}
+
+/******************************************************************************
+
+Download one file over several connections at once, for --parallel.  On a
+link with a long round trip a single connection is limited by its TCP window
+rather than by the bandwidth, and every further connection adds a window.
+
+Asking for the first byte of the file tells its size and ETag.  The local
+file is then preallocated to that size and cut into one range per
+connection, and every range is fetched by its own thread: the first over the
+existing connection, the rest over new ones that log in with the same
+credentials.  Each range asks for the version of the file the ETag names and
+is written at its place with pwrite, and reconnects and resumes by itself
+like any other download.
+
+The result is only kept if every range arrived in full from that one version
+of the file and the local file has exactly its size.  Its ETag is then
+recorded as for any other download.  Returns false only if the existing
+connection was lost for good.
+
+******************************************************************************/
+bool download_parallel(struct connection *conn, const char *remote, const char *local, int parallel)
+{
+    struct connection extra[MAX_PARALLEL];
+    struct download segments[MAX_PARALLEL];
+    struct segment_job jobs[MAX_PARALLEL];
+    unsigned char etag[ETAG_SIZE];
+    char etagfile[PATH_MAX + 8];
+    unsigned long long size;
+    struct timespec start, end;
+    struct stat fileInfo;
+    bool found, complete = true;
+    double seconds;
+    int fd, count;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!probe_file(conn, remote, &size, etag, &found))
+        return false;
+    if (!found)
+        return true;
+
+    // Whatever was there before is gone, and so is its ETag
+    etag_path(etagfile, sizeof(etagfile), local);
+    unlink(etagfile);
+    fd = open(local, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0 || (size > 0 && posix_fallocate(fd, 0, size) != 0 && ftruncate(fd, size) < 0))
+    {
+        fprintf(stderr, "Client: Could not create '%s': %s\n", local, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return true;
+    }
+    close(fd);
+
+    // No range is empty, so a tiny file gets fewer of them
+    count = size < (unsigned long long)parallel ? (int)size : parallel;
+    for (int i = 0; i < count; i++)
+    {
+        struct download *d = &segments[i];
+
+        memset(d, 0, sizeof(*d));
+        d->remote = remote;
+        snprintf(d->local, sizeof(d->local), "%s", local);
+        d->fd = -1;
+        d->segment = true;
+        memcpy(d->etag, etag, ETAG_SIZE);
+        d->pos = size * i / count;
+        d->end = size * (i + 1) / count;
+        d->size = size;
+
+        extra[i] = *conn;
+        extra[i].quiet = true;
+        extra[i].ssl = NULL;
+        extra[i].sockfd = -1;
+        jobs[i].conn = i == 0 ? conn : &extra[i];
+        jobs[i].segment = d;
+        if (pthread_create(&jobs[i].thread, NULL, fetch_segment, &jobs[i]) != 0)
+        {
+            fprintf(stderr, "Client: Could not start a download thread\n");
+            count = i;
+            complete = false;
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        pthread_join(jobs[i].thread, NULL);
+        if (i > 0 && extra[i].ssl != NULL)
+            send_frame(extra[i].ssl, OP_EXIT, ++extra[i].request_id, NULL, 0);
+        if (i > 0)
+            close_connection(&extra[i]);
+        complete = complete && jobs[i].ok && !segments[i].failed && segments[i].pos == segments[i].end;
+    }
+    complete = complete && stat(local, &fileInfo) == 0 && (unsigned long long)fileInfo.st_size == size;
+    if (!complete)
+    {
+        fprintf(stderr, "Client: Parallel download of '%s' failed, discarding what arrived\n", remote);
+        unlink(local);
+        return count == 0 || jobs[0].ok;
+    }
+
+    write_etag(etagfile, etag);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stdout,
+            "Client: Successfully transferred file '%s' (%llu bytes over %d connections in %.3f s, %.2f MB/s) "
+            "from server\n",
+            remote, size, count, seconds, size / seconds / 1e6);
+    return true;
+}
+
+/******************************************************************************
+
+Download a file a segment at a time, from version 9.  The file's manifest
+lists its segments, a few seconds of audio each, and the SHA-256 of each
+one's bytes.  Each segment is then asked for by its hash, checked against it
+as it arrives and written at its place in the local file, so the first can
+be played as soon as it is in, which is reported.
+
+A segment that arrives damaged is fetched again, and a lost connection is
+restored and carries on with the segment it was on, so nothing already in
+is fetched twice.  Segments the local file holds already, which their hashes
+show, aren't fetched at all, so a download that was cut short, even by the
+client stopping, picks up where it left off.  If the file changes on the
+server in between, its segments are gone and the download stops.  Returns
+false only if the connection was lost for good.
+
+******************************************************************************/
+struct manifest_entry
+{
+    unsigned long long offset;
+    unsigned long long length;
+    unsigned char hash[SEGMENT_HASH_SIZE];
+};
+
+// How fetching one segment went
+enum segment_result
+{
+    SEGMENT_OK,
+    SEGMENT_DAMAGED, // Its bytes don't match its hash
+    SEGMENT_FAILED,  // The server or the local file refused, so the download stops
+    SEGMENT_LOST     // The connection failed
+};
+
+// Ask for a file's manifest.  *count is 0, having said why, if the server
+// refused.  Returns false if the connection failed.
+bool fetch_manifest(struct connection *conn, const char *remote, struct manifest_entry **entries, size_t *count,
+                    unsigned char *etag)
+{
+    unsigned char *payload = malloc(FRAME_MAX_PAYLOAD);
+    uint32_t id = ++conn->request_id;
+    struct frame_header hdr;
+    size_t capacity = 0;
+    bool connected = false;
+
+    *entries = NULL;
+    *count = 0;
+    if (payload == NULL || !send_frame(conn->ssl, OP_MANIFEST, id, remote, strlen(remote)))
+    {
+        free(payload);
+        return false;
+    }
+
+    while (read_frame(conn->ssl, &hdr, payload, FRAME_MAX_PAYLOAD) && hdr.request_id == id)
+    {
+        if (hdr.opcode == OP_SEGMENTS)
+        {
+            for (size_t at = 0; at + SEGMENT_RECORD_SIZE <= hdr.length; at += SEGMENT_RECORD_SIZE)
+            {
+                struct manifest_entry *e;
+
+                if (*count == capacity)
+                {
+                    capacity = capacity > 0 ? capacity * 2 : 256;
+                    if ((e = realloc(*entries, capacity * sizeof(*e))) == NULL)
+                        break;
+                    *entries = e;
+                }
+                e = &(*entries)[(*count)++];
+                e->offset = get_u64(payload + at);
+                e->length = get_u64(payload + at + 8);
+                memcpy(e->hash, payload + at + 24, SEGMENT_HASH_SIZE);
+            }
+            continue;
+        }
+        if (hdr.opcode == OP_SEGMENTS_END && hdr.length >= ETAG_SIZE)
+        {
+            memcpy(etag, payload, ETAG_SIZE);
+            free(payload);
+            return true;
+        }
+        if (hdr.opcode == OP_ERROR)
+        {
+            fprintf(stderr, "Client: '%s': ", remote);
+            print_error(payload);
+            connected = true;
+        }
+        break;
+    }
+    free(payload);
+    free(*entries);
+    *entries = NULL;
+    *count = 0;
+    return connected;
+}
+
+// Does the local file hold a segment already?
+bool have_segment(int fd, const struct manifest_entry *e)
+{
+    char data[TRANSFER_SIZE];
+    unsigned char hash[SEGMENT_HASH_SIZE];
+    unsigned long long pos = e->offset, end = e->offset + e->length;
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    bool same = md != NULL && EVP_DigestInit_ex(md, EVP_sha256(), NULL);
+
+    while (same && pos < end)
+    {
+        size_t n = end - pos < sizeof(data) ? end - pos : sizeof(data);
+
+        same = pread(fd, data, n, pos) == (ssize_t)n && EVP_DigestUpdate(md, data, n);
+        pos += n;
+    }
+    same = same && EVP_DigestFinal_ex(md, hash, NULL) && memcmp(hash, e->hash, SEGMENT_HASH_SIZE) == 0;
+    EVP_MD_CTX_free(md);
+    return same;
+}
+
+// Fetch one segment by its hash and write it at its place in 'fd'
+enum segment_result fetch_segment_by_hash(struct connection *conn, const char *remote, const struct manifest_entry *e,
+                                          int fd)
+{
+    unsigned char request[SEGMENT_HASH_SIZE + PATH_LENGTH + sizeof(SERVER_DIR)];
+    unsigned char payload[REPLY_SIZE], hash[SEGMENT_HASH_SIZE];
+    char data[TRANSFER_SIZE];
+    size_t namelen = strlen(remote);
+    uint32_t id = ++conn->request_id;
+    unsigned long long pos = e->offset, end = e->offset + e->length;
+    enum segment_result result = SEGMENT_LOST;
+    bool written = true;
+    struct frame_header hdr;
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+
+    memcpy(request, e->hash, SEGMENT_HASH_SIZE);
+    memcpy(request + SEGMENT_HASH_SIZE, remote, namelen);
+    if (md == NULL || !EVP_DigestInit_ex(md, EVP_sha256(), NULL) ||
+        !send_frame(conn->ssl, OP_SEGMENT, id, request, SEGMENT_HASH_SIZE + namelen))
+    {
+        EVP_MD_CTX_free(md);
+        return SEGMENT_LOST;
+    }
+
+    while (result == SEGMENT_LOST && read_frame(conn->ssl, &hdr, payload, sizeof(payload)) && hdr.request_id == id)
+    {
+        if (hdr.opcode == OP_FILE_DATA)
+        {
+            size_t left = hdr.length;
+
+            // Whatever arrives is hashed, but only the segment's own range written
+            for (size_t n; left > 0; left -= n, pos += n)
+            {
+                n = left < sizeof(data) ? left : sizeof(data);
+                if (!read_full(conn->ssl, data, n))
+                    break;
+                EVP_DigestUpdate(md, data, n);
+                if (written && pos + n <= end && pwrite(fd, data, n, pos) != (ssize_t)n)
+                {
+                    fprintf(stderr, "Client: Could not write file: %s\n", strerror(errno));
+                    written = false;
+                }
+            }
+            if (left > 0)
+                break;
+        }
+        else if (hdr.opcode == OP_FILE_END)
+        {
+            EVP_DigestFinal_ex(md, hash, NULL);
+            if (!written)
+                result = SEGMENT_FAILED;
+            else if (pos != end || memcmp(hash, e->hash, SEGMENT_HASH_SIZE) != 0)
+                result = SEGMENT_DAMAGED;
+            else
+                result = SEGMENT_OK;
+        }
+        else if (hdr.opcode == OP_ERROR)
+        {
+            fprintf(stderr, "Client: '%s': ", remote);
+            print_error(payload);
+            result = SEGMENT_FAILED;
+        }
+        else if (hdr.opcode != OP_FILE_BEGIN)
+            break;
+    }
+    EVP_MD_CTX_free(md);
+    return result;
+}
+
+bool download_segmented(struct connection *conn, const char *remote, const char *local)
+{
+    struct manifest_entry *entries;
+    enum segment_result result = SEGMENT_OK;
+    unsigned char etag[ETAG_SIZE];
+    char etagfile[PATH_MAX + 8];
+    struct timespec start, now;
+    size_t count, fetched = 0, i = 0;
+    double first = 0;
+    int attempt = 0, fd;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!fetch_manifest(conn, remote, &entries, &count, etag))
+        return false;
+    if (count == 0)
+        return true;
+
+    // Until every segment is in, the local copy is no version of the file
+    etag_path(etagfile, sizeof(etagfile), local);
+    unlink(etagfile);
+    if ((fd = open(local, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0)
+    {
+        fprintf(stderr, "Client: Could not create '%s': %s\n", local, strerror(errno));
+        free(entries);
+        return true;
+    }
+
+    while (i < count && result != SEGMENT_FAILED)
+    {
+        if (result == SEGMENT_DAMAGED || !have_segment(fd, &entries[i]))
+        {
+            result = conn->ssl != NULL ? fetch_segment_by_hash(conn, remote, &entries[i], fd) : SEGMENT_LOST;
+            if (result == SEGMENT_DAMAGED && ++attempt <= RECONNECT_ATTEMPTS)
+                fprintf(stderr, "Client: Segment %zu of '%s' arrived damaged, fetching it again\n", i, remote);
+            else if (result == SEGMENT_DAMAGED)
+                result = SEGMENT_FAILED;
+            if (result == SEGMENT_LOST)
+            {
+                close_connection(conn);
+                if (++attempt > RECONNECT_ATTEMPTS)
+                {
+                    fprintf(stderr, "Client: Giving up after %d attempts to reconnect\n", RECONNECT_ATTEMPTS);
+                    break;
+                }
+                sleep(attempt);
+                fprintf(stderr, "Client: Reconnecting to resume downloads (attempt %d of %d)\n", attempt,
+                        RECONNECT_ATTEMPTS);
+                if (connect_server(conn))
+                    login(conn);
+            }
+            if (result != SEGMENT_OK)
+                continue;
+            fetched++;
+            attempt = 0;
+        }
+        if (i++ == 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            first = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+        }
+    }
+
+    // Anything past the last segment is left over from another version
+    if (i == count && ftruncate(fd, entries[count - 1].offset + entries[count - 1].length) == 0)
+    {
+        write_etag(etagfile, etag);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        fprintf(stdout,
+                "Client: Successfully transferred file '%s' (%llu bytes, %zu of %zu segments fetched, playable "
+                "after %.3f s, all in %.3f s) from server\n",
+                remote, entries[count - 1].offset + entries[count - 1].length, fetched, count, first,
+                (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9);
+    }
+    else
+        fprintf(stderr, "Client: Download of '%s' stopped after %zu of %zu segments\n", remote, i, count);
+    close(fd);
+    free(entries);
+    return conn->ssl != NULL;
+}
+
+/******************************************************************************
+
+Save a preview clip of 'remote', 'length' ms from 'start' or the server's
+default with 0, to 'local'.  A clip is small and made on the spot, so one
+that is cut short is fetched again from the start rather than resumed.
+Returns false if the connection was lost.
+
+******************************************************************************/
+bool fetch_preview(struct connection *conn, const char *remote, uint32_t start, uint32_t length, const char *local)
+{
+    unsigned char request[PREVIEW_HEADER_SIZE + PATH_LENGTH + sizeof(SERVER_DIR)];
+    unsigned char payload[REPLY_SIZE];
+    char data[TRANSFER_SIZE];
+    size_t namelen = strlen(remote);
+    uint32_t id = ++conn->request_id;
+    unsigned long long received = 0;
+    struct frame_header hdr;
+    int fd = -1;
+
+    put_u32(request, start);
+    put_u32(request + 4, length);
+    memcpy(request + PREVIEW_HEADER_SIZE, remote, namelen);
+    if (!send_frame(conn->ssl, OP_PREVIEW, id, request, PREVIEW_HEADER_SIZE + namelen))
+        return false;
+
+    while (read_frame(conn->ssl, &hdr, payload, sizeof(payload)) && hdr.request_id == id)
+    {
+        if (hdr.opcode == OP_FILE_BEGIN)
+        {
+            if ((fd = open(local, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0)
+                fprintf(stderr, "Client: Could not create '%s': %s\n", local, strerror(errno));
+        }
+        else if (hdr.opcode == OP_FILE_DATA)
+        {
+            size_t left = hdr.length;
+
+            for (size_t n; left > 0; left -= n, received += n)
+            {
+                n = left < sizeof(data) ? left : sizeof(data);
+                if (!read_full(conn->ssl, data, n))
+                    break;
+                if (fd >= 0 && write(fd, data, n) != (ssize_t)n)
+                {
+                    fprintf(stderr, "Client: Could not write file: %s\n", strerror(errno));
+                    close(fd);
+                    fd = -1;
+                }
+            }
+            if (left > 0)
+                break;
+        }
+        else if (hdr.opcode == OP_FILE_END)
+        {
+            if (fd >= 0)
+                fprintf(stdout, "Client: Saved a preview of '%s' as '%s' (%llu bytes)\n", remote, local, received);
+            close(fd);
+            return true;
+        }
+        else if (hdr.opcode == OP_ERROR)
+        {
+            fprintf(stderr, "Client: '%s': ", remote);
+            print_error(payload);
+            return true;
+        }
+        else
+            break;
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+        unlink(local);
+    }
+    return false;
+}
+
+/******************************************************************************
+
+Record 'seconds' of a radio channel into CLIENT_DIR/<channel>.mp3.  A session
+that has tuned in sends nothing but the channel's audio from then on, so the
+recording is made over a connection of its own and the menu's connection
+stays free.  The audio starts a couple of seconds before the moment of tuning
+in, always on a frame, so the file plays from its first byte.
+
+******************************************************************************/
+void record_radio(struct connection *conn, const char *channel, unsigned int seconds)
+{
+    struct connection radio = *conn;
+    unsigned char payload[REPLY_SIZE];
+    char local[PATH_MAX];
+    struct frame_header hdr;
+    struct timespec start, now;
+    unsigned long long bytes = 0;
+    int fd = -1;
+
+    snprintf(local, sizeof(local), "%s%s.mp3", CLIENT_DIR, channel);
+    radio.quiet = true;
+    radio.ssl = NULL;
+    radio.sockfd = -1;
+    radio.request_id = 0;
+    if (!connect_server(&radio) || !login(&radio) ||
+        !send_frame(radio.ssl, OP_TUNE, ++radio.request_id, channel, strlen(channel)))
+    {
+        fprintf(stderr, "Client: Could not tune in to channel %s\n", channel);
+        close_connection(&radio);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    now = start;
+    while (now.tv_sec - start.tv_sec < seconds && read_frame(radio.ssl, &hdr, payload, sizeof(payload)))
+    {
+        if (hdr.opcode == OP_ERROR)
+        {
+            print_error(payload);
+            break;
+        }
+
+        // The file is only made once there is audio to put in it
+        if (hdr.opcode == OP_RADIO_DATA)
+        {
+            if (fd < 0 && (fd = open(local, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0)
+            {
+                fprintf(stderr, "Client: Could not create '%s': %s\n", local, strerror(errno));
+                break;
+            }
+            if (write(fd, payload, hdr.length) != (ssize_t)hdr.length)
+            {
+                fprintf(stderr, "Client: Could not write '%s': %s\n", local, strerror(errno));
+                break;
+            }
+            bytes += hdr.length;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+    if (fd >= 0)
+        close(fd);
+    if (bytes > 0)
+        fprintf(stdout, "Client: Recorded %llu bytes of channel %s to '%s'\n", bytes, channel, local);
+    SSL_shutdown(radio.ssl);
+    close_connection(&radio);
+}
+
+/******************************************************************************
+
+The sequence of steps required to establish a secure SSL/TLS connection is:
+
+1.  Initialize the SSL algorithms
+2.  Create and configure an SSL context object
+3.  Connect to the server with connect_server(), which creates the socket and
+    the SSL session object and establishes the session
+
+Once these steps are completed successfully, use the functions SSL_read() and
+SSL_write() to read from/write to the socket, but using the SSL object rather
+then the socket descriptor.  Once the session is complete, free the memory
+allocated to the SSL object and close the socket descriptor.
+
+******************************************************************************/
+
+// Function prototypes
+int playFile(char input[PATH_MAX]);
+int listFiles(char dirName[PATH_MAX]);
+
+int main(int argc, char **argv)
+{
+    const SSL_METHOD *method;
+    unsigned int port = DEFAULT_PORT;
+    char remote_host[MAX_HOSTNAME_LENGTH];
+    char command[PATH_LENGTH] = {0};
+    char *temp_ptr;
+    char playChoice;
+    SSL_CTX *ssl_ctx;
+    int parallel = 0; // Connections per file with --parallel
+    bool usage = false;
+    int opt;
+
+    static const struct option options[] = {
+        {"parallel", required_argument, NULL, 'n'},
+        {NULL, 0, NULL, 0}};
+
+    while ((opt = getopt_long(argc, argv, "n:", options, NULL)) != -1)
+    {
+        parallel = opt == 'n' ? atoi(optarg) : 0;
+        usage = usage || parallel < 1 || parallel > MAX_PARALLEL;
+    }
+
+    if (usage || argc - optind != 1)
+    {
+        fprintf(stderr, "Client: Usage: ssl-client [--parallel N] <server name>:<port>\n");
+        fprintf(stderr, "  -n, --parallel N  download each file over N connections at once (at most %d)\n",
+                MAX_PARALLEL);
+        exit(EXIT_FAILURE);
+    }
+    else
+    {
+        argv += optind - 1;
+
+        // Search for ':' in the argument to see if port is specified
+        temp_ptr = strchr(argv[1], ':');
+        if (temp_ptr == NULL) // Hostname only. Use default port
+            strncpy(remote_host, argv[1], MAX_HOSTNAME_LENGTH);
+        else
+        {
+            // Argument is formatted as <hostname>:<port>. Need to separate
+            // First, split out the hostname from port, delineated with a colon
+            // remote_host will have the <hostname> substring
+            strncpy(remote_host, strtok(argv[1], ":"), MAX_HOSTNAME_LENGTH);
+            // Port number will be the substring after the ':'. At this point
+            // temp is a pointer to the array element containing the ':'
+            port = (unsigned int)atoi(temp_ptr + sizeof(char));
+        }
+    }
+
+    // Initialize OpenSSL ciphers and digests
+    OpenSSL_add_all_algorithms();
+
+    // SSL_library_init() registers the available SSL/TLS ciphers and digests.
+    if (SSL_library_init() < 0)
+    {
+        fprintf(stderr, "Client: Could not initialize the OpenSSL library!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Use the SSL/TLS method for clients
+    method = SSLv23_client_method();
+
+    // Create new context instance
+    ssl_ctx = SSL_CTX_new(method);
+    if (ssl_ctx == NULL)
+    {
+        fprintf(stderr, "Unable to create a new SSL context structure.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // This disables SSLv2, which means only SSLv3 and TLSv1 are available
+    // to be negotiated between client and server
+    SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_SSLv2);
+
+    // Hand every session the server gives us to save_session(), so that the
+    // next connection can resume it
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ssl_ctx, save_session);
+
+    char password[PASSWORD_LENGTH];
+    char username[USERNAME_LENGTH];
+    char filename[PATH_LENGTH];
+    char filenames[MAX_DOWNLOADS * PATH_LENGTH];
+    char nameAndPath[PATH_LENGTH + strlen(filename)];
+    struct connection conn = {
+        .ssl_ctx = ssl_ctx, .hostname = remote_host, .port = port, .username = username, .password = password};
+
+    snprintf(conn.session_file, sizeof(conn.session_file), "%s.%s-%u.session", CLIENT_DIR, remote_host, port);
+    snprintf(conn.token_file, sizeof(conn.token_file), "%s.%s-%u.token", CLIENT_DIR, remote_host, port);
+
+    if (!connect_server(&conn))
+        exit(EXIT_FAILURE);
+
+    fprintf(stdout, "Enter username: \n");
+    fgets(username, USERNAME_LENGTH, stdin);
+    username[strcspn(username, "\n")] = '\0';
+
+    fprintf(stdout, "Enter password: \n");
+    getPassword(password);
+
+    if (!login(&conn))
+        exit(EXIT_FAILURE);
+
+    while (true)
+    {
+        // Request filename from user and strip trailing newline character
+        fprintf(stdout, "Enter 1 to list dir, 2 to download file, 3 to play local file, 4 to exit, "
+                        "5 to show a file's tags, 6 to search, 7 to record a radio channel, 8 to download by "
+                        "segments, 9 to save a preview and 10 to show the server's stats: ");
+        fgets(command, PATH_LENGTH, stdin);
+        // command[strlen(command)-1] = '\0';
+
+        int cmd = atoi(command);
+        // first if command to check if directory change
+        if (cmd == 1)
+        {
+            struct ls_options options;
+            bool paged = false;
+
+            // Since version 6 the listing can be filtered, sorted and paged
+            if (conn.version >= 6)
+            {
+                fprintf(stdout, "List options (-n entries per page, -s name|size|mtime, -r to reverse, "
+                                "a prefix or pattern), or enter for everything: ");
+                fgets(command, PATH_LENGTH, stdin);
+                command[strcspn(command, "\n")] = '\0';
+                if (!parse_ls_options(command, &options))
+                {
+                    fprintf(stderr, "Client: Unknown list options '%s'\n", command);
+                    continue;
+                }
+                paged = command[strspn(command, " ")] != '\0';
+            }
+            if (!list_remote(conn.ssl, ++conn.request_id, paged ? &options : NULL))
+                break;
+
+            // else if block for downloading
+        }
+        else if (cmd == 2) //for downloading files
+        {
+            struct download downloads[MAX_DOWNLOADS];
+            char remotePaths[MAX_DOWNLOADS][PATH_LENGTH + sizeof(SERVER_DIR)];
+            int count = 0;
+
+            // Request file path(s) from user.  Several names separated by
+            // spaces are downloaded at the same time, and "name@12:30"
+            // starts twelve and a half minutes into the file.
+            fprintf(stdout, "Enter filename(s): ");
+            fgets(filenames, sizeof(filenames), stdin);
+
+            for (char *name = strtok(filenames, " \t\n"); name != NULL && count < MAX_DOWNLOADS;
+                 name = strtok(NULL, " \t\n"))
+            {
+                char *at = strrchr(name, '@'), *ext;
+
+                downloads[count].at = NULL;
+                if (at != NULL && parse_time(at + 1, &downloads[count].ms))
+                {
+                    if (conn.version < 7)
+                    {
+                        fprintf(stderr, "Client: The server can't start '%s' at a time\n", name);
+                        continue;
+                    }
+                    *at = '\0';
+                    downloads[count].at = at + 1;
+                }
+
+                // Combine path to data folder with filename, and path to client
+                // data folder with filename.  The part from a time is kept as
+                // "name@time.mp3".
+                snprintf(remotePaths[count], sizeof(remotePaths[count]), "%s%s", SERVER_DIR, name);
+                if (downloads[count].at != NULL)
+                {
+                    ext = strrchr(name, '.');
+                    ext = ext != NULL ? ext : name + strlen(name);
+                    snprintf(downloads[count].local, sizeof(downloads[count].local), "%s%.*s@%s%s", CLIENT_DIR,
+                             (int)(ext - name), name, downloads[count].at, ext);
+                }
+                else
+                    snprintf(downloads[count].local, sizeof(downloads[count].local), "%s%s", CLIENT_DIR, name);
+                downloads[count].remote = remotePaths[count];
+                downloads[count].fd = -1;
+                downloads[count].done = false;
+                count++;
+            }
+
+            // With --parallel the files are fetched one after another, each
+            // over several connections.  Version 1 servers can't send ranges.
+            if (parallel > 0 && conn.version >= 2)
+            {
+                bool connected = true;
+
+                // A download by time is only part of the file, fetched as usual
+                for (int i = 0; i < count && connected; i++)
+                    connected = downloads[i].at != NULL
+                                    ? download_with_retries(&conn, &downloads[i], 1)
+                                    : download_parallel(&conn, downloads[i].remote, downloads[i].local, parallel);
+                if (!connected)
+                    break;
+            }
+            else if (count > 0 && !download_with_retries(&conn, downloads, count))
+                break;
+        }
+        else if (cmd == 3)
+        {
+            // Prompts user to play local file or not
+            listFiles("./localData");
+            printf("Play local file? (y/n)\n");
+            scanf("%c", &playChoice);
+
+            char filePath[PATH_MAX];
+
+            if (playChoice == 'y')
+            {
+                printf("Enter filename to play song\n");
+
+                // Clear variable before setting again
+                bzero(nameAndPath, PATH_LENGTH);
+
+                //filename input
+                scanf("%s", filename);
+
+                // Combine path to client data folder with filename
+                sprintf(nameAndPath, "%s%s", CLIENT_DIR, filename);
+
+
+                printf("Playing file %s...\n", nameAndPath);
+                playFile(nameAndPath);
+            }
+            else if (playChoice == 'n')
+            {
+                printf("Canceled by user");
+                exit(EXIT_SUCCESS);
+            }
+            else
+            {
+                printf("Invalid input");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (cmd == 4) // exit issuing commands
+        {
+            send_frame(conn.ssl, OP_EXIT, ++conn.request_id, NULL, 0);
+            break;
+        }
+        else if ((cmd == 5 || cmd == 6) && conn.version < 4)
+        {
+            fprintf(stderr, "Client: Server '%s' does not keep track metadata\n", remote_host);
+        }
+        else if (cmd == 5)
+        {
+            fprintf(stdout, "Enter filename: ");
+            fgets(filename, sizeof(filename), stdin);
+            filename[strcspn(filename, "\n")] = '\0';
+            if (!show_metadata(&conn, filename))
+                break;
+        }
+        else if (cmd == 6)
+        {
+            static const char *fields[] = {"title", "artist", "album", "year", "any"};
+            char query[SEARCH_QUERY_MAX + 2];
+            int field = -1;
+
+            if (conn.version >= 5)
+                fprintf(stdout, "Search by title, artist, album, year or any: ");
+            else
+                fprintf(stdout, "Search by title, artist, album or year: ");
+            fgets(command, PATH_LENGTH, stdin);
+            command[strcspn(command, "\n")] = '\0';
+            for (int i = 0; i < (int)(sizeof(fields) / sizeof(fields[0])); i++)
+            {
+                if (strcmp(command, fields[i]) == 0)
+                    field = i;
+            }
+            if (field < 0 || (field == SEARCH_ANY && conn.version < 5))
+            {
+                fprintf(stderr, "Client: Unknown field '%s'\n", command);
+                continue;
+            }
+            fprintf(stdout, "Enter search text: ");
+            fgets(query, sizeof(query), stdin);
+            query[strcspn(query, "\n")] = '\0';
+            if (!search_remote(&conn, field, query))
+                break;
+        }
+        else if (cmd == 7 && conn.version < 8)
+        {
+            fprintf(stderr, "Client: Server '%s' has no radio channels\n", remote_host);
+        }
+        else if (cmd == 7)
+        {
+            char channel[PATH_LENGTH];
+            unsigned int seconds;
+
+            fprintf(stdout, "Enter channel and seconds to record: ");
+            fgets(command, PATH_LENGTH, stdin);
+            if (sscanf(command, "%247s %u", channel, &seconds) != 2 || seconds == 0)
+            {
+                fprintf(stderr, "Client: Expected a channel name and a number of seconds\n");
+                continue;
+            }
+            record_radio(&conn, channel, seconds);
+        }
+        else if (cmd == 8 && conn.version < 9)
+        {
+            fprintf(stderr, "Client: Server '%s' does not cut files into segments\n", remote_host);
+        }
+        else if (cmd == 8)
+        {
+            char remote[PATH_LENGTH + sizeof(SERVER_DIR)], local[PATH_MAX];
+
+            fprintf(stdout, "Enter filename: ");
+            fgets(filename, sizeof(filename), stdin);
+            filename[strcspn(filename, "\n")] = '\0';
+            snprintf(remote, sizeof(remote), "%s%s", SERVER_DIR, filename);
+            snprintf(local, sizeof(local), "%s%s", CLIENT_DIR, filename);
+            if (!download_segmented(&conn, remote, local))
+                break;
+        }
+        else if (cmd == 9 && conn.version < 10)
+        {
+            fprintf(stderr, "Client: Server '%s' does not make previews\n", remote_host);
+        }
+        else if (cmd == 9)
+        {
+            char remote[PATH_LENGTH + sizeof(SERVER_DIR)], local[PATH_MAX], at[PATH_LENGTH] = "0";
+            unsigned int seconds = 0;
+            uint64_t start;
+            char *ext;
+
+            // "name 1:30 20" is the 20 seconds from a minute and a half in
+            fprintf(stdout, "Enter filename, and optionally a start time and seconds: ");
+            fgets(command, PATH_LENGTH, stdin);
+            if (sscanf(command, "%247s %247s %u", filename, at, &seconds) < 1 || !parse_time(at, &start) ||
+                start > UINT32_MAX || seconds > UINT32_MAX / 1000)
+            {
+                fprintf(stderr, "Client: Expected a filename, a time and a number of seconds\n");
+                continue;
+            }
+            ext = strrchr(filename, '.');
+            ext = ext != NULL ? ext : filename + strlen(filename);
+            snprintf(remote, sizeof(remote), "%s%s", SERVER_DIR, filename);
+            snprintf(local, sizeof(local), "%s%.*s.preview%s", CLIENT_DIR, (int)(ext - filename), filename, ext);
+            if (!fetch_preview(&conn, remote, start, seconds * 1000, local))
+                break;
+        }
+        else if (cmd == 10 && conn.version < 11)
+        {
+            fprintf(stderr, "Client: Server '%s' does not report stats\n", remote_host);
+        }
+        else if (cmd == 10)
+        {
+            if (!show_stats(&conn))
+                break;
+        }
+    }
+
+    // Deallocate memory for the SSL data structures and close the socket
+    close_connection(&conn);
+    SSL_CTX_free(ssl_ctx);
+    fprintf(stdout, "Client: Terminated SSL/TLS connection with server '%s'\n", remote_host);
+
+    return (0);
+}
+
+int playFile(char input[PATH_MAX])
+{
+    // metadata strings from ID3 tag
+    char buffer[128];
+    char title[31];
+    char artist[31];
+    char album[31];
+    char year[5];
+    char filePath[PATH_MAX];
+
+    int fd;
+    int flags = MIX_INIT_MP3;
+    int result;
+
+    fd = open(input, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Could not open file. Error: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    // End of mp3 file contains metadata, so go to end and shift left 128 bytes to read the tag
+    lseek(fd, -128L, SEEK_END);
+
+    // Now, can start reading 128-byte tag from where we seeked to above
+    read(fd, buffer, 128);
+    close(fd);
+
+    // first 3 bytes are just "ID3", every 30 bytes following are each metadata field
+    strncpy(title, buffer + 3, 30);
+    strncpy(artist, buffer + 33, 30);
+    strncpy(album, buffer + 63, 30);
+    strncpy(year, buffer + 93, 4);
+
+    printf("Now Playing:\n");
+    printf("  Title: %s\n", title);
+    printf("  Artist: %s\n", artist);
+    printf("  Album: %s\n", album);
+    printf("  Year: %s\n", year);
+
+    // Start mixer, check for errors
+    result = Mix_Init(flags);
+    if (flags != result)
+    {
+        fprintf(stderr, "Could not initialize mixer (result: %d).\n", result);
+        fprintf(stderr, "playaudio: %s\n", Mix_GetError());
+        return EXIT_FAILURE;
+    }
+
+    // Open MP3 file
+    if (Mix_OpenAudio(44100, AUDIO_S16SYS, 2, 1024) < 0)
+    {
+        fprintf(stderr, "playaudio: %s\n", Mix_GetError());
+        return EXIT_FAILURE;
+    }
+
+    // Load music file passed to method
+    Mix_Music *music = Mix_LoadMUS(input);
+    if (!music)
+    {
+        fprintf(stderr, "playaudio: %s\n", Mix_GetError());
+        return EXIT_FAILURE;
+    }
+
+    // plays song one time
+    Mix_PlayMusic(music, 1);
+
+    // Program ends immediately unless this is here, in which case it ends once music stops
+    while (1)
+    {
+        SDL_Delay(200);
+        if (Mix_PlayingMusic() == 0)
+            break;
+    }
+
+    Mix_FreeMusic(music);
+    Mix_CloseAudio();
+    Mix_Quit();
+
+    return EXIT_SUCCESS;
+}
+
+int listFiles(char dirName[PATH_MAX])
+{
+    struct dirent *de;
+
+    DIR *dr;
+
+    dr = opendir(dirName);
+
+    if (dr == NULL)
+    {
+        printf("Could not open current directory\n");
+        return 0;
+    }
+
+    printf("Locally stored mp3 files:\n");
+
+    while ((de = readdir(dr)) != NULL)
+    {
+        printf("%s\n", de->d_name);
+    }
+    closedir(dr);
+    return 0;
+}
@@ -1,545 +1,3275 @@
-/******************************************************************************
-
-PROGRAM:  ssl-server.c
-AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
-SYNOPSIS: This program is a small server application that receives incoming TCP
-          connections from clients and transfers a requested file from the
-          server to the client.  It uses a secure SSL/TLS connection using
-          a certificate generated with the openssl application.
-
-          To create a self-signed certificate your server can use, at the command
-          prompt type:
-
-          openssl req -newkey rsa:2048 -nodes -keyout key.pem -x509 -days 365 -out cert.pem
-
-          This will create two files: a private key contained in the file 'key.pem'
-          and a certificate containing a public key in the file 'cert.pem'.  Your
-          server will require both in order to operate properly.
-
-          Some of the code and descriptions can be found in "Network Security with
-          OpenSSL", O'Reilly Media, 2002.
-
-******************************************************************************/
-#include <fcntl.h>
-#include <stdio.h>
-#include <string.h>
-#include <unistd.h>
-#include <stdbool.h>
-#include <sys/stat.h>
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <openssl/ssl.h>
-#include <openssl/err.h>
-#include <time.h>
-#include <crypt.h>
-#include <stdio.h>
-#include <string.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <termios.h>
-#include <dirent.h>
-
-#define BUFFER_SIZE 264
-#define PATH_LENGTH 256
-#define DEFAULT_PORT 4433
-#define CERTIFICATE_FILE "cert.pem"
-#define KEY_FILE "key.pem"
-
-#define ERR_TOO_FEW_ARGS 1
-#define ERR_TOO_MANY_ARGS 2
-#define ERR_INVALID_OP 3
-
-// For Authenticaion
-#define PASSWORD_LENGTH 32
-#define SEED_LENGTH 8
-#define USERNAME_LENGTH 32
-
-/******************************************************************************
-
-This function does the basic necessary housekeeping to establish TCP connections
-to the server.  It first creates a new socket, binds the network interface of the
-machine to that socket, then listens on the socket for incoming TCP connections.
-
-*******************************************************************************/
-int create_socket(unsigned int port)
-{
-    int s;
-    struct sockaddr_in addr;
-
-    // First we set up a network socket. An IP socket address is a combination
-    // of an IP interface address plus a 16-bit port number. The struct field
-    // sin_family is *always* set to AF_INET. Anything else returns an error.
-    // The TCP port is stored in sin_port, but needs to be converted to the
-    // format on the host machine to network byte order, which is why htons()
-    // is called. Setting s_addr to INADDR_ANY binds the socket and listen on
-    // any available network interface on the machine, so clients can connect
-    // through any, e.g., external network interface, localhost, etc.
-
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-
-    // Create a socket (endpoint) for network communication.  The socket()
-    // call returns a socket descriptor, which works exactly like a file
-    // descriptor for file system operations we worked with in CS431
-    //
-    // Sockets are by default blocking, so the server will block while reading
-    // from or writing to a socket. For most applications this is acceptable.
-    s = socket(AF_INET, SOCK_STREAM, 0);
-    if (s < 0)
-    {
-        fprintf(stderr, "Server: Unable to create socket: %s", strerror(errno));
-        exit(EXIT_FAILURE);
-    }
-
-    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
-
-    // When you create a socket, it exists within a namespace, but does not have
-    // a network address associated with it.  The bind system call creates the
-    // association between the socket and the network interface.
-    //
-    // An error could result from an invalid socket descriptor, an address already
-    // in use, or an invalid network address
-    if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0)
-    {
-        fprintf(stderr, "Server: Unable to bind to socket: %s", strerror(errno));
-        exit(EXIT_FAILURE);
-    }
-
-    // Listen for incoming TCP connections using the newly created and configured
-    // socket. The second argument (1) indicates the number of pending connections
-    // allowed, which in this case is one.  That means if the server is connected
-    // to one client, a second client attempting to connect may receive an error,
-    // e.g., connection refused.
-    //
-    // Failure could result from an invalid socket descriptor or from using a socket
-    // descriptor that is already in use.
-    if (listen(s, 1) < 0)
-    {
-        fprintf(stderr, "Server: Unable to listen: %s", strerror(errno));
-        exit(EXIT_FAILURE);
-    }
-
-    fprintf(stdout, "Server: Listening on TCP port %u\n", port);
-
-    return s;
-}
-
-/******************************************************************************
-
-This function does some initialization of the OpenSSL library functions used in
-this program.  The function SSL_load_error_strings registers the error strings
-for all of the libssl and libcrypto functions so that appropriate textual error
-messages can be displayed when error conditions arise.  OpenSSL_add_ssl_algorithms
-registers the available SSL/TLS ciphers and digests used for encryption.
-
-******************************************************************************/
-void init_openssl()
-{
-    SSL_load_error_strings();
-    OpenSSL_add_ssl_algorithms();
-}
-
-/******************************************************************************
-
-EVP_cleanup removes all of the SSL/TLS ciphers and digests registered earlier.
-
-******************************************************************************/
-void cleanup_openssl()
-{
-    EVP_cleanup();
-}
-
-/******************************************************************************
-
-An SSL_CTX object is an instance of a factory design pattern that produces SSL
-connection objects, each called a context. A context is used to set parameters
-for the connection, and in this program, each context is configured using the
-configure_context() function below. Each context object is created using the
-function SSL_CTX_new(), and the result of that call is what is returned by this
-function and subsequently configured with connection information.
-
-One other thing to point out is when creating a context, the SSL protocol must
-be specified ahead of time using an instance of an SSL_method object.  In this
-case, we are creating an instance of an SSLv23_server_method, which is an
-SSL_METHOD object for an SSL/TLS server. Of the available types in the OpenSSL
-library, this provides the most functionality.
-
-******************************************************************************/
-SSL_CTX *create_new_context()
-{
-    const SSL_METHOD *ssl_method; // This should be declared 'const' to avoid getting
-                                  // a warning from the call to SSLv23_server_method()
-    SSL_CTX *ssl_ctx;
-
-    // Use SSL/TLS method for server
-    ssl_method = SSLv23_server_method();
-
-    // Create new context instance
-    ssl_ctx = SSL_CTX_new(ssl_method);
-    if (ssl_ctx == NULL)
-    {
-        fprintf(stderr, "Server: cannot create SSL context:\n");
-        ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
-    }
-
-    return ssl_ctx;
-}
-
-/******************************************************************************
-
-We will use Elliptic Curve Diffie Hellman anonymous key agreement protocol for
-the session key shared between client and server.  We first configure the SSL
-context to use that protocol by calling the function SSL_CTX_set_ecdh_auto().
-The second argument (onoff) tells the function to automatically use the highest
-preference curve (supported by both client and server) for the key agreement.
-
-Note that for error conditions specific to SSL/TLS, the OpenSSL library does
-not set the variable errno, so we must use the built-in error printing routines.
-
-******************************************************************************/
-void configure_context(SSL_CTX *ssl_ctx)
-{
-    SSL_CTX_set_ecdh_auto(ssl_ctx, 1);
-
-    // Set the certificate to use, i.e., 'cert.pem'
-    if (SSL_CTX_use_certificate_file(ssl_ctx, CERTIFICATE_FILE, SSL_FILETYPE_PEM) <= 0)
-    {
-        fprintf(stderr, "Server: cannot set certificate:\n");
-        ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
-    }
-
-    // Set the private key contained in the key file, i.e., 'key.pem'
-    if (SSL_CTX_use_PrivateKey_file(ssl_ctx, KEY_FILE, SSL_FILETYPE_PEM) <= 0)
-    {
-        fprintf(stderr, "Server: cannot set certificate:\n");
-        ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
-    }
-}
-
-// This function reads in a character string that represents a password,
-// but does so while not echoing the characters typed to the console.
-// Doing that requires first saving the terminal settings, changing the
-// echo flag to off, then setting the flags.  Turning the echo back on
-// just reverses the steps using the saved terminal settings.
-
-void getPassword(char *password)
-{
-    static struct termios oldsettings, newsettings;
-    int c, i = 0;
-
-    // Save the current terminal settings and copy settings for resetting
-    tcgetattr(STDIN_FILENO, &oldsettings);
-    newsettings = oldsettings;
-
-    // Hide, i.e., turn off echoing, the characters typed to the console
-    newsettings.c_lflag &= ~(ECHO);
-
-    // Set the new terminal settings
-    tcsetattr(STDIN_FILENO, TCSANOW, &newsettings);
-
-    // Read the password from the console one character at a time
-    while ((c = getchar()) != '\n' && c != EOF && i < BUFFER_SIZE)
-        password[i++] = c;
-
-    password[i] = '\0';
-
-    // Restore the old (saved) terminal settings
-    tcsetattr(STDIN_FILENO, TCSANOW, &oldsettings);
-}
-
-/******************************************************************************
-
-The sequence of steps required to establish a secure SSL/TLS connection is:
-
-1.  Initialize the SSL algorithms
-2.  Create and configure an SSL context object
-3.  Create a new network socket in the traditional way
-4.  Listen for incoming connections
-5.  Accept incoming connections as they arrive
-6.  Create a new SSL object for the newly arrived connection
-7.  Bind the SSL object to the network socket descriptor
-
-Once these steps are completed successfully, use the functions SSL_read() and
-SSL_write() to read from/write to the socket, but using the SSL object rather
-then the socket descriptor.  Once the session is complete, free the memory
-allocated to the SSL object and close the socket descriptor.
-
-******************************************************************************/
-
-int main(int argc, char **argv)
-{
-    SSL_CTX *ssl_ctx;
-    unsigned int sockfd;
-    unsigned int port;
-    char buffer[BUFFER_SIZE];
-    char dirname[PATH_LENGTH];
-    char extra[PATH_LENGTH];
-    char filename[PATH_LENGTH];
-
-    struct dirent *currentEntry;
-    struct stat fileInfo;
-    char olddir[PATH_LENGTH];
-    DIR *d;
-
-    // Initialize and create SSL data structures and algorithms
-    init_openssl();
-    ssl_ctx = create_new_context();
-    configure_context(ssl_ctx);
-
-    // Port can be specified on the command line. If it's not, use the default port
-    switch (argc)
-    {
-    case 1:
-        port = DEFAULT_PORT;
-        break;
-    case 2:
-        port = atoi(argv[1]);
-        break;
-    default:
-        fprintf(stderr, "Usage: ssl-server <port> (optional)\n");
-        exit(EXIT_FAILURE);
-    }
-
-    // This will create a network socket and return a socket descriptor, which is
-    // and works just like a file descriptor, but for network communcations. Note
-    // we have to specify which TCP/UDP port on which we are communicating as an
-    // argument to our user-defined create_socket() function.
-    sockfd = create_socket(port);
-
-    // Wait for incoming connections and handle them as the arrive
-    while (true)
-    {
-        SSL *ssl;
-        int client;
-        int readfd;
-        int rcount;
-        struct sockaddr_in addr;
-        unsigned int len = sizeof(addr);
-        char client_addr[INET_ADDRSTRLEN];
-
-        // Once an incoming connection arrives, accept it.  If this is successful, we
-        // now have a connection between client and server and can communicate using
-        // the socket descriptor
-        client = accept(sockfd, (struct sockaddr *)&addr, &len);
-        if (client < 0)
-        {
-            fprintf(stderr, "Server: Unable to accept connection: %s\n", strerror(errno));
-            exit(EXIT_FAILURE);
-        }
-
-        // Display the IPv4 network address of the connected client
-        inet_ntop(AF_INET, (struct in_addr *)&addr.sin_addr, client_addr, INET_ADDRSTRLEN);
-        fprintf(stdout, "Server: Established TCP connection with client (%s) on port %u\n", client_addr, port);
-
-        // Here we are creating a new SSL object to bind to the socket descriptor
-        ssl = SSL_new(ssl_ctx);
-
-        // Bind the SSL object to the network socket descriptor.  The socket descriptor
-        // will be used by OpenSSL to communicate with a client. This function should
-        // only be called once the TCP connection is established.
-        SSL_set_fd(ssl, client);
-
-        // The last step in establishing a secure connection is calling SSL_accept(),
-        // which executes the SSL/TLS handshake.  Because network sockets are
-        // blocking by default, this function will block as well until the handshake
-        // is complete.
-        if (SSL_accept(ssl) <= 0)
-        {
-            fprintf(stderr, "Server: Could not establish secure connection:\n");
-            ERR_print_errors_fp(stderr);
-        }
-        else
-        {
-            fprintf(stdout, "Server: Established SSL/TLS connection with client (%s)\n", client_addr);
-        }
-
-        char password[PASSWORD_LENGTH];
-        char username[USERNAME_LENGTH];
-        char verifyPassword[PASSWORD_LENGTH] = "hello";
-        char verifyUser[USERNAME_LENGTH] = "GroupProject";
-        char hash[BUFFER_SIZE];
-        char verifyHash[BUFFER_SIZE];
-        char *seedchars = "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
-        // The first three characters indicate which hashing algorithm to
-        // use. "$5$ selects the SHA256 algorithm.  I use MD5 ($1$) because
-        // the hash is shorter. It still illustrates how this works. The length
-        // of this char array is the seed length plus 3 to account for the
-        // identifier and two '$" separators
-        char salt[] = "$1$........";
-
-        srand(time(0));
-        // Convert the salt into printable characters from the seedchars string
-        for (int i = 0; i < SEED_LENGTH; i++)
-            salt[3 + i] = seedchars[rand() % strlen(seedchars)];
-
-        // Receive RPC request and transfer the file
-        bzero(buffer, BUFFER_SIZE);
-        rcount = SSL_read(ssl, buffer, BUFFER_SIZE);
-        sscanf(buffer, "user %s", username);
-        fprintf(stdout, "SERVER: User: %s\n", username);
-
-        bzero(buffer, BUFFER_SIZE);
-        rcount = SSL_read(ssl, buffer, BUFFER_SIZE);
-        sscanf(buffer, "pass %s", password);
-        // hash of the user entered password with salt
-        strncpy(hash, crypt(password, salt), BUFFER_SIZE);
-        fprintf(stdout, "SERVER: Pass: %s\n", password);
-        fprintf(stdout, "The salt is: %s\n", salt);
-        fprintf(stdout, "The hash of the password (w/ salt) is: %s\n", hash);
-
-        strncpy(verifyHash, crypt(verifyPassword, salt), BUFFER_SIZE);
-
-        if (strncmp(hash, verifyHash, BUFFER_SIZE) == 0 && strncmp(username, verifyUser, BUFFER_SIZE) == 0)
-        {
-            fprintf(stdout, "Passwords and Username match. User authenticated\n");
-
-            while (true)
-            {
-                rcount = SSL_read(ssl, buffer, BUFFER_SIZE);
-
-                printf("Server Buffer: %s\n", buffer);
-
-                if (strncmp("ls", buffer, 2) == 0)
-                {
-
-                    strcpy(dirname, "./data");
-
-                    // Save the current working directory so that stat will work properly
-                    // when getting the size in bytes of files in a different directory
-                    getcwd(olddir, PATH_LENGTH);
-
-                    // Open the directory and check for error
-                    d = opendir(dirname);
-                    if (d == NULL)
-                    {
-                        fprintf(stderr, "Could not open directory %s: %s\n", dirname, strerror(errno));
-                        return EXIT_FAILURE;
-                    }
-
-                    // Change to the directory being listed so that the calls to stat on each
-                    // directory entry will work correctly
-                    chdir(dirname);
-
-                    // Read each entry in the directory and display name and size
-                    currentEntry = readdir(d);
-
-                    // Iterate through all directory entries
-                    while (currentEntry != NULL)
-                    {
-
-                        // Use stat to get the size of the file in bytes.  If the program is listing
-                        // a directory other than the working directory of this program, the stat
-                        // call here will not work properly since d_name is relative
-                        if (stat(currentEntry->d_name, &fileInfo) < 0)
-                            fprintf(stderr, "stat: %s: %s\n", currentEntry->d_name, strerror(errno));
-
-                        // Check to see if the item is a subdirectory
-                        if (S_ISDIR(fileInfo.st_mode))
-                        {
-                            fprintf(stdout, "%-30s\t<dir>\n", currentEntry->d_name);
-                        }
-                        else
-                        {
-                            sprintf(buffer, "%-30s\t<dir>\n", currentEntry->d_name);
-                            SSL_write(ssl, buffer, strlen(buffer) + 1);
-                        }
-
-                        // Get the next directory entry
-                        currentEntry = readdir(d);
-                        bzero(buffer, BUFFER_SIZE);
-                    }
-                    sprintf(buffer, "EOF");
-                    SSL_write(ssl, buffer, strlen(buffer) + 1);
-
-                    // Change back to the original directory from where the program was invoked
-                    chdir(olddir);
-
-                    closedir(d);
-                }
-                else if (strncmp("getfile ", buffer, 8) == 0)
-                {
-                    // Check for invalid operation by comparing the first 8 chars to "getfile "
-                    if (strncmp(buffer, "getfile ", 8) != 0)
-                    {
-                        sprintf(buffer, "rpcerror %d", ERR_INVALID_OP);
-                        SSL_write(ssl, buffer, strlen(buffer) + 1);
-
-                        // Check for too many parameters
-                    }
-                    else if (sscanf(buffer, "getfile %s %s", filename, extra) == 2)
-                    {
-                        sprintf(buffer, "rpcerror %d", ERR_TOO_MANY_ARGS);
-                        SSL_write(ssl, buffer, strlen(buffer) + 1);
-
-                        // Check for too few parameters
-                    }
-                    else if (sscanf(buffer, "getfile %s", filename) != 1)
-                    {
-                        sprintf(buffer, "rpcerror %d", ERR_TOO_FEW_ARGS);
-                        SSL_write(ssl, buffer, strlen(buffer) + 1);
-
-                        // Check for the correct number of parameters
-                    }
-                    else if (sscanf(buffer, "getfile %s", filename) == 1)
-                    {
-
-                        // Now check for a file error
-                        readfd = open(filename, O_RDONLY);
-                        if (readfd < 0)
-                        {
-                            fprintf(stderr, "Server: Could not open file \"%s\": %s\n", filename, strerror(errno));
-                            sprintf(buffer, "fileerror %d\n", errno);
-                            SSL_write(ssl, buffer, strlen(buffer) + 1);
-
-                            // Passed all error checks, so transfer the file contents to the client
-                        }
-                        else
-                        {
-                            do
-                            {
-                                rcount = read(readfd, buffer, BUFFER_SIZE);
-                                SSL_write(ssl, buffer, rcount);
-                            } while (rcount > 0);
-                            sprintf(buffer, "EOF");
-                            SSL_write(ssl, buffer, strlen(buffer) + 1);
-                            close(readfd);
-
-                            // File transfer complete
-                            fprintf(stdout, "Server: Completed file transfer to client (%s)\n", client_addr);
-                        }
-                    }
-                }
-                else if (strncmp("exit", buffer, 4) == 0)
-                {
-                    // Tear down and clean up server data structures before terminating
-                    SSL_CTX_free(ssl_ctx);
-                    cleanup_openssl();
-                    close(sockfd);
-
-                    // Terminate the SSL session, close the TCP connection, and clean up
-                    fprintf(stdout, "Server: Terminating SSL session and TCP connection with client (%s)\n", client_addr);
-                    SSL_free(ssl);
-                    close(client);
-                    break;
-                }
-                else
-                {
-                    printf("Unrecognized command\n");
-                    sprintf(buffer, "rpcerror %d", ERR_INVALID_OP);
-                    SSL_write(ssl, buffer, strlen(buffer) + 1);
-                }
-            }
-            break;
-        }
-        else
-        {
-            fprintf(stdout, "Passwords or Username do not match\n");
-        }
-    }
-    exit(EXIT_SUCCESS);
-    return 0;
-}
+/******************************************************************************
+
+PROGRAM:  ssl-server.c
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: This program is a small server application that receives incoming TCP
+          connections from clients and transfers a requested file from the
+          server to the client.  It uses a secure SSL/TLS connection using
+          a certificate generated with the openssl application.
+
+          To create a self-signed certificate your server can use, at the command
+          prompt type:
+
+          openssl req -newkey rsa:2048 -nodes -keyout key.pem -x509 -days 365 -out cert.pem
+
+          This will create two files: a private key contained in the file 'key.pem'
+          and a certificate containing a public key in the file 'cert.pem'.  Your
+          server will require both in order to operate properly.
+
+          Some of the code and descriptions can be found in "Network Security with
+          OpenSSL", O'Reilly Media, 2002.
+
+******************************************************************************/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <crypt.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <termios.h>
+#include <stddef.h>
+#include <limits.h>
+
+#include "auth.h"
+#include "catalog.h"
+#include "filecache.h"
+#include "id3.h"
+#include "metrics.h"
+#include "preview.h"
+#include "protocol.h"
+#include "radio.h"
+#include "request.h"
+#include "resumption.h"
+#include "seektable.h"
+#include "shaper.h"
+#include "trace.h"
+
+#define BUFFER_SIZE 264
+#define DEFAULT_PORT 4433
+#define DATA_DIRECTORY "./data"
+#define CATALOG_SNAPSHOT "catalog.snapshot"
+#define SEEK_DIRECTORY "seektables"
+#define CERTIFICATE_FILE "cert.pem"
+#define KEY_FILE "key.pem"
+
+// Where the trace goes unless --trace says otherwise
+#define TRACE_FILE "server.trace"
+
+// For authentication, see auth.h
+#define CREDENTIAL_FILE "credentials"
+#define DEFAULT_AUTH_THREADS 2
+#define AUTH_QUEUE_SIZE 1024
+
+// For the event loop
+#define MAX_EVENTS 256
+#define TRANSFER_BURST 16
+#define TRANSFER_QUANTUM (256 * 1024)
+#define SESSION_BUDGET (64 * 1024)
+#define DEFAULT_SESSION_MEMORY (256UL * 1024 * 1024)
+
+// How long, in seconds, one ticket key encrypts new session tickets
+#define DEFAULT_TICKET_KEY_LIFETIME 3600
+
+// Memory for files kept mapped by the file cache, see filecache.h
+#define DEFAULT_CACHE_SIZE (256UL * 1024 * 1024)
+
+// Memory for preview clips kept by their cache, see preview.h
+#define DEFAULT_PREVIEW_CACHE_SIZE (32UL * 1024 * 1024)
+
+// The reply buffer every session has
+#define REPLY_SIZE 4096
+
+// Requests a binary client may have in flight on one connection
+#define MAX_STREAMS 8
+
+// Entries a search looks through before letting other streams have a turn,
+// and the most a track record can take
+#define SEARCH_BATCH 4096
+#define TRACK_RECORD_MAX (TRACK_HEADER_SIZE + 4 * 255)
+
+// Bytes of a file a seek table build walks before letting other streams
+// have a turn
+#define SEEK_BATCH (256 * 1024)
+
+// Radio channels play the MP3 files matching this unless told otherwise
+#define DEFAULT_CHANNEL_PATTERN "*.mp3"
+
+// Socket send buffer of a listener, a few seconds of audio.  The kernel
+// would otherwise let megabytes pile up for a client that stopped reading
+// before the session saw it was falling behind.
+#define RADIO_SEND_BUFFER (64 * 1024)
+
+// For file transfers.  TRANSFER_SIZE is the largest TLS record, so each
+// userspace write fills exactly one record; SENDFILE_CHUNK bounds how much a
+// single SSL_sendfile() call may push before other sessions get a turn.
+#define TRANSFER_SIZE (16 * 1024)
+#define SENDFILE_CHUNK (256 * 1024)
+
+// Most a session's socket holds that TCP hasn't sent yet, so that what goes
+// out next is decided by the scheduler (see drive_session()) rather than
+// by whatever is already queued in the kernel
+#define NOTSENT_LOWAT (128 * 1024)
+
+/******************************************************************************
+
+This function does the basic necessary housekeeping to establish TCP connections
+to the server.  It first creates a new socket, binds the network interface of the
+machine to that socket, then listens on the socket for incoming TCP connections.
+Each worker calls it for its own listening socket, with 'reuseport' set when
+there is more than one worker sharing the port.
+
+*******************************************************************************/
+int create_socket(unsigned int port, bool reuseport)
+{
+    int s;
+    struct sockaddr_in addr;
+
+    // First we set up a network socket. An IP socket address is a combination
+    // of an IP interface address plus a 16-bit port number. The struct field
+    // sin_family is *always* set to AF_INET. Anything else returns an error.
+    // The TCP port is stored in sin_port, but needs to be converted to the
+    // format on the host machine to network byte order, which is why htons()
+    // is called. Setting s_addr to INADDR_ANY binds the socket and listen on
+    // any available network interface on the machine, so clients can connect
+    // through any, e.g., external network interface, localhost, etc.
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    // Create a socket (endpoint) for network communication.  The socket()
+    // call returns a socket descriptor, which works exactly like a file
+    // descriptor for file system operations we worked with in CS431
+    //
+    // Sockets are by default blocking, so the server would block while reading
+    // from or writing to a socket.  Since a single event loop serves every
+    // client, the listening socket (and every socket accepted from it) is put
+    // in non-blocking mode instead.
+    s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (s < 0)
+    {
+        fprintf(stderr, "Server: Unable to create socket: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+
+    // When several workers each listen on the same port, SO_REUSEPORT lets
+    // them all bind it and has the kernel balance new connections across
+    // their sockets
+    if (reuseport && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0)
+    {
+        fprintf(stderr, "Server: Unable to set SO_REUSEPORT: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // When you create a socket, it exists within a namespace, but does not have
+    // a network address associated with it.  The bind system call creates the
+    // association between the socket and the network interface.
+    //
+    // An error could result from an invalid socket descriptor, an address already
+    // in use, or an invalid network address
+    if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        fprintf(stderr, "Server: Unable to bind to socket: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // Listen for incoming TCP connections using the newly created and configured
+    // socket. The second argument indicates the number of pending connections
+    // allowed.  The event loop accepts connections as fast as they arrive, but
+    // a burst of clients connecting at once should queue in the kernel rather
+    // than be refused, so ask for the largest backlog the system allows.
+    //
+    // Failure could result from an invalid socket descriptor or from using a socket
+    // descriptor that is already in use.
+    if (listen(s, SOMAXCONN) < 0)
+    {
+        fprintf(stderr, "Server: Unable to listen: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stdout, "Server: Listening on TCP port %u\n", port);
+
+    return s;
+}
+
+/******************************************************************************
+
+This function does some initialization of the OpenSSL library functions used in
+this program.  The function SSL_load_error_strings registers the error strings
+for all of the libssl and libcrypto functions so that appropriate textual error
+messages can be displayed when error conditions arise.  OpenSSL_add_ssl_algorithms
+registers the available SSL/TLS ciphers and digests used for encryption.
+
+******************************************************************************/
+void init_openssl()
+{
+    SSL_load_error_strings();
+    OpenSSL_add_ssl_algorithms();
+}
+
+/******************************************************************************
+
+EVP_cleanup removes all of the SSL/TLS ciphers and digests registered earlier.
+
+******************************************************************************/
+void cleanup_openssl()
+{
+    EVP_cleanup();
+}
+
+/******************************************************************************
+
+An SSL_CTX object is an instance of a factory design pattern that produces SSL
+connection objects, each called a context. A context is used to set parameters
+for the connection, and in this program, each context is configured using the
+configure_context() function below. Each context object is created using the
+function SSL_CTX_new(), and the result of that call is what is returned by this
+function and subsequently configured with connection information.
+
+One other thing to point out is when creating a context, the SSL protocol must
+be specified ahead of time using an instance of an SSL_method object.  In this
+case, we are creating an instance of an SSLv23_server_method, which is an
+SSL_METHOD object for an SSL/TLS server. Of the available types in the OpenSSL
+library, this provides the most functionality.
+
+******************************************************************************/
+SSL_CTX *create_new_context()
+{
+    const SSL_METHOD *ssl_method; // This should be declared 'const' to avoid getting
+                                  // a warning from the call to SSLv23_server_method()
+    SSL_CTX *ssl_ctx;
+
+    // Use SSL/TLS method for server
+    ssl_method = SSLv23_server_method();
+
+    // Create new context instance
+    ssl_ctx = SSL_CTX_new(ssl_method);
+    if (ssl_ctx == NULL)
+    {
+        fprintf(stderr, "Server: cannot create SSL context:\n");
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    return ssl_ctx;
+}
+
+/******************************************************************************
+
+We will use Elliptic Curve Diffie Hellman anonymous key agreement protocol for
+the session key shared between client and server.  We first configure the SSL
+context to use that protocol by calling the function SSL_CTX_set_ecdh_auto().
+The second argument (onoff) tells the function to automatically use the highest
+preference curve (supported by both client and server) for the key agreement.
+
+Note that for error conditions specific to SSL/TLS, the OpenSSL library does
+not set the variable errno, so we must use the built-in error printing routines.
+
+******************************************************************************/
+void configure_context(SSL_CTX *ssl_ctx)
+{
+    SSL_CTX_set_ecdh_auto(ssl_ctx, 1);
+
+    // Sockets are non-blocking, so SSL_write() may have to be retried after
+    // SSL_ERROR_WANT_WRITE.  ACCEPT_MOVING_WRITE_BUFFER allows the retry to come
+    // from a session's buffer even if it was refilled in between, and
+    // RELEASE_BUFFERS hands the ~34KB of record buffers back to the allocator
+    // while a session is idle, which is most of them most of the time.
+    SSL_CTX_set_mode(ssl_ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+    // Ask OpenSSL to hand record encryption to the kernel after the handshake
+    // where it can.  That is what lets getfile use SSL_sendfile().  If the
+    // kernel lacks the tls module or the cipher isn't supported, the session
+    // simply stays in userspace.
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+    // Let returning clients resume their session with any worker instead of
+    // paying for a full handshake again
+    resumption_configure(ssl_ctx);
+
+    // Set the certificate to use, i.e., 'cert.pem'
+    if (SSL_CTX_use_certificate_file(ssl_ctx, CERTIFICATE_FILE, SSL_FILETYPE_PEM) <= 0)
+    {
+        fprintf(stderr, "Server: cannot set certificate:\n");
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    // Set the private key contained in the key file, i.e., 'key.pem'
+    if (SSL_CTX_use_PrivateKey_file(ssl_ctx, KEY_FILE, SSL_FILETYPE_PEM) <= 0)
+    {
+        fprintf(stderr, "Server: cannot set certificate:\n");
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// This function reads in a character string that represents a password,
+// but does so while not echoing the characters typed to the console.
+// Doing that requires first saving the terminal settings, changing the
+// echo flag to off, then setting the flags.  Turning the echo back on
+// just reverses the steps using the saved terminal settings.
+
+void getPassword(char *password)
+{
+    static struct termios oldsettings, newsettings;
+    int c, i = 0;
+
+    // Save the current terminal settings and copy settings for resetting
+    tcgetattr(STDIN_FILENO, &oldsettings);
+    newsettings = oldsettings;
+
+    // Hide, i.e., turn off echoing, the characters typed to the console
+    newsettings.c_lflag &= ~(ECHO);
+
+    // Set the new terminal settings
+    tcsetattr(STDIN_FILENO, TCSANOW, &newsettings);
+
+    // Read the password from the console one character at a time
+    while ((c = getchar()) != '\n' && c != EOF && i < BUFFER_SIZE)
+        password[i++] = c;
+
+    password[i] = '\0';
+
+    // Restore the old (saved) terminal settings
+    tcsetattr(STDIN_FILENO, TCSANOW, &oldsettings);
+}
+
+/******************************************************************************
+
+Each client is served by a session: a small state machine that owns the
+client's socket, its SSL object and whatever it is in the middle of sending.
+The server no longer blocks in SSL_accept(), SSL_read() or SSL_write().  Every
+step is attempted on a non-blocking socket, and when OpenSSL answers with
+SSL_ERROR_WANT_READ or SSL_ERROR_WANT_WRITE the session stays in its current
+state until epoll reports that the socket is ready again.
+
+A session's memory is bounded: the request buffer and the reply buffer are
+fixed-size arrays inside the session itself, a directory listing only holds
+a reference to a catalog snapshot shared by every session, a file transfer
+adds one TRANSFER_SIZE buffer (and none at all when the kernel does the
+encryption), and OpenSSL's record buffers are released whenever the session
+is idle (see configure_context()).  SESSION_BUDGET is the worst case we plan
+for per session, including the SSL object and its buffers while a transfer
+is active, and the number of sessions the server accepts is derived from it.
+
+A session speaks either the binary protocol described in protocol.h or, for
+clients that don't ask for it, the original text protocol.  Requests from
+both are parsed into the same struct request, and only the functions that
+queue replies need to know which protocol is in use.
+
+******************************************************************************/
+enum session_state
+{
+    STATE_HANDSHAKE, // SSL_accept() has not completed yet
+    STATE_NEGOTIATE, // Waiting for the first bytes to pick a protocol
+    STATE_USER,      // Waiting for the username
+    STATE_PASS,      // Waiting for the password
+    STATE_AUTH,      // Waiting for an auth thread to check the password
+    STATE_READY,     // Authenticated, taking requests and sending replies
+    STATE_RADIO      // Tuned in to a radio channel, sending its audio
+};
+
+// Result of a single step of a session's state machine
+enum step_result
+{
+    STEP_CONTINUE,   // Made progress, run the next step right away
+    STEP_WANT_READ,  // Blocked until the socket is readable
+    STEP_WANT_WRITE, // Blocked until the socket is writable
+    STEP_YIELD,      // Still has work, but let other sessions have a turn
+    STEP_WAIT,       // Waiting for something other than the socket
+    STEP_SLEEP,      // Waiting for its rate limits to let it send file data
+    STEP_CLOSE       // Tear the session down
+};
+
+/******************************************************************************
+
+A stream is one request being answered: a directory listing, a search, a
+file transfer, a file's segments or a preview clip.  A binary client can
+have up to MAX_STREAMS requests in flight on one connection, each answered
+by frames carrying its request id, and the streams take turns sending
+records.  A text protocol session has at most one.
+
+******************************************************************************/
+struct stream
+{
+    uint8_t opcode;             // OP_LS, OP_SEARCH, OP_GETFILE, OP_MANIFEST, OP_SEGMENT or OP_PREVIEW
+    uint32_t id;                // Request id its replies carry
+    struct catalog *catalog;    // Snapshot being listed or searched
+    size_t piece;               // Next piece of its listing to send, entry to search, or 1 once a page started
+    int field;                  // What the search looks in
+    char query[SEARCH_QUERY_MAX + 1];
+    uint32_t *ranked;           // Entries a SEARCH_ANY found, best first, sent from 'piece' on
+    size_t nranked;
+    bool paged;                 // A listing page rather than the whole listing
+    struct catalog_page page;   // Where it has got to
+    char pattern[PATH_LENGTH];  // What 'page' points to, set again before each step
+    char after[NAME_MAX + 1];   // since the stream may move
+    size_t left;                // Entries it may still send
+    bool done;                  // No more entries to look at
+    int filefd;                 // File being sent
+    struct cached_file *cached; // or the file cache's copy of it
+    off_t filestart;            // Where the range being sent starts
+    off_t fileoff;              // How far it has been sent
+    off_t filesize;             // and where it ends
+    size_t chunkleft;           // Bytes of the current FILE_DATA frame still to sendfile
+    struct seek_build *seeking; // Seek table being built before the file is sent
+    uint64_t seekms;            // Time the range or clip starts at
+    uint64_t length;            // and its length
+    struct segment_build *cutting; // Segment list being built before it is sent
+    struct segment_list *segments; // The file's segments
+    unsigned char hash[SEGMENT_HASH_SIZE]; // and the one to send
+    char *path;                 // File a preview clip is cut from
+    struct preview *preview;    // The clip being cut, then sent
+    size_t filled;              // How much of it has been cut
+    unsigned char etag[ETAG_SIZE];
+    uint64_t started;           // metrics_now() when the request was taken
+};
+
+struct session
+{
+    int fd;
+    SSL *ssl;
+    enum session_state state;
+    uint32_t events; // epoll events currently registered for fd
+    bool binary;     // Speaking the binary protocol rather than text
+    uint8_t version; // and which version of it
+    bool hangup;     // Close the connection once the pending record is sent
+    bool readable;   // There may be input that hasn't been read yet
+    char client_addr[INET_ADDRSTRLEN];
+    char username[AUTH_NAME_MAX];
+
+    struct auth_queue *logins; // Where this worker's finished password checks go
+    struct auth_job *auth;     // The password check in progress, in STATE_AUTH
+    uint32_t login_id;         // Request id of the PASS it answers
+
+    struct metrics *metrics;  // This worker's
+    uint64_t accepted;        // metrics_now() when the connection was accepted
+    uint64_t login_started;   // and when the password check was submitted
+    struct trace_ring *trace; // This worker's
+    uint64_t conn;            // The connection's id in the trace
+
+    // Received bytes that do not yet form a complete request.  Text commands
+    // are terminated by a NUL (what the original client sends) or a newline,
+    // binary requests are frames.
+    char inbuf[REQUEST_SIZE];
+    size_t inlen;
+
+    // The next record to send, which is either a reply in outbuf or a chunk
+    // of a file in xferbuf.  SSL_write() must be retried with the same record
+    // until it succeeds, so nothing new is produced while one is pending.
+    char outbuf[REPLY_SIZE];
+    const char *outptr;
+    size_t outlen;
+
+    bool ktls;     // The kernel encrypts what this session sends
+    char *xferbuf; // TRANSFER_SIZE bytes while userspace transfers run
+
+    struct stream streams[MAX_STREAMS];
+    int nstreams; // Requests in flight
+    int next;     // Stream whose turn it is to send
+    int sending;  // Stream in the middle of a sendfile frame, or -1
+
+    // The scheduler's view of the session (see drive_session()): the file
+    // data its turn may still send, whether its last turn ran out of that,
+    // and its rate limits with when they next let it send file data.
+    // Sleeping sessions are on their worker's list.
+    long deficit;
+    bool bulk;
+    bool shaped;                   // It has a rate limit at all
+    struct rate_bucket rate;       // The connection's
+    struct rate_bucket *user_rate; // and its user's, or NULL
+    uint64_t wake;                 // shaper_now() it may send again, or 0
+    bool sleeping;
+    struct session *prev_sleeper, *next_sleeper;
+
+    // In STATE_RADIO, the channel and how far into its audio the session
+    // has got.  Every listener is on its worker's list.
+    struct radio_channel *channel;
+    uint64_t radio_pos;
+    uint32_t radio_id; // Request id of the TUNE
+    struct session **listeners;
+    struct session *prev_listener, *next_listener;
+};
+
+/******************************************************************************
+
+Every file transfer takes one of two paths.  If kernel TLS is active for the
+session, the file goes straight from the page cache to the socket with
+SSL_sendfile() and never passes through this process.  Otherwise it is read
+into a TRANSFER_SIZE buffer and encrypted by SSL_write(), one full record at
+a time.  The metrics count how many transfers took each path.
+
+******************************************************************************/
+enum transfer_path
+{
+    PATH_SENDFILE,
+    PATH_USERSPACE
+};
+
+const char *transfer_path_names[] = {"kTLS sendfile", "userspace"};
+
+/******************************************************************************
+
+A worker is one event loop.  With --workers N the server starts N of them,
+each in its own thread with its own listening socket, epoll instance and
+SSL_CTX, so the workers share nothing on the connection path.  The kernel
+spreads incoming connections across the listening sockets (SO_REUSEPORT),
+and each session then lives on the worker that accepted it.
+
+******************************************************************************/
+struct worker
+{
+    int id;
+    int cpu; // CPU the worker is pinned to, or -1
+    pthread_t thread;
+    SSL_CTX *ssl_ctx;
+    int epollfd;
+    int listenfd;
+    unsigned int port;
+    bool accepting;      // Is the listening socket registered for EPOLLIN?
+    size_t sessions;     // Sessions currently open
+    size_t max_sessions; // This worker's share of the session limit
+    struct auth_queue logins;  // Password checks the auth threads have finished
+    int radiofd;               // Written to by the radio channels when they have more audio
+    struct session *listeners; // Sessions tuned in to a channel
+    int timerfd;               // Expires when the first sleeping session may send again
+    uint64_t timer_at;         // which is then, or 0 if it is not armed
+    struct session *sleepers;  // Sessions waiting for their rate limits, longest first
+    struct session *last_sleeper;
+    struct metrics metrics;    // Counted by this worker's thread alone
+    struct trace_ring *trace;  // Written by this worker's thread alone
+    uint64_t connections;      // Accepted so far
+};
+
+/******************************************************************************
+
+What to do with a listener that has fallen too far behind its channel (see
+radio.h): skip it ahead to what is being played now, or disconnect it.
+
+******************************************************************************/
+enum radio_slow
+{
+    SLOW_SKIP,
+    SLOW_CLOSE
+};
+
+enum radio_slow radio_slow = SLOW_SKIP;
+
+_Static_assert(sizeof(struct session) <= SESSION_BUDGET / 4,
+               "struct session no longer leaves room for OpenSSL in SESSION_BUDGET");
+_Static_assert(CATALOG_PIECE_SIZE <= TRANSFER_SIZE, "a listing piece must fit in the transfer buffer");
+_Static_assert(FRAME_HEADER_SIZE + METRICS_TEXT_MAX <= TRANSFER_SIZE, "the metrics must fit in the transfer buffer");
+
+/******************************************************************************
+
+Translate the return value of a failed SSL_accept(), SSL_read() or SSL_write()
+into what the session should do next.  Anything other than "try again when the
+socket is ready" means the connection is unusable.
+
+******************************************************************************/
+enum step_result ssl_step_result(struct session *sess, int ret)
+{
+    switch (SSL_get_error(sess->ssl, ret))
+    {
+    case SSL_ERROR_WANT_READ:
+        return STEP_WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+        return STEP_WANT_WRITE;
+    case SSL_ERROR_ZERO_RETURN:
+        return STEP_CLOSE;
+    case SSL_ERROR_SYSCALL:
+        if (errno != 0 && errno != ECONNRESET && errno != EPIPE)
+            fprintf(stderr, "Server: Connection with client (%s) failed: %s\n", sess->client_addr, strerror(errno));
+        return STEP_CLOSE;
+    default:
+#ifdef SSL_R_UNEXPECTED_EOF_WHILE_READING
+        // OpenSSL 3 reports a client that went without a close_notify as an
+        // error, but it is only a disconnect
+        if (ERR_GET_REASON(ERR_peek_last_error()) == SSL_R_UNEXPECTED_EOF_WHILE_READING)
+        {
+            ERR_clear_error();
+            return STEP_CLOSE;
+        }
+#endif
+        fprintf(stderr, "Server: SSL/TLS error on connection with client (%s):\n", sess->client_addr);
+        ERR_print_errors_fp(stderr);
+        return STEP_CLOSE;
+    }
+}
+
+// Queue a record to be sent.  The caller must have checked that the previous
+// record has been flushed.
+void queue_record(struct session *sess, const void *data, size_t len)
+{
+    memcpy(sess->outbuf, data, len);
+    sess->outptr = sess->outbuf;
+    sess->outlen = len;
+}
+
+// Queue a NUL terminated string as a record, including the terminator, which
+// is how every textual reply has always been sent
+void queue_string(struct session *sess, const char *str)
+{
+    queue_record(sess, str, strlen(str) + 1);
+}
+
+// Queue a frame answering the request with the given id
+void queue_frame(struct session *sess, uint8_t opcode, uint32_t id, const void *payload, size_t len)
+{
+    encode_frame_header((unsigned char *)sess->outbuf, opcode, id, len);
+    // The frames that end a reply have no payload, and pass NULL
+    if (len > 0)
+        memcpy(sess->outbuf + FRAME_HEADER_SIZE, payload, len);
+    sess->outptr = sess->outbuf;
+    sess->outlen = FRAME_HEADER_SIZE + len;
+}
+
+/******************************************************************************
+
+Report a failed request.  The text protocol has always used "rpcerror <code>"
+for malformed requests and "fileerror <errno>" for files that can't be opened;
+the binary protocol sends an ERROR frame with the same information.  A
+rejected login has no text equivalent, the connection is simply closed.
+
+******************************************************************************/
+void queue_error(struct session *sess, uint32_t id, int kind, int code)
+{
+    char buffer[BUFFER_SIZE];
+
+    trace(sess->trace, TRACE_DEBUG, TRACE_ERROR, sess->conn, id, (uint64_t)kind << 32 | (uint32_t)code, NULL);
+    if (sess->binary)
+    {
+        unsigned char payload[5];
+
+        payload[0] = kind;
+        put_u32(payload + 1, code);
+        queue_frame(sess, OP_ERROR, id, payload, sizeof(payload));
+    }
+    else if (kind == ERR_KIND_FILE)
+    {
+        sprintf(buffer, "fileerror %d\n", code);
+        queue_string(sess, buffer);
+    }
+    else if (kind == ERR_KIND_RPC)
+    {
+        sprintf(buffer, "rpcerror %d", code);
+        queue_string(sess, buffer);
+    }
+}
+
+/******************************************************************************
+
+Take the next complete request out of the session's input buffer, if there is
+one.  Returns 1 if 'req' was filled in, 0 if more input is needed and -1 if
+the input can never form a valid request.
+
+******************************************************************************/
+int take_request(struct session *sess, struct request *req)
+{
+    size_t used;
+
+    if (sess->binary)
+    {
+        struct frame_header hdr;
+
+        if (sess->inlen < FRAME_HEADER_SIZE)
+            return 0;
+        decode_frame_header((unsigned char *)sess->inbuf, &hdr);
+        if (hdr.length >= REQUEST_SIZE - FRAME_HEADER_SIZE)
+            return -1;
+        if (sess->inlen < FRAME_HEADER_SIZE + hdr.length)
+            return 0;
+
+        parse_frame_request(&hdr, (unsigned char *)sess->inbuf + FRAME_HEADER_SIZE, sess->version, req);
+        used = FRAME_HEADER_SIZE + hdr.length;
+    }
+    else
+    {
+        char *end = NULL;
+
+        for (size_t i = 0; i < sess->inlen && end == NULL; i++)
+            if (sess->inbuf[i] == '\0' || sess->inbuf[i] == '\n')
+                end = sess->inbuf + i;
+        if (end == NULL)
+            return sess->inlen == sizeof(sess->inbuf) ? -1 : 0;
+
+        *end = '\0';
+        parse_text_request(sess->inbuf, req);
+        used = end - sess->inbuf + 1;
+    }
+
+    // Drop the request from the buffer
+    sess->inlen -= used;
+    memmove(sess->inbuf, sess->inbuf + used, sess->inlen);
+    return 1;
+}
+
+// Read more from the connection into the session's input buffer
+enum step_result fill_input(struct session *sess)
+{
+    int rcount = SSL_read(sess->ssl, sess->inbuf + sess->inlen, sizeof(sess->inbuf) - sess->inlen);
+
+    if (rcount <= 0)
+        return ssl_step_result(sess, rcount);
+    sess->inlen += rcount;
+    return STEP_CONTINUE;
+}
+
+/******************************************************************************
+
+Get the next request from the client, reading more from the connection if
+necessary.  Returns STEP_CONTINUE with the request in 'req', or the reason no
+request is available yet.
+
+******************************************************************************/
+enum step_result next_request(struct session *sess, struct request *req)
+{
+    enum step_result result;
+    int taken;
+
+    while ((taken = take_request(sess, req)) == 0)
+    {
+        if ((result = fill_input(sess)) != STEP_CONTINUE)
+            return result;
+    }
+
+    if (taken < 0)
+    {
+        fprintf(stderr, "Server: Request from client (%s) is too long\n", sess->client_addr);
+        return STEP_CLOSE;
+    }
+
+    return STEP_CONTINUE;
+}
+
+/******************************************************************************
+
+Decide which protocol the client speaks from the first bytes it sends.  A
+binary client starts with PROTO_MAGIC and its highest version, and is told
+which version the server will use.  Anything else is left in the buffer to be
+parsed as a text command.
+
+******************************************************************************/
+enum step_result negotiate_step(struct session *sess)
+{
+    enum step_result result;
+
+    while (sess->inlen < 2 && !(sess->inlen == 1 && (unsigned char)sess->inbuf[0] != PROTO_MAGIC))
+    {
+        if ((result = fill_input(sess)) != STEP_CONTINUE)
+            return result;
+    }
+
+    if ((unsigned char)sess->inbuf[0] == PROTO_MAGIC)
+    {
+        unsigned char reply[2] = {PROTO_MAGIC, PROTO_VERSION};
+
+        if ((unsigned char)sess->inbuf[1] < reply[1])
+            reply[1] = sess->inbuf[1] > 0 ? sess->inbuf[1] : 1;
+        sess->binary = true;
+        sess->version = reply[1];
+        sess->inlen -= 2;
+        memmove(sess->inbuf, sess->inbuf + 2, sess->inlen);
+        queue_record(sess, reply, sizeof(reply));
+    }
+
+    sess->state = STATE_USER;
+    return STEP_CONTINUE;
+}
+
+/******************************************************************************
+
+Logging in.  The password is never checked on the worker: STATE_PASS hands
+it to the auth threads (see auth.h) and the session sleeps in STATE_AUTH,
+registered for no events at all, until finish_logins() picks up the result.
+A binary client of version 3 or later is given a session token on success,
+and may present one in place of its username to skip the password entirely.
+
+******************************************************************************/
+void login_succeeded(struct session *sess, uint32_t id)
+{
+    sess->user_rate = shaper_login(sess->username, &sess->rate);
+    sess->shaped = sess->rate.rate != 0 || sess->user_rate != NULL;
+    trace(sess->trace, TRACE_INFO, TRACE_LOGIN, sess->conn, id, TRACE_LOGIN_OK, sess->username);
+    metrics_add(sess->metrics, METRIC_LOGINS_OK, 1);
+    if (sess->binary)
+    {
+        unsigned char token[TOKEN_MAX_SIZE];
+        size_t len = sess->version >= 3 ? auth_make_token(sess->username, token) : 0;
+
+        queue_frame(sess, OP_OK, id, token, len);
+    }
+    sess->state = STATE_READY;
+    sess->readable = true;
+}
+
+enum step_result login_failed(struct session *sess, uint32_t id, int kind, int code)
+{
+    trace(sess->trace, TRACE_INFO, TRACE_LOGIN, sess->conn, id,
+          kind == ERR_KIND_AUTH ? TRACE_LOGIN_REJECTED : TRACE_LOGIN_BUSY, sess->username);
+    metrics_add(sess->metrics, kind == ERR_KIND_AUTH ? METRIC_LOGINS_REJECTED : METRIC_LOGINS_BUSY, 1);
+    if (!sess->binary)
+        return STEP_CLOSE;
+
+    // Tell a binary client why, then hang up once that has been sent
+    queue_error(sess, id, kind, code);
+    sess->hangup = true;
+    return STEP_CONTINUE;
+}
+
+enum step_result token_login(struct session *sess, const struct request *req)
+{
+    char username[AUTH_NAME_MAX];
+
+    if (!auth_check_token((const unsigned char *)req->arg, req->arglen, username))
+    {
+        // The client still has its password to fall back on
+        trace(sess->trace, TRACE_INFO, TRACE_LOGIN, sess->conn, req->id, TRACE_LOGIN_REJECTED, "(token)");
+        metrics_add(sess->metrics, METRIC_LOGINS_REJECTED, 1);
+        queue_error(sess, req->id, ERR_KIND_AUTH, 0);
+        return STEP_CONTINUE;
+    }
+    strcpy(sess->username, username);
+    login_succeeded(sess, req->id);
+    return STEP_CONTINUE;
+}
+
+enum step_result submit_login(struct session *sess, const struct request *req)
+{
+    struct auth_job *job;
+
+    if (req->opcode != OP_PASS || strlen(req->arg) >= AUTH_PASSWORD_MAX)
+        return login_failed(sess, req->id, ERR_KIND_AUTH, 0);
+    if ((job = calloc(1, sizeof(*job))) == NULL)
+        return STEP_CLOSE;
+    strcpy(job->username, sess->username);
+    strcpy(job->password, req->arg);
+    job->owner = sess;
+    job->reply = sess->logins;
+    if (!auth_submit(job))
+    {
+        explicit_bzero(job->password, sizeof(job->password));
+        free(job);
+        return login_failed(sess, req->id, ERR_KIND_RPC, ERR_BUSY);
+    }
+    sess->auth = job;
+    sess->login_id = req->id;
+    sess->login_started = metrics_now();
+    trace(sess->trace, TRACE_DEBUG, TRACE_AUTH, sess->conn, req->id, 0, sess->username);
+    sess->state = STATE_AUTH;
+    return STEP_WAIT;
+}
+
+/******************************************************************************
+
+Start a stream for a request and return it, or NULL if the session already
+has as many requests in flight as it is allowed.
+
+******************************************************************************/
+struct stream *new_stream(struct session *sess, const struct request *req)
+{
+    struct stream *st;
+
+    if (sess->nstreams == MAX_STREAMS)
+        return NULL;
+    st = &sess->streams[sess->nstreams++];
+    memset(st, 0, sizeof(*st));
+    st->opcode = req->opcode;
+    st->id = req->id;
+    st->filefd = -1;
+    st->started = metrics_now();
+    return st;
+}
+
+// Release what a stream held and remove it from the session
+void end_stream(struct session *sess, struct stream *st)
+{
+    trace(sess->trace, TRACE_DEBUG, TRACE_END, sess->conn, st->id, st->opcode, NULL);
+    if (st->opcode == OP_LS)
+        metrics_observe(sess->metrics, HIST_LS, st->started);
+    else if (st->opcode == OP_SEARCH)
+        metrics_observe(sess->metrics, HIST_SEARCH, st->started);
+    else if (st->opcode == OP_GETFILE || st->opcode == OP_SEGMENT || st->opcode == OP_PREVIEW)
+        metrics_observe(sess->metrics, HIST_TRANSFER, st->started);
+
+    if (st->catalog != NULL)
+        catalog_release(st->catalog);
+    free(st->ranked);
+    if (st->filefd >= 0)
+        close(st->filefd);
+    if (st->cached != NULL)
+        filecache_put(st->cached);
+    if (st->seeking != NULL)
+        seek_build_abort(st->seeking);
+    if (st->cutting != NULL)
+        segment_build_abort(st->cutting);
+    segment_free(st->segments);
+    if (st->preview != NULL)
+        preview_put(st->preview);
+    free(st->path);
+
+    // Keep the array packed by moving the last stream into the hole
+    *st = sess->streams[--sess->nstreams];
+    sess->sending = -1;
+
+    // The transfer buffer is only needed while a file is being sent
+    if (sess->nstreams == 0)
+    {
+        free(sess->xferbuf);
+        sess->xferbuf = NULL;
+    }
+}
+
+/******************************************************************************
+
+Start a directory listing of DATA_DIRECTORY.  The listing comes from the
+current catalog snapshot rather than the directory itself, and the stream
+keeps that snapshot for as long as it takes to send, so the client sees one
+consistent listing even if the directory changes in the meantime.  A page of
+the listing starts where its cursor says, which may be in an older snapshot.
+
+******************************************************************************/
+void start_ls(struct session *sess, const struct request *req)
+{
+    struct stream *st;
+
+    if (req->paged && (req->sort < LS_SORT_NAME || req->sort > LS_SORT_MTIME))
+    {
+        queue_error(sess, req->id, ERR_KIND_RPC, ERR_INVALID_OP);
+        return;
+    }
+    if (req->paged && strlen(req->arg) >= PATH_LENGTH)
+    {
+        queue_error(sess, req->id, ERR_KIND_RPC, ERR_TOO_MANY_ARGS);
+        return;
+    }
+
+    st = new_stream(sess, req);
+    st->catalog = catalog_acquire();
+    if (!req->paged)
+        return;
+
+    st->paged = true;
+    st->left = req->page > 0 ? req->page : SIZE_MAX;
+    st->page.sort = req->sort;
+    st->page.reverse = req->reverse;
+    st->page.files_only = !sess->binary;
+    strcpy(st->pattern, req->arg);
+    if (req->cursor[0] != '\0' && !catalog_parse_cursor(req->cursor, &st->page, st->after))
+    {
+        end_stream(sess, st);
+        queue_error(sess, req->id, ERR_KIND_RPC, ERR_CURSOR);
+    }
+}
+
+// The userspace transfer buffer, allocated when a stream first needs it
+char *transfer_buffer(struct session *sess)
+{
+    if (sess->xferbuf == NULL && (sess->xferbuf = malloc(TRANSFER_SIZE)) == NULL)
+        fprintf(stderr, "Server: Out of memory for file transfer\n");
+    return sess->xferbuf;
+}
+
+/******************************************************************************
+
+Send the next part of a listing page.  Entries are packed into the transfer
+buffer until the next might not fit, as one LS_DATA frame or as text lines
+with their sizes, just like the whole listing.  A step looks at no more than
+SEARCH_BATCH entries, so a pattern that matches little takes turns with the
+other streams.  A page that stopped short of the end of the listing ends
+with the cursor of the next one: in LS_END, or as a "more <cursor>" line
+before the text protocol's EOF.
+
+******************************************************************************/
+enum step_result page_step(struct session *sess, struct stream *st)
+{
+    size_t header = sess->binary ? FRAME_HEADER_SIZE : 0, len = 0, budget = SEARCH_BATCH;
+    uint32_t found[TRANSFER_SIZE / (LS_ENTRY_HEADER_SIZE + NAME_MAX + 32)];
+    char *buf;
+
+    if (st->done || st->left == 0)
+    {
+        char cursor[LS_CURSOR_MAX + sizeof("more ") + sizeof("EOF")] = "more ";
+        size_t len = 0;
+
+        // A page that filled up before the end of the listing has more after it
+        if (!st->done)
+        {
+            catalog_cursor(&st->page, cursor + 5);
+            len = strlen(cursor + 5);
+        }
+        if (sess->binary)
+            queue_frame(sess, OP_LS_END, st->id, cursor + 5, len);
+        else if (st->done)
+            queue_string(sess, "EOF");
+        else
+        {
+            // Both lines go in one record, as only one can be queued at a time
+            strcpy(cursor + 5 + len + 1, "EOF");
+            queue_record(sess, cursor, 5 + len + 1 + sizeof("EOF"));
+        }
+        end_stream(sess, st);
+        return STEP_CONTINUE;
+    }
+    if ((buf = transfer_buffer(sess)) == NULL)
+        return STEP_CLOSE;
+
+    // The stream may have moved since the last step
+    st->page.pattern = st->pattern[0] != '\0' ? st->pattern : NULL;
+    if (st->page.after != NULL && st->piece == 0)
+        st->page.after = st->after;
+
+    // Ask for as many entries as are sure to fit in what is left of the
+    // buffer, until it is nearly full
+    while (st->left > 0 && !st->done && budget > 0)
+    {
+        size_t room = (TRANSFER_SIZE - header - len) / (LS_ENTRY_HEADER_SIZE + NAME_MAX + 32), want;
+        ssize_t n;
+
+        if (room == 0)
+            break;
+        want = room < st->left ? room : st->left;
+        want = want < sizeof(found) / sizeof(found[0]) ? want : sizeof(found) / sizeof(found[0]);
+        if ((n = catalog_page(st->catalog, &st->page, found, want, budget, &st->done)) < 0)
+        {
+            fprintf(stderr, "Server: Out of memory sorting the listing\n");
+            return STEP_CLOSE;
+        }
+        st->piece = 1;
+        budget = budget > want ? budget - want : 0;
+        st->left -= n;
+        for (ssize_t k = 0; k < n; k++)
+        {
+            const struct catalog_entry *entry = &st->catalog->entries[found[k]];
+
+            len += catalog_format_entry(buf + header + len, TRANSFER_SIZE - header - len,
+                                        catalog_name(st->catalog, entry), entry->namelen, entry->type, entry->size,
+                                        sess->binary);
+        }
+    }
+    if (len == 0)
+        return STEP_CONTINUE;
+
+    if (sess->binary)
+        encode_frame_header((unsigned char *)buf, OP_LS_DATA, st->id, len);
+    sess->outptr = buf;
+    sess->outlen = header + len;
+    return STEP_CONTINUE;
+}
+
+/******************************************************************************
+
+Send the next piece of a directory listing.  The catalog keeps each listing
+already serialized and cut into pieces that fit in a TLS record.  A text
+piece is sent straight from the snapshot.  A binary piece becomes the payload
+of an LS_DATA frame, which is assembled in the transfer buffer because the
+snapshot is shared and its pieces have no room for this request's header.
+
+******************************************************************************/
+enum step_result list_step(struct session *sess, struct stream *st)
+{
+    const struct catalog_listing *listing = sess->binary ? &st->catalog->binary : &st->catalog->text;
+
+    if (st->paged)
+        return page_step(sess, st);
+
+    if (st->piece < listing->pieces)
+    {
+        const char *piece = listing->data + listing->cuts[st->piece];
+        size_t len = listing->cuts[st->piece + 1] - listing->cuts[st->piece];
+
+        st->piece++;
+        if (!sess->binary)
+        {
+            sess->outptr = piece;
+            sess->outlen = len;
+            return STEP_CONTINUE;
+        }
+
+        char *frame = transfer_buffer(sess);
+        if (frame == NULL)
+            return STEP_CLOSE;
+        encode_frame_header((unsigned char *)frame, OP_LS_DATA, st->id, len);
+        memcpy(frame + FRAME_HEADER_SIZE, piece, len);
+        sess->outptr = frame;
+        sess->outlen = FRAME_HEADER_SIZE + len;
+        return STEP_CONTINUE;
+    }
+
+    if (sess->binary)
+        queue_frame(sess, OP_LS_END, st->id, NULL, 0);
+    else
+        queue_string(sess, "EOF");
+    end_stream(sess, st);
+    return STEP_CONTINUE;
+}
+
+/******************************************************************************
+
+Track metadata comes from the catalog too (see catalog.h), so a meta or
+search request never touches the files themselves.  The binary protocol
+sends track records; the text protocol sends the same information as text,
+a line per field for meta and a tab separated line per track for search.
+
+******************************************************************************/
+size_t encode_track(const struct catalog *cat, size_t i, unsigned char *p)
+{
+    const char *name = catalog_name(cat, &cat->entries[i]);
+    size_t lens[CATALOG_TAGS + 1], len = TRACK_HEADER_SIZE;
+
+    lens[0] = cat->entries[i].namelen;
+    for (int t = 0; t < CATALOG_TAGS; t++)
+        lens[t + 1] = strlen(catalog_tag(cat, i, t));
+
+    put_u32(p, cat->durations[i]);
+    put_u16(p + 4, cat->bitrates[i]);
+    put_u16(p + 6, cat->years[i]);
+    put_u16(p + 8, lens[0]);
+    for (int t = 0; t < CATALOG_TAGS; t++)
+        p[10 + t] = lens[t + 1];
+
+    memcpy(p + len, name, lens[0]);
+    len += lens[0];
+    for (int t = 0; t < CATALOG_TAGS; t++)
+    {
+        memcpy(p + len, catalog_tag(cat, i, t), lens[t + 1]);
+        len += lens[t + 1];
+    }
+    return len;
+}
+
+void start_meta(struct session *sess, const struct request *req)
+{
+    struct catalog *cat;
+    const struct catalog_entry *entry;
+
+    if (req->arg[0] == '\0')
+    {
+        queue_error(sess, req->id, ERR_KIND_RPC, ERR_TOO_FEW_ARGS);
+        return;
+    }
+
+    cat = catalog_acquire();
+    if ((entry = catalog_lookup(cat, req->arg)) == NULL)
+        queue_error(sess, req->id, ERR_KIND_FILE, ENOENT);
+    else if (sess->binary)
+    {
+        unsigned char record[TRACK_RECORD_MAX];
+
+        queue_frame(sess, OP_TRACKS, req->id, record, encode_track(cat, entry - cat->entries, record));
+    }
+    else
+    {
+        static const char *audio[] = {"none", "ok", "corrupt", "truncated"};
+        size_t i = entry - cat->entries;
+        char text[TRACK_RECORD_MAX + 192];
+
+        snprintf(text, sizeof(text),
+                 "Title: %s\nArtist: %s\nAlbum: %s\nYear: %u\nDuration: %u:%02u\nBitrate: %u kbit/s\n"
+                 "Sample rate: %u Hz\nAudio: %s\n",
+                 catalog_tag(cat, i, SEARCH_TITLE), catalog_tag(cat, i, SEARCH_ARTIST),
+                 catalog_tag(cat, i, SEARCH_ALBUM), cat->years[i], cat->durations[i] / 60000,
+                 cat->durations[i] / 1000 % 60, cat->bitrates[i], cat->samplerates[i], audio[cat->audio[i]]);
+        queue_string(sess, text);
+    }
+    catalog_release(cat);
+}
+
+// Start a search of the current catalog snapshot, see search_step()
+void start_search(struct session *sess, const struct request *req)
+{
+    struct stream *st;
+
+    if (req->field < SEARCH_TITLE || req->field > SEARCH_ANY ||
+        (req->field == SEARCH_ANY && sess->binary && sess->version < 5))
+    {
+        queue_error(sess, req->id, ERR_KIND_RPC, ERR_INVALID_OP);
+        return;
+    }
+    if (req->arg[0] == '\0' || strlen(req->arg) > SEARCH_QUERY_MAX)
+    {
+        queue_error(sess, req->id, ERR_KIND_RPC, req->arg[0] == '\0' ? ERR_TOO_FEW_ARGS : ERR_TOO_MANY_ARGS);
+        return;
+    }
+    st = new_stream(sess, req);
+    st->catalog = catalog_acquire();
+    st->field = req->field;
+    strcpy(st->query, req->arg);
+
+    // A ranked search is answered from the catalog's index all at once, and
+    // its results are then sent like those of any other search
+    if (st->field == SEARCH_ANY)
+    {
+        if ((st->ranked = malloc(SEARCH_RANKED_MAX * sizeof(*st->ranked))) == NULL)
+        {
+            end_stream(sess, st);
+            queue_error(sess, req->id, ERR_KIND_FILE, ENOMEM);
+            return;
+        }
+        st->nranked = catalog_rank(st->catalog, st->query, st->ranked, SEARCH_RANKED_MAX);
+    }
+}
+
+/******************************************************************************
+
+Send the next batch of search results.  Matches are packed into the transfer
+buffer until the next might not fit, as one TRACKS frame or as text lines.
+A step looks through at most SEARCH_BATCH entries, so searching a large
+library for something rare takes turns with the other streams like any
+other request; a step that found nothing simply sends nothing.  A ranked
+search already knows its results and only has to send them.
+
+******************************************************************************/
+size_t append_track(const struct session *sess, const struct catalog *cat, size_t i, char *p, size_t size)
+{
+    if (sess->binary)
+        return encode_track(cat, i, (unsigned char *)p);
+
+    // Each line NUL terminated, like the text protocol's listing
+    return snprintf(p, size, "%s\t%s\t%s\t%s\t%u\t%u:%02u\n", catalog_name(cat, &cat->entries[i]),
+                    catalog_tag(cat, i, SEARCH_TITLE), catalog_tag(cat, i, SEARCH_ARTIST),
+                    catalog_tag(cat, i, SEARCH_ALBUM), cat->years[i], cat->durations[i] / 60000,
+                    cat->durations[i] / 1000 % 60) + 1;
+}
+
+enum step_result search_step(struct session *sess, struct stream *st)
+{
+    const struct catalog *cat = st->catalog;
+    size_t header = sess->binary ? FRAME_HEADER_SIZE : 0;
+    size_t len = 0, end, i;
+    char *buf;
+
+    if (st->piece >= (st->ranked != NULL ? st->nranked : cat->count))
+    {
+        if (sess->binary)
+            queue_frame(sess, OP_TRACKS_END, st->id, NULL, 0);
+        else
+            queue_string(sess, "EOF");
+        end_stream(sess, st);
+        return STEP_CONTINUE;
+    }
+    if ((buf = transfer_buffer(sess)) == NULL)
+        return STEP_CLOSE;
+
+    if (st->ranked != NULL)
+    {
+        while (header + len + TRACK_RECORD_MAX + 128 <= TRANSFER_SIZE && st->piece < st->nranked)
+            len += append_track(sess, cat, st->ranked[st->piece++], buf + header + len, TRANSFER_SIZE - header - len);
+    }
+    else
+    {
+        end = cat->count - st->piece > SEARCH_BATCH ? st->piece + SEARCH_BATCH : cat->count;
+        while (header + len + TRACK_RECORD_MAX + 128 <= TRANSFER_SIZE &&
+               (i = catalog_search(cat, st->field, st->query, st->piece, end - st->piece)) < end)
+        {
+            len += append_track(sess, cat, i, buf + header + len, TRANSFER_SIZE - header - len);
+            st->piece = i + 1;
+        }
+        if (header + len + TRACK_RECORD_MAX + 128 <= TRANSFER_SIZE)
+            st->piece = end;
+    }
+    if (len == 0)
+        return STEP_CONTINUE;
+
+    if (sess->binary)
+        encode_frame_header((unsigned char *)buf, OP_TRACKS, st->id, len);
+    sess->outptr = buf;
+    sess->outlen = header + len;
+    return STEP_CONTINUE;
+}
+
+/******************************************************************************
+
+Settle the range a getfile sends, 'length' bytes from 'start' or the rest of
+the file, and announce it to a binary client with FILE_BEGIN.
+
+******************************************************************************/
+void begin_file(struct session *sess, struct stream *st, off_t start, uint64_t length)
+{
+    unsigned char begin[FILE_BEGIN_SIZE];
+    off_t size = st->filesize;
+
+    st->filestart = st->fileoff = start;
+    if (length > 0 && length < (uint64_t)(size - start))
+        st->filesize = start + length;
+
+    // Version 1 clients only get the size
+    put_u64(begin, size);
+    put_u64(begin + 8, st->filestart);
+    put_u64(begin + 16, st->filesize - st->filestart);
+    memcpy(begin + 24, st->etag, ETAG_SIZE);
+    if (sess->binary)
+        queue_frame(sess, OP_FILE_BEGIN, st->id, begin, sess->version < 2 ? 8 : sizeof(begin));
+}
+
+// Where a getfile by time starts, by the seek table of its file.  A table
+// built from another version of the file than the one being sent (which
+// changed in between) is no use, and all of it is sent.
+off_t seek_at(const struct stream *st, const struct seek_table *table)
+{
+    unsigned char etag[ETAG_SIZE];
+
+    encode_etag(etag, table->mtime, table->size);
+    if (st->filefd < 0 || memcmp(etag, st->etag, ETAG_SIZE) != 0)
+        return 0;
+    return seek_find(table, st->filefd, st->seekms);
+}
+
+// Start sending a clip that has been cut, or was found in the cache.  The
+// file it was cut from isn't needed any more.
+void begin_preview(struct session *sess, struct stream *st)
+{
+    if (st->filefd >= 0)
+        close(st->filefd);
+    st->filefd = -1;
+    st->filesize = st->preview->size;
+    begin_file(sess, st, 0, 0);
+}
+
+// The catalog's name for a file named by its path, as a getfile names it
+const char *catalog_path_name(const char *path)
+{
+    size_t len = strlen(DATA_DIRECTORY) - 2;
+
+    path += strncmp(path, "./", 2) == 0 ? 2 : 0;
+    if (strncmp(path, DATA_DIRECTORY + 2, len) == 0 && path[len] == '/')
+        return path + len + 1;
+    return path;
+}
+
+/******************************************************************************
+
+Cut a preview clip by the file's seek table: the frames from the one nearest
+its start to the one nearest its end, behind a tag of its own with the
+catalog's tags for the file and the clip's length.  The frames are read into
+the clip SEEK_BATCH bytes at a step by preview_step().  A table built from
+another version of the file than the one open gives a clip with no audio.
+
+******************************************************************************/
+void cut_preview(struct session *sess, struct stream *st, const struct seek_table *table)
+{
+    uint64_t total = table->frames * table->samples * 1000 / table->samplerate;
+    unsigned char tag[ID3_TAG_MAX], etag[ETAG_SIZE];
+    struct id3_info info = {0};
+    const struct catalog_entry *entry;
+    struct catalog *cat = catalog_acquire();
+    off_t from = 0, to = 0;
+    size_t taglen;
+
+    encode_etag(etag, table->mtime, table->size);
+    if (st->filefd >= 0 && memcmp(etag, st->etag, ETAG_SIZE) == 0)
+    {
+        from = seek_find(table, st->filefd, st->seekms);
+        to = seek_find(table, st->filefd, st->seekms + st->length);
+    }
+    if ((entry = catalog_lookup(cat, catalog_path_name(st->path))) != NULL)
+    {
+        size_t i = entry - cat->entries;
+
+        snprintf(info.title, sizeof(info.title), "%s", catalog_tag(cat, i, SEARCH_TITLE));
+        snprintf(info.artist, sizeof(info.artist), "%s", catalog_tag(cat, i, SEARCH_ARTIST));
+        snprintf(info.album, sizeof(info.album), "%s", catalog_tag(cat, i, SEARCH_ALBUM));
+        info.year = cat->years[i];
+    }
+    catalog_release(cat);
+    if (to > from)
+        info.duration = st->seekms + st->length < total ? st->length : total - st->seekms;
+    else
+        to = from;
+    taglen = id3_make_tag(&info, tag);
+
+    st->preview = preview_new(st->path, st->filesize, table->mtime, st->seekms, st->length, taglen + (to - from));
+    if (st->preview == NULL)
+    {
+        queue_error(sess, st->id, ERR_KIND_FILE, ENOMEM);
+        end_stream(sess, st);
+        return;
+    }
+    memcpy(st->preview->data, tag, taglen);
+    st->filled = taglen;
+    st->fileoff = from;
+    if (st->filled == st->preview->size)
+    {
+        preview_add(st->preview);
+        begin_preview(sess, st);
+    }
+}
+
+// Read the next SEEK_BATCH bytes of a clip's frames, and once it is whole
+// offer it to the cache and start sending it
+enum step_result preview_step(struct session *sess, struct stream *st)
+{
+    struct preview *clip = st->preview;
+    size_t want = clip->size - st->filled < SEEK_BATCH ? clip->size - st->filled : SEEK_BATCH;
+    ssize_t got = pread(st->filefd, clip->data + st->filled, want, st->fileoff);
+
+    if (got <= 0)
+    {
+        fprintf(stderr, "Server: Could not read file: %s\n", got < 0 ? strerror(errno) : "file truncated");
+        queue_error(sess, st->id, ERR_KIND_FILE, got < 0 ? errno : EIO);
+        end_stream(sess, st);
+        return STEP_CONTINUE;
+    }
+    st->filled += got;
+    st->fileoff += got;
+    if (st->filled == clip->size)
+    {
+        preview_add(clip);
+        begin_preview(sess, st);
+    }
+    return STEP_CONTINUE;
+}
+
+/******************************************************************************
+
+Build the seek table of a file asked for by time, SEEK_BATCH bytes of it at
+a step, so that walking a long file takes turns with the other streams and
+sessions rather than holding them all up.  Once the table is done it is
+saved and the range is sent from where it says, or the preview clip cut.
+
+******************************************************************************/
+enum step_result seek_step(struct session *sess, struct stream *st)
+{
+    struct seek_table *table;
+
+    if (seek_build_step(st->seeking, SEEK_BATCH))
+        return STEP_CONTINUE;
+    table = seek_build_end(st->seeking);
+    st->seeking = NULL;
+    if (table == NULL)
+    {
+        queue_error(sess, st->id, ERR_KIND_RPC, ERR_NO_AUDIO);
+        end_stream(sess, st);
+        return STEP_CONTINUE;
+    }
+    if (st->opcode == OP_PREVIEW)
+        cut_preview(sess, st, table);
+    else
+        begin_file(sess, st, seek_at(st, table), st->length);
+    seek_free(table);
+    return STEP_CONTINUE;
+}
+
+/******************************************************************************
+
+Open the file a request names and find its size and modification time.  A
+session that encrypts in userspace gets the file cache's copy when the file
+is small enough to be cached, unless 'cached' is NULL.  Any error is
+reported to the client straight away, and false returned.
+
+******************************************************************************/
+bool open_file(struct session *sess, const struct request *req, struct cached_file **cached, int *filefd,
+               off_t *size, int64_t *mtime)
+{
+    struct stat fileInfo;
+    int error = 0;
+
+    if (cached != NULL)
+        *cached = NULL;
+    *filefd = -1;
+    if (req->arg[0] == '\0')
+    {
+        queue_error(sess, req->id, ERR_KIND_RPC, ERR_TOO_FEW_ARGS);
+        return false;
+    }
+
+    // Now check for a file error
+    if (!sess->ktls && cached != NULL)
+        *cached = filecache_get(req->arg, &error);
+    if ((cached == NULL || *cached == NULL) && error == 0 && (*filefd = open(req->arg, O_RDONLY)) < 0)
+        error = errno;
+    if (error != 0)
+    {
+        fprintf(stderr, "Server: Could not open file \"%s\": %s\n", req->arg, strerror(error));
+        queue_error(sess, req->id, ERR_KIND_FILE, error);
+        return false;
+    }
+    if (cached != NULL && *cached != NULL)
+    {
+        *size = (*cached)->size;
+        *mtime = (*cached)->mtime;
+    }
+    else
+    {
+        fstat(*filefd, &fileInfo);
+        *size = fileInfo.st_size;
+        *mtime = fileInfo.st_mtim.tv_sec * 1000000000LL + fileInfo.st_mtim.tv_nsec;
+    }
+    return true;
+}
+
+void close_file(struct cached_file *cached, int filefd)
+{
+    if (cached != NULL)
+        filecache_put(cached);
+    else
+        close(filefd);
+}
+
+/******************************************************************************
+
+Open the file named in a getfile request.  Any error is reported to the client
+straight away; otherwise the file is sent by getfile_step().  Binary clients
+are told the size of the file before any of it is sent.
+
+From version 2 a request may ask for a byte range.  The range is sent only
+if the client's ETag matches the file as it is now, or if it sent none, and
+only as much of it as the file holds; otherwise the whole file is sent.
+FILE_BEGIN tells the client which it is getting.
+
+A range may also start at a time, from version 7 or with "@" in the text
+protocol.  It then starts at the audio frame the file's seek table says,
+and if the file has no table yet the stream builds one first, see
+seek_step().
+
+A session that encrypts in userspace sends from the file cache when the file
+is small enough to be cached.  With kernel TLS the file is read by the kernel
+from the page cache anyway, so it is simply opened.
+
+******************************************************************************/
+void start_getfile(struct session *sess, const struct request *req)
+{
+    static const unsigned char no_etag[ETAG_SIZE];
+    unsigned char etag[ETAG_SIZE];
+    struct cached_file *cached;
+    struct seek_table *table = NULL;
+    struct seek_build *build = NULL;
+    struct stream *st;
+    bool ranged;
+    int64_t mtime;
+    off_t size;
+    int filefd;
+
+    if (!open_file(sess, req, &cached, &filefd, &size, &mtime))
+        return;
+    encode_etag(etag, mtime, size);
+    ranged = memcmp(req->if_match, no_etag, ETAG_SIZE) == 0 || memcmp(req->if_match, etag, ETAG_SIZE) == 0;
+
+    // A time needs the file's seek table, or failing that MPEG audio to build one from
+    if (ranged && req->timed && (table = seek_load(req->arg, size, mtime)) == NULL &&
+        (build = seek_build_start(req->arg)) == NULL)
+    {
+        close_file(cached, filefd);
+        queue_error(sess, req->id, ERR_KIND_RPC, ERR_NO_AUDIO);
+        return;
+    }
+
+    // Passed all error checks, so transfer the file contents to the client
+    st = new_stream(sess, req);
+    st->cached = cached;
+    st->filefd = filefd;
+    st->filesize = size;
+    memcpy(st->etag, etag, ETAG_SIZE);
+    if (build != NULL || table != NULL)
+    {
+        // The frame headers are read from the file, even if it is cached
+        if (filefd < 0)
+            st->filefd = open(req->arg, O_RDONLY);
+        st->seekms = req->offset;
+        st->length = req->length;
+    }
+    if (build != NULL)
+    {
+        trace(sess->trace, TRACE_DEBUG, TRACE_BUILD, sess->conn, req->id, req->opcode, "seek table");
+        st->seeking = build;
+        return;
+    }
+    if (table != NULL)
+    {
+        begin_file(sess, st, seek_at(st, table), req->length);
+        seek_free(table);
+    }
+    else if (ranged && req->offset <= (uint64_t)size)
+        begin_file(sess, st, req->offset, req->length);
+    else
+        begin_file(sess, st, 0, 0);
+}
+
+// Start sending the segment a SEGMENT asks for, if its list was cut from the
+// version of the file the stream has open and has a segment with that hash
+void begin_segment(struct session *sess, struct stream *st)
+{
+    const struct segment *seg = NULL;
+    unsigned char etag[ETAG_SIZE];
+
+    encode_etag(etag, st->segments->mtime, st->segments->size);
+    if (memcmp(etag, st->etag, ETAG_SIZE) == 0)
+        seg = segment_find(st->segments, st->hash);
+    if (seg == NULL)
+    {
+        queue_error(sess, st->id, ERR_KIND_RPC, ERR_NO_SEGMENT);
+        end_stream(sess, st);
+        return;
+    }
+    begin_file(sess, st, seg->offset, seg->length);
+}
+
+/******************************************************************************
+
+Start answering a preview request, from version 10 or with "preview" in the
+text protocol: a clip of 'length' ms from 'start' into an MP3 file, by
+default the first PREVIEW_DEFAULT_MS and at most PREVIEW_MAX_MS, sent like
+a whole file.  A clip of the file as it is now may be in the preview cache;
+otherwise it is cut by the file's seek table, built first if need be, and
+then cached.  The file cache is left alone, since a clip needs only a small
+part of the file.
+
+******************************************************************************/
+void start_preview(struct session *sess, const struct request *req)
+{
+    uint32_t start = req->offset < UINT32_MAX ? req->offset : UINT32_MAX;
+    uint32_t length = req->length < PREVIEW_MAX_MS ? req->length : PREVIEW_MAX_MS;
+    struct seek_table *table = NULL;
+    struct seek_build *build = NULL;
+    struct preview *clip;
+    struct stream *st;
+    int64_t mtime;
+    off_t size;
+    int filefd;
+
+    if (length == 0)
+        length = PREVIEW_DEFAULT_MS;
+    if (!open_file(sess, req, NULL, &filefd, &size, &mtime))
+        return;
+    if ((clip = preview_get(req->arg, size, mtime, start, length)) == NULL &&
+        (table = seek_load(req->arg, size, mtime)) == NULL && (build = seek_build_start(req->arg)) == NULL)
+    {
+        close(filefd);
+        queue_error(sess, req->id, ERR_KIND_RPC, ERR_NO_AUDIO);
+        return;
+    }
+
+    st = new_stream(sess, req);
+    st->filefd = filefd;
+    st->filesize = size;
+    encode_etag(st->etag, mtime, size);
+    st->seekms = start;
+    st->length = length;
+    if (clip != NULL)
+    {
+        st->preview = clip;
+        st->filled = clip->size;
+        begin_preview(sess, st);
+        return;
+    }
+    if ((st->path = strdup(req->arg)) == NULL)
+    {
+        seek_free(table);
+        if (build != NULL)
+            seek_build_abort(build);
+        queue_error(sess, req->id, ERR_KIND_FILE, ENOMEM);
+        end_stream(sess, st);
+        return;
+    }
+    if (build != NULL)
+    {
+        trace(sess->trace, TRACE_DEBUG, TRACE_BUILD, sess->conn, req->id, req->opcode, "seek table");
+        st->seeking = build;
+        return;
+    }
+    cut_preview(sess, st, table);
+    seek_free(table);
+}
+
+/******************************************************************************
+
+Start answering a MANIFEST or SEGMENT request.  Both need the file's segment
+list, which is loaded if it was saved from the file as it is now and
+otherwise built by the stream, SEEK_BATCH bytes at a step like a seek table
+(see cut_step()).  A segment is then sent like a getfile of its range, from
+the file opened here, so that it comes from the same version of the file
+that its hash was found in.
+
+******************************************************************************/
+void start_segments(struct session *sess, const struct request *req)
+{
+    struct cached_file *cached;
+    struct segment_list *list;
+    struct segment_build *build = NULL;
+    struct stream *st;
+    int64_t mtime;
+    off_t size;
+    int filefd;
+
+    if (!open_file(sess, req, &cached, &filefd, &size, &mtime))
+        return;
+    if ((list = segment_load(req->arg, size, mtime)) == NULL &&
+        (build = segment_build_start(req->arg, size, mtime)) == NULL)
+    {
+        close_file(cached, filefd);
+        queue_error(sess, req->id, ERR_KIND_RPC, ERR_NO_AUDIO);
+        return;
+    }
+
+    st = new_stream(sess, req);
+    st->segments = list;
+    st->cutting = build;
+    st->filesize = size;
+    encode_etag(st->etag, mtime, size);
+    memcpy(st->hash, req->hash, SEGMENT_HASH_SIZE);
+    if (req->opcode == OP_SEGMENT)
+    {
+        st->cached = cached;
+        st->filefd = filefd;
+    }
+    else
+        close_file(cached, filefd);
+    if (build != NULL)
+        trace(sess->trace, TRACE_DEBUG, TRACE_BUILD, sess->conn, req->id, req->opcode, "segments");
+    else if (req->opcode == OP_SEGMENT)
+        begin_segment(sess, st);
+}
+
+// Build a file's segment list, SEEK_BATCH bytes at a step, then send what
+// was asked for from it
+enum step_result cut_step(struct session *sess, struct stream *st)
+{
+    if (segment_build_step(st->cutting, SEEK_BATCH))
+        return STEP_CONTINUE;
+    st->segments = segment_build_end(st->cutting);
+    st->cutting = NULL;
+    if (st->segments == NULL)
+    {
+        queue_error(sess, st->id, ERR_KIND_RPC, ERR_NO_AUDIO);
+        end_stream(sess, st);
+    }
+    else if (st->opcode == OP_SEGMENT)
+        begin_segment(sess, st);
+    return STEP_CONTINUE;
+}
+
+size_t append_segment(const struct session *sess, const struct segment_list *list, size_t i, char *p, size_t size)
+{
+    const struct segment *seg = &list->segments[i];
+    char hex[2 * SEGMENT_HASH_SIZE + 1];
+
+    if (sess->binary)
+    {
+        unsigned char *record = (unsigned char *)p;
+
+        put_u64(record, seg->offset);
+        put_u64(record + 8, seg->length);
+        put_u32(record + 16, seg->start);
+        put_u32(record + 20, seg->duration);
+        memcpy(record + 24, seg->hash, SEGMENT_HASH_SIZE);
+        return SEGMENT_RECORD_SIZE;
+    }
+
+    // Each line NUL terminated, like the text protocol's listing
+    for (int k = 0; k < SEGMENT_HASH_SIZE; k++)
+        sprintf(hex + 2 * k, "%02x", seg->hash[k]);
+    return snprintf(p, size, "%zu\t%llu\t%llu\t%u\t%u\t%s\n", i, (unsigned long long)seg->offset,
+                    (unsigned long long)seg->length, seg->start, seg->duration, hex) + 1;
+}
+
+/******************************************************************************
+
+Send the next batch of a manifest, packed into the transfer buffer like
+search results, and end it with the ETag of the file the segments were cut
+from.
+
+******************************************************************************/
+enum step_result manifest_step(struct session *sess, struct stream *st)
+{
+    const struct segment_list *list = st->segments;
+    size_t header = sess->binary ? FRAME_HEADER_SIZE : 0;
+    size_t len = 0;
+    char *buf;
+
+    if (st->cutting != NULL)
+        return cut_step(sess, st);
+    if (st->piece >= list->count)
+    {
+        unsigned char etag[ETAG_SIZE];
+
+        encode_etag(etag, list->mtime, list->size);
+        if (sess->binary)
+            queue_frame(sess, OP_SEGMENTS_END, st->id, etag, sizeof(etag));
+        else
+            queue_string(sess, "EOF");
+        end_stream(sess, st);
+        return STEP_CONTINUE;
+    }
+    if ((buf = transfer_buffer(sess)) == NULL)
+        return STEP_CLOSE;
+
+    while (header + len + SEGMENT_RECORD_SIZE + 128 <= TRANSFER_SIZE && st->piece < list->count)
+        len += append_segment(sess, list, st->piece++, buf + header + len, TRANSFER_SIZE - header - len);
+    if (sess->binary)
+        encode_frame_header((unsigned char *)buf, OP_SEGMENTS, st->id, len);
+    sess->outptr = buf;
+    sess->outlen = header + len;
+    return STEP_CONTINUE;
+}
+
+/******************************************************************************
+
+Take up to 'want' bytes of file data from the session's rate limits, and at
+least 'least' of them.  If they won't allow that many yet it takes none and
+returns 0, with sess->wake set to when they will.
+
+******************************************************************************/
+size_t shape(struct session *sess, size_t want, size_t least)
+{
+    uint64_t now, ready;
+    size_t allowed;
+
+    if (!sess->shaped)
+        return want;
+    now = shaper_now();
+    allowed = bucket_allows(&sess->rate, now, want);
+    if (sess->user_rate != NULL)
+        allowed = bucket_allows(sess->user_rate, now, allowed);
+    if (allowed < least)
+    {
+        ready = bucket_ready(&sess->rate, now, least);
+        if (sess->user_rate != NULL && bucket_ready(sess->user_rate, now, least) > ready)
+            ready = bucket_ready(sess->user_rate, now, least);
+        sess->wake = ready;
+        metrics_add(sess->metrics, METRIC_THROTTLED, 1);
+        return 0;
+    }
+    bucket_take(&sess->rate, now, allowed);
+    if (sess->user_rate != NULL)
+        bucket_take(sess->user_rate, now, allowed);
+    return allowed;
+}
+
+/******************************************************************************
+
+Send the next chunk of a file.  In the binary protocol each chunk is a
+FILE_DATA frame.  On the userspace path the frame header and data share one
+full TLS record.  With sendfile the header is written first and the kernel
+then sends the data straight from the page cache; until that data is all out,
+the session can't switch to another stream (see pick_stream()).
+
+Every chunk is taken from the session's rate limits first, and counts
+against what its turn may send (see drive_session()).  A sendfile chunk is
+sent a turn's worth at a time.
+
+******************************************************************************/
+enum step_result getfile_step(struct session *sess, struct stream *st)
+{
+    enum transfer_path path = sess->ktls && st->preview == NULL ? PATH_SENDFILE : PATH_USERSPACE;
+    size_t header = sess->binary ? FRAME_HEADER_SIZE : 0;
+
+    if (st->seeking != NULL)
+        return seek_step(sess, st);
+    if (st->cutting != NULL)
+        return cut_step(sess, st);
+    if (st->preview != NULL && st->filled < st->preview->size)
+        return preview_step(sess, st);
+
+    if (st->fileoff < st->filesize)
+    {
+        if (sess->deficit <= 0)
+        {
+            sess->bulk = true;
+            return STEP_YIELD;
+        }
+        if (path == PATH_SENDFILE)
+        {
+            ossl_ssize_t sent;
+            size_t len;
+
+            // Start a new chunk, announcing it first in the binary protocol
+            if (st->chunkleft == 0)
+            {
+                len = st->filesize - st->fileoff;
+                if (len > SENDFILE_CHUNK)
+                    len = SENDFILE_CHUNK;
+                if ((st->chunkleft = shape(sess, len, len < TRANSFER_SIZE ? len : TRANSFER_SIZE)) == 0)
+                    return STEP_CONTINUE;
+                sess->sending = st - sess->streams;
+                if (sess->binary)
+                {
+                    encode_frame_header((unsigned char *)sess->outbuf, OP_FILE_DATA, st->id, st->chunkleft);
+                    sess->outptr = sess->outbuf;
+                    sess->outlen = FRAME_HEADER_SIZE;
+                    return STEP_CONTINUE;
+                }
+            }
+
+            len = st->chunkleft;
+            if ((long)len > sess->deficit)
+                len = sess->deficit > TRANSFER_SIZE ? sess->deficit : TRANSFER_SIZE;
+            if (len > st->chunkleft)
+                len = st->chunkleft;
+            sent = SSL_sendfile(sess->ssl, st->filefd, st->fileoff, len, 0);
+            if (sent <= 0)
+                return ssl_step_result(sess, sent);
+            metrics_add(sess->metrics, METRIC_BYTES_SENT, sent);
+            st->fileoff += sent;
+            st->chunkleft -= sent;
+            sess->deficit -= sent;
+            if (st->chunkleft == 0)
+                sess->sending = -1;
+            return STEP_CONTINUE;
+        }
+
+        // Only the userspace path needs a buffer
+        if (transfer_buffer(sess) == NULL)
+            return STEP_CLOSE;
+
+        size_t want = TRANSFER_SIZE - header;
+        if ((off_t)want > st->filesize - st->fileoff)
+            want = st->filesize - st->fileoff;
+        if (shape(sess, want, want) == 0)
+            return STEP_CONTINUE;
+
+        int rcount = st->preview != NULL ? (int)preview_copy(st->preview, st->fileoff, sess->xferbuf + header, want)
+                     : st->cached != NULL ? (int)filecache_copy(st->cached, st->fileoff, sess->xferbuf + header, want)
+                                          : pread(st->filefd, sess->xferbuf + header, want, st->fileoff);
+        if (rcount > 0)
+        {
+            if (sess->binary)
+                encode_frame_header((unsigned char *)sess->xferbuf, OP_FILE_DATA, st->id, rcount);
+            st->fileoff += rcount;
+            sess->deficit -= rcount;
+            sess->outptr = sess->xferbuf;
+            sess->outlen = header + rcount;
+            return STEP_CONTINUE;
+        }
+
+        // The file shrank or can't be read.  A binary client has been promised
+        // more bytes than it will get, so tell it the transfer failed.
+        fprintf(stderr, "Server: Could not read file: %s\n", rcount < 0 ? strerror(errno) : "file truncated");
+        if (sess->binary)
+        {
+            queue_error(sess, st->id, ERR_KIND_FILE, rcount < 0 ? errno : EIO);
+            end_stream(sess, st);
+            return STEP_CONTINUE;
+        }
+    }
+
+    if (sess->binary)
+        queue_frame(sess, OP_FILE_END, st->id, NULL, 0);
+    else
+        queue_string(sess, "EOF");
+
+    // File transfer complete
+    metrics_add(sess->metrics, METRIC_TRANSFERS_SENDFILE + path, 1);
+    trace(sess->trace, TRACE_INFO, TRACE_TRANSFER, sess->conn, st->id, st->fileoff - st->filestart,
+          transfer_path_names[path]);
+    end_stream(sess, st);
+    return STEP_CONTINUE;
+}
+
+/******************************************************************************
+
+Tune the session in to a radio channel.  From then on it only sends the
+channel's audio, so it can't have requests of its own still in flight.  It
+starts a little way back (see radio_tune()) and waits on its worker's list
+of listeners whenever it has sent all there is.
+
+******************************************************************************/
+void start_tune(struct session *sess, const struct request *req)
+{
+    struct radio_channel *ch = radio_find(req->arg);
+
+    if (ch == NULL)
+    {
+        queue_error(sess, req->id, ERR_KIND_RPC, ERR_NO_CHANNEL);
+        return;
+    }
+    if (sess->nstreams > 0)
+    {
+        queue_error(sess, req->id, ERR_KIND_RPC, ERR_INVALID_OP);
+        return;
+    }
+    sess->channel = ch;
+    sess->radio_pos = radio_tune(ch);
+    sess->radio_id = req->id;
+    sess->state = STATE_RADIO;
+    setsockopt(sess->fd, SOL_SOCKET, SO_SNDBUF, &(int){RADIO_SEND_BUFFER}, sizeof(int));
+    sess->prev_listener = NULL;
+    sess->next_listener = *sess->listeners;
+    if (sess->next_listener != NULL)
+        sess->next_listener->prev_listener = sess;
+    *sess->listeners = sess;
+    if (sess->binary)
+        queue_frame(sess, OP_OK, req->id, NULL, 0);
+    trace(sess->trace, TRACE_INFO, TRACE_TUNE, sess->conn, req->id, 0, radio_name(ch));
+}
+
+// A listener has fallen behind its channel; either skip it to what is being
+// played now or let it go, as --radio-slow says
+enum step_result fell_behind(struct session *sess)
+{
+    uint64_t live;
+
+    if (radio_slow == SLOW_CLOSE)
+    {
+        trace(sess->trace, TRACE_INFO, TRACE_BEHIND, sess->conn, sess->radio_id, 0, radio_name(sess->channel));
+        return STEP_CLOSE;
+    }
+    live = radio_live(sess->channel);
+    trace(sess->trace, TRACE_INFO, TRACE_BEHIND, sess->conn, sess->radio_id, live - sess->radio_pos,
+          radio_name(sess->channel));
+    sess->radio_pos = live;
+    return STEP_CONTINUE;
+}
+
+/******************************************************************************
+
+Send a listener the next record of its channel's audio, as much as has been
+played up to REPLY_SIZE.  A listener has nothing more to say, but its input
+is still read, and thrown away, since that is how a closed connection is
+noticed.  Once it has everything there is, it waits for its worker to be
+woken by the channel (see wake_listeners()).
+
+******************************************************************************/
+enum step_result radio_step(struct session *sess)
+{
+    size_t header = sess->binary ? FRAME_HEADER_SIZE : 0;
+    enum step_result result;
+    ssize_t n;
+
+    if (sess->readable)
+    {
+        sess->inlen = 0;
+        if ((result = fill_input(sess)) != STEP_WANT_READ)
+            return result;
+        sess->readable = false;
+    }
+
+    n = radio_read(sess->channel, &sess->radio_pos, sess->outbuf + header, REPLY_SIZE - header);
+    if (n < 0)
+        return fell_behind(sess);
+    if (n == 0)
+        return STEP_WANT_READ;
+    if (sess->binary)
+        encode_frame_header((unsigned char *)sess->outbuf, OP_RADIO_DATA, sess->radio_id, n);
+    sess->outptr = sess->outbuf;
+    sess->outlen = header + n;
+    return STEP_CONTINUE;
+}
+
+/******************************************************************************
+
+Choose the stream that sends the next record.  Listings, searches and
+manifests go before file data, so they never wait behind a download, and
+otherwise streams take turns, one record each, so a short file requested
+after a long one doesn't have to wait for it to finish.  File data waits
+while the session's rate limits say so, and then there may be nothing to
+send at all.  The exception is a stream whose FILE_DATA frame is still being
+sent with sendfile: its frame must be completed before anything else can be
+written, and has been paid for.
+
+******************************************************************************/
+bool file_stream(const struct stream *st)
+{
+    return st->opcode == OP_GETFILE || st->opcode == OP_SEGMENT || st->opcode == OP_PREVIEW;
+}
+
+struct stream *pick_stream(struct session *sess)
+{
+    bool waiting = sess->wake != 0 && sess->wake > shaper_now();
+
+    if (sess->sending >= 0)
+        return &sess->streams[sess->sending];
+    if (!waiting)
+        sess->wake = 0;
+    for (int i = 0; i < sess->nstreams; i++)
+    {
+        int k = (sess->next + i) % sess->nstreams;
+
+        if (!file_stream(&sess->streams[k]))
+        {
+            sess->next = k + 1;
+            return &sess->streams[k];
+        }
+    }
+    if (waiting)
+        return NULL;
+    if (sess->next >= sess->nstreams)
+        sess->next = 0;
+    return &sess->streams[sess->next++];
+}
+
+/******************************************************************************
+
+Answer a stats request with the whole server's metrics, as a STATS_DATA frame
+or a string.  They are too long for the reply buffer, so they go out from the
+transfer buffer, which is kept until a stream ends or the session does.
+
+******************************************************************************/
+void start_stats(struct session *sess, const struct request *req)
+{
+    size_t header = sess->binary ? FRAME_HEADER_SIZE : 0, len;
+    char *buf = transfer_buffer(sess);
+
+    if (buf == NULL)
+    {
+        queue_error(sess, req->id, ERR_KIND_RPC, ERR_BUSY);
+        return;
+    }
+    len = metrics_format(buf + header, TRANSFER_SIZE - header);
+    if (sess->binary)
+        encode_frame_header((unsigned char *)buf, OP_STATS_DATA, req->id, len);
+    else
+        len++; // and its NUL
+    sess->outptr = buf;
+    sess->outlen = header + len;
+}
+
+/******************************************************************************
+
+Act on a new request.  ls, search, getfile, manifest, segment and preview
+start a stream, meta and stats are answered straight away, tune turns the
+session over to a radio channel, exit ends the session and anything else is
+answered with an error.
+
+******************************************************************************/
+enum step_result start_request(struct session *sess, const struct request *req)
+{
+    trace(sess->trace, TRACE_DEBUG, TRACE_REQUEST, sess->conn, req->id, req->opcode, req->arg);
+    switch (req->opcode)
+    {
+    case OP_LS:
+        metrics_add(sess->metrics, METRIC_REQUESTS_LS, 1);
+        start_ls(sess, req);
+        break;
+    case OP_GETFILE:
+        metrics_add(sess->metrics, METRIC_REQUESTS_GETFILE, 1);
+        start_getfile(sess, req);
+        break;
+    case OP_META:
+        metrics_add(sess->metrics, METRIC_REQUESTS_META, 1);
+        start_meta(sess, req);
+        break;
+    case OP_SEARCH:
+        metrics_add(sess->metrics, METRIC_REQUESTS_SEARCH, 1);
+        start_search(sess, req);
+        break;
+    case OP_TUNE:
+        metrics_add(sess->metrics, METRIC_REQUESTS_TUNE, 1);
+        start_tune(sess, req);
+        break;
+    case OP_MANIFEST:
+        metrics_add(sess->metrics, METRIC_REQUESTS_MANIFEST, 1);
+        start_segments(sess, req);
+        break;
+    case OP_SEGMENT:
+        metrics_add(sess->metrics, METRIC_REQUESTS_SEGMENT, 1);
+        start_segments(sess, req);
+        break;
+    case OP_PREVIEW:
+        metrics_add(sess->metrics, METRIC_REQUESTS_PREVIEW, 1);
+        start_preview(sess, req);
+        break;
+    case OP_STATS:
+        metrics_add(sess->metrics, METRIC_REQUESTS_STATS, 1);
+        start_stats(sess, req);
+        break;
+    case OP_EXIT:
+        return STEP_CLOSE;
+    default:
+        metrics_add(sess->metrics, METRIC_REQUESTS_INVALID, 1);
+        queue_error(sess, req->id, ERR_KIND_RPC, req->error ? req->error : ERR_INVALID_OP);
+        break;
+    }
+    return STEP_CONTINUE;
+}
+
+/******************************************************************************
+
+One step of an authenticated session.  New requests are taken whenever
+there is room for another stream: a binary client may have up to MAX_STREAMS
+requests in flight, while the text protocol is strictly one at a time.  The
+socket is only read when epoll says there is input or when there is nothing
+to send, so a busy session doesn't pay for a failed read on every record.
+Otherwise the next stream in turn sends a record.
+
+******************************************************************************/
+enum step_result ready_step(struct session *sess)
+{
+    struct request req;
+    enum step_result result;
+    int limit = sess->binary ? MAX_STREAMS : 1;
+    int taken;
+
+    while (sess->nstreams < limit)
+    {
+        taken = take_request(sess, &req);
+        if (taken < 0)
+        {
+            fprintf(stderr, "Server: Request from client (%s) is too long\n", sess->client_addr);
+            return STEP_CLOSE;
+        }
+        if (taken > 0)
+        {
+            if ((result = start_request(sess, &req)) != STEP_CONTINUE)
+                return result;
+
+            // Send any reply it produced before taking the next request, and
+            // take none at all after a tune
+            if (sess->outlen > 0 || sess->state != STATE_READY)
+                return STEP_CONTINUE;
+            continue;
+        }
+
+        if (sess->nstreams > 0 && !sess->readable)
+            break;
+        result = fill_input(sess);
+        if (result == STEP_WANT_READ)
+        {
+            sess->readable = false;
+            if (sess->nstreams > 0)
+                break;
+        }
+        if (result != STEP_CONTINUE)
+            return result;
+    }
+
+    struct stream *st = pick_stream(sess);
+    if (st == NULL)
+        return STEP_SLEEP;
+    if (st->opcode == OP_LS)
+        return list_step(sess, st);
+    if (st->opcode == OP_SEARCH)
+        return search_step(sess, st);
+    if (st->opcode == OP_MANIFEST)
+        return manifest_step(sess, st);
+    return getfile_step(sess, st);
+}
+
+/******************************************************************************
+
+The metrics the caches and TLS resumption keep for themselves, added to the
+server's own by metrics_format().
+
+******************************************************************************/
+size_t format_cache_metrics(char *buffer, size_t size)
+{
+    struct filecache_stats files;
+    struct preview_stats clips;
+    struct resumption_stats resumption;
+    int n;
+
+    filecache_get_stats(&files);
+    preview_get_stats(&clips);
+    resumption_get_stats(&resumption);
+    n = snprintf(buffer, size,
+                 "# HELP ssl_server_cache_lookups_total Lookups in the file and preview caches.\n"
+                 "# TYPE ssl_server_cache_lookups_total counter\n"
+                 "ssl_server_cache_lookups_total{cache=\"file\",result=\"hit\"} %lu\n"
+                 "ssl_server_cache_lookups_total{cache=\"file\",result=\"miss\"} %lu\n"
+                 "ssl_server_cache_lookups_total{cache=\"preview\",result=\"hit\"} %lu\n"
+                 "ssl_server_cache_lookups_total{cache=\"preview\",result=\"miss\"} %lu\n"
+                 "# HELP ssl_server_cache_evictions_total Entries dropped to make room.\n"
+                 "# TYPE ssl_server_cache_evictions_total counter\n"
+                 "ssl_server_cache_evictions_total{cache=\"file\"} %lu\n"
+                 "ssl_server_cache_evictions_total{cache=\"preview\"} %lu\n"
+                 "# HELP ssl_server_cache_entries Files and clips in the caches.\n"
+                 "# TYPE ssl_server_cache_entries gauge\n"
+                 "ssl_server_cache_entries{cache=\"file\"} %zu\n"
+                 "ssl_server_cache_entries{cache=\"preview\"} %zu\n"
+                 "# HELP ssl_server_cache_bytes Memory the caches hold.\n"
+                 "# TYPE ssl_server_cache_bytes gauge\n"
+                 "ssl_server_cache_bytes{cache=\"file\"} %zu\n"
+                 "ssl_server_cache_bytes{cache=\"preview\"} %zu\n"
+                 "# HELP ssl_server_tickets_renewed_total Tickets made with an older key, renewed.\n"
+                 "# TYPE ssl_server_tickets_renewed_total counter\n"
+                 "ssl_server_tickets_renewed_total %lu\n"
+                 "# HELP ssl_server_ticket_key_rotations_total Ticket keys replaced.\n"
+                 "# TYPE ssl_server_ticket_key_rotations_total counter\n"
+                 "ssl_server_ticket_key_rotations_total %lu\n"
+                 "# HELP ssl_server_session_cache_lookups_total Session ids looked up in the session cache.\n"
+                 "# TYPE ssl_server_session_cache_lookups_total counter\n"
+                 "ssl_server_session_cache_lookups_total{result=\"hit\"} %lu\n"
+                 "ssl_server_session_cache_lookups_total{result=\"miss\"} %lu\n"
+                 "# HELP ssl_server_session_cache_sessions Sessions in the session cache.\n"
+                 "# TYPE ssl_server_session_cache_sessions gauge\n"
+                 "ssl_server_session_cache_sessions %zu\n",
+                 files.hits, files.misses, clips.hits, clips.misses, files.evictions, clips.evictions, files.files,
+                 clips.clips, files.bytes, clips.bytes, resumption.renewed, resumption.rotations,
+                 resumption.cache_hits, resumption.cache_misses, resumption.cached);
+    if (n < 0)
+        return 0;
+    return (size_t)n < size ? (size_t)n : size - 1;
+}
+
+/******************************************************************************
+
+Run one step of a session: finish sending the pending record if there is one,
+otherwise do whatever the session's current state calls for next.
+
+******************************************************************************/
+enum step_result session_step(struct session *sess)
+{
+    struct request req;
+    enum step_result result;
+    bool resumed;
+    int ret;
+
+    if (sess->outlen > 0)
+    {
+        ret = SSL_write(sess->ssl, sess->outptr, sess->outlen);
+        if (ret <= 0)
+            return ssl_step_result(sess, ret);
+        metrics_add(sess->metrics, METRIC_BYTES_SENT, ret);
+        sess->outlen = 0;
+        return sess->hangup ? STEP_CLOSE : STEP_CONTINUE;
+    }
+
+    switch (sess->state)
+    {
+    case STATE_HANDSHAKE:
+        // The last step in establishing a secure connection is calling SSL_accept(),
+        // which executes the SSL/TLS handshake.  Because the socket is non-blocking
+        // it may take several calls, each resumed once the socket is ready.
+        ret = SSL_accept(sess->ssl);
+        if (ret <= 0)
+        {
+            result = ssl_step_result(sess, ret);
+            if (result == STEP_CLOSE)
+            {
+                trace(sess->trace, TRACE_INFO, TRACE_HANDSHAKE_FAILED, sess->conn, 0, 0, NULL);
+                metrics_add(sess->metrics, METRIC_HANDSHAKE_FAILURES, 1);
+            }
+            return result;
+        }
+        // OpenSSL switches the connection to kernel TLS during the handshake
+        // when both the kernel and the negotiated cipher support it
+        sess->ktls = BIO_get_ktls_send(SSL_get_wbio(sess->ssl));
+        resumed = resumption_count(sess->ssl);
+        trace(sess->trace, TRACE_INFO, TRACE_HANDSHAKE, sess->conn, 0,
+              (resumed ? TRACE_RESUMED : 0) | (sess->ktls ? TRACE_KTLS : 0), NULL);
+        metrics_add(sess->metrics, resumed ? METRIC_HANDSHAKES_RESUMED : METRIC_HANDSHAKES_FULL, 1);
+        metrics_observe(sess->metrics, HIST_HANDSHAKE, sess->accepted);
+        sess->state = STATE_NEGOTIATE;
+        return STEP_CONTINUE;
+
+    case STATE_NEGOTIATE:
+        return negotiate_step(sess);
+
+    case STATE_USER:
+        if ((result = next_request(sess, &req)) != STEP_CONTINUE)
+            return result;
+        if (req.opcode == OP_TOKEN && sess->version >= 3)
+            return token_login(sess, &req);
+
+        // A name too long for any account can't log in, whatever the password
+        if (req.opcode != OP_USER || strlen(req.arg) >= sizeof(sess->username))
+            sess->username[0] = '\0';
+        else
+            strcpy(sess->username, req.arg);
+        sess->state = STATE_PASS;
+        return STEP_CONTINUE;
+
+    case STATE_PASS:
+        if ((result = next_request(sess, &req)) != STEP_CONTINUE)
+            return result;
+        return submit_login(sess, &req);
+
+    case STATE_AUTH:
+        return STEP_WAIT;
+
+    case STATE_READY:
+        return ready_step(sess);
+
+    case STATE_RADIO:
+        return radio_step(sess);
+    }
+
+    return STEP_CLOSE;
+}
+
+// Register the epoll events a session is waiting for, if they changed
+void set_session_events(struct worker *worker, struct session *sess, uint32_t events)
+{
+    struct epoll_event ev = {.events = events, .data.ptr = sess};
+
+    if (sess->events == events)
+        return;
+    if (epoll_ctl(worker->epollfd, EPOLL_CTL_MOD, sess->fd, &ev) < 0)
+        fprintf(stderr, "Server: epoll_ctl: %s\n", strerror(errno));
+    sess->events = events;
+}
+
+// Start or stop waiting for incoming connections on the listening socket
+void set_accepting(struct worker *worker, bool accepting)
+{
+    struct epoll_event ev = {.events = accepting ? EPOLLIN : 0, .data.ptr = NULL};
+
+    if (worker->accepting == accepting)
+        return;
+    epoll_ctl(worker->epollfd, EPOLL_CTL_MOD, worker->listenfd, &ev);
+    worker->accepting = accepting;
+}
+
+// Arm the worker's timer for 'when', unless it already expires before then
+void arm_timer(struct worker *worker, uint64_t when)
+{
+    struct itimerspec at = {.it_value = {.tv_sec = when / 1000000000ULL, .tv_nsec = when % 1000000000ULL}};
+
+    if (worker->timer_at != 0 && worker->timer_at <= when)
+        return;
+    if (timerfd_settime(worker->timerfd, TFD_TIMER_ABSTIME, &at, NULL) < 0)
+        fprintf(stderr, "Server: timerfd_settime: %s\n", strerror(errno));
+    worker->timer_at = when;
+}
+
+// Put a session at the end of its worker's list of sleepers until sess->wake
+void sleep_session(struct worker *worker, struct session *sess)
+{
+    if (!sess->sleeping)
+    {
+        sess->next_sleeper = NULL;
+        sess->prev_sleeper = worker->last_sleeper;
+        if (worker->last_sleeper != NULL)
+            worker->last_sleeper->next_sleeper = sess;
+        else
+            worker->sleepers = sess;
+        worker->last_sleeper = sess;
+        sess->sleeping = true;
+    }
+    arm_timer(worker, sess->wake);
+}
+
+// and take it off again
+void wake_session(struct worker *worker, struct session *sess)
+{
+    if (sess->prev_sleeper != NULL)
+        sess->prev_sleeper->next_sleeper = sess->next_sleeper;
+    else
+        worker->sleepers = sess->next_sleeper;
+    if (sess->next_sleeper != NULL)
+        sess->next_sleeper->prev_sleeper = sess->prev_sleeper;
+    else
+        worker->last_sleeper = sess->prev_sleeper;
+    sess->sleeping = false;
+}
+
+/******************************************************************************
+
+Terminate the SSL session, close the TCP connection and release everything the
+session owned.  If the server had stopped accepting because it was at its
+session limit, there is now room for another client.
+
+******************************************************************************/
+void close_session(struct worker *worker, struct session *sess)
+{
+    trace(sess->trace, TRACE_INFO, TRACE_CLOSE, sess->conn, 0, 0, NULL);
+
+    // Send the close_notify alert if we can, but never wait for the reply.
+    // After a failed session that fails too, and the error it queues would
+    // otherwise be blamed on the next session this worker serves.
+    if (sess->state != STATE_HANDSHAKE)
+        SSL_shutdown(sess->ssl);
+    ERR_clear_error();
+    SSL_free(sess->ssl);
+
+    while (sess->nstreams > 0)
+        end_stream(sess, &sess->streams[0]);
+    free(sess->xferbuf);
+
+    // A password check still in progress is freed when it comes back
+    if (sess->auth != NULL)
+        sess->auth->owner = NULL;
+
+    if (sess->sleeping)
+        wake_session(worker, sess);
+    if (sess->state == STATE_RADIO)
+    {
+        if (sess->prev_listener != NULL)
+            sess->prev_listener->next_listener = sess->next_listener;
+        else
+            *sess->listeners = sess->next_listener;
+        if (sess->next_listener != NULL)
+            sess->next_listener->prev_listener = sess->prev_listener;
+    }
+
+    // Closing the descriptor also removes it from the epoll set
+    close(sess->fd);
+    free(sess);
+
+    worker->sessions--;
+    metrics_set(&worker->metrics, METRIC_SESSIONS, worker->sessions);
+    set_accepting(worker, true);
+}
+
+/******************************************************************************
+
+Run a session until it blocks, finishes or has had its turn.  Sessions take
+turns by deficit round robin: a turn adds TRANSFER_QUANTUM bytes to what the
+session may send of file data, and ends once that is spent, whether the
+data went out in 16 kB records or as sendfile chunks.  Whatever a turn
+overspends, finishing a record, comes off the next one.  A turn also ends
+after TRANSFER_BURST records of anything.  Either way one fast download
+can't starve everybody else: a session that yields stays registered for
+EPOLLOUT, so the (level triggered) event loop comes back to it after serving
+the other ready sessions, and those that ran out of file data to send are
+served last (see run_worker()).
+
+A session whose rate limits hold back its file data sleeps on its worker's
+list, still reading requests if it has room for them, and is woken by the
+worker's timer.
+
+******************************************************************************/
+void drive_session(struct worker *worker, struct session *sess, uint32_t events)
+{
+    enum step_result result;
+    int records = 0;
+
+    // A session waiting for its password check is only woken by errors, and
+    // one waiting for its rate limits may be too
+    if ((sess->state == STATE_AUTH || sess->sleeping) && (events & (EPOLLHUP | EPOLLERR)))
+    {
+        close_session(worker, sess);
+        return;
+    }
+    if (events & EPOLLIN)
+        sess->readable = true;
+    sess->deficit = sess->deficit < 0 ? sess->deficit + TRANSFER_QUANTUM : TRANSFER_QUANTUM;
+    sess->bulk = false;
+
+    do
+    {
+        bool writing = sess->outlen > 0 || sess->nstreams > 0 || sess->state == STATE_RADIO;
+
+        result = session_step(sess);
+        if (writing && result == STEP_CONTINUE && ++records == TRANSFER_BURST)
+            result = STEP_YIELD;
+    } while (result == STEP_CONTINUE);
+
+    if (sess->sleeping && result != STEP_SLEEP)
+        wake_session(worker, sess);
+    switch (result)
+    {
+    case STEP_WANT_READ:
+        set_session_events(worker, sess, EPOLLIN);
+        break;
+    case STEP_WANT_WRITE:
+        set_session_events(worker, sess, EPOLLOUT);
+        break;
+    case STEP_WAIT:
+        set_session_events(worker, sess, 0);
+        break;
+    case STEP_SLEEP:
+        set_session_events(worker, sess, sess->nstreams < (sess->binary ? MAX_STREAMS : 1) ? EPOLLIN : 0);
+        sleep_session(worker, sess);
+        break;
+    case STEP_YIELD:
+        // Keep listening for new requests while replies are going out, as
+        // long as there is room to start another stream.  (Not when the
+        // socket is full: input would then be reported over and over while
+        // nothing can be done about it.)
+        if (sess->nstreams < (sess->binary ? MAX_STREAMS : 1))
+            set_session_events(worker, sess, EPOLLOUT | EPOLLIN);
+        else
+            set_session_events(worker, sess, EPOLLOUT);
+        break;
+    default:
+        close_session(worker, sess);
+        break;
+    }
+}
+
+/******************************************************************************
+
+Carry on with every session whose password check has come back.  A check
+whose session has since been closed is simply thrown away.
+
+******************************************************************************/
+void finish_logins(struct worker *worker)
+{
+    struct auth_job *job = auth_queue_take(&worker->logins);
+
+    while (job != NULL)
+    {
+        struct auth_job *next = job->next;
+        struct session *sess = job->owner;
+
+        if (sess != NULL)
+        {
+            sess->auth = NULL;
+            metrics_observe(sess->metrics, HIST_LOGIN, sess->login_started);
+            if (job->ok)
+                login_succeeded(sess, sess->login_id);
+            else if (login_failed(sess, sess->login_id, ERR_KIND_AUTH, 0) == STEP_CLOSE)
+            {
+                close_session(worker, sess);
+                sess = NULL;
+            }
+            if (sess != NULL)
+                drive_session(worker, sess, 0);
+        }
+        free(job);
+        job = next;
+    }
+}
+
+/******************************************************************************
+
+Feed every listener that is waiting for more audio, now that a channel has
+played another tick.  One still waiting for its socket to drain is left to
+epoll, unless it has fallen so far behind that it is to be disconnected
+anyway: a client that stops reading altogether is noticed here.
+
+******************************************************************************/
+void wake_listeners(struct worker *worker)
+{
+    struct session *sess, *next;
+    uint64_t count;
+
+    if (read(worker->radiofd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "Server: Reading the radio eventfd: %s\n", strerror(errno));
+
+    for (sess = worker->listeners; sess != NULL; sess = next)
+    {
+        next = sess->next_listener;
+        if (sess->events == EPOLLIN)
+            drive_session(worker, sess, 0);
+        else if (radio_slow == SLOW_CLOSE && radio_behind(sess->channel, sess->radio_pos))
+        {
+            fell_behind(sess);
+            close_session(worker, sess);
+        }
+    }
+}
+
+/******************************************************************************
+
+Carry on with every sleeping session whose rate limits now let it send, and
+set the timer for the first of the others.  Those that have waited longest
+go first, since sessions of the same user compete for one bucket, and one
+that has to sleep again goes to the back.
+
+******************************************************************************/
+void wake_sleepers(struct worker *worker)
+{
+    struct session *sess, *next;
+    uint64_t count, now = shaper_now();
+
+    if (read(worker->timerfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "Server: Reading the timerfd: %s\n", strerror(errno));
+    worker->timer_at = 0;
+
+    for (sess = worker->sleepers; sess != NULL; sess = next)
+    {
+        next = sess->next_sleeper;
+        if (sess->wake <= now)
+        {
+            wake_session(worker, sess);
+            drive_session(worker, sess, 0);
+        }
+        else
+            arm_timer(worker, sess->wake);
+    }
+}
+
+/******************************************************************************
+
+Accept every pending connection on the listening socket and start a session
+for each.  Once the session limit is reached the listening socket is taken
+out of the epoll set, so further clients wait in the listen backlog instead
+of being accepted and starved.
+
+******************************************************************************/
+void accept_sessions(struct worker *worker)
+{
+    while (worker->sessions < worker->max_sessions)
+    {
+        struct session *sess;
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        int client;
+
+        // Once an incoming connection arrives, accept it.  If this is successful, we
+        // now have a connection between client and server and can communicate using
+        // the socket descriptor
+        client = accept4(worker->listenfd, (struct sockaddr *)&addr, &len, SOCK_NONBLOCK);
+        if (client < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR)
+                fprintf(stderr, "Server: Unable to accept connection: %s\n", strerror(errno));
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return;
+        }
+
+        sess = calloc(1, sizeof(*sess));
+        if (sess == NULL)
+        {
+            fprintf(stderr, "Server: Out of memory for new session\n");
+            close(client);
+            return;
+        }
+        sess->fd = client;
+        sess->sending = -1;
+        sess->metrics = &worker->metrics;
+        sess->accepted = metrics_now();
+        sess->trace = worker->trace;
+        sess->conn = (uint64_t)worker->id << 40 | ++worker->connections;
+        sess->logins = &worker->logins;
+        sess->listeners = &worker->listeners;
+        sess->state = STATE_HANDSHAKE;
+
+        // OpenSSL writes every handshake record on its own.  With Nagle's
+        // algorithm the later ones would wait for the client's delayed ACK,
+        // which costs tens of milliseconds per handshake.
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+        setsockopt(client, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &(int){NOTSENT_LOWAT}, sizeof(int));
+
+        // Display the IPv4 network address of the connected client
+        inet_ntop(AF_INET, (struct in_addr *)&addr.sin_addr, sess->client_addr, INET_ADDRSTRLEN);
+        trace(worker->trace, TRACE_INFO, TRACE_ACCEPT, sess->conn, 0, worker->port, sess->client_addr);
+
+        // Here we are creating a new SSL object and binding it to the socket
+        // descriptor.  The socket descriptor will be used by OpenSSL to
+        // communicate with the client.
+        sess->ssl = SSL_new(worker->ssl_ctx);
+        if (sess->ssl == NULL || SSL_set_fd(sess->ssl, client) != 1)
+        {
+            fprintf(stderr, "Server: Could not create SSL session:\n");
+            ERR_print_errors_fp(stderr);
+            SSL_free(sess->ssl);
+            close(client);
+            free(sess);
+            continue;
+        }
+
+        // The client speaks first, so wait for its ClientHello
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = sess};
+        sess->events = EPOLLIN;
+        if (epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, client, &ev) < 0)
+        {
+            fprintf(stderr, "Server: epoll_ctl: %s\n", strerror(errno));
+            SSL_free(sess->ssl);
+            close(client);
+            free(sess);
+            continue;
+        }
+        worker->sessions++;
+        metrics_add(&worker->metrics, METRIC_ACCEPTS, 1);
+        metrics_set(&worker->metrics, METRIC_SESSIONS, worker->sessions);
+    }
+
+    set_accepting(worker, false);
+}
+
+/******************************************************************************
+
+Work out how many sessions to allow.  An explicit --max-sessions wins;
+otherwise the default memory allowance is divided by SESSION_BUDGET.  Either
+way every session needs a file descriptor, so the open file limit is raised
+as far as the hard limit permits and the session count capped to fit in it.
+
+******************************************************************************/
+size_t session_limit(size_t requested)
+{
+    struct rlimit rl;
+    size_t limit = requested ? requested : DEFAULT_SESSION_MEMORY / SESSION_BUDGET;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+
+        // Leave a few descriptors for the listening socket, epoll, stdio and
+        // the files being sent
+        if (rl.rlim_cur != RLIM_INFINITY && limit > (rl.rlim_cur - 16) / 2)
+            limit = (rl.rlim_cur - 16) / 2;
+    }
+
+    return limit;
+}
+
+/******************************************************************************
+
+The body of a worker thread.  Pin the thread to its CPU if asked to, then
+wait for incoming connections and client requests and handle them as they
+arrive.
+
+******************************************************************************/
+void *run_worker(void *arg)
+{
+    struct worker *worker = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    if (worker->cpu >= 0)
+    {
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+            fprintf(stderr, "Server: Could not pin worker %d to CPU %d\n", worker->id, worker->cpu);
+    }
+
+    while (true)
+    {
+        int n = epoll_wait(worker->epollfd, events, MAX_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Server: epoll_wait: %s\n", strerror(errno));
+            break;
+        }
+
+        bool logins = false, radio = false, timer = false;
+        int bulk = 0;
+
+        // Sessions that only have file data to send wait until every other
+        // session in the batch has had its turn, so a listing or a reply
+        // isn't held up behind the downloads
+        for (int i = 0; i < n; i++)
+        {
+            struct session *sess = events[i].data.ptr;
+
+            if (sess == NULL)
+                accept_sessions(worker);
+            else if (events[i].data.ptr == &worker->logins)
+                logins = true;
+            else if (events[i].data.ptr == &worker->radiofd)
+                radio = true;
+            else if (events[i].data.ptr == &worker->timerfd)
+                timer = true;
+            else if (sess->bulk && !(events[i].events & EPOLLIN))
+                events[bulk++] = events[i];
+            else
+                drive_session(worker, sess, events[i].events);
+        }
+        for (int i = 0; i < bulk; i++)
+            drive_session(worker, events[i].data.ptr, events[i].events);
+
+        // Only once the batch is done, as finishing a login, feeding a
+        // listener or waking a sleeper may close a session that still has an
+        // event further down the list
+        if (logins)
+            finish_logins(worker);
+        if (radio)
+            wake_listeners(worker);
+        if (timer)
+            wake_sleepers(worker);
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+
+Set up everything a worker owns: its SSL context, listening socket and epoll
+instance.  Each worker gets its own SSL_CTX so that no OpenSSL state on the
+connection path (session cache, locks on the context) is shared between
+threads.
+
+******************************************************************************/
+void init_worker(struct worker *worker, int id, unsigned int port, bool reuseport, size_t max_sessions, int cpu)
+{
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+
+    worker->id = id;
+    worker->cpu = cpu;
+    worker->port = port;
+    worker->max_sessions = max_sessions;
+    metrics_register(&worker->metrics);
+    worker->trace = trace_ring_new(id);
+
+    // Initialize and create SSL data structures
+    worker->ssl_ctx = create_new_context();
+    configure_context(worker->ssl_ctx);
+
+    // This will create a network socket and return a socket descriptor, which is
+    // and works just like a file descriptor, but for network communcations. Note
+    // we have to specify which TCP/UDP port on which we are communicating as an
+    // argument to our user-defined create_socket() function.
+    worker->listenfd = create_socket(port, reuseport);
+
+    worker->epollfd = epoll_create1(0);
+    if (worker->epollfd < 0)
+    {
+        fprintf(stderr, "Server: Unable to create epoll instance: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, worker->listenfd, &ev);
+    worker->accepting = true;
+
+    // The auth threads wake the worker through this when logins are checked
+    if (auth_queue_init(&worker->logins) < 0)
+    {
+        fprintf(stderr, "Server: Unable to create eventfd: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    ev.data.ptr = &worker->logins;
+    epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, worker->logins.eventfd, &ev);
+
+    // and the radio channels when they have played more audio
+    worker->radiofd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker->radiofd < 0 || radio_watch(worker->radiofd) < 0)
+    {
+        fprintf(stderr, "Server: Unable to watch the radio channels: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    ev.data.ptr = &worker->radiofd;
+    epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, worker->radiofd, &ev);
+
+    // and its timer when a session held back by its rate limits may send again
+    worker->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (worker->timerfd < 0)
+    {
+        fprintf(stderr, "Server: Unable to create timerfd: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    ev.data.ptr = &worker->timerfd;
+    epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, worker->timerfd, &ev);
+}
+
+/******************************************************************************
+
+Set a rate limit, "KB" in KB a second for everyone or "USER=KB" for one user,
+on each connection or on all of a user's connections together (see
+shaper.h).  0 means no limit.
+
+******************************************************************************/
+int set_rate(char *arg, bool connection)
+{
+    char *value = strchr(arg, '='), *user = NULL, *end;
+    unsigned long long kb;
+
+    if (value != NULL)
+    {
+        *value++ = '\0';
+        user = arg;
+    }
+    else
+        value = arg;
+    kb = strtoull(value, &end, 10);
+    if (end == value || *end != '\0' || (user != NULL && (*user == '\0' || strlen(user) >= AUTH_NAME_MAX)))
+        return -1;
+    if (connection)
+        return shaper_set_connection_rate(user, kb * 1024);
+    return shaper_set_user_rate(user, kb * 1024);
+}
+
+void usage(void)
+{
+    fprintf(stderr, "Usage: ssl-server [--workers N] [--pin] [--max-sessions N] [--cache-size MB]\n"
+                    "                  [--preview-cache-size MB]\n"
+                    "                  [--ticket-key-lifetime SECONDS] [--no-tickets]\n"
+                    "                  [--credentials FILE] [--auth-threads N] [--ingest-threads N]\n"
+                    "                  [--channel NAME[=PATTERN]]... [--radio-slow skip|close]\n"
+                    "                  [--metrics-port PORT] [--trace FILE] [--trace-level off|info|debug]\n"
+                    "                  [--rate [USER=]KB] [--user-rate [USER=]KB]\n"
+                    "                  <port> (optional)\n"
+                    "       ssl-server [--credentials FILE] [--rounds N] --add-user NAME\n");
+    exit(EXIT_FAILURE);
+}
+
+/******************************************************************************
+
+The sequence of steps required to establish a secure SSL/TLS connection is:
+
+1.  Initialize the SSL algorithms
+2.  Create and configure an SSL context object
+3.  Create a new network socket in the traditional way
+4.  Listen for incoming connections
+5.  Accept incoming connections as they arrive
+6.  Create a new SSL object for the newly arrived connection
+7.  Bind the SSL object to the network socket descriptor
+
+Once these steps are completed successfully, use the functions SSL_read() and
+SSL_write() to read from/write to the socket, but using the SSL object rather
+then the socket descriptor.  Once the session is complete, free the memory
+allocated to the SSL object and close the socket descriptor.
+
+Steps 2 through 7 and everything after them happen in every worker, and each
+worker's epoll loop advances many clients' sessions at once.
+
+******************************************************************************/
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        {"workers", required_argument, NULL, 'w'},
+        {"pin", no_argument, NULL, 'p'},
+        {"max-sessions", required_argument, NULL, 'm'},
+        {"cache-size", required_argument, NULL, 'c'},
+        {"preview-cache-size", required_argument, NULL, 'P'},
+        {"ticket-key-lifetime", required_argument, NULL, 'k'},
+        {"no-tickets", no_argument, NULL, 'T'},
+        {"credentials", required_argument, NULL, 'C'},
+        {"auth-threads", required_argument, NULL, 'a'},
+        {"ingest-threads", required_argument, NULL, 'i'},
+        {"add-user", required_argument, NULL, 'u'},
+        {"rounds", required_argument, NULL, 'r'},
+        {"channel", required_argument, NULL, 'R'},
+        {"radio-slow", required_argument, NULL, 'S'},
+        {"metrics-port", required_argument, NULL, 'M'},
+        {"trace", required_argument, NULL, 't'},
+        {"trace-level", required_argument, NULL, 'L'},
+        {"rate", required_argument, NULL, 'B'},
+        {"user-rate", required_argument, NULL, 'U'},
+        {NULL, 0, NULL, 0}};
+    struct worker *workers;
+    unsigned int port = DEFAULT_PORT;
+    size_t max_sessions = 0;
+    size_t cache_size = DEFAULT_CACHE_SIZE;
+    size_t preview_cache_size = DEFAULT_PREVIEW_CACHE_SIZE;
+    unsigned int ticket_key_lifetime = DEFAULT_TICKET_KEY_LIFETIME;
+    bool tickets = true;
+    const char *credentials = CREDENTIAL_FILE;
+    const char *add_user = NULL;
+    unsigned int rounds = AUTH_DEFAULT_ROUNDS;
+    int auth_threads = DEFAULT_AUTH_THREADS;
+    int ingest_threads = 0;
+    char *channels[RADIO_CHANNELS_MAX];
+    int nchannels = 0;
+    unsigned int metrics_port = 0;
+    const char *trace_file = TRACE_FILE;
+    enum trace_level level = TRACE_INFO;
+    int nworkers = 1;
+    bool pin = false;
+    int ncpus;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "w:pm:c:P:k:TC:a:i:u:r:R:S:M:t:L:B:U:", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            nworkers = atoi(optarg);
+            if (nworkers < 1)
+                usage();
+            break;
+        case 'p':
+            pin = true;
+            break;
+        case 'm':
+            max_sessions = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            cache_size = strtoul(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'P':
+            preview_cache_size = strtoul(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'k':
+            ticket_key_lifetime = strtoul(optarg, NULL, 10);
+            if (ticket_key_lifetime == 0)
+                usage();
+            break;
+        case 'T':
+            tickets = false;
+            break;
+        case 'C':
+            credentials = optarg;
+            break;
+        case 'a':
+            auth_threads = atoi(optarg);
+            if (auth_threads < 1)
+                usage();
+            break;
+        case 'i':
+            ingest_threads = atoi(optarg);
+            if (ingest_threads < 1)
+                usage();
+            break;
+        case 'u':
+            add_user = optarg;
+            break;
+        case 'r':
+            rounds = strtoul(optarg, NULL, 10);
+            if (rounds == 0)
+                usage();
+            break;
+        case 'R':
+            if (nchannels == RADIO_CHANNELS_MAX)
+                usage();
+            channels[nchannels++] = optarg;
+            break;
+        case 'S':
+            if (strcmp(optarg, "skip") == 0)
+                radio_slow = SLOW_SKIP;
+            else if (strcmp(optarg, "close") == 0)
+                radio_slow = SLOW_CLOSE;
+            else
+                usage();
+            break;
+        case 'M':
+            metrics_port = strtoul(optarg, NULL, 10);
+            if (metrics_port == 0 || metrics_port > 65535)
+                usage();
+            break;
+        case 't':
+            trace_file = optarg;
+            break;
+        case 'L':
+            if (strcmp(optarg, "off") == 0)
+                level = TRACE_OFF;
+            else if (strcmp(optarg, "info") == 0)
+                level = TRACE_INFO;
+            else if (strcmp(optarg, "debug") == 0)
+                level = TRACE_DEBUG;
+            else
+                usage();
+            break;
+        case 'B':
+        case 'U':
+            if (set_rate(optarg, opt == 'B') < 0)
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+
+    // Adding an account is all --add-user does
+    if (add_user != NULL)
+    {
+        char password[BUFFER_SIZE + 1];
+        int ret;
+
+        if (argc - optind != 0)
+            usage();
+        fprintf(stdout, "Password for %s: ", add_user);
+        fflush(stdout);
+        getPassword(password);
+        fprintf(stdout, "\n");
+        ret = auth_add_user(credentials, add_user, password, rounds);
+        explicit_bzero(password, sizeof(password));
+        if (ret < 0)
+            exit(EXIT_FAILURE);
+        fprintf(stdout, "Server: Added %s to %s\n", add_user, credentials);
+        exit(EXIT_SUCCESS);
+    }
+
+    // Port can be specified on the command line. If it's not, use the default port
+    switch (argc - optind)
+    {
+    case 0:
+        break;
+    case 1:
+        port = atoi(argv[optind]);
+        break;
+    default:
+        usage();
+    }
+
+    // A client that disconnects in the middle of a transfer must not kill the
+    // server, so report broken connections as EPIPE instead of SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+
+    // Initialize the SSL algorithms once for the whole process
+    init_openssl();
+    resumption_init(ticket_key_lifetime, tickets);
+
+    if (auth_load(credentials) < 0 || auth_start(auth_threads, AUTH_QUEUE_SIZE) < 0)
+    {
+        fprintf(stderr, "Server: Unable to load the accounts in %s: %s\n", credentials, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    filecache_init(cache_size);
+    preview_init(preview_cache_size);
+
+    // Index the library before any client can ask for it.  A snapshot left
+    // by the last run makes this almost instant however large the library.
+    // New files are read by a thread per CPU unless told otherwise.
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (catalog_start(DATA_DIRECTORY, CATALOG_SNAPSHOT, ingest_threads > 0 ? ingest_threads : ncpus) < 0)
+    {
+        fprintf(stderr, "Server: Unable to build the catalog of %s\n", DATA_DIRECTORY);
+        exit(EXIT_FAILURE);
+    }
+
+    // Seek tables and segment lists are only an optimisation, without
+    // somewhere to keep them they are built for every request that needs one
+    seek_init(SEEK_DIRECTORY);
+
+    // What happens to each connection goes to the trace rather than stdout
+    if (trace_start(trace_file, level) < 0)
+    {
+        fprintf(stderr, "Server: Unable to open the trace %s: %s\n", trace_file, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    metrics_collect(format_cache_metrics);
+
+    max_sessions = session_limit(max_sessions);
+    workers = calloc(nworkers, sizeof(*workers));
+
+    // Every worker is set up before any of them starts, so a port that can't
+    // be bound fails the server immediately rather than leaving it half started
+    for (int i = 0; i < nworkers; i++)
+        init_worker(&workers[i], i, port, nworkers > 1, (max_sessions + nworkers - 1) / nworkers,
+                    pin ? i % ncpus : -1);
+
+    fprintf(stdout, "Server: %d worker(s) accepting up to %zu concurrent sessions\n", nworkers, max_sessions);
+
+    // Metrics for a Prometheus server on this machine to scrape, if asked for
+    if (metrics_port != 0 && metrics_serve(metrics_port) < 0)
+    {
+        fprintf(stderr, "Server: Unable to serve metrics on port %u: %s\n", metrics_port, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // Channels are started once every worker is watching them.  A channel
+    // is "NAME" or "NAME=PATTERN".
+    for (int i = 0; i < nchannels; i++)
+    {
+        char *pattern = strchr(channels[i], '=');
+
+        if (pattern != NULL)
+            *pattern++ = '\0';
+        if (radio_start(channels[i], pattern != NULL ? pattern : DEFAULT_CHANNEL_PATTERN, DATA_DIRECTORY) < 0)
+        {
+            fprintf(stderr, "Server: Unable to start radio channel %s\n", channels[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; i < nworkers; i++)
+    {
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0)
+        {
+            fprintf(stderr, "Server: Unable to start worker %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; i < nworkers; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    // Tear down and clean up server data structures before terminating
+    for (int i = 0; i < nworkers; i++)
+    {
+        SSL_CTX_free(workers[i].ssl_ctx);
+        close(workers[i].listenfd);
+        close(workers[i].epollfd);
+    }
+    free(workers);
+    cleanup_openssl();
+
+    return EXIT_FAILURE;
+}
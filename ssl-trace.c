@@ -0,0 +1,333 @@
+/******************************************************************************
+
+PROGRAM:  ssl-trace.c
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: Print the server's trace, see trace.h, one record to a line.
+
+          Each worker's records reach the file in batches, so the records
+          of every run are put back in the order they were written before
+          being printed.  A record that ends a step also shows how long the
+          step took, from the record that started it:
+
+              handshake        since the accept
+              login            since the password went to be checked
+              transfer, end    since the request
+              error            since the request, if it got that far
+              close            since the accept
+
+          ssl-trace [-c connection] [file]
+
+          The file defaults to server.trace.  -c prints only the records of
+          one connection, written as the trace shows it, "worker.count".
+
+******************************************************************************/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "protocol.h"
+#include "trace.h"
+
+#define DEFAULT_TRACE "server.trace"
+
+static const char *event_names[TRACE_EVENTS] = {
+    [TRACE_START] = "start",
+    [TRACE_DROPPED] = "dropped",
+    [TRACE_ACCEPT] = "accept",
+    [TRACE_HANDSHAKE] = "handshake",
+    [TRACE_HANDSHAKE_FAILED] = "handshake-failed",
+    [TRACE_AUTH] = "auth",
+    [TRACE_LOGIN] = "login",
+    [TRACE_REQUEST] = "request",
+    [TRACE_ERROR] = "error",
+    [TRACE_TRANSFER] = "transfer",
+    [TRACE_END] = "end",
+    [TRACE_TUNE] = "tune",
+    [TRACE_BEHIND] = "behind",
+    [TRACE_CLOSE] = "close",
+    [TRACE_BUILD] = "build",
+};
+
+static const char *opcode_name(uint64_t opcode)
+{
+    static const char *names[] = {
+        [OP_USER] = "user",         [OP_PASS] = "pass",     [OP_LS] = "ls",
+        [OP_GETFILE] = "getfile",   [OP_EXIT] = "exit",     [OP_TOKEN] = "token",
+        [OP_META] = "meta",         [OP_SEARCH] = "search", [OP_TUNE] = "tune",
+        [OP_MANIFEST] = "manifest", [OP_SEGMENT] = "segment", [OP_PREVIEW] = "preview",
+        [OP_STATS] = "stats",
+    };
+
+    if (opcode < sizeof(names) / sizeof(names[0]) && names[opcode] != NULL)
+        return names[opcode];
+    return "invalid";
+}
+
+/******************************************************************************
+
+Where each step started, to time the record that ends it.  Keyed by the
+connection, the request id and the event that started it, in a table that
+doubles when it gets half full.  A later record with the same key replaces
+the earlier one: text protocol requests all have id 0.
+
+******************************************************************************/
+struct start
+{
+    uint64_t conn;
+    uint32_t request;
+    uint16_t event;
+    uint64_t time;
+};
+
+static struct start *starts;
+static size_t nstarts, starts_size;
+
+static size_t start_slot(const struct start *table, size_t size, uint64_t conn, uint32_t request, uint16_t event)
+{
+    uint64_t hash = (conn * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)request << 16 | event) * 0xC2B2AE3D27D4EB4FULL;
+    size_t i = hash & (size - 1);
+
+    while (table[i].event != 0 &&
+           (table[i].conn != conn || table[i].request != request || table[i].event != event))
+        i = (i + 1) & (size - 1);
+    return i;
+}
+
+static void remember(uint64_t conn, uint32_t request, uint16_t event, uint64_t time)
+{
+    size_t i;
+
+    if (2 * (nstarts + 1) > starts_size)
+    {
+        size_t size = starts_size != 0 ? 2 * starts_size : 1024;
+        struct start *table = calloc(size, sizeof(*table));
+
+        if (table == NULL)
+        {
+            perror("ssl-trace");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t j = 0; j < starts_size; j++)
+        {
+            if (starts[j].event != 0)
+                table[start_slot(table, size, starts[j].conn, starts[j].request, starts[j].event)] = starts[j];
+        }
+        free(starts);
+        starts = table;
+        starts_size = size;
+    }
+    i = start_slot(starts, starts_size, conn, request, event);
+    if (starts[i].event == 0)
+        nstarts++;
+    starts[i] = (struct start){conn, request, event, time};
+}
+
+// When the step ending now started, or 0 if the trace doesn't say
+static uint64_t started(uint64_t conn, uint32_t request, uint16_t event)
+{
+    size_t i;
+
+    if (starts_size == 0)
+        return 0;
+    i = start_slot(starts, starts_size, conn, request, event);
+    return starts[i].event != 0 ? starts[i].time : 0;
+}
+
+static int by_time(const void *a, const void *b)
+{
+    const struct trace_record *x = a, *y = b;
+
+    if (x->time != y->time)
+        return x->time < y->time ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+// Say what a record is about, and how long its step took if it ends one
+static void describe(const struct trace_record *r, char *details, size_t size, uint64_t *since)
+{
+    static const char *logins[] = {"ok", "rejected", "busy"};
+    char text[TRACE_TEXT_SIZE + 1];
+
+    memcpy(text, r->text, TRACE_TEXT_SIZE);
+    text[TRACE_TEXT_SIZE] = '\0';
+    details[0] = '\0';
+    *since = 0;
+
+    switch (r->event)
+    {
+    case TRACE_ACCEPT:
+        remember(r->conn, 0, TRACE_ACCEPT, r->time);
+        snprintf(details, size, "%s on port %" PRIu64, text, r->arg);
+        break;
+    case TRACE_HANDSHAKE:
+        snprintf(details, size, "%s%s", r->arg & TRACE_RESUMED ? "resumed" : "full",
+                 r->arg & TRACE_KTLS ? ", kernel TLS" : "");
+        // fall through
+    case TRACE_HANDSHAKE_FAILED:
+    case TRACE_CLOSE:
+        *since = started(r->conn, 0, TRACE_ACCEPT);
+        break;
+    case TRACE_AUTH:
+        remember(r->conn, r->request, TRACE_AUTH, r->time);
+        snprintf(details, size, "%s", text);
+        break;
+    case TRACE_LOGIN:
+        *since = started(r->conn, r->request, TRACE_AUTH);
+        snprintf(details, size, "%s %s", text, r->arg < 3 ? logins[r->arg] : "?");
+        break;
+    case TRACE_REQUEST:
+        remember(r->conn, r->request, TRACE_REQUEST, r->time);
+        snprintf(details, size, "%s%s%s", opcode_name(r->arg), text[0] != '\0' ? " " : "", text);
+        break;
+    case TRACE_ERROR:
+        *since = started(r->conn, r->request, TRACE_REQUEST);
+        snprintf(details, size, "%s %" PRIu32,
+                 r->arg >> 32 == ERR_KIND_FILE ? "file" : r->arg >> 32 == ERR_KIND_AUTH ? "auth" : "rpc",
+                 (uint32_t)r->arg);
+        break;
+    case TRACE_TRANSFER:
+        *since = started(r->conn, r->request, TRACE_REQUEST);
+        snprintf(details, size, "%" PRIu64 " bytes by %s", r->arg, text);
+        break;
+    case TRACE_END:
+        *since = started(r->conn, r->request, TRACE_REQUEST);
+        snprintf(details, size, "%s", opcode_name(r->arg));
+        break;
+    case TRACE_BUILD:
+        snprintf(details, size, "%s for %s", text, opcode_name(r->arg));
+        break;
+    case TRACE_TUNE:
+        snprintf(details, size, "%s", text);
+        break;
+    case TRACE_BEHIND:
+        if (r->arg != 0)
+            snprintf(details, size, "%s, skipped %" PRIu64 " bytes", text, r->arg);
+        else
+            snprintf(details, size, "%s, disconnected", text);
+        break;
+    case TRACE_DROPPED:
+        snprintf(details, size, "%" PRIu64 " records", r->arg);
+        break;
+    }
+}
+
+/******************************************************************************
+
+Print one run: the records after a start record, up to the next one.
+
+******************************************************************************/
+static void print_run(struct trace_record *records, size_t count, uint64_t offset, bool filter, uint64_t conn)
+{
+    // Connections are counted again from 1 in every run
+    if (starts != NULL)
+        memset(starts, 0, starts_size * sizeof(*starts));
+    nstarts = 0;
+    qsort(records, count, sizeof(*records), by_time);
+    for (size_t i = 0; i < count; i++)
+    {
+        const struct trace_record *r = &records[i];
+        uint64_t ns = r->time + offset, since;
+        time_t seconds = ns / 1000000000ULL;
+        char when[32], id[32], request[16], details[128];
+        const char *name;
+
+        describe(r, details, sizeof(details), &since);
+        if (filter && r->conn != conn)
+            continue;
+        strftime(when, sizeof(when), "%F %T", localtime(&seconds));
+        if (r->conn != 0)
+            snprintf(id, sizeof(id), "%" PRIu64 ".%" PRIu64, r->conn >> 40, r->conn & (((uint64_t)1 << 40) - 1));
+        else
+            snprintf(id, sizeof(id), "-");
+        if ((r->event >= TRACE_AUTH && r->event <= TRACE_END) || r->event == TRACE_BUILD)
+            snprintf(request, sizeof(request), "#%" PRIu32, r->request);
+        else
+            request[0] = '\0';
+        name = r->event < TRACE_EVENTS && event_names[r->event] != NULL ? event_names[r->event] : "?";
+
+        printf("%s.%06llu %3u %-10s %-7s %-16s %s", when, (unsigned long long)(ns % 1000000000ULL / 1000),
+               r->thread, id, request, name, details);
+        if (since != 0)
+            printf("%s(%.3f ms)", details[0] != '\0' ? " " : "", (r->time - since) / 1e6);
+        printf("\n");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = DEFAULT_TRACE;
+    struct trace_record *records = NULL;
+    size_t count = 0, capacity = 0;
+    uint64_t offset = 0, conn = 0;
+    bool filter = false;
+    FILE *file;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:")) != -1)
+    {
+        unsigned long long worker, n;
+
+        if (opt != 'c' || sscanf(optarg, "%llu.%llu", &worker, &n) != 2)
+        {
+            fprintf(stderr, "Usage: ssl-trace [-c worker.connection] [file]\n");
+            exit(EXIT_FAILURE);
+        }
+        conn = worker << 40 | n;
+        filter = true;
+    }
+    if (optind < argc)
+        path = argv[optind];
+    if ((file = fopen(path, "rb")) == NULL)
+    {
+        fprintf(stderr, "ssl-trace: %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    while (true)
+    {
+        if (count == capacity)
+        {
+            capacity = capacity != 0 ? 2 * capacity : 4096;
+            if ((records = realloc(records, capacity * sizeof(*records))) == NULL)
+            {
+                perror("ssl-trace");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (fread(&records[count], sizeof(*records), 1, file) != 1)
+            break;
+
+        // A start record begins a new run, with a clock of its own
+        if (records[count].event == TRACE_START)
+        {
+            print_run(records, count, offset, filter, conn);
+            offset = records[count].arg;
+            if (!filter)
+            {
+                time_t seconds = (records[count].time + offset) / 1000000000ULL;
+                char when[32];
+
+                strftime(when, sizeof(when), "%F %T", localtime(&seconds));
+                printf("--- %.*s started %s\n", TRACE_TEXT_SIZE, records[count].text, when);
+            }
+            count = 0;
+            continue;
+        }
+        count++;
+    }
+    if (ferror(file))
+    {
+        fprintf(stderr, "ssl-trace: %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    print_run(records, count, offset, filter, conn);
+    fclose(file);
+    free(records);
+    return 0;
+}
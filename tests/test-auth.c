@@ -0,0 +1,89 @@
+/******************************************************************************
+
+PROGRAM:  test-auth.c
+SYNOPSIS: Regression tests of auth.c: a login as a username that doesn't
+          exist must cost as much as a wrong password for one that does,
+          or the time a reply takes tells which accounts exist.
+
+          Accounts are added with different rounds to a credential file of
+          its own, which is then loaded, and the hash an unknown username
+          is checked against must have the setting, method and rounds, of
+          the dearest account.
+
+          test-auth
+
+******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../auth.h"
+
+static int failures;
+
+// The setting of a crypt() hash, everything up to the salt: "$6$rounds=N$"
+static void hash_setting(const char *hash, char *setting, size_t size)
+{
+    const char *end = hash;
+
+    for (int dollars = 0; *end != '\0' && dollars < 3; end++)
+        dollars += *end == '$';
+    snprintf(setting, size, "%.*s", (int)(end - hash), hash);
+}
+
+// Check that a login as 'username' is hashed with the same setting as one as
+// the account 'like'
+static void expect_setting(const char *name, const char *username, const char *like)
+{
+    char got[64], want[64];
+
+    hash_setting(auth_expected_hash(username), got, sizeof(got));
+    hash_setting(auth_expected_hash(like), want, sizeof(want));
+    if (strcmp(got, want) != 0)
+    {
+        printf("FAIL %s: \"%s\" is hashed with %s, expected %s\n", name, username, got, want);
+        failures++;
+    }
+    else
+        printf("ok   %s\n", name);
+}
+
+int main(void)
+{
+    char path[] = "/tmp/test-auth.XXXXXX";
+    int fd = mkstemp(path);
+
+    if (fd < 0)
+    {
+        perror("test-auth");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    if (auth_add_user(path, "cheap", "password", AUTH_DEFAULT_ROUNDS) < 0 ||
+        auth_add_user(path, "dear", "password", 4 * AUTH_DEFAULT_ROUNDS) < 0 ||
+        auth_add_user(path, "middle", "password", 2 * AUTH_DEFAULT_ROUNDS) < 0 || auth_load(path) < 0)
+    {
+        unlink(path);
+        printf("FAIL could not write and load %s\n", path);
+        return EXIT_FAILURE;
+    }
+    unlink(path);
+
+    expect_setting("unknown user costs the dearest account", "nobody", "dear");
+    expect_setting("unknown user with a known user's prefix", "dea", "dear");
+    if (strcmp(auth_expected_hash("nobody"), auth_expected_hash("dear")) == 0)
+    {
+        printf("FAIL unknown users are checked against a real account's hash\n");
+        failures++;
+    }
+    else
+        printf("ok   unknown users have a hash of their own\n");
+
+    if (failures != 0)
+    {
+        printf("%d failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,103 @@
+/******************************************************************************
+
+PROGRAM:  test-request.c
+SYNOPSIS: Regression tests of request.c: text protocol commands, malformed
+          and over-long ones above all, parsed into the request the server
+          would act on.
+
+          Every argument of a text command is read into a buffer of
+          PATH_LENGTH, while a command may be up to REQUEST_SIZE long and
+          is parsed before the client has logged in.  "make check" builds
+          this with AddressSanitizer, so a conversion that overruns its
+          buffer fails the run even where it would not crash.
+
+          test-request
+
+******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../request.h"
+
+// A segment hash in hex, as a text manifest lists it
+#define HASH "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"
+
+static int failures;
+
+// Parse 'command' and check the opcode, error and argument it gives; an
+// 'arg' of NULL is not checked
+static void expect(const char *name, const char *command, int opcode, int error, const char *arg)
+{
+    struct request req;
+
+    parse_text_request(command, &req);
+    if (req.opcode != opcode || req.error != error || (arg != NULL && strcmp(req.arg, arg) != 0))
+    {
+        printf("FAIL %s: opcode %d error %d arg \"%.40s\", expected %d, %d, \"%.40s\"\n", name, req.opcode,
+               req.error, req.arg, opcode, error, arg != NULL ? arg : req.arg);
+        failures++;
+    }
+    else
+        printf("ok   %s\n", name);
+}
+
+// "<verb> " followed by 'length' copies of 'fill' and then 'tail'
+static char *long_command(const char *verb, size_t length, char fill, const char *tail)
+{
+    static char command[REQUEST_SIZE + 1];
+    size_t n = snprintf(command, sizeof(command), "%s ", verb);
+
+    memset(command + n, fill, length);
+    snprintf(command + n + length, sizeof(command) - n - length, "%s", tail);
+    return command;
+}
+
+int main(void)
+{
+    char name[PATH_LENGTH];
+
+    memset(name, 'a', PATH_LENGTH - 1);
+    name[PATH_LENGTH - 1] = '\0';
+
+    expect("getfile", "getfile song1.mp3", OP_GETFILE, 0, "song1.mp3");
+    expect("getfile by time", "getfile song1.mp3 @1:30", OP_GETFILE, 0, "song1.mp3");
+    expect("getfile, two names", "getfile a b", 0, ERR_TOO_MANY_ARGS, NULL);
+    expect("getfile, longest time", "getfile a @18446744073709550.999", OP_GETFILE, 0, "a");
+    expect("getfile, time too long to count", "getfile a @18446744073709551", 0, ERR_TOO_MANY_ARGS, NULL);
+    expect("getfile, time past strtoul", "getfile a @99999999999999999999999", 0, ERR_TOO_MANY_ARGS, NULL);
+    expect("getfile, minutes too long to count", "getfile a @307445734561825:59", 0, ERR_TOO_MANY_ARGS, NULL);
+    expect("getfile, longest name", long_command("getfile", PATH_LENGTH - 1, 'a', ""), OP_GETFILE, 0, name);
+    expect("getfile, name longer than PATH_LENGTH", long_command("getfile", 1000, 'A', ""), 0,
+           ERR_TOO_MANY_ARGS, NULL);
+    expect("getfile, second argument too long", long_command("getfile a", 1000, '@', ""), 0, ERR_TOO_MANY_ARGS,
+           NULL);
+
+    expect("meta", "meta song1.mp3", OP_META, 0, "song1.mp3");
+    expect("meta, no name", "meta ", 0, ERR_TOO_FEW_ARGS, NULL);
+    expect("meta, name longer than PATH_LENGTH", long_command("meta", 1000, 'a', ""), OP_META, 0, name);
+
+    expect("manifest", "manifest song1.mp3", OP_MANIFEST, 0, "song1.mp3");
+    expect("manifest, name longer than PATH_LENGTH", long_command("manifest", 1000, 'a', ""), OP_MANIFEST, 0, name);
+    expect("segment", "segment song1.mp3 " HASH, OP_SEGMENT, 0, "song1.mp3");
+    expect("segment, bad hash", "segment song1.mp3 xyz", 0, ERR_NO_SEGMENT, NULL);
+    expect("segment, name longer than PATH_LENGTH", long_command("segment", 1000, 'a', " " HASH), 0,
+           ERR_TOO_MANY_ARGS, NULL);
+    expect("segment, hash longer than PATH_LENGTH", long_command("segment a", 1000, '0', ""), 0, ERR_TOO_MANY_ARGS,
+           NULL);
+
+    expect("preview", "preview song1.mp3 0:30 15", OP_PREVIEW, 0, "song1.mp3");
+    expect("preview, bad time", "preview song1.mp3 soon", 0, ERR_INVALID_OP, NULL);
+    expect("preview, length too long to count", "preview a 0 18446744073709551615", 0, ERR_INVALID_OP, NULL);
+    expect("preview, name longer than PATH_LENGTH", long_command("preview", 1000, 'a', ""), 0, ERR_TOO_MANY_ARGS,
+           NULL);
+    expect("preview, length longer than PATH_LENGTH", long_command("preview a 0", 1000, '1', ""), 0,
+           ERR_TOO_MANY_ARGS, NULL);
+
+    if (failures != 0)
+    {
+        printf("%d failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
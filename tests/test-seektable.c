@@ -0,0 +1,72 @@
+/******************************************************************************
+
+PROGRAM:  test-seektable.c
+SYNOPSIS: Regression tests of seektable.c: where seek_find() puts a time
+          into a track, above all a time past its end, however far past,
+          which must be the end of the file and not wrap round to a frame
+          somewhere in the middle.
+
+          The table is made up, with no file behind it: a time that finds
+          a frame reads the frame headers from the file, and with none to
+          read it is the checkpoint before it.
+
+          test-seektable
+
+******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "../seektable.h"
+
+#define FRAMES 10000
+#define FILE_SIZE (FRAMES * 417 + 1000)
+
+static int failures;
+
+static void expect(const char *name, const struct seek_table *table, uint64_t ms, off_t want)
+{
+    off_t got = seek_find(table, -1, ms);
+
+    if (got != want)
+    {
+        printf("FAIL %s: %llu ms is at %lld, expected %lld\n", name, (unsigned long long)ms, (long long)got,
+               (long long)want);
+        failures++;
+    }
+    else
+        printf("ok   %s\n", name);
+}
+
+int main(void)
+{
+    // Four minutes of MPEG-1 layer III at 44.1 kHz, in 417 byte frames
+    static uint64_t offsets[(FRAMES + SEEK_STRIDE - 1) / SEEK_STRIDE];
+    struct seek_table table = {
+        .size = FILE_SIZE,
+        .samplerate = 44100,
+        .samples = 1152,
+        .frames = FRAMES,
+        .count = sizeof(offsets) / sizeof(offsets[0]),
+        .offsets = offsets,
+    };
+    uint64_t duration = (uint64_t)FRAMES * 1152 * 1000 / 44100;
+
+    for (size_t i = 0; i < table.count; i++)
+        offsets[i] = 1000 + i * SEEK_STRIDE * 417;
+
+    expect("start", &table, 0, 1000);
+    expect("a minute in", &table, 60000, offsets[60000ULL * 44100 / 1152 / 1000 / SEEK_STRIDE]);
+    expect("the end", &table, duration, FILE_SIZE);
+    expect("an hour past the end", &table, duration + 3600000, FILE_SIZE);
+    // ms * samplerate wraps round to under a second
+    expect("a time that overflows in samples", &table, UINT64_MAX / 44100 + 1, FILE_SIZE);
+    expect("the longest time", &table, UINT64_MAX, FILE_SIZE);
+
+    if (failures != 0)
+    {
+        printf("%d failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,187 @@
+/******************************************************************************
+
+PROGRAM:  trace.c
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: The trace, see trace.h.
+
+          A ring has one writer, its thread, and one reader, the drain
+          thread, so 'head' and 'tail' are all they need to share: the
+          writer only moves 'head' once a record is complete, and the reader
+          only moves 'tail' once the records behind it are in the file.
+
+******************************************************************************/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+// How often the drain thread empties the rings
+#define DRAIN_INTERVAL_MS 100
+
+enum trace_level trace_level = TRACE_OFF;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *rings;
+static int trace_fd = -1;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void trace_write(struct trace_ring *ring, enum trace_level level, enum trace_event event, uint64_t conn,
+                 uint32_t request, uint64_t arg, const char *text)
+{
+    struct trace_record *record;
+    unsigned long head;
+
+    if (ring == NULL)
+        return;
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    // Only look at where the drain thread has got to when the ring seems full
+    if (head - ring->tail_seen >= TRACE_RING_SIZE)
+    {
+        ring->tail_seen = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - ring->tail_seen >= TRACE_RING_SIZE)
+        {
+            atomic_store_explicit(&ring->dropped, atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+                                  memory_order_relaxed);
+            return;
+        }
+    }
+
+    record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+    record->time = clock_ns(CLOCK_MONOTONIC);
+    record->conn = conn;
+    record->arg = arg;
+    record->request = request;
+    record->event = event;
+    record->thread = ring->thread;
+    record->level = level;
+    record->unused = 0;
+    strncpy(record->text, text != NULL ? text : "", sizeof(record->text));
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+struct trace_ring *trace_ring_new(int thread)
+{
+    struct trace_ring *ring;
+
+    if (trace_level == TRACE_OFF || (ring = aligned_alloc(64, sizeof(*ring))) == NULL)
+        return NULL;
+    memset(ring, 0, sizeof(*ring));
+    ring->thread = thread;
+    pthread_mutex_lock(&rings_lock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+    return ring;
+}
+
+// Write records to the trace file, giving up on them if it fails
+static void write_records(const struct trace_record *records, size_t count)
+{
+    const char *p = (const char *)records;
+    size_t left = count * sizeof(*records);
+
+    while (left > 0)
+    {
+        ssize_t n = write(trace_fd, p, left);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            fprintf(stderr, "Server: Could not write the trace: %s\n", n < 0 ? strerror(errno) : "disk full");
+            return;
+        }
+        p += n;
+        left -= n;
+    }
+}
+
+// Write what a ring has, in at most two pieces as it may wrap around
+static void drain_ring(struct trace_ring *ring)
+{
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned long dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+
+    while (tail != head)
+    {
+        size_t start = tail & (TRACE_RING_SIZE - 1);
+        size_t count = head - tail < TRACE_RING_SIZE - start ? head - tail : TRACE_RING_SIZE - start;
+
+        write_records(&ring->records[start], count);
+        tail += count;
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    if (dropped != ring->dropped_seen)
+    {
+        struct trace_record record = {.time = clock_ns(CLOCK_MONOTONIC),
+                                      .arg = dropped - ring->dropped_seen,
+                                      .event = TRACE_DROPPED,
+                                      .thread = ring->thread,
+                                      .level = TRACE_INFO};
+
+        write_records(&record, 1);
+        ring->dropped_seen = dropped;
+    }
+}
+
+static void *drain(void *arg)
+{
+    struct timespec interval = {.tv_nsec = DRAIN_INTERVAL_MS * 1000000L};
+
+    (void)arg;
+    while (true)
+    {
+        nanosleep(&interval, NULL);
+        pthread_mutex_lock(&rings_lock);
+        for (struct trace_ring *ring = rings; ring != NULL; ring = ring->next)
+            drain_ring(ring);
+        pthread_mutex_unlock(&rings_lock);
+    }
+    return NULL;
+}
+
+int trace_start(const char *path, enum trace_level level)
+{
+    struct trace_record start = {.event = TRACE_START, .level = TRACE_INFO};
+    pthread_t thread;
+    int error;
+
+    if (level == TRACE_OFF)
+        return 0;
+    if ((trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+        return -1;
+
+    // The decoder turns monotonic times into dates with the difference
+    start.time = clock_ns(CLOCK_MONOTONIC);
+    start.arg = clock_ns(CLOCK_REALTIME) - start.time;
+    strncpy(start.text, "ssl-server", sizeof(start.text));
+    write_records(&start, 1);
+
+    if ((error = pthread_create(&thread, NULL, drain, NULL)) != 0)
+    {
+        close(trace_fd);
+        trace_fd = -1;
+        errno = error;
+        return -1;
+    }
+    pthread_detach(thread);
+    trace_level = level;
+    return 0;
+}
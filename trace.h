@@ -0,0 +1,126 @@
+/******************************************************************************
+
+PROGRAM:  trace.h
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: The server's trace: what happened to every connection, as fixed
+          size binary records written to a file in the background.
+
+          Each worker thread writes its records into a ring of its own, so
+          tracing never takes a lock, never makes a system call and never
+          waits for the file: a record is a clock read and a 64 byte copy.
+          A drain thread empties every ring into the file a few times a
+          second.  A thread that gets that far ahead of the drain thread
+          drops records rather than waiting, and the drain thread then
+          writes down how many.
+
+          A record names its connection and, for requests, the request id,
+          so a connection's story can be followed from its accept through
+          its handshake, login and requests to its close, and the time
+          between two of its records is how long that step took.  Records
+          at TRACE_INFO say what happened to the connection, those at
+          TRACE_DEBUG add every request.  ssl-trace prints a trace file.
+
+          Records are in the byte order of the machine that wrote them.
+          Every run of the server starts with a TRACE_START record and
+          appends to the file, so one file can hold several runs.
+
+******************************************************************************/
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TRACE_RECORD_SIZE 64
+#define TRACE_TEXT_SIZE 28
+
+// Records a ring holds, a power of two
+#define TRACE_RING_SIZE 4096
+
+enum trace_level
+{
+    TRACE_OFF,
+    TRACE_INFO,
+    TRACE_DEBUG
+};
+
+enum trace_event
+{
+    TRACE_START = 1,        // A run of the server: arg is CLOCK_REALTIME - CLOCK_MONOTONIC in ns
+    TRACE_DROPPED,          // arg records the thread of 'thread' had no room for
+    TRACE_ACCEPT,           // text the client's address, arg the port
+    TRACE_HANDSHAKE,        // arg TRACE_RESUMED and TRACE_KTLS
+    TRACE_HANDSHAKE_FAILED,
+    TRACE_AUTH,             // Debug: the password went to the auth threads, text the username
+    TRACE_LOGIN,            // text the username, arg TRACE_LOGIN_OK, ...
+    TRACE_REQUEST,          // Debug: arg the opcode, text its argument
+    TRACE_ERROR,            // Debug: a request failed, arg the kind << 32 | the code
+    TRACE_TRANSFER,         // A file sent to the end, arg its bytes, text the path it took
+    TRACE_END,              // Debug: a streamed request ended, arg the opcode
+    TRACE_TUNE,             // text the channel
+    TRACE_BEHIND,           // A listener fell behind, text the channel, arg bytes skipped or 0 if closed
+    TRACE_CLOSE,
+    TRACE_BUILD,            // Debug: a request waits for the file to be read through, text for what, arg the opcode
+    TRACE_EVENTS
+};
+
+#define TRACE_RESUMED 1
+#define TRACE_KTLS 2
+
+#define TRACE_LOGIN_OK 0
+#define TRACE_LOGIN_REJECTED 1
+#define TRACE_LOGIN_BUSY 2
+
+struct trace_record
+{
+    uint64_t time;    // CLOCK_MONOTONIC in ns
+    uint64_t conn;    // The writing thread's id << 40 | its count of connections, or 0
+    uint64_t arg;
+    uint32_t request; // Request id
+    uint16_t event;
+    uint8_t thread;   // Writing thread
+    uint8_t level;
+    uint32_t unused;
+    char text[TRACE_TEXT_SIZE]; // Not NUL terminated if it fills the field
+};
+
+_Static_assert(sizeof(struct trace_record) == TRACE_RECORD_SIZE, "trace records must be TRACE_RECORD_SIZE bytes");
+
+// One thread's records on their way to the file
+struct trace_ring
+{
+    struct trace_record records[TRACE_RING_SIZE];
+    int thread;
+    _Alignas(64) atomic_ulong head; // Records written, by the owning thread
+    unsigned long tail_seen;        // What it last saw of 'tail'
+    atomic_ulong dropped;           // Records it had no room for
+    _Alignas(64) atomic_ulong tail; // Records written out, by the drain thread
+    unsigned long dropped_seen;     // Drops it has written down
+    struct trace_ring *next;
+};
+
+// The level records are written at, set once by trace_start()
+extern enum trace_level trace_level;
+
+// Append to the trace file 'path' and start draining the rings into it.
+// Records up to 'level' are written.  Returns -1 if the file can't be opened.
+int trace_start(const char *path, enum trace_level level);
+
+// Make a ring for thread 'thread' to write into.  Returns NULL, which trace()
+// takes as a ring to ignore, when tracing is off or there is no memory.
+struct trace_ring *trace_ring_new(int thread);
+
+void trace_write(struct trace_ring *ring, enum trace_level level, enum trace_event event, uint64_t conn,
+                 uint32_t request, uint64_t arg, const char *text);
+
+// Write a record if tracing is at 'level' or more, which costs a comparison
+// when it isn't.  Only the thread that owns the ring may call this.
+static inline void trace(struct trace_ring *ring, enum trace_level level, enum trace_event event, uint64_t conn,
+                         uint32_t request, uint64_t arg, const char *text)
+{
+    if (level <= trace_level)
+        trace_write(ring, level, event, conn, request, arg, text);
+}
+
+#endif
@@ -0,0 +1,1325 @@
+/******************************************************************************
+
+PROGRAM:  trigram.c
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: The trigram index, see trigram.h.
+
+          Every field has posting lists of its own, so the lists a document
+          is on say which of its fields have which trigrams.  Documents are
+          numbered by rank, shortest first, and every list is sorted by
+          rank, compressed as the difference to the previous rank, less
+          one, in a varint.  Lists are cut into blocks of TRIGRAM_BLOCK
+          documents, and the first rank of each block is kept uncompressed
+          in a skip table.  An intersection starts from the shortest list
+          and decodes only those blocks of the longer lists that could hold
+          one of the documents still left, then intersects the two four at
+          a time with SSE2.
+
+          Which lists a document is on also bounds the score it can have:
+          a word can score no more in a field than it would if it were
+          there, and it can only start a word there if the field has a word
+          starting with its first three letters, which have lists of their
+          own.  Matches are looked for among the shortest documents first,
+          in ever larger spans of rank, and the candidates of a span are
+          checked best bound first, so the search can stop as soon as the
+          ranking is full and nothing left could beat the worst document in
+          it.  However many documents contain a common prefix, only the
+          shortest of them are ever looked at.
+
+          The index is built in two passes over the documents: the first
+          finds the trigrams and measures their lists, the second writes the
+          lists into memory allocated for exactly that, so nothing is ever
+          copied or reallocated however large the library.
+
+          Searches only read the index, so any number of threads may search
+          it at once.  Each thread keeps the memory its largest search
+          needed for the next one.
+
+******************************************************************************/
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "trigram.h"
+
+#define TRIGRAM_BLOCK 128
+
+// Longest folded text, per field or query, terminator included
+#define FOLD_MAX 512
+
+// A query of SEARCH_QUERY_MAX bytes has no more words than this
+#define QUERY_WORDS 64
+
+// A letter wrong, missing, extra, or two swapped changes no more trigrams
+#define TYPO_TRIGRAMS 4
+
+// Matches are looked for among this many of the shortest documents first,
+// then twice as many at a time
+#define FIRST_SPAN 8192
+
+// A list's key is its field, then its trigram.  Besides the trigrams of its
+// text, a field has those that start a word of three letters or more, as
+// the word's first three letters with WORD_START added.
+#define FIELD_SHIFT 24
+#define WORD_START (1u << (FIELD_SHIFT + 4))
+
+// A word scores 1 in the last field, 3 in the one before and so on, and one
+// more where it starts a word.  Matches always rank above near misses.
+#define WORD_SCORE_MAX (TRIGRAM_FIELDS * 2)
+#define SCORE_MATCH (1u << 31)
+
+struct posting_list
+{
+    uint32_t key;   // Field << FIELD_SHIFT | the trigram's three bytes, the first the highest, maybe with WORD_START
+    uint32_t count; // Documents on the list
+    uint32_t skip;  // Its first entry in the skip table, one per block
+    uint64_t data;  // Offset of its blocks in the data
+};
+
+struct skip_entry
+{
+    uint32_t first;  // First rank of the block
+    uint32_t offset; // Where the rest of the block starts, from the list's data
+};
+
+struct trigram_index
+{
+    struct posting_list *lists; // Sorted by key
+    size_t nlists;
+    struct skip_entry *skips;
+    size_t nskips;
+    uint8_t *data;
+    size_t datalen;
+    size_t postings;
+    uint32_t *docs; // The document of each rank
+    size_t count;
+};
+
+// A trigram's list while the index is built
+struct builder
+{
+    uint32_t key;
+    uint32_t count;
+    uint32_t last;  // Last rank added, UINT32_MAX before the first
+    uint32_t skip;
+    uint64_t bytes; // Measured in the first pass, written so far in the second
+    uint64_t data;
+};
+
+struct build
+{
+    struct builder *builders;
+    size_t nbuilders, size;
+    uint32_t *slots; // Open addressing hash table of builder + 1, 0 when free
+    int bits;        // log2 of the number of slots
+};
+
+// A query, folded with a space at either end.  Each word is kept as where
+// the space before it is, and its length without that space.
+struct query
+{
+    char text[FOLD_MAX];
+    size_t len;
+    const char *words[QUERY_WORDS];
+    size_t lens[QUERY_WORDS];
+    int nwords;
+};
+
+// Candidates, sorted by rank, each with the most it can score
+struct matches
+{
+    uint32_t *ranks;
+    uint16_t *bounds;
+    size_t count;
+};
+
+// The ranks a search looks at in one go
+struct span
+{
+    uint32_t lo, hi;
+};
+
+struct hit
+{
+    uint32_t score;
+    uint32_t rank;
+};
+
+// The best hits so far, kept as a heap with the worst at the top
+struct ranking
+{
+    struct hit *hits;
+    size_t count, limit;
+};
+
+// A thread's memory for searches.  Everything taken during a search is given
+// back at once when the next one starts; what didn't fit in 'base' is then
+// freed and 'base' made large enough for it.
+struct arena
+{
+    char *base;
+    size_t size, used;
+    size_t wanted; // What the search took in all
+    void **extra;
+    size_t nextra, extrasize;
+};
+
+static __thread struct arena arena;
+
+static void *arena_alloc(size_t bytes)
+{
+    void *p;
+
+    bytes = (bytes + 15) & ~(size_t)15;
+    arena.wanted += bytes;
+    if (arena.used + bytes <= arena.size)
+    {
+        p = arena.base + arena.used;
+        arena.used += bytes;
+        return p;
+    }
+    if (arena.nextra == arena.extrasize)
+    {
+        size_t size = arena.extrasize ? arena.extrasize * 2 : 16;
+        void **grown = realloc(arena.extra, size * sizeof(*grown));
+
+        if (grown == NULL)
+            return NULL;
+        arena.extra = grown;
+        arena.extrasize = size;
+    }
+    if ((p = malloc(bytes)) != NULL)
+        arena.extra[arena.nextra++] = p;
+    return p;
+}
+
+static void arena_reset(void)
+{
+    for (size_t i = 0; i < arena.nextra; i++)
+        free(arena.extra[i]);
+    arena.nextra = 0;
+    if (arena.wanted > arena.size)
+    {
+        free(arena.base);
+        arena.base = malloc(arena.wanted);
+        arena.size = arena.base != NULL ? arena.wanted : 0;
+    }
+    arena.used = 0;
+    arena.wanted = 0;
+}
+
+/******************************************************************************
+
+Fold text (see trigram.h) into 'out', which has room for FOLD_MAX bytes,
+with a space at either end if 'pad'.  Returns its length.  UTF-8 sequences
+are kept as they are; text too long is cut short.
+
+******************************************************************************/
+static size_t fold(const char *text, char *out, bool pad)
+{
+    size_t len = 0;
+
+    if (pad)
+        out[len++] = ' ';
+    for (; *text != '\0' && len < FOLD_MAX - 2; text++)
+    {
+        unsigned char c = *text;
+
+        if (c >= 0x80 || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z'))
+            out[len++] = c;
+        else if (c >= 'A' && c <= 'Z')
+            out[len++] = c - 'A' + 'a';
+        else if (len > 0 && out[len - 1] != ' ')
+            out[len++] = ' ';
+    }
+    if (pad && out[len - 1] != ' ')
+        out[len++] = ' ';
+    else if (!pad && len > 0 && out[len - 1] == ' ')
+        len--;
+    out[len] = '\0';
+    return len;
+}
+
+static uint32_t trigram_key(const char *p)
+{
+    return (uint32_t)(unsigned char)p[0] << 16 | (uint32_t)(unsigned char)p[1] << 8 | (unsigned char)p[2];
+}
+
+static size_t varint_size(uint32_t value)
+{
+    size_t n = 1;
+
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static size_t put_varint(uint8_t *p, uint32_t value)
+{
+    size_t n = 0;
+
+    while (value >= 0x80)
+    {
+        p[n++] = value | 0x80;
+        value >>= 7;
+    }
+    p[n++] = value;
+    return n;
+}
+
+static size_t list_blocks(const struct posting_list *list)
+{
+    return (list->count + TRIGRAM_BLOCK - 1) / TRIGRAM_BLOCK;
+}
+
+// Decode block 'b' of a list into 'out' and return how many ranks it holds
+static size_t decode_block(const struct trigram_index *index, const struct posting_list *list, size_t b,
+                           uint32_t *out)
+{
+    const struct skip_entry *skip = &index->skips[list->skip + b];
+    const uint8_t *p = index->data + list->data + skip->offset;
+    size_t n = list->count - b * TRIGRAM_BLOCK < TRIGRAM_BLOCK ? list->count - b * TRIGRAM_BLOCK : TRIGRAM_BLOCK;
+    uint32_t rank = skip->first;
+
+    out[0] = rank;
+    for (size_t i = 1; i < n; i++)
+    {
+        uint32_t delta = *p & 0x7f;
+
+        for (int shift = 7; *p++ & 0x80; shift += 7)
+            delta |= (uint32_t)(*p & 0x7f) << shift;
+        rank += delta + 1;
+        out[i] = rank;
+    }
+    return n;
+}
+
+static size_t decode_list(const struct trigram_index *index, const struct posting_list *list, uint32_t *out)
+{
+    size_t n = 0;
+
+    for (size_t b = 0; b < list_blocks(list); b++)
+        n += decode_block(index, list, b, out + n);
+    return n;
+}
+
+// Decode the ranks of a list from 'lo' up to 'hi', decoding only the blocks
+// that could hold them
+static size_t decode_range(const struct trigram_index *index, const struct posting_list *list, uint32_t lo,
+                           uint32_t hi, uint32_t *out)
+{
+    const struct skip_entry *skips = index->skips + list->skip;
+    size_t nblocks = list_blocks(list), first = 0, last = nblocks, n = 0;
+    uint32_t block[TRIGRAM_BLOCK];
+
+    // The last block starting at or before 'lo'
+    while (last - first > 1)
+    {
+        size_t mid = first + (last - first) / 2;
+
+        if (skips[mid].first <= lo)
+            first = mid;
+        else
+            last = mid;
+    }
+    for (size_t b = first; b < nblocks && skips[b].first < hi; b++)
+    {
+        size_t len = decode_block(index, list, b, block);
+
+        for (size_t i = 0; i < len; i++)
+        {
+            if (block[i] >= lo && block[i] < hi)
+                out[n++] = block[i];
+        }
+    }
+    return n;
+}
+
+/******************************************************************************
+
+Building.  Both passes go through every trigram of every document in order
+of rank, so a list grows in order and a field that has the same trigram
+twice puts its document on the list once.
+
+******************************************************************************/
+static size_t builder_slot(const struct build *build, uint32_t key)
+{
+    return (size_t)((key * 0x9E3779B97F4A7C15ull) >> (64 - build->bits));
+}
+
+// Find a list's builder, adding it if 'add', or return NULL
+static struct builder *find_builder(struct build *build, uint32_t key, bool add)
+{
+    size_t mask = ((size_t)1 << build->bits) - 1, slot;
+
+    for (slot = builder_slot(build, key); build->slots[slot] != 0; slot = (slot + 1) & mask)
+    {
+        if (build->builders[build->slots[slot] - 1].key == key)
+            return &build->builders[build->slots[slot] - 1];
+    }
+    if (!add)
+        return NULL;
+
+    if (build->nbuilders == build->size)
+    {
+        size_t size = build->size * 2;
+        struct builder *grown = realloc(build->builders, size * sizeof(*grown));
+
+        if (grown == NULL)
+            return NULL;
+        build->builders = grown;
+        build->size = size;
+    }
+
+    // Keep the table at most half full
+    if ((build->nbuilders + 1) * 2 > mask + 1)
+    {
+        uint32_t *old = build->slots;
+        size_t oldslots = mask + 1;
+
+        if ((build->slots = calloc(oldslots * 2, sizeof(*build->slots))) == NULL)
+        {
+            build->slots = old;
+            return NULL;
+        }
+        build->bits++;
+        mask = mask * 2 + 1;
+        for (size_t i = 0; i < oldslots; i++)
+        {
+            if (old[i] == 0)
+                continue;
+            for (slot = builder_slot(build, build->builders[old[i] - 1].key); build->slots[slot] != 0;
+                 slot = (slot + 1) & mask)
+                ;
+            build->slots[slot] = old[i];
+        }
+        free(old);
+        for (slot = builder_slot(build, key); build->slots[slot] != 0; slot = (slot + 1) & mask)
+            ;
+    }
+
+    build->builders[build->nbuilders] = (struct builder){.key = key, .last = UINT32_MAX};
+    build->slots[slot] = ++build->nbuilders;
+    return &build->builders[build->nbuilders - 1];
+}
+
+// Add a document to a list: measuring it in the first pass, writing it in
+// the second
+static bool add_posting(struct build *build, struct trigram_index *index, uint32_t key, uint32_t rank, bool write)
+{
+    struct builder *b = find_builder(build, key, !write);
+
+    if (b == NULL)
+        return false;
+    if (b->last == rank)
+        return true;
+    if (b->count % TRIGRAM_BLOCK == 0)
+    {
+        if (write)
+            index->skips[b->skip + b->count / TRIGRAM_BLOCK] = (struct skip_entry){rank, b->bytes};
+    }
+    else if (!write)
+        b->bytes += varint_size(rank - b->last - 1);
+    else
+        b->bytes += put_varint(index->data + b->data + b->bytes, rank - b->last - 1);
+    b->count++;
+    b->last = rank;
+    return true;
+}
+
+// Add a document to the lists of its trigrams
+static bool index_document(struct build *build, const struct trigram_source *src, struct trigram_index *index,
+                           uint32_t rank, bool write)
+{
+    char text[FOLD_MAX];
+
+    for (int f = 0; f < TRIGRAM_FIELDS; f++)
+    {
+        size_t len = fold(src->field(src->ctx, index->docs[rank], f), text, true);
+
+        for (size_t i = 0; i + 3 <= len; i++)
+        {
+            if (!add_posting(build, index, (uint32_t)f << FIELD_SHIFT | trigram_key(text + i), rank, write))
+                return false;
+            if (text[i] == ' ' && i + 4 < len && text[i + 2] != ' ' && text[i + 3] != ' ' &&
+                !add_posting(build, index, WORD_START | (uint32_t)f << FIELD_SHIFT | trigram_key(text + i + 1), rank,
+                             write))
+                return false;
+        }
+    }
+    return true;
+}
+
+static int compare_lists(const void *a, const void *b)
+{
+    uint32_t x = ((const struct posting_list *)a)->key, y = ((const struct posting_list *)b)->key;
+
+    return x < y ? -1 : x > y;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Number the documents shortest first, and by document within one length
+static bool rank_documents(const struct trigram_source *src, struct trigram_index *index)
+{
+    uint64_t *order = malloc((src->count + 1) * sizeof(*order));
+
+    if (order == NULL || (index->docs = malloc((src->count + 1) * sizeof(*index->docs))) == NULL)
+    {
+        free(order);
+        return false;
+    }
+    for (size_t doc = 0; doc < src->count; doc++)
+    {
+        uint64_t len = 0;
+
+        for (int f = 0; f < TRIGRAM_FIELDS; f++)
+            len += strlen(src->field(src->ctx, doc, f));
+        order[doc] = (len < UINT32_MAX ? len : UINT32_MAX) << 32 | doc;
+    }
+    qsort(order, src->count, sizeof(*order), compare_u64);
+    for (size_t rank = 0; rank < src->count; rank++)
+        index->docs[rank] = (uint32_t)order[rank];
+    index->count = src->count;
+    free(order);
+    return true;
+}
+
+struct trigram_index *trigram_build(const struct trigram_source *src)
+{
+    struct build build = {.size = 1024, .bits = 11};
+    struct trigram_index *index = NULL;
+    bool ok = false;
+
+    if (src->count >= UINT32_MAX)
+        return NULL;
+    build.builders = malloc(build.size * sizeof(*build.builders));
+    build.slots = calloc((size_t)1 << build.bits, sizeof(*build.slots));
+    if (build.builders == NULL || build.slots == NULL || (index = calloc(1, sizeof(*index))) == NULL ||
+        !rank_documents(src, index))
+        goto out;
+
+    for (size_t rank = 0; rank < src->count; rank++)
+    {
+        if (!index_document(&build, src, index, rank, false))
+            goto out;
+    }
+
+    // Lay the lists out one after the other, then start them again empty
+    for (size_t i = 0; i < build.nbuilders; i++)
+    {
+        struct builder *b = &build.builders[i];
+
+        b->skip = index->nskips;
+        b->data = index->datalen;
+        index->nskips += (b->count + TRIGRAM_BLOCK - 1) / TRIGRAM_BLOCK;
+        index->datalen += b->bytes;
+        index->postings += b->count;
+        b->count = 0;
+        b->last = UINT32_MAX;
+        b->bytes = 0;
+    }
+    index->nlists = build.nbuilders;
+    index->lists = malloc((index->nlists + 1) * sizeof(*index->lists));
+    index->skips = malloc((index->nskips + 1) * sizeof(*index->skips));
+    index->data = malloc(index->datalen + 1);
+    if (index->lists == NULL || index->skips == NULL || index->data == NULL)
+        goto out;
+
+    for (size_t rank = 0; rank < src->count; rank++)
+        index_document(&build, src, index, rank, true);
+    for (size_t i = 0; i < build.nbuilders; i++)
+    {
+        const struct builder *b = &build.builders[i];
+
+        index->lists[i] = (struct posting_list){b->key, b->count, b->skip, b->data};
+    }
+    qsort(index->lists, index->nlists, sizeof(*index->lists), compare_lists);
+    ok = true;
+
+out:
+    free(build.builders);
+    free(build.slots);
+    if (!ok && index != NULL)
+    {
+        trigram_free(index);
+        index = NULL;
+    }
+    return index;
+}
+
+void trigram_free(struct trigram_index *index)
+{
+    if (index == NULL)
+        return;
+    free(index->lists);
+    free(index->skips);
+    free(index->data);
+    free(index->docs);
+    free(index);
+}
+
+size_t trigram_memory(const struct trigram_index *index, size_t *postings, size_t *lists)
+{
+    if (postings != NULL)
+        *postings = index->postings;
+    if (lists != NULL)
+        *lists = index->nlists;
+    return sizeof(*index) + index->nlists * sizeof(*index->lists) + index->nskips * sizeof(*index->skips) +
+           index->datalen + index->count * sizeof(*index->docs);
+}
+
+/******************************************************************************
+
+Posting list operations, on sorted arrays of ranks.  The results always go
+into a separate array.
+
+******************************************************************************/
+// The first list with a key no lower than this
+static size_t first_list(const struct trigram_index *index, uint32_t key)
+{
+    size_t lo = 0, hi = index->nlists;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (index->lists[mid].key < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static const struct posting_list *find_list(const struct trigram_index *index, int field, uint32_t trigram)
+{
+    uint32_t key = (uint32_t)field << FIELD_SHIFT | trigram;
+    size_t i = first_list(index, key);
+
+    return i < index->nlists && index->lists[i].key == key ? &index->lists[i] : NULL;
+}
+
+// The lists of field 'f' of the trigrams starting with the two bytes at 'p'
+static size_t prefix_lists(const struct trigram_index *index, int f, const char *p, size_t *end)
+{
+    uint32_t key = (uint32_t)f << FIELD_SHIFT | (trigram_key(p) & ~0xffu);
+
+    *end = first_list(index, key + 0x100);
+    return first_list(index, key);
+}
+
+static size_t intersect(const uint32_t *a, size_t na, const uint32_t *b, size_t nb, uint32_t *out)
+{
+    size_t i = 0, j = 0, n = 0;
+
+#ifdef __SSE2__
+    // Compare four of each at once, every one of a against every one of b
+    // by rotating b, and move on from whichever four end lower
+    while (i + 4 <= na && j + 4 <= nb)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + j));
+        __m128i eq = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi32(va, vb), _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)))),
+            _mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))),
+                         _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)))));
+        unsigned int mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+        uint32_t amax = a[i + 3], bmax = b[j + 3];
+
+        for (; mask != 0; mask &= mask - 1)
+            out[n++] = a[i + __builtin_ctz(mask)];
+        if (amax <= bmax)
+            i += 4;
+        if (bmax <= amax)
+            j += 4;
+    }
+#endif
+    while (i < na && j < nb)
+    {
+        if (a[i] < b[j])
+            i++;
+        else if (a[i] > b[j])
+            j++;
+        else
+        {
+            out[n++] = a[i];
+            i++;
+            j++;
+        }
+    }
+    return n;
+}
+
+// Intersect candidates with a posting list, decoding only the blocks that
+// could hold one of them
+static size_t intersect_list(const struct trigram_index *index, const struct posting_list *list,
+                             const uint32_t *cand, size_t n, uint32_t *out)
+{
+    const struct skip_entry *skips = index->skips + list->skip;
+    size_t nblocks = list_blocks(list), found = 0, c = 0, b = 0;
+    uint32_t block[TRIGRAM_BLOCK];
+
+    while (c < n && b < nblocks)
+    {
+        size_t lo = b, hi = nblocks, end, len;
+
+        // The last block starting at or before the next candidate
+        while (hi - lo > 1)
+        {
+            size_t mid = lo + (hi - lo) / 2;
+
+            if (skips[mid].first <= cand[c])
+                lo = mid;
+            else
+                hi = mid;
+        }
+        b = lo;
+        if (skips[b].first > cand[c])
+        {
+            while (c < n && cand[c] < skips[b].first)
+                c++;
+            continue;
+        }
+
+        for (end = c; end < n && (b + 1 == nblocks || cand[end] < skips[b + 1].first); end++)
+            ;
+        len = decode_block(index, list, b, block);
+        found += intersect(cand + c, end - c, block, len, out + found);
+        c = end;
+        b++;
+    }
+    return found;
+}
+
+static int compare_counts(const void *a, const void *b)
+{
+    const struct posting_list *x = *(const struct posting_list *const *)a, *y = *(const struct posting_list *const *)b;
+
+    return x->count < y->count ? -1 : x->count > y->count;
+}
+
+// The ranks in 'span' of the documents whose field 'f' has every one of the
+// trigrams, of those in 'cand' if it isn't NULL
+static bool intersect_keys(const struct trigram_index *index, const uint32_t *keys, size_t nkeys, int f,
+                           struct span span, const uint32_t *cand, size_t ncand, uint32_t **out, size_t *count)
+{
+    const struct posting_list *lists[FOLD_MAX];
+    uint32_t *a, *b;
+    size_t n, first = 0;
+
+    *count = 0;
+    for (size_t i = 0; i < nkeys; i++)
+    {
+        if ((lists[i] = find_list(index, f, keys[i])) == NULL)
+            return true;
+    }
+    qsort(lists, nkeys, sizeof(*lists), compare_counts);
+    if (cand == NULL || ncand > lists[0]->count)
+    {
+        cand = NULL;
+        ncand = lists[0]->count < span.hi - span.lo ? lists[0]->count : span.hi - span.lo;
+    }
+    if ((a = arena_alloc(ncand * sizeof(*a))) == NULL || (b = arena_alloc(ncand * sizeof(*b))) == NULL)
+        return false;
+
+    if (cand != NULL)
+    {
+        memcpy(a, cand, ncand * sizeof(*a));
+        n = ncand;
+    }
+    else
+        n = decode_range(index, lists[first++], span.lo, span.hi, a);
+    for (size_t i = first; i < nkeys && n > 0; i++)
+    {
+        uint32_t *swap = a;
+
+        n = intersect_list(index, lists[i], a, n, b);
+        a = b;
+        b = swap;
+    }
+    *out = a;
+    *count = n;
+    return true;
+}
+
+// Add ranks to candidates, all with the same bound.  A candidate already
+// there keeps the higher of its two bounds.
+static bool add_matches(struct matches *m, const uint32_t *ranks, size_t n, uint16_t bound)
+{
+    struct matches out = {0};
+    size_t i = 0, j = 0;
+
+    if (n == 0)
+        return true;
+    if ((out.ranks = arena_alloc((m->count + n) * sizeof(*out.ranks))) == NULL ||
+        (out.bounds = arena_alloc((m->count + n) * sizeof(*out.bounds))) == NULL)
+        return false;
+    while (i < m->count || j < n)
+    {
+        if (j == n || (i < m->count && m->ranks[i] < ranks[j]))
+        {
+            out.ranks[out.count] = m->ranks[i];
+            out.bounds[out.count++] = m->bounds[i++];
+        }
+        else
+        {
+            uint16_t best = bound;
+
+            if (i < m->count && m->ranks[i] == ranks[j] && m->bounds[i++] > bound)
+                best = m->bounds[i - 1];
+            out.ranks[out.count] = ranks[j++];
+            out.bounds[out.count++] = best;
+        }
+    }
+    *m = out;
+    return true;
+}
+
+// Keep the candidates that are in both, adding up their bounds
+static void intersect_matches(struct matches *m, const struct matches *other)
+{
+    size_t i = 0, j = 0, k = 0;
+
+    while (i < m->count && j < other->count)
+    {
+        if (m->ranks[i] < other->ranks[j])
+            i++;
+        else if (m->ranks[i] > other->ranks[j])
+            j++;
+        else
+        {
+            m->ranks[k] = m->ranks[i];
+            m->bounds[k++] = m->bounds[i++] + other->bounds[j++];
+        }
+    }
+    m->count = k;
+}
+
+/******************************************************************************
+
+Ranking.  The best 'limit' hits are kept in a heap with the worst on top, so
+each new hit is compared with that one only.  Of two hits with the same score
+the shorter document, with the lower rank, is better.
+
+******************************************************************************/
+static bool worse(const struct hit *a, const struct hit *b)
+{
+    return a->score < b->score || (a->score == b->score && a->rank > b->rank);
+}
+
+static void sift_down(struct ranking *r, size_t i)
+{
+    while (true)
+    {
+        size_t worst = i, left = 2 * i + 1, right = left + 1;
+        struct hit tmp;
+
+        if (left < r->count && worse(&r->hits[left], &r->hits[worst]))
+            worst = left;
+        if (right < r->count && worse(&r->hits[right], &r->hits[worst]))
+            worst = right;
+        if (worst == i)
+            return;
+        tmp = r->hits[i];
+        r->hits[i] = r->hits[worst];
+        r->hits[worst] = tmp;
+        i = worst;
+    }
+}
+
+static void rank_hit(struct ranking *r, uint32_t score, uint32_t rank)
+{
+    struct hit hit = {score, rank};
+
+    if (r->count < r->limit)
+    {
+        size_t i = r->count++;
+
+        // Sift up
+        while (i > 0 && worse(&hit, &r->hits[(i - 1) / 2]))
+        {
+            r->hits[i] = r->hits[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        r->hits[i] = hit;
+    }
+    else if (worse(&r->hits[0], &hit))
+    {
+        r->hits[0] = hit;
+        sift_down(r, 0);
+    }
+}
+
+// Whether a hit with this score and rank could still make it into the ranking
+static bool could_rank(const struct ranking *r, uint32_t score, uint32_t rank)
+{
+    struct hit hit = {score, rank};
+
+    return r->count < r->limit || worse(&r->hits[0], &hit);
+}
+
+static int compare_hits(const void *a, const void *b)
+{
+    return worse(b, a) ? -1 : worse(a, b);
+}
+
+/******************************************************************************
+
+Scoring.  A word scores by the most important field it occurs in, and one
+more if it starts a word there.  Fields are only folded once a word is looked
+for in them, which for most documents means the title alone.
+
+******************************************************************************/
+static void parse_query(const char *text, struct query *q)
+{
+    q->len = fold(text, q->text, true);
+    q->nwords = 0;
+    for (size_t i = 0; i + 1 < q->len && q->nwords < QUERY_WORDS; i++)
+    {
+        if (q->text[i] == ' ')
+        {
+            q->words[q->nwords] = q->text + i;
+            q->lens[q->nwords] = strcspn(q->text + i + 1, " ");
+            q->nwords++;
+        }
+    }
+}
+
+// 2 if a word of the query starts a word of the field, 1 if it is in it
+// elsewhere, 0 if it isn't.  Short words only count at the start.
+static int word_score(const char *field, size_t len, const char *word, size_t wordlen)
+{
+    if (memmem(field, len, word, wordlen + 1) != NULL)
+        return 2;
+    if (wordlen < 3 || memmem(field, len, word + 1, wordlen) == NULL)
+        return 0;
+    return 1;
+}
+
+// Score a document against the query, or return 0 if a word isn't in it
+static uint32_t score_document(const struct trigram_source *src, uint32_t doc, const struct query *q)
+{
+    char fields[TRIGRAM_FIELDS][FOLD_MAX];
+    size_t lens[TRIGRAM_FIELDS];
+    int folded = 0;
+    uint32_t score = 0;
+
+    for (int w = 0; w < q->nwords; w++)
+    {
+        int best = 0;
+
+        for (int f = 0; f < TRIGRAM_FIELDS && best == 0; f++)
+        {
+            int s;
+
+            if (f == folded)
+            {
+                lens[f] = fold(src->field(src->ctx, doc, f), fields[f], true);
+                folded++;
+            }
+            if ((s = word_score(fields[f], lens[f], q->words[w], q->lens[w])) > 0)
+                best = (TRIGRAM_FIELDS - 1 - f) * 2 + s;
+        }
+        if (best == 0)
+            return 0;
+        score += best;
+    }
+    return SCORE_MATCH | score;
+}
+
+/******************************************************************************
+
+Finding matches.  For each word of the query and each field, the documents
+whose field has all of the word's trigrams may have the word there, and
+those that also have a space and its first two letters may have it at the
+start of a word.  Together these give each document the most the word can
+score in it.  A document must be able to have every word, so the words are
+looked up rarest first, each among the candidates of those before it, and
+their bounds added up.
+
+Without an index every document is a candidate, and may score the most.
+
+******************************************************************************/
+static size_t add_key(uint32_t *keys, size_t n, uint32_t key)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        if (keys[i] == key)
+            return n;
+    }
+    keys[n] = key;
+    return n + 1;
+}
+
+// Words of one letter start a word wherever the field has a trigram of a
+// space, the letter and anything
+static bool match_letter(const struct trigram_index *index, const char *word, struct span span,
+                         const struct matches *cand, struct matches *m)
+{
+    for (int f = 0; f < TRIGRAM_FIELDS; f++)
+    {
+        uint16_t bound = (TRIGRAM_FIELDS - 1 - f) * 2 + 2;
+        size_t end;
+
+        for (size_t i = prefix_lists(index, f, word, &end); i < end; i++)
+        {
+            const struct posting_list *list = &index->lists[i];
+            size_t size = cand != NULL ? cand->count : span.hi - span.lo, n;
+            uint32_t *ranks = arena_alloc(size * sizeof(*ranks));
+
+            if (ranks == NULL)
+                return false;
+            n = cand != NULL ? intersect_list(index, list, cand->ranks, cand->count, ranks)
+                             : decode_range(index, list, span.lo, span.hi, ranks);
+            if (!add_matches(m, ranks, n, bound))
+                return false;
+        }
+    }
+    return true;
+}
+
+static bool match_word(const struct trigram_index *index, const char *word, size_t len, struct span span,
+                       const struct matches *cand, struct matches *m)
+{
+    uint32_t keys[FOLD_MAX], start = len == 2 ? trigram_key(word) : WORD_START | trigram_key(word + 1);
+    size_t nkeys = 0;
+
+    *m = (struct matches){0};
+    if (len == 1)
+        return match_letter(index, word, span, cand, m);
+    if (len == 2)
+        keys[nkeys++] = start;
+    for (size_t i = 1; i + 3 <= len + 1; i++)
+        nkeys = add_key(keys, nkeys, trigram_key(word + i));
+
+    for (int f = 0; f < TRIGRAM_FIELDS; f++)
+    {
+        uint16_t bound = (TRIGRAM_FIELDS - 1 - f) * 2 + 1;
+        const struct posting_list *list;
+        uint32_t *in, *at;
+        size_t n;
+
+        if (!intersect_keys(index, keys, nkeys, f, span, cand != NULL ? cand->ranks : NULL,
+                            cand != NULL ? cand->count : 0, &in, &n))
+            return false;
+        if (n == 0)
+            continue;
+        if (len == 2)
+        {
+            if (!add_matches(m, in, n, bound + 1))
+                return false;
+            continue;
+        }
+        if (!add_matches(m, in, n, bound))
+            return false;
+        if ((list = find_list(index, f, start)) != NULL)
+        {
+            if ((at = arena_alloc(n * sizeof(*at))) == NULL ||
+                !add_matches(m, at, intersect_list(index, list, in, n, at), bound + 1))
+                return false;
+        }
+    }
+    return true;
+}
+
+// Check candidates best bound first, ranking what they really score, until
+// none left could make it into the ranking.  With 'm' NULL every document
+// is a candidate, with the same bound.
+static bool check_candidates(const struct trigram_index *index, const struct trigram_source *src,
+                             const struct query *q, const struct matches *m, uint16_t bound, struct ranking *r)
+{
+    size_t starts[QUERY_WORDS * WORD_SCORE_MAX + 2] = {0}, pos = 0;
+    size_t count = m != NULL ? m->count : src->count;
+    uint32_t *order = NULL;
+
+    // Sort by bound, highest first, and keep them in order of rank within
+    // one bound
+    if (m != NULL)
+    {
+        if ((order = arena_alloc(m->count * sizeof(*order))) == NULL)
+            return false;
+        for (size_t i = 0; i < m->count; i++)
+            starts[m->bounds[i]]++;
+        for (int b = QUERY_WORDS * WORD_SCORE_MAX + 1; b >= 0; b--)
+        {
+            size_t n = starts[b];
+
+            starts[b] = pos;
+            pos += n;
+        }
+        for (size_t i = 0; i < m->count; i++)
+            order[starts[m->bounds[i]]++] = i;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t rank = m != NULL ? m->ranks[order[i]] : i;
+        uint32_t score;
+
+        if (m != NULL)
+            bound = m->bounds[order[i]];
+        if (!could_rank(r, SCORE_MATCH | bound, rank))
+            break;
+        if ((score = score_document(src, index != NULL ? index->docs[rank] : rank, q)) != 0)
+            rank_hit(r, score, rank);
+    }
+    return true;
+}
+
+// How many documents a word could be in at most: in each field, no more
+// than are on its shortest list.  'best' is the most it can score.
+static size_t word_estimate(const struct trigram_index *index, const char *word, size_t len, uint16_t *best)
+{
+    size_t total = 0;
+
+    *best = 0;
+    for (int f = 0; f < TRIGRAM_FIELDS; f++)
+    {
+        size_t least = index->count, end;
+
+        if (len == 1)
+        {
+            least = 0;
+            for (size_t i = prefix_lists(index, f, word, &end); i < end; i++)
+                least += index->lists[i].count;
+        }
+        for (size_t i = len == 2 ? 0 : 1; i + 3 <= len + 1; i++)
+        {
+            const struct posting_list *list = find_list(index, f, trigram_key(word + i));
+            size_t n = list != NULL ? list->count : 0;
+
+            least = n < least ? n : least;
+        }
+        if (least > 0 && *best == 0)
+            *best = (TRIGRAM_FIELDS - f) * 2;
+        total += least;
+    }
+    return total;
+}
+
+// Find and rank the matches among the documents in 'span', looking the
+// words up in 'order'.  Each word after the first is only looked for among
+// the documents that have all the words before it.
+static bool match_span(const struct trigram_index *index, const struct trigram_source *src, const struct query *q,
+                       const int *order, struct span span, struct ranking *r)
+{
+    struct matches found = {0}, word;
+
+    for (int i = 0; i < q->nwords; i++)
+    {
+        if (!match_word(index, q->words[order[i]], q->lens[order[i]], span, i > 0 ? &found : NULL, &word))
+            return false;
+        if (i == 0)
+            found = word;
+        else
+            intersect_matches(&found, &word);
+        if (found.count == 0)
+            return true;
+    }
+    return check_candidates(index, src, q, &found, 0, r);
+}
+
+static bool find_matches(const struct trigram_index *index, const struct trigram_source *src,
+                         const struct query *q, struct ranking *r)
+{
+    size_t estimates[QUERY_WORDS];
+    int order[QUERY_WORDS];
+    struct span span = {0, 0};
+    uint16_t most = 0;
+
+    if (index == NULL)
+        return check_candidates(index, src, q, NULL, q->nwords * WORD_SCORE_MAX, r);
+
+    // The words in the fewest documents first
+    for (int w = 0; w < q->nwords; w++)
+    {
+        uint16_t best;
+        int i;
+
+        if ((estimates[w] = word_estimate(index, q->words[w], q->lens[w], &best)) == 0)
+            return true;
+        most += best;
+        for (i = w; i > 0 && estimates[order[i - 1]] > estimates[w]; i--)
+            order[i] = order[i - 1];
+        order[i] = w;
+    }
+
+    // The shortest documents first, in ever larger spans, until the ranking
+    // is full of hits that no longer document could beat
+    for (size_t size = FIRST_SPAN; span.hi < index->count; size *= 2)
+    {
+        span.lo = span.hi;
+        span.hi = size < index->count - span.lo ? span.lo + size : index->count;
+        if (!match_span(index, src, q, order, span, r))
+            return false;
+        if (!could_rank(r, SCORE_MATCH | most, span.hi))
+            break;
+    }
+    return true;
+}
+
+/******************************************************************************
+
+Near misses must share 'need' of the query's trigrams, in any field: all but
+the TYPO_TRIGRAMS one typing mistake can change, and at least a third.  A
+document on no more than 'need' - 1 of their lists can't, so every near miss
+is on at least one of the shortest 'present' - 'need' + 1.  Those are decoded
+whole, counting each document's hits, and the longer ones are only looked up
+for the documents found so far.  A near miss scores by the share of the
+trigrams it has.
+
+******************************************************************************/
+struct trigram_lists
+{
+    uint32_t key;
+    size_t count; // In all fields
+};
+
+static int compare_trigram_lists(const void *a, const void *b)
+{
+    size_t x = ((const struct trigram_lists *)a)->count, y = ((const struct trigram_lists *)b)->count;
+
+    return x < y ? -1 : x > y;
+}
+
+// Count a hit for each document with one of the trigrams, once however many
+// of its fields have it.  'seen' is which trigram was counted last.
+static void count_hits(const uint32_t *ranks, size_t n, uint16_t k, uint8_t *hits, uint16_t *seen)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        if (seen[ranks[i]] != k)
+        {
+            seen[ranks[i]] = k;
+            hits[ranks[i]]++;
+        }
+    }
+}
+
+static bool find_near_misses(const struct trigram_index *index, const struct query *q, struct ranking *r)
+{
+    struct trigram_lists keys[FOLD_MAX];
+    size_t nkeys = 0, present = 0, need, merged, n = 0, most = 0;
+    uint32_t *cand, *ranks;
+    uint16_t *seen;
+    uint8_t *hits;
+
+    for (size_t i = 0; i + 3 <= q->len && nkeys < UINT8_MAX; i++)
+    {
+        uint32_t key = trigram_key(q->text + i);
+        size_t k;
+
+        for (k = 0; k < nkeys && keys[k].key != key; k++)
+            ;
+        if (k < nkeys)
+            continue;
+        keys[nkeys] = (struct trigram_lists){key, 0};
+        for (int f = 0; f < TRIGRAM_FIELDS; f++)
+        {
+            const struct posting_list *list = find_list(index, f, key);
+
+            keys[nkeys].count += list != NULL ? list->count : 0;
+            most = list != NULL && list->count > most ? list->count : most;
+        }
+        present += keys[nkeys++].count > 0;
+    }
+    need = nkeys > TYPO_TRIGRAMS ? nkeys - TYPO_TRIGRAMS : 0;
+    need = need > (nkeys + 2) / 3 ? need : (nkeys + 2) / 3;
+    if (need == 0 || present < need)
+        return true;
+    qsort(keys, nkeys, sizeof(*keys), compare_trigram_lists);
+
+    if ((hits = arena_alloc(index->count * sizeof(*hits))) == NULL ||
+        (seen = arena_alloc(index->count * sizeof(*seen))) == NULL ||
+        (ranks = arena_alloc(most * sizeof(*ranks))) == NULL)
+        return false;
+    memset(hits, 0, index->count * sizeof(*hits));
+    memset(seen, 0, index->count * sizeof(*seen));
+
+    // The lists no document has come first
+    merged = nkeys - need + 1;
+    for (size_t k = nkeys - present; k < merged; k++)
+    {
+        for (int f = 0; f < TRIGRAM_FIELDS; f++)
+        {
+            const struct posting_list *list = find_list(index, f, keys[k].key);
+
+            if (list != NULL)
+                count_hits(ranks, decode_list(index, list, ranks), k + 1, hits, seen);
+        }
+    }
+    for (size_t i = 0; i < index->count; i++)
+        n += hits[i] != 0;
+    if ((cand = arena_alloc(n * sizeof(*cand))) == NULL)
+        return false;
+    n = 0;
+    for (size_t i = 0; i < index->count; i++)
+    {
+        if (hits[i] != 0)
+            cand[n++] = i;
+    }
+
+    for (size_t k = merged; k < nkeys && n > 0; k++)
+    {
+        size_t m = 0;
+
+        for (int f = 0; f < TRIGRAM_FIELDS; f++)
+        {
+            const struct posting_list *list = find_list(index, f, keys[k].key);
+
+            if (list != NULL)
+                count_hits(ranks, intersect_list(index, list, cand, n, ranks), k + 1, hits, seen);
+        }
+
+        // Drop whatever can't reach 'need' any more
+        for (size_t c = 0; c < n; c++)
+        {
+            if (hits[cand[c]] + (nkeys - k - 1) >= need)
+                cand[m++] = cand[c];
+        }
+        n = m;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        uint32_t score = (uint32_t)hits[cand[i]] * 256 / nkeys;
+
+        if (hits[cand[i]] >= need && could_rank(r, score, cand[i]))
+            rank_hit(r, score, cand[i]);
+    }
+    return true;
+}
+
+size_t trigram_search(const struct trigram_index *index, const struct trigram_source *src, const char *query,
+                      uint32_t *results, size_t limit)
+{
+    struct ranking r = {.limit = limit};
+    struct query q;
+
+    parse_query(query, &q);
+    if (limit == 0 || q.nwords == 0 || (r.hits = malloc(limit * sizeof(*r.hits))) == NULL)
+        return 0;
+    arena_reset();
+
+    if (find_matches(index, src, &q, &r) && index != NULL && r.count == 0)
+        find_near_misses(index, &q, &r);
+
+    qsort(r.hits, r.count, sizeof(*r.hits), compare_hits);
+    for (size_t i = 0; i < r.count; i++)
+        results[i] = index != NULL ? index->docs[r.hits[i].rank] : r.hits[i].rank;
+    free(r.hits);
+    return r.count;
+}
@@ -0,0 +1,63 @@
+/******************************************************************************
+
+PROGRAM:  trigram.h
+AUTHOR:   Jack Peterson, Joseph Pham, Emil Welton
+SYNOPSIS: A trigram index for finding tracks by any part of their names and
+          tags, tolerating typing mistakes.
+
+          Every document (a track) has TRIGRAM_FIELDS text fields, most
+          important first.  Text is folded before it is indexed or searched:
+          ASCII letters are lower cased and every run of punctuation and
+          spaces becomes a single space, so "AC/DC" and "ac dc" are the same.
+          Each field is indexed by the three byte sequences (trigrams) of its
+          folded text with a space at either end, and each trigram has a
+          posting list per field of the documents containing it there.
+
+          A query matches a document if every word of it occurs in one of
+          its fields.  Words of three bytes or more may occur anywhere, even
+          inside another word; shorter ones only at the start of a word.
+          Each word scores by the most important field it occurs in, and
+          more if it starts a word there.  Of documents scoring the same,
+          the shorter ranks first.
+
+          If no document matches, near misses are found instead: documents
+          sharing all but the four trigrams one typing mistake can change
+          (and at least a third) of the query's, ranked by how many they
+          share, which is enough to find "beatles" from "beatels".
+
+******************************************************************************/
+#ifndef TRIGRAM_H
+#define TRIGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRIGRAM_FIELDS 4
+
+// The documents to index or search.  'field' returns the text of one
+// field of a document, "" for none; it is called from several threads at
+// once when they search at the same time.
+struct trigram_source
+{
+    size_t count;
+    const char *(*field)(const void *ctx, uint32_t doc, int field);
+    const void *ctx;
+};
+
+struct trigram_index;
+
+// Index every document of 'src', or return NULL if out of memory
+struct trigram_index *trigram_build(const struct trigram_source *src);
+
+void trigram_free(struct trigram_index *index);
+
+// Bytes the index takes, and how many postings and posting lists it holds
+size_t trigram_memory(const struct trigram_index *index, size_t *postings, size_t *lists);
+
+// Find the documents best matching 'query' and put up to 'limit' of them
+// in 'results', best first.  Returns how many were found.  With 'index'
+// NULL every document is checked instead, and near misses aren't found.
+size_t trigram_search(const struct trigram_index *index, const struct trigram_source *src, const char *query,
+                      uint32_t *results, size_t limit);
+
+#endif